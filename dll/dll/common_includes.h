@@ -42,11 +42,14 @@
 #include <fstream>
 #include <sstream>
 #include <iterator>
+#include <functional>
 
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <queue>
+#include <deque>
 #include <list>
 
 #include <thread>
@@ -58,6 +61,7 @@
 #include <filesystem>
 #include <optional>
 #include <numeric>
+#include <random>
 
 // common includes
 #include "common_helpers/common_helpers.hpp"
@@ -0,0 +1,70 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef __INCLUDED_FILE_IO_POOL_H__
+#define __INCLUDED_FILE_IO_POOL_H__
+
+#include "base.h"
+
+struct File_IO_Op {
+    std::string key{}; // ops with the same key run one at a time, in the order they were submitted
+    std::function<void()> work{}; // runs on a worker thread, must not touch anything guarded by global_mutex
+    std::function<void()> done{}; // runs later in run_completions()
+
+    std::chrono::high_resolution_clock::time_point queued{};
+    std::chrono::high_resolution_clock::time_point started{};
+    std::chrono::high_resolution_clock::time_point finished{};
+};
+
+// small pool of threads doing blocking file operations
+// the queue is bounded, submit() blocks when it is full until a worker picks up an op
+class File_IO_Pool
+{
+    std::mutex pool_mutex{};
+    std::condition_variable work_cv{}; // workers wait here for ops
+    std::condition_variable state_cv{}; // submit() waits here for room, wait() for a key to be idle
+
+    std::deque<File_IO_Op> pending{};
+    std::multiset<std::string> running_keys{};
+    std::vector<File_IO_Op> completed{};
+    std::vector<std::thread> workers{};
+
+    unsigned max_workers{};
+    size_t max_pending{};
+    bool stopping = false;
+
+    bool key_busy(const std::string &key) const;
+    std::deque<File_IO_Op>::iterator next_op();
+    void worker_thread();
+
+public:
+    File_IO_Pool(unsigned max_workers, size_t max_pending);
+    // finishes every queued op before returning, their done callbacks are dropped
+    ~File_IO_Pool();
+
+    File_IO_Pool(const File_IO_Pool &) = delete;
+    File_IO_Pool &operator=(const File_IO_Pool &) = delete;
+
+    void submit(const std::string &key, std::function<void()> work, std::function<void()> done);
+    // blocks until nothing with this key is queued or running
+    void wait(const std::string &key);
+    size_t queue_depth();
+    // calls the done callbacks of the finished ops, on the calling thread
+    void run_completions();
+};
+
+#endif // __INCLUDED_FILE_IO_POOL_H__
@@ -39,6 +39,42 @@ struct image_t {
     std::vector<image_pixel_t> pix_map{};
 };
 
+struct Local_Storage_File {
+    uint64_t size{};
+    uint64_t timestamp{};
+};
+
+#if defined(__WINDOWS__)
+// file names are case insensitive on Windows, "Save.dat" and "save.dat" are the same file
+struct Local_Storage_Name_Less {
+    bool operator()(const std::string &a, const std::string &b) const
+    {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](unsigned char x, unsigned char y) {
+            return std::tolower(x) < std::tolower(y);
+        });
+    }
+};
+#else
+using Local_Storage_Name_Less = std::less<std::string>;
+#endif
+
+// files of a folder, kept up to date with our own writes and the changes reported by the OS instead of walking the folder every time
+struct Local_Storage_Index {
+    std::map<std::string, Local_Storage_File, Local_Storage_Name_Less> files{}; // key: path relative to the folder, sanitized like on disk
+    std::vector<std::string> names{}; // files in iterate_file() order, built again when names_dirty is set
+    bool names_dirty = true;
+    bool valid = false; // false until scanned or when an outside change can't be applied to the index
+
+#if defined(__WINDOWS__)
+    void *dir_handle = nullptr; // HANDLE of the folder, opened for ReadDirectoryChangesW
+    OVERLAPPED change_overlapped{};
+    std::vector<DWORD> change_buffer{}; // FILE_NOTIFY_INFORMATION records, they must be DWORD aligned
+#elif defined(__LINUX__)
+    int inotify_fd = -1;
+    std::map<int, std::string> watches{}; // watch descriptor -> folder relative to the indexed one
+#endif
+};
+
 class Local_Storage {
 private:
     static std::string saves_folder_name;
@@ -47,6 +83,7 @@ public:
     static constexpr char inventory_storage_folder[]   = "inventory";
     static constexpr char settings_storage_folder[]    = "settings";
     static constexpr char remote_storage_folder[]      = "remote";
+    static constexpr char remote_storage_temp_folder[] = "remote_temp";
     static constexpr char stats_storage_folder[]       = "stats";
     static constexpr char leaderboard_storage_folder[] = "leaderboard";
     static constexpr char user_data_storage[]          = "local";
@@ -69,13 +106,21 @@ public:
 private:
     std::string save_directory{};
     std::string appid{}; // game appid
+    std::map<std::string, Local_Storage_Index> indexes{}; // key: full path of the indexed folder
+
+    Local_Storage_Index *find_index(const std::string &full_folder);
+    Local_Storage_Index &get_index(const std::string &full_folder);
+    void update_index(const std::string &full_folder, const std::string &file);
     
 public:
     Local_Storage(const std::string &save_directory);
+    ~Local_Storage();
 
     const std::string& get_current_save_directory() const;
     void setAppId(uint32 appid);
     int store_data(std::string folder, std::string file, char *data, unsigned int length);
+    // written to a temporary file first, then renamed over the old one, a crash never leaves a half written file
+    int store_data_atomic(std::string folder, std::string file, const char *data, unsigned int length);
     int store_data_settings(std::string file, const char *data, unsigned int length);
     int get_data(std::string folder, std::string file, char *data, unsigned int max_length, unsigned int offset=0);
     unsigned int data_settings_size(std::string file);
@@ -88,6 +133,10 @@ public:
     uint64_t file_timestamp(std::string folder, std::string file);
     std::string get_global_settings_path();
     std::string get_path(std::string folder);
+    // full path of a file as stored on disk, the folder isn't created
+    std::string get_file_path(std::string folder, std::string file);
+    // refreshes the cached info of a file written or deleted without going through this class
+    void file_changed(std::string folder, std::string file);
 
     bool update_save_filenames(std::string folder);
 
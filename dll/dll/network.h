@@ -19,6 +19,7 @@
 #define NETWORK_INCLUDE
 
 #include "base.h"
+#include "shared_memory.h"
 #include <curl/curl.h>
 
 #define DEFAULT_PORT 47584
@@ -79,9 +80,23 @@ struct TCP_Socket {
     bool received_data = false;
     std::vector<char> recv_buffer{};
     std::vector<char> send_buffer{};
+    uint64 bytes_queued{}; // every byte ever put in send_buffer
     std::chrono::high_resolution_clock::time_point last_heartbeat_sent{}, last_heartbeat_received{};
 };
 
+// same host transport to a peer, one ring per direction
+struct Shared_Memory_Link {
+    uint64 peer_token{};
+    Shared_Memory_Ring send{}, recv{};
+    std::chrono::high_resolution_clock::time_point last_open_attempt{};
+    // reliable messages waiting for room in the send ring, stay in order with the ones already in it
+    std::deque<std::pair<std::string, uint32>> pending{};
+    size_t pending_bytes{};
+    uint64 pending_bytes_queued{}; // every byte ever put in pending
+    // frames of a big reliable message received so far
+    std::string recv_partial{};
+};
+
 struct Connection {
     struct TCP_Socket tcp_socket_outgoing{}, tcp_socket_incoming{};
     bool connected = false;
@@ -91,6 +106,81 @@ struct Connection {
     std::vector<CSteamID> ids{};
     uint32 appid{};
     std::chrono::high_resolution_clock::time_point last_received{};
+
+    bool udp_fragments = false; // the peer can reassemble big unreliable messages sent as UDP fragments
+
+    std::chrono::high_resolution_clock::time_point last_udp_heartbeat_sent{};
+    std::chrono::microseconds rtt{}; // smoothed round trip time of the UDP heartbeats, 0 = not measured yet
+
+    std::shared_ptr<Shared_Memory_Link> shm{}; // the peer runs on this host, null otherwise
+};
+
+// fake network conditions applied to the packets of a peer, same units as the k_ESteamNetworkingConfig_FakePacket* config values
+struct Network_Conditions {
+    float loss_send{}; // percent
+    float loss_recv{};
+    int32 lag_send{}; // milliseconds
+    int32 lag_recv{};
+    float reorder_send{}; // percent
+    float reorder_recv{};
+    int32 reorder_time{}; // reordered packets are delayed by a random extra time up to this, in milliseconds
+    float dup_send{}; // percent
+    float dup_recv{};
+    int32 dup_time_max{}; // milliseconds
+};
+
+struct Fragmented_Message {
+    uint32 received{};
+    std::vector<std::string> fragments{};
+    std::chrono::high_resolution_clock::time_point first_received{};
+};
+
+struct Delayed_Packet {
+    bool incoming{};
+    bool reliable{};
+    CSteamID peer{};
+    uint32 appid{};
+    IP_PORT ip_port{};
+    Common_Message msg{};
+};
+
+enum A2S_Query_Type {
+    A2S_QUERY_INFO,
+    A2S_QUERY_PLAYERS,
+    A2S_QUERY_RULES,
+};
+
+struct A2S_Player {
+    std::string name{};
+    int32 score{};
+    float duration{}; // seconds
+};
+
+struct A2S_Result {
+    bool responded = false; // false if the server never answered
+    int ping{}; // round trip time of the answered request in milliseconds
+    Gameserver info{}; // A2S_QUERY_INFO
+    std::vector<A2S_Player> players{}; // A2S_QUERY_PLAYERS
+    std::vector<std::pair<std::string, std::string>> rules{}; // A2S_QUERY_RULES
+};
+
+// a source query (A2S) sent by us to a server
+struct A2S_Query {
+    A2S_Query_Type type{};
+    IP_PORT ip_port{};
+    int32 challenge = -1; // none yet
+    unsigned attempts{};
+    unsigned challenges{};
+    bool done{};
+    std::chrono::high_resolution_clock::time_point last_sent{};
+    A2S_Result result{};
+};
+
+// parts of a split A2S response
+struct A2S_Split_Response {
+    std::vector<std::string> parts{};
+    unsigned received{};
+    std::chrono::high_resolution_clock::time_point first_received{};
 };
 
 class Networking
@@ -112,13 +202,55 @@ class Networking
     std::recursive_mutex mutex;
 
     struct Network_Callback_Container callbacks[CALLBACK_IDS_MAX];
-    std::vector<Common_Message> local_send;
+    std::vector<Common_Message> local_send; // messages to our own ids, delivered on the next Run()
+
+    // shared memory transport to peers on this host
+    bool shm_enabled = false;
+    uint64 shm_token{}; // identifies our side of the rings, changes every run
+#if !defined(__WINDOWS__)
+    int shm_lock_fd = -1; // flock held while we run, see remove_stale_shared_memory()
+#endif
+    std::string shm_host{};
+
+    // unreliable messages bigger than a UDP packet
+    uint64 next_fragmented_message_id = 1;
+    std::map<std::pair<uint64, uint64>, Fragmented_Message> fragmented_messages{}; // key: source id, message id
+
+    // network condition simulation
+    Network_Conditions simulation_conditions{};
+    std::map<CSteamID, Network_Conditions> simulation_conditions_peers{};
+    std::mt19937 simulation_rng{ std::random_device{}() };
+    std::multimap<std::chrono::high_resolution_clock::time_point, Delayed_Packet> delayed_packets{};
+    // reliable packets must stay in order even if the lag is changed while they are queued
+    std::chrono::high_resolution_clock::time_point last_reliable_send_due{}, last_reliable_recv_due{};
+
+    // source queries sent to servers, all on one socket, see a2sQuery()
+    sock_t a2s_socket = static_cast<sock_t>(~0);
+    uint64 next_a2s_query_id = 1;
+    std::map<uint64, A2S_Query> a2s_queries{};
+    std::map<std::pair<IP_PORT, uint32>, A2S_Split_Response> a2s_split_responses{}; // key: source, split id
 
     struct Connection *find_connection(CSteamID id, uint32 appid = 0);
     struct Connection *new_connection(CSteamID id, uint32 appid);
 
     bool handle_announce(Common_Message *msg, IP_PORT ip_port);
     bool handle_low_level_udp(Common_Message *msg, IP_PORT ip_port);
+    void handle_udp(Common_Message *msg, IP_PORT ip_port);
+    void handle_fragment(Common_Message *msg, IP_PORT ip_port);
+    void send_fragments(Common_Message *msg, Connection *conn);
+    void expire_fragmented_messages();
+    void send_udp_heartbeats();
+    bool send_to_connection(Common_Message *msg, bool reliable, Connection *conn);
+    void setup_shared_memory(Connection *conn, uint64 peer_token);
+    bool send_shared_memory(Common_Message *msg, bool reliable, Connection *conn, bool &sent);
+    void run_shared_memory(Connection &conn);
+    bool simulate(Common_Message *msg, bool incoming, bool reliable, uint32 appid, IP_PORT ip_port);
+    void run_delayed_packets();
+    void run_source_query();
+    bool send_a2s_query(A2S_Query &query);
+    void handle_a2s_response(IP_PORT ip_port, const char *data, size_t len);
+    void handle_a2s_packet(IP_PORT ip_port, const char *data, size_t len);
+    void run_a2s_queries();
     bool handle_tcp(Common_Message *msg, struct TCP_Socket &socket);
     void send_announce_broadcasts();
 
@@ -144,6 +276,8 @@ public:
 
     // send to a specific user, set_dest_id() must be called
     bool sendTo(Common_Message *msg, bool reliable, Connection *conn = NULL);
+    // same as above for a message the caller doesn't need anymore, messages to our own ids are moved to the local queue instead of copied
+    bool sendTo(Common_Message &&msg, bool reliable);
     
     // send to all users whose account type is Individual, no need to call set_dest_id(), this is done automatically
     bool sendToAllIndividuals(Common_Message *msg, bool reliable);
@@ -164,6 +298,34 @@ public:
     uint32 getIP(CSteamID id);
     uint32 getOwnIP();
 
+    // round trip time to this user in milliseconds, -1 if it wasn't measured yet
+    int getPing(CSteamID id);
+
+    // bytes waiting in the TCP send buffers to this user
+    size_t getPendingSendBytes(CSteamID id);
+    // end of the reliable send queue to this user, counted in bytes since the connection was made
+    // a message queued when it was at some position is sent once getSendQueueDrained() reaches that position
+    uint64 getSendQueuePosition(CSteamID id);
+    uint64 getSendQueueDrained(CSteamID id);
+    // outgoing messages to this user held back by the fake network conditions, message_bytes says how much each of them counts
+    size_t getDelayedSendBytes(CSteamID id, bool reliable, const std::function<size_t(const Common_Message &)> &message_bytes);
+
+    // fake lag/loss/reorder/duplication, pass k_steamIDNil for the global conditions
+    // conditions of a peer replace the global ones for that peer
+    Network_Conditions getSimulationConditions(CSteamID peer = k_steamIDNil);
+    void setSimulationConditions(const Network_Conditions &conditions, CSteamID peer = k_steamIDNil);
+    void resetSimulationConditions(CSteamID peer = k_steamIDNil);
+    void setSimulationSeed(uint32 seed);
+
+    // exchange messages with peers on this host through shared memory instead of the loopback sockets
+    void setSharedMemory(bool enabled);
+
+    // asynchronous source query to any server reachable by ip, answered while Run() is called
+    uint64 a2sQuery(uint32 ip, uint16 port, A2S_Query_Type type);
+    // true once the query is finished (answered or timed out), the query is then forgotten
+    bool a2sResult(uint64 id, A2S_Result &result);
+    void a2sCancel(uint64 id);
+
     void startQuery(IP_PORT ip_port);
     void shutDownQuery();
     bool isQueryAlive();
@@ -226,6 +226,12 @@ public:
 
     //networking
     bool disable_networking = false;
+    // send reliable ISteamNetworkingSockets messages on a per-connection reliable UDP channel instead of the shared TCP stream
+    bool networking_sockets_reliable_udp = false;
+    // seed of the fake lag/loss simulation (k_ESteamNetworkingConfig_FakePacket*), 0 = random
+    uint32 network_simulation_seed = 0;
+    // talk to peers running on this host through shared memory rings instead of the loopback sockets
+    bool networking_shared_memory = false;
 
     //gameserver source query
     bool disable_source_query = false;
@@ -236,6 +242,8 @@ public:
 
     //make lobby creation fail in the matchmaking interface
     bool disable_lobby_creation = false;
+    //how many chat messages are kept per lobby for ISteamMatchmaking::GetLobbyChatEntry()
+    uint32 lobby_chat_history_size = 256;
 
     //steamhttp external download support
     bool download_steamhttp_requests = false;
@@ -0,0 +1,87 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef __INCLUDED_SHARED_MEMORY_H__
+#define __INCLUDED_SHARED_MEMORY_H__
+
+// included by network.h, keep this header free of the emulator includes
+#include "common_helpers/os_detector.h"
+#include "steam/steamtypes.h"
+#include <atomic>
+#include <string>
+
+// lives at the start of the shared segment, followed by the ring data
+struct Shared_Memory_Ring_Header {
+    std::atomic<uint32> magic{}; // set last by the writer once the header is ready
+    uint32 capacity{}; // size of the ring data, power of 2
+    alignas(64) std::atomic<uint32> head{}; // write position, only moved by the writer
+    alignas(64) std::atomic<uint32> tail{}; // read position, only moved by the reader
+    alignas(64) std::atomic<uint32> reader_attached{};
+    std::atomic<uint32> writer_closed{};
+};
+
+// single writer/single reader ring of messages in a named shared memory segment
+// the writer creates the segment, the reader (another process on the same host) opens it by name
+class Shared_Memory_Ring
+{
+    std::string name{};
+    bool writer = false;
+    Shared_Memory_Ring_Header *header = nullptr;
+    uint8 *ring = nullptr;
+    size_t mapped_size = 0;
+    // our copy of header->capacity, the other process can rewrite the header at any time
+    uint32 capacity = 0;
+
+#if defined(__WINDOWS__)
+    void *mapping = nullptr; // HANDLE of the file mapping
+#else
+    bool linked = false; // the segment file still exists in /dev/shm
+#endif
+
+    bool map(bool create, uint32 capacity);
+    void unlink();
+    void copy_in(uint32 pos, const void *data, uint32 size);
+    void copy_out(uint32 pos, void *data, uint32 size) const;
+
+public:
+    Shared_Memory_Ring() = default;
+    ~Shared_Memory_Ring();
+
+    Shared_Memory_Ring(const Shared_Memory_Ring &) = delete;
+    Shared_Memory_Ring &operator=(const Shared_Memory_Ring &) = delete;
+
+    // writer side, fails if a segment with this name already exists
+    bool create(const std::string &name, uint32 capacity);
+    // reader side, fails if the writer didn't create the segment yet or it isn't readable by us
+    bool open(const std::string &name);
+    void close();
+
+    bool is_open() const;
+    // the reader mapped the segment, everything written from now on will be read
+    bool reader_attached() const;
+    // the writer closed its side, nothing else will be written
+    bool writer_closed() const;
+
+    // biggest message that fits in the ring
+    uint32 max_message_size() const;
+    // false if there isn't enough free room right now
+    bool write(const void *data, uint32 size, uint32 flags);
+    // false if there is nothing to read
+    bool read(std::string &data, uint32 &flags);
+};
+
+#endif // __INCLUDED_SHARED_MEMORY_H__
@@ -20,13 +20,48 @@
 
 #include "base.h"
 
+struct Gameserver_Player_Info_t;
+
+struct Source_Query_Rate {
+    double tokens{};
+    std::chrono::steady_clock::time_point last{};
+};
+
 class Source_Query
 {
-    Source_Query() = delete;
-    ~Source_Query() = delete;
+    // challenges are derived from the client address and a secret, the previous secret is still accepted after a rotation
+    uint32 challenge_secret{};
+    uint32 old_challenge_secret{};
+    std::chrono::steady_clock::time_point challenge_secret_time{};
+
+    // responses are built again only when the server data or the players change
+    uint64 cached_server_version{};
+    bool cached_server_valid = false;
+    std::vector<uint8_t> info_response{};
+    size_t info_response_players{};
+    std::vector<uint8_t> rules_response{};
+    std::vector<uint8_t> player_response{};
+    size_t player_response_players{};
+    std::chrono::steady_clock::time_point player_response_time{};
+
+    // queries allowed per source IP
+    std::map<uint32, Source_Query_Rate> rates{};
+    std::chrono::steady_clock::time_point last_rates_cleanup{};
+
+    uint32 next_split_id{};
+
+    uint32 make_challenge(uint32 secret, uint32 ip, uint16 port) const;
+    bool check_challenge(uint32 challenge, uint32 ip, uint16 port);
+    bool allow_query(uint32 ip);
+    void update_cache(uint64 server_version);
+    void add_response(std::vector<uint8_t> const& response, std::vector<std::vector<uint8_t>> &packets);
 
 public:
-    static std::vector<uint8_t> handle_source_query(const void* buffer, size_t len, Gameserver const& gs);
+    Source_Query();
+
+    // returns the packets to send back to ip:port, none if the query is ignored
+    // server_version changes whenever gs does, the cached responses are built again only then
+    std::vector<std::vector<uint8_t>> handle_source_query(const void* buffer, size_t len, uint32 ip, uint16 port, Gameserver const& gs, uint64 server_version, std::vector<std::pair<CSteamID, Gameserver_Player_Info_t>> const& players);
 };
 
 #endif // __INCLUDED_SOURCE_QUERY_H__
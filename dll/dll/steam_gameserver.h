@@ -60,6 +60,8 @@ public ISteamGameServer
     bool logged_in = false;
     bool call_servers_disconnected = false;
     Gameserver server_data{};
+    // bumped by every change to server_data, tells the source query cache when to build its responses again
+    uint64 server_data_version{};
     std::vector<std::pair<CSteamID, Gameserver_Player_Info_t>> players{};
 
     uint32 flags{};
@@ -67,8 +69,25 @@ public ISteamGameServer
 
     std::chrono::high_resolution_clock::time_point last_sent_server_info{};
     Auth_Manager *auth_manager{};
+    class Source_Query *source_query{};
 
-    std::vector<struct Gameserver_Outgoing_Packet> outgoing_packets{};
+    // replies to the source queries, in the order they have to be sent
+    std::deque<struct Gameserver_Outgoing_Packet> outgoing_packets{};
+
+    // server_data as the synced peers last received it, changes are sent as deltas against this
+    Gameserver synced_server_data{};
+    uint64 server_revision{};
+    std::chrono::high_resolution_clock::time_point last_sent_server_delta{};
+    // peers browsing servers recently, they get every change of server_data
+    std::map<uint64, std::chrono::high_resolution_clock::time_point> server_browsers{};
+    // interested peers that received the whole server_data and can apply deltas
+    std::set<uint64> synced_peers{};
+
+    // every change to server_data goes through this
+    Gameserver &edit_server_data();
+    void sync_server_data();
+    void Callback(Common_Message *msg);
+    static void steam_gameserver_network_callback(void *object, Common_Message *msg);
 
 
 public:
@@ -369,6 +388,12 @@ public:
     // called by steam_client::runcallbacks
     void RunCallbacks();
 
+    // moves every pending source query reply to packets, used by the networking to send them at once
+    void take_outgoing_packets(std::vector<struct Gameserver_Outgoing_Packet> &packets);
+
+    static bool make_gameserver_delta(const Gameserver &old_server, const Gameserver &server, Gameserver_Update *update);
+    static void apply_gameserver_delta(Gameserver *server, const Gameserver_Update &update);
+
 };
 
 #endif // __INCLUDED_STEAM_GAMESERVER_H__
@@ -41,19 +41,44 @@ struct Data_Requested {
 };
 
 struct Filter_Values {
-	std::string key{};
+	std::string key{}; // lowercase
 	std::string value_string{};
 	int value_int{};
 	bool is_int{};
 	ELobbyComparison eComparisonType{};
 };
 
+struct Near_Filter {
+    std::string key{}; // lowercase
+    int value{};
+};
+
+// the filters of a RequestLobbyList() call, compiled once and evaluated against each lobby when it changes
+struct Lobby_Query {
+    std::vector<struct Filter_Values> filters{};
+    // lowercase key -> indexes in filters, so each lobby value is looked up once
+    std::map<std::string, std::vector<size_t>> filters_by_key{};
+    // earlier filters take precedence when sorting the results
+    std::vector<struct Near_Filter> near_filters{};
+    int slots_available = -1;
+    int max_results{};
+    // every peer is on the LAN, this is kept but doesn't filter anything
+    ELobbyDistanceFilter distance = k_ELobbyDistanceFilterDefault;
+};
+
 struct Chat_Entry {
+    int id = -1; // -1 for the slots never written
     std::string message{};
     EChatEntryType type{};
     CSteamID lobby_id, user_id{};
 };
 
+// the last chat messages of a lobby, the oldest one is overwritten when it's full
+struct Lobby_Chat_History {
+    std::vector<struct Chat_Entry> entries{}; // the entry with some id is at (id % entries.size())
+    int next_id{};
+};
+
 
 class Steam_Matchmaking :
 public ISteamMatchmaking002,
@@ -77,20 +102,34 @@ public ISteamMatchmaking
     std::vector<struct Pending_Joins> pending_joins{};
     std::vector<struct Pending_Creates> pending_creates{};
 
-    std::vector<struct Filter_Values> filter_values{};
-    int filter_max_results{};
-    std::vector<struct Filter_Values> filter_values_copy{};
-    int filter_max_results_copy{};
+    // filters added for the next RequestLobbyList() call
+    Lobby_Query pending_query{};
+    // filters of the running search
+    Lobby_Query search_query{};
+    // lobbies matching the running search
+    std::set<uint64> search_matches{};
+    // lobbies added or changed since the running search last evaluated them
+    std::set<uint64> search_dirty{};
     std::vector<CSteamID> filtered_lobbies{};
     std::chrono::high_resolution_clock::time_point lobby_last_search{};
+    // seconds the running search waits for replies, longer right after startup or when peers connect during it
+    double search_timeout{};
+    std::chrono::high_resolution_clock::time_point started{};
     SteamAPICall_t search_call_api_id{};
     bool searching{};
 
-    std::vector<struct Chat_Entry> chat_entries{};
+    std::map<uint64, struct Lobby_Chat_History> chat_history{};
     std::vector<struct Data_Requested> data_requested{};
 
     std::map<uint64, ::google::protobuf::Map<std::string, std::string>> self_lobby_member_data{};
 
+    // owned lobbies as the other peers last received them, changes are sent as deltas against this
+    std::map<uint64, Lobby> lobby_synced_state{};
+    // peers who searched for lobbies recently, they get the changes of our lobbies too
+    std::map<uint64, std::chrono::high_resolution_clock::time_point> lobby_searchers{};
+    // last time we asked for the whole state of a lobby
+    std::map<uint64, std::chrono::high_resolution_clock::time_point> lobby_snapshot_requests{};
+
     google::protobuf::Map<std::string,std::string>::const_iterator caseinsensitive_find(const ::google::protobuf::Map< ::std::string, ::std::string >& map, std::string key);
 
     static Lobby_Member *get_lobby_member(Lobby *lobby, CSteamID user_id);
@@ -100,6 +139,18 @@ public ISteamMatchmaking
     Lobby *get_lobby(CSteamID id);
     void send_lobby_data();
 
+    static bool make_lobby_delta(const Lobby &old_lobby, const Lobby &lobby, Lobby_Delta *delta, bool *members_reordered);
+    static void apply_lobby_delta(Lobby *lobby, const Lobby_Delta &delta);
+    void sync_lobby(Lobby *lobby);
+    void send_lobby_snapshot(const Lobby &lobby, CSteamID dest);
+    void request_lobby_snapshot(CSteamID lobby_id, CSteamID owner);
+    void on_lobby_received(Lobby *new_lobby);
+    int add_chat_entry(struct Chat_Entry &&entry);
+
+    static bool lobby_matches_query(const Lobby &lobby, const Lobby_Query &query);
+    void search_lobby_changed(uint64 room_id);
+    void finish_lobby_search();
+
     void trigger_lobby_dataupdate(CSteamID lobby, CSteamID member, bool success, double cb_timeout=0.005, bool send_changed_lobby=true);
     void trigger_lobby_member_join_leave(CSteamID lobby, CSteamID member, bool leaving, bool success, double cb_timeout=0.0);
 
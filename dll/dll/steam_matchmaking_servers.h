@@ -19,7 +19,6 @@
 #define __INCLUDED_STEAM_MATCHMAKING_SERVERS_H__
 
 #include "base.h"
-#include <ssq/a2s.h>
 
 struct Steam_Matchmaking_Servers_Direct_IP_Request {
 	HServerQuery id{};
@@ -30,6 +29,8 @@ struct Steam_Matchmaking_Servers_Direct_IP_Request {
 	ISteamMatchmakingRulesResponse *rules_response{};
 	ISteamMatchmakingPlayersResponse *players_response{};
 	ISteamMatchmakingPingResponse *ping_response{};
+	// source query sent to the server when it isn't one of the gameservers we know about
+	uint64 a2s_query{};
 };
 
 struct Steam_Matchmaking_Servers_Gameserver_Friends {
@@ -43,6 +44,16 @@ struct Steam_Matchmaking_Servers_Gameserver {
     Gameserver server{};
     std::chrono::high_resolution_clock::time_point last_recv{};
     EMatchMakingType type{};
+    // revision of the gameserver from its last heartbeat, server is outdated when its revision is older
+    uint64 latest_revision{};
+    // false until the whole state is received, the gameserver was only heard of through heartbeats
+    bool has_details = true;
+    // server converted for the server browser, built again once server changes
+    std::shared_ptr<gameserveritem_t> details{};
+    // source query refreshing server before details are built, see server_details_pending()
+    uint64 a2s_query{};
+    // round trip time of the last answered source query in milliseconds, 0 if none
+    int query_ping{};
 };
 
 struct Steam_Matchmaking_Request {
@@ -51,8 +62,20 @@ struct Steam_Matchmaking_Request {
     ISteamMatchmakingServerListResponse *callbacks{};
 	ISteamMatchmakingServerListResponse001 *old_callbacks{};
     bool completed{}, cancelled{}, released{};
-    std::vector <struct Steam_Matchmaking_Servers_Gameserver> gameservers_filtered{};
+    std::chrono::high_resolution_clock::time_point created{};
     EMatchMakingType type{};
+
+    // servers of the list, picked once the request is ready, and their details as given to the game
+    // the game keeps the details pointers until it releases the request, they are only ever updated in place
+    bool listed{};
+    std::vector<std::shared_ptr<struct Steam_Matchmaking_Servers_Gameserver>> servers{};
+    std::vector<std::unique_ptr<gameserveritem_t>> servers_details{};
+    // false until the details are filled for the current refresh of the list
+    std::vector<bool> servers_details_current{};
+    // servers already reported with ServerResponded(), a few more every frame
+    size_t responded{};
+    // RefreshServer() calls not answered yet
+    std::vector<int> refresh_servers{};
 };
 
 class Steam_Matchmaking_Servers :
@@ -63,7 +86,10 @@ public ISteamMatchmakingServers
     class Local_Storage *local_storage{};
     class Networking *network{};
 
-    std::vector <struct Steam_Matchmaking_Servers_Gameserver> gameservers{};
+    std::vector <std::shared_ptr<struct Steam_Matchmaking_Servers_Gameserver>> gameservers{};
+    // gameservers by query address, built again when needed after the list or an address changed
+    std::multimap<uint64, std::shared_ptr<struct Steam_Matchmaking_Servers_Gameserver>> gameservers_by_address{};
+    bool gameservers_by_address_dirty = true;
     std::vector <struct Steam_Matchmaking_Servers_Gameserver_Friends> gameservers_friends{};
     std::vector <struct Steam_Matchmaking_Request> requests{};
     std::vector <struct Steam_Matchmaking_Servers_Direct_IP_Request> direct_ip_requests{};
@@ -73,10 +99,19 @@ public ISteamMatchmakingServers
 	
     //
 	static void network_callback(void *object, Common_Message *msg);
-    void server_details(Gameserver *g, gameserveritem_t *server);
+    bool server_details_pending(Steam_Matchmaking_Servers_Gameserver &g);
+    void read_server_details_queries();
+    void server_details(Steam_Matchmaking_Servers_Gameserver &g, gameserveritem_t *server);
     void server_details_players(Gameserver *g, Steam_Matchmaking_Servers_Direct_IP_Request *r);
     void server_details_rules(Gameserver *g, Steam_Matchmaking_Servers_Direct_IP_Request *r);
     void Callback(Common_Message *msg);
+    void request_gameserver_state(AppId_t appid, CSteamID server_id);
+    bool waiting_for_gameservers(const Steam_Matchmaking_Request &request);
+    void list_request_servers(Steam_Matchmaking_Request &request);
+    std::shared_ptr<gameserveritem_t> get_server_details(Steam_Matchmaking_Servers_Gameserver &g);
+    gameserveritem_t *get_request_server_details(Steam_Matchmaking_Request &request, int index);
+    void update_request_server_details(Steam_Matchmaking_Request &request, int index);
+    std::vector<std::shared_ptr<struct Steam_Matchmaking_Servers_Gameserver>> find_gameservers(uint32 ip, uint16 query_port);
 
 public:
     Steam_Matchmaking_Servers(class Settings *settings, class Local_Storage *local_storage, class Networking *network);
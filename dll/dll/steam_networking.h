@@ -25,6 +25,14 @@ struct Steam_Networking_Connection {
     std::set<int> open_channels{};
 };
 
+// received packet waiting for ReadP2PPacket
+struct P2P_Packet {
+    CSteamID remote{};
+    int channel{};
+    std::string data{};
+    uint64 time_processed{};
+};
+
 struct steam_listen_socket {
     SNetListenSocket_t id{};
     int nVirtualP2PPort{};
@@ -65,11 +73,14 @@ public ISteamNetworking
     class RunEveryRunCB *run_every_runcb{};
 
     std::recursive_mutex messages_mutex{};
-    std::list<Common_Message> messages{};
+    // packets from users with an open session, only the front of a channel queue is ever looked at
+    std::map<int, std::deque<struct P2P_Packet>> channel_messages{};
+    // packets from users without a session, moved to the channel queues once the session exists or dropped after a while
+    std::map<CSteamID, std::deque<struct P2P_Packet>> orphaned_messages{};
     std::list<Common_Message> unprocessed_messages{};
 
     std::recursive_mutex connections_edit_mutex{};
-    std::vector<struct Steam_Networking_Connection> connections{};
+    std::unordered_map<uint64, struct Steam_Networking_Connection> connections{}; // key: remote steam id
 
     std::vector<struct steam_listen_socket> listen_sockets{};
     std::vector<struct steam_connection_socket> connection_sockets{};
@@ -81,6 +92,7 @@ public ISteamNetworking
 
     bool connection_exists(CSteamID id);
     struct Steam_Networking_Connection *get_or_create_connection(CSteamID id);
+    void remove_messages(CSteamID id);
     void remove_connection(CSteamID id);
     SNetSocket_t create_connection_socket(CSteamID target, int nVirtualPort, uint32 nIP, uint16 nPort, SNetListenSocket_t id=0, enum steam_socket_connection_status status=SOCKET_CONNECTING, SNetSocket_t other_id=0);
     struct steam_connection_socket *get_connection_socket(SNetSocket_t id);
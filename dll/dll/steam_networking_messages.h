@@ -20,9 +20,21 @@
 
 #include "base.h"
 
+// received message which owns its payload, the game reads it straight from here
+struct Steam_Message_Received : public SteamNetworkingMessage_t {
+    std::string payload{};
+};
+
+// DATA message waiting for RunCallbacks() to match it against its session
+struct Steam_Message_Incoming {
+    CSteamID source_id{};
+    unsigned id_from{};
+    int channel{};
+    std::string payload{};
+};
+
 struct Steam_Message_Connection {
     SteamNetworkingIdentity remote_identity{};
-    std::map<int, std::queue<std::string>> data{};
 
     std::list<int> channels{};
     bool accepted = false;
@@ -44,7 +56,9 @@ public ISteamNetworkingMessages
     class RunEveryRunCB *run_every_runcb{};
 
     std::map<CSteamID, Steam_Message_Connection> connections{};
-    std::list<Common_Message> incoming_data{};
+    std::deque<Steam_Message_Incoming> incoming_data{};
+    // messages ready to be received, per local channel, in arrival order
+    std::map<int, std::deque<Steam_Message_Received *>> channel_messages{};
 
     unsigned id_counter = 0;
     std::chrono::steady_clock::time_point created{};
@@ -58,6 +72,7 @@ public ISteamNetworkingMessages
     std::map<CSteamID, Steam_Message_Connection>::iterator find_or_create_message_connection(SteamNetworkingIdentity identityRemote, bool incoming, bool restartbroken);
 
     void end_connection(CSteamID steam_id);
+    void remove_messages(CSteamID steam_id);
 
     void RunCallbacks();
     void Callback(Common_Message *msg);
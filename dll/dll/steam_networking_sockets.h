@@ -20,6 +20,9 @@
 
 #include "base.h"
 
+// k_ESteamNetworkingConfig_SendBufferSize, same default as the real library
+#define DEFAULT_SEND_BUFFER_SIZE (512 * 1024)
+
 struct Listen_Socket {
     HSteamListenSocket socket_id{};
 
@@ -27,6 +30,9 @@ struct Listen_Socket {
     int real_port{};
 
     CSteamID created_by{};
+
+    // k_ESteamNetworkingConfig_SendBufferSize of the connections accepted on this socket
+    int32 send_buffer_size{};
 };
 
 enum connect_socket_status {
@@ -38,6 +44,72 @@ enum connect_socket_status {
     CONNECT_SOCKET_TIMEDOUT
 };
 
+struct Reliable_UDP_Segment {
+    Networking_Sockets data{};
+
+    std::chrono::steady_clock::time_point first_sent{};
+    std::chrono::steady_clock::time_point last_sent{};
+    unsigned retransmits{};
+    // how many times a later segment was acked before this one, used for fast retransmit
+    unsigned times_skipped{};
+};
+
+// reliable, ordered delivery on top of the unreliable (UDP) path of the network layer
+// every connection has its own channel, so a stalled connection doesn't hold back the others
+// like the shared TCP stream does
+struct Reliable_UDP_Channel {
+    // send side
+    uint64 next_seq = 1;
+    std::queue<Networking_Sockets> send_queue{}; // segments waiting for room in the congestion window
+    std::map<uint64, Reliable_UDP_Segment> in_flight{};
+    size_t send_queue_bytes{};
+    size_t in_flight_bytes{};
+    uint64 recovery_seq{}; // don't shrink the window again for losses before this segment
+
+    double cwnd{};
+    double ssthresh{};
+    std::chrono::microseconds srtt{};
+    std::chrono::microseconds rttvar{};
+    std::chrono::microseconds rto{};
+
+    // receive side
+    uint64 recv_next = 1;
+    std::map<uint64, Networking_Sockets> recv_out_of_order{};
+    std::string recv_partial{};
+    bool ack_pending{};
+
+    // for the remote connection quality
+    uint64 segments_sent{};
+    uint64 segments_retransmitted{};
+};
+
+// traffic counters of a connection, the rates are recalculated once per interval
+struct Connection_Stats {
+    std::chrono::steady_clock::time_point interval_start{};
+    uint64 out_packets{};
+    uint64 out_bytes{};
+    uint64 in_packets{};
+    uint64 in_bytes{};
+
+    float out_packets_per_sec{};
+    float out_bytes_per_sec{};
+    float in_packets_per_sec{};
+    float in_bytes_per_sec{};
+
+    // loss is detected from gaps in the message numbers of the received messages
+    uint64 highest_message_number{};
+    uint64 messages_received{};
+    uint64 messages_lost{};
+    float quality_local = 1.0f;
+};
+
+// a message of a connection waiting in the send queue shared by all the traffic to the peer
+struct Connect_Socket_Queued_Send {
+    uint64 position{}; // position in that queue once the message was added, see Networking::getSendQueuePosition()
+    uint32 size{};
+    bool reliable{};
+};
+
 struct Connect_Socket {
     struct compare_snm_for_queue {
         bool operator()(const Networking_Sockets &left, const Networking_Sockets &right) {
@@ -64,13 +136,38 @@ struct Connect_Socket {
 
     std::chrono::steady_clock::time_point connect_request_last_sent{};
     unsigned connect_requests_sent{};
+
+    // send reliable messages on the reliable UDP channel instead of the shared TCP stream
+    // only honored once both ends agreed on it during the connection handshake
+    bool reliable_udp{};
+    struct Reliable_UDP_Channel reliable_channel{};
+
+    struct Connection_Stats stats{};
+
+    // k_ESteamNetworkingConfig_SendBufferSize, sending fails with k_EResultLimitExceeded once this much data is queued
+    int32 send_buffer_size{};
+    // messages of this connection still in the send queue to the peer, unreliable ones end up there before UDP works
+    std::deque<struct Connect_Socket_Queued_Send> tcp_pending{};
+    size_t tcp_pending_reliable_bytes{};
+    size_t tcp_pending_unreliable_bytes{};
+    // reliable messages sent while connecting with the reliable UDP channel wished, see send_held_reliable()
+    std::vector<Common_Message> held_reliable{};
+    size_t held_reliable_bytes{};
+
+    // when CloseConnection() was called, while the reliable UDP channel is still being flushed
+    std::chrono::steady_clock::time_point linger_start{};
 };
 
 struct shared_between_client_server {
     std::vector<struct Listen_Socket> listen_sockets{};
     std::map<HSteamNetConnection, struct Connect_Socket> connect_sockets{};
+    // closed connections whose reliable UDP data isn't acked yet, CONNECTION_END is sent once it is
+    std::map<HSteamNetConnection, struct Connect_Socket> lingering_sockets{};
     std::map<HSteamNetPollGroup, std::list<HSteamNetConnection>> poll_groups{};
     unsigned used{};
+
+    // global k_ESteamNetworkingConfig_SendBufferSize
+    int32 send_buffer_size = DEFAULT_SEND_BUFFER_SIZE;
 };
 
 class Steam_Networking_Sockets :
@@ -105,12 +202,30 @@ public ISteamNetworkingSockets
 
     static unsigned long get_socket_id();
 
-    HSteamNetConnection new_connect_socket(SteamNetworkingIdentity remote_identity, int virtual_port, int real_port, enum connect_socket_status status=CONNECT_SOCKET_CONNECTING, HSteamListenSocket listen_socket_id=k_HSteamListenSocket_Invalid, HSteamNetConnection remote_id=k_HSteamNetConnection_Invalid);
+    HSteamNetConnection new_connect_socket(SteamNetworkingIdentity remote_identity, int virtual_port, int real_port, enum connect_socket_status status=CONNECT_SOCKET_CONNECTING, HSteamListenSocket listen_socket_id=k_HSteamListenSocket_Invalid, HSteamNetConnection remote_id=k_HSteamNetConnection_Invalid, int32 send_buffer_size=0);
     struct Listen_Socket *get_connection_socket(HSteamListenSocket id);
 
     bool send_packet_new_connection(HSteamNetConnection m_hConn);
 
-    HSteamListenSocket new_listen_socket(int nSteamConnectVirtualPort, int real_port);
+    int32 send_buffer_size_from_options(int nOptions, const SteamNetworkingConfigValue_t *pOptions);
+    size_t get_tcp_pending_bytes(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, bool reliable);
+    bool send_data(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, Common_Message &&msg, bool reliable);
+    void send_held_reliable(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket);
+    size_t get_delayed_send_bytes(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, bool reliable);
+    size_t get_pending_send_bytes(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket);
+    Common_Message create_connection_message(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, Networking_Sockets::Types type);
+    void reliable_udp_send(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, const Networking_Sockets &message);
+    void reliable_udp_transmit(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, Reliable_UDP_Segment &segment);
+    void reliable_udp_fill_window(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket);
+    void reliable_udp_receive(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, const Networking_Sockets &segment);
+    void reliable_udp_handle_ack(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, const Networking_Sockets &ack);
+    // returns false if the connection should be considered dead
+    bool reliable_udp_run(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, std::chrono::steady_clock::time_point now);
+    // data is moved into the connection queue
+    void receive_data(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, Networking_Sockets &data);
+    void update_stats(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, std::chrono::steady_clock::time_point now);
+
+    HSteamListenSocket new_listen_socket(int nSteamConnectVirtualPort, int real_port, int32 send_buffer_size);
 
     ESteamNetworkingConnectionState convert_status(enum connect_socket_status old_status);
 
@@ -47,6 +47,11 @@ public ISteamNetworkingUtils
     which will delay that first access.
     */
 
+    static float *simulation_float_value(Network_Conditions &conditions, ESteamNetworkingConfigValue eValue);
+    static int32 *simulation_int32_value(Network_Conditions &conditions, ESteamNetworkingConfigValue eValue);
+    bool simulation_peer(ESteamNetworkingConfigScope eScopeType, intptr_t scopeObj, CSteamID *peer);
+    int32 *send_buffer_size_value(ESteamNetworkingConfigScope eScopeType, intptr_t scopeObj);
+
     static void free_steam_message_data(SteamNetworkingMessage_t *pMsg);
     static void delete_steam_message(SteamNetworkingMessage_t *pMsg);
 
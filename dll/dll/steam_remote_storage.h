@@ -20,6 +20,7 @@
 
 #include "base.h"
 #include "ugc_remote_storage_bridge.h"
+#include "file_io_pool.h"
 
 struct Async_Read {
  SteamAPICall_t api_call{};
@@ -27,12 +28,21 @@ struct Async_Read {
  uint32 to_read{};
  uint32 size{};
  std::string file_name{};
+ bool completed = false; // the pool finished reading the range into data
+ std::vector<char> data{};
+};
+
+// owned by the file io pool while chunks are queued, the game thread only touches it after waiting for them
+struct Stream_Write_File {
+    std::ofstream file{};
+    bool failed = false;
 };
 
 struct Stream_Write {
     std::string file_name{};
     UGCFileWriteStreamHandle_t write_stream_handle{};
-    std::vector<char> file_data{};
+    std::string temp_path{}; // chunks are appended here, then it's renamed over the file on close
+    std::shared_ptr<Stream_Write_File> temp_file{};
 };
 
 struct Downloaded_File {
@@ -59,6 +69,10 @@ public:
 
     // *** used when source = FromUGCDownloadToLocation only
     std::string download_to_location_fullpath{};
+
+    // *** opened by the first UGCRead(), kept until the file is closed or read till the end
+    std::string read_fullpath{};
+    std::shared_ptr<std::ifstream> read_handle{};
     
 };
 
@@ -86,6 +100,8 @@ private:
     class Local_Storage *local_storage{};
     class SteamCallResults *callback_results{};
     class SteamCallBacks *callbacks{};
+    class RunEveryRunCB *run_every_runcb{};
+    class File_IO_Pool *file_io{};
 
     std::vector<struct Async_Read> async_reads{};
     std::vector<struct Stream_Write> stream_writes{};
@@ -94,9 +110,21 @@ private:
     
     bool steam_cloud_enabled = true;
 
+    static void steam_remote_storage_run_every_runcb(void *object);
+
+    // key of the pool ops touching this remote storage file
+    std::string file_io_key(const std::string &file) const;
+    // sync calls must see the result of the async writes queued before them
+    void wait_file_io(const std::string &key);
+    // waits for the queued chunks, closes the temp file and deletes it unless it was moved into place
+    void close_stream_write(Stream_Write &stream_write);
+
 public:
 
-    Steam_Remote_Storage(class Settings *settings, class Ugc_Remote_Storage_Bridge *ugc_bridge, class Local_Storage *local_storage, class SteamCallResults *callback_results, class SteamCallBacks *callbacks);
+    Steam_Remote_Storage(class Settings *settings, class Ugc_Remote_Storage_Bridge *ugc_bridge, class Local_Storage *local_storage, class SteamCallResults *callback_results, class SteamCallBacks *callbacks, class RunEveryRunCB *run_every_runcb);
+    ~Steam_Remote_Storage();
+
+    void RunCallbacks();
 
     // NOTE
     //
@@ -32,16 +32,30 @@ struct Steam_Leaderboard {
     std::string name{};
     ELeaderboardSortMethod sort_method = k_ELeaderboardSortMethodNone;
     ELeaderboardDisplayType display_type = k_ELeaderboardDisplayTypeNone;
+    // kept in rank order, rank N is entries[N - 1], users with the same score keep the order they got it in
     std::vector<Steam_Leaderboard_Entry> entries{};
+    // score of each user in entries, to find their entry with a binary search instead of a scan
+    std::unordered_map<uint64, int32> entries_index{};
+
+    bool ranks_before(int32 score1, int32 score2) const;
+    std::vector<Steam_Leaderboard_Entry>::const_iterator find_entry(const CSteamID &steamid) const;
 
     Steam_Leaderboard_Entry* find_recent_entry(const CSteamID &steamid) const;
+    // returns a value 1 -> entries.size(), inclusive, or 0 if the user has no entry
+    int find_rank(const CSteamID &steamid) const;
+    // adds the user's entry or replaces the old one, and moves it to its rank
+    Steam_Leaderboard_Entry* upsert_entry(const Steam_Leaderboard_Entry &entry);
+    // same result as calling upsert_entry() on each of them, sorted once instead of inserted one by one
+    void load_entries(const std::vector<Steam_Leaderboard_Entry> &loaded);
     void remove_entries(const CSteamID &steamid);
 
-    // remove entries with the same steamid, keeping only most recent one
-    void remove_duplicate_entries();
-
-    void sort_entries();
+};
 
+// rows returned by one of the DownloadLeaderboardEntries() calls, as they were at that time
+struct Steam_Leaderboard_Download {
+    SteamLeaderboardEntries_t handle{};
+    std::vector<int> ranks{}; // global rank of each of the entries
+    std::vector<Steam_Leaderboard_Entry> entries{};
 };
 
 struct achievement_trigger {
@@ -71,6 +85,7 @@ public ISteamUserStats
 {
 public:
     static constexpr const auto achievements_user_file = "achievements.json";
+    static constexpr const auto stats_user_file = "stats.bin";
 
 private:
     template<typename T>
@@ -90,14 +105,24 @@ private:
     class Steam_Overlay* overlay{};
 
     std::vector<struct Steam_Leaderboard> cached_leaderboards{};
+    // oldest first, only the last few are kept
+    std::deque<struct Steam_Leaderboard_Download> leaderboard_downloads{};
+    SteamLeaderboardEntries_t last_leaderboard_download{};
 
     nlohmann::json defined_achievements{};
+    // key: lowercase achievement name, value: its index in defined_achievements
+    std::unordered_map<std::string, size_t> defined_achievements_index{};
     nlohmann::json user_achievements{};
     std::vector<std::string> sorted_achievement_names{};
     size_t last_loaded_ach_icon{};
 
     std::map<std::string, int32> stats_cache_int{};
     std::map<std::string, float> stats_cache_float{};
+    // count and session length behind the average of each avgrate stat
+    std::map<std::string, std::pair<float, double>> stats_avgrate_totals{};
+    // the caches are written to stats_user_file a while after they change, or on StoreStats()
+    bool stats_dirty = false;
+    std::chrono::high_resolution_clock::time_point stats_dirty_since{};
 
     std::map<std::string, std::vector<achievement_trigger>> achievement_stat_trigger{};
     
@@ -107,6 +132,10 @@ private:
 
     GameServerStats_Messages::AllStats pending_server_updates{};
 
+    void load_stats();
+    bool load_legacy_stat(const std::string &stat_name, GameServerStats_Messages::StatInfo::Stat_Type type);
+    void save_stats(bool now);
+    void set_stats_dirty();
     void load_achievements_db();
     void load_achievements();
     void save_achievements();
@@ -126,6 +155,9 @@ private:
     // null steamid means broadcast to all
     void send_my_leaderboard_score(const Steam_Leaderboard &board, const CSteamID *steamid = nullptr, bool want_scores_back = false);
     void request_user_leaderboard_entry(const Steam_Leaderboard &board, const CSteamID &steamid);
+    // copies the entries with ranks [first_rank, last_rank], clamped to the board
+    void add_leaderboard_rows(Steam_Leaderboard_Download &download, const Steam_Leaderboard &board, int64 first_rank, int64 last_rank);
+    SteamAPICall_t add_leaderboard_download(SteamLeaderboard_t hSteamLeaderboard, Steam_Leaderboard_Download &&download);
 
     // change stats/achievements without sending back to server
     bool clear_stats_internal();
@@ -0,0 +1,139 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "dll/file_io_pool.h"
+
+
+File_IO_Pool::File_IO_Pool(unsigned max_workers, size_t max_pending)
+{
+    this->max_workers = max_workers ? max_workers : 1;
+    this->max_pending = max_pending ? max_pending : 1;
+}
+
+File_IO_Pool::~File_IO_Pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        stopping = true;
+    }
+
+    work_cv.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+bool File_IO_Pool::key_busy(const std::string &key) const
+{
+    if (running_keys.count(key)) return true;
+
+    return std::any_of(pending.begin(), pending.end(), [&key](const File_IO_Op &op) { return op.key == key; });
+}
+
+// the oldest op whose key isn't already being worked on, later ops with the same key are behind it in the queue
+std::deque<File_IO_Op>::iterator File_IO_Pool::next_op()
+{
+    return std::find_if(pending.begin(), pending.end(), [this](const File_IO_Op &op) { return running_keys.count(op.key) == 0; });
+}
+
+void File_IO_Pool::worker_thread()
+{
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    while (true) {
+        auto op_itr = pending.end();
+        work_cv.wait(lock, [this, &op_itr]{
+            op_itr = next_op();
+            return op_itr != pending.end() || (stopping && pending.empty());
+        });
+        if (op_itr == pending.end()) break;
+
+        File_IO_Op op(std::move(*op_itr));
+        pending.erase(op_itr);
+        running_keys.insert(op.key);
+        state_cv.notify_all();
+        lock.unlock();
+
+        op.started = std::chrono::high_resolution_clock::now();
+        op.work();
+        op.finished = std::chrono::high_resolution_clock::now();
+
+        lock.lock();
+        running_keys.erase(running_keys.find(op.key));
+        completed.push_back(std::move(op));
+        // another worker may be waiting for this key to be released
+        work_cv.notify_all();
+        state_cv.notify_all();
+    }
+}
+
+void File_IO_Pool::submit(const std::string &key, std::function<void()> work, std::function<void()> done)
+{
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    if (pending.size() >= max_pending) {
+        PRINT_DEBUG("queue full (%zu), waiting for a worker", pending.size());
+        state_cv.wait(lock, [this]{ return pending.size() < max_pending; });
+    }
+
+    File_IO_Op op{};
+    op.key = key;
+    op.work = std::move(work);
+    op.done = std::move(done);
+    op.queued = std::chrono::high_resolution_clock::now();
+    pending.push_back(std::move(op));
+
+    // start another worker only when the ones we have are all busy
+    if (workers.size() < max_workers && running_keys.size() + pending.size() > workers.size()) {
+        workers.emplace_back(&File_IO_Pool::worker_thread, this);
+    }
+
+    work_cv.notify_one();
+}
+
+void File_IO_Pool::wait(const std::string &key)
+{
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    state_cv.wait(lock, [this, &key]{ return !key_busy(key); });
+}
+
+size_t File_IO_Pool::queue_depth()
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    return pending.size() + running_keys.size();
+}
+
+void File_IO_Pool::run_completions()
+{
+    std::vector<File_IO_Op> done_ops{};
+    size_t depth = 0;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if (completed.empty()) return;
+
+        done_ops.swap(completed);
+        depth = pending.size() + running_keys.size();
+    }
+
+    for (auto &op : done_ops) {
+        PRINT_DEBUG("'%s' queued %.3fms, took %.3fms, queue depth %zu",
+            op.key.c_str(),
+            std::chrono::duration<double, std::milli>(op.started - op.queued).count(),
+            std::chrono::duration<double, std::milli>(op.finished - op.started).count(),
+            depth
+        );
+        if (op.done) op.done();
+    }
+}
@@ -17,6 +17,10 @@
 
 #include "dll/local_storage.h"
 
+#if defined(__LINUX__)
+#include <sys/inotify.h>
+#endif
+
 #if defined(__WINDOWS__)
 // NOTE: stb_image_write
 #define STBIW_WINDOWS_UTF8
@@ -100,6 +104,16 @@ std::string Local_Storage::get_path(std::string folder)
     return empty_str;
 }
 
+std::string Local_Storage::get_file_path(std::string folder, std::string file)
+{
+    return empty_str;
+}
+
+void Local_Storage::file_changed(std::string folder, std::string file)
+{
+
+}
+
 std::string Local_Storage::get_global_settings_path()
 {
     return empty_str;
@@ -110,6 +124,11 @@ Local_Storage::Local_Storage(const std::string &save_directory)
 
 }
 
+Local_Storage::~Local_Storage()
+{
+
+}
+
 const std::string& Local_Storage::get_current_save_directory() const
 {
     return empty_str;
@@ -125,6 +144,11 @@ int Local_Storage::store_data(std::string folder, std::string file, char *data,
     return -1;
 }
 
+int Local_Storage::store_data_atomic(std::string folder, std::string file, const char *data, unsigned int length)
+{
+    return -1;
+}
+
 int Local_Storage::store_data_settings(std::string file, const char *data, unsigned int length)
 {
     return -1;
@@ -455,6 +479,237 @@ static std::vector<struct File_Data> get_filenames_recursive(std::string base_pa
 
 #endif
 
+static bool stat_index_file(const std::string &full_path, Local_Storage_File &file)
+{
+#if defined(STEAM_WIN32)
+    struct _stat buffer{};
+    if (_wstat(utf8_decode(full_path).c_str(), &buffer) != 0 || (buffer.st_mode & S_IFDIR)) return false;
+#else
+    struct stat buffer{};
+    if (stat(full_path.c_str(), &buffer) != 0 || !S_ISREG(buffer.st_mode)) return false;
+#endif
+
+    file.size = static_cast<uint64_t>(buffer.st_size);
+    file.timestamp = static_cast<uint64_t>(buffer.st_mtime);
+    return true;
+}
+
+static void close_index_watch(Local_Storage_Index &index)
+{
+#if defined(__WINDOWS__)
+    if (index.dir_handle) {
+        // the pending read writes into change_buffer, it has to be finished before the buffer goes away
+        CancelIo((HANDLE)index.dir_handle);
+        DWORD len = 0;
+        GetOverlappedResult((HANDLE)index.dir_handle, &index.change_overlapped, &len, TRUE);
+        CloseHandle((HANDLE)index.dir_handle);
+        index.dir_handle = nullptr;
+    }
+
+    if (index.change_overlapped.hEvent) {
+        CloseHandle(index.change_overlapped.hEvent);
+    }
+
+    index.change_overlapped = {};
+    reset_LastError();
+#elif defined(__LINUX__)
+    if (index.inotify_fd >= 0) {
+        close(index.inotify_fd);
+        index.inotify_fd = -1;
+    }
+
+    index.watches.clear();
+#endif
+}
+
+#if defined(__WINDOWS__)
+#define INDEX_WATCH_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE)
+#define INDEX_WATCH_BUFFER_SIZE (64 * 1024)
+
+// queues the next ReadDirectoryChangesW(), read_index_changes() picks up its result without blocking
+static bool read_index_watch(Local_Storage_Index &index)
+{
+    ResetEvent(index.change_overlapped.hEvent);
+    return ReadDirectoryChangesW((HANDLE)index.dir_handle, index.change_buffer.data(), static_cast<DWORD>(index.change_buffer.size() * sizeof(DWORD)),
+        TRUE, INDEX_WATCH_FILTER, NULL, &index.change_overlapped, NULL);
+}
+#elif defined(__LINUX__)
+#define INDEX_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// like get_filenames_recursive() with the sizes and timestamps, every folder is watched before it's read so nothing written meanwhile is missed
+static void scan_index_folder(Local_Storage_Index &index, const std::string &base_path, const std::string &relative)
+{
+    std::string path(base_path + relative);
+    if (index.inotify_fd >= 0) {
+        int wd = inotify_add_watch(index.inotify_fd, path.c_str(), INDEX_WATCH_EVENTS);
+        if (wd >= 0) {
+            index.watches[wd] = relative;
+        } else {
+            // probably out of watches, the index can't be trusted after this scan
+            close_index_watch(index);
+        }
+    }
+
+    DIR *dir = opendir(path.c_str());
+    if (!dir) return;
+
+    struct dirent *dp;
+    while ((dp = readdir(dir)) != NULL) {
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) continue;
+
+        std::string name(relative + dp->d_name);
+        struct stat buffer{};
+        if (stat((base_path + name).c_str(), &buffer) != 0) continue;
+
+        if (S_ISREG(buffer.st_mode)) {
+            Local_Storage_File &file = index.files[name];
+            file.size = static_cast<uint64_t>(buffer.st_size);
+            file.timestamp = static_cast<uint64_t>(buffer.st_mtime);
+        } else if (S_ISDIR(buffer.st_mode)) {
+            scan_index_folder(index, base_path, name + PATH_SEPARATOR);
+        }
+    }
+
+    closedir(dir);
+}
+#endif
+
+static void scan_index(Local_Storage_Index &index, const std::string &full_folder)
+{
+    PRINT_DEBUG("'%s'", full_folder.c_str());
+    close_index_watch(index);
+    index.files.clear();
+    index.names_dirty = true;
+
+#if defined(__WINDOWS__)
+    HANDLE handle = CreateFileW(utf8_decode(full_folder).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (handle != INVALID_HANDLE_VALUE) {
+        index.dir_handle = (void *)handle;
+        index.change_overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        index.change_buffer.resize(INDEX_WATCH_BUFFER_SIZE / sizeof(DWORD));
+        if (!index.change_overlapped.hEvent || !read_index_watch(index)) close_index_watch(index);
+    }
+    reset_LastError();
+
+    for (auto &f : get_filenames_recursive(full_folder)) {
+        Local_Storage_File file{};
+        if (stat_index_file(full_folder + f.name, file)) index.files[f.name] = file;
+    }
+
+    index.valid = index.dir_handle != nullptr;
+#elif defined(__LINUX__)
+    index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    scan_index_folder(index, full_folder, "");
+    index.valid = index.inotify_fd >= 0;
+#else
+    for (auto &f : get_filenames_recursive(full_folder)) {
+        Local_Storage_File file{};
+        if (stat_index_file(full_folder + f.name, file)) index.files[f.name] = file;
+    }
+
+    // nothing tells us about outside changes, scanned again next time
+    index.valid = false;
+#endif
+}
+
+static void refresh_index_file(Local_Storage_Index &index, const std::string &full_folder, const std::string &file)
+{
+    Local_Storage_File data{};
+    if (stat_index_file(full_folder + file, data)) {
+        auto result = index.files.insert_or_assign(file, data);
+        if (result.second) index.names_dirty = true;
+    } else if (index.files.erase(file)) {
+        index.names_dirty = true;
+    }
+}
+
+// applies the changes the OS reported since the last time, index.valid is cleared if they can't be applied one by one
+static void read_index_changes(Local_Storage_Index &index, const std::string &full_folder)
+{
+#if defined(__WINDOWS__)
+    if (!index.dir_handle) return;
+
+    DWORD len = 0;
+    while (GetOverlappedResult((HANDLE)index.dir_handle, &index.change_overlapped, &len, FALSE)) {
+        if (len == 0) {
+            // more changes than the buffer could hold, they were dropped
+            PRINT_DEBUG("'%s' changes overflowed", full_folder.c_str());
+            index.valid = false;
+        }
+
+        const char *ptr = reinterpret_cast<const char *>(index.change_buffer.data());
+        while (len) {
+            const FILE_NOTIFY_INFORMATION *info = reinterpret_cast<const FILE_NOTIFY_INFORMATION *>(ptr);
+            std::string name(utf8_encode(std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR))));
+
+            if (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+                // a folder appeared with whatever is inside it
+                std::error_code ec{};
+                if (std::filesystem::is_directory(std::filesystem::u8path(full_folder + name), ec)) index.valid = false;
+            } else if (info->Action == FILE_ACTION_REMOVED || info->Action == FILE_ACTION_RENAMED_OLD_NAME) {
+                // a folder went away, the files we know under it aren't reported one by one
+                std::string prefix(name + PATH_SEPARATOR);
+                auto entry = index.files.lower_bound(prefix);
+                if (entry != index.files.end() && entry->first.size() > prefix.size() &&
+                    !Local_Storage_Name_Less()(prefix, entry->first.substr(0, prefix.size()))) {
+                    index.valid = false;
+                }
+            }
+
+            refresh_index_file(index, full_folder, name);
+            if (!info->NextEntryOffset) break;
+            ptr += info->NextEntryOffset;
+        }
+
+        if (!read_index_watch(index)) {
+            close_index_watch(index);
+            index.valid = false;
+            break;
+        }
+    }
+
+    if (index.dir_handle && GetLastError() != ERROR_IO_INCOMPLETE) {
+        // the folder itself was removed or the watch broke
+        PRINT_DEBUG("'%s' watch failed %lu", full_folder.c_str(), GetLastError());
+        close_index_watch(index);
+        index.valid = false;
+    }
+
+    reset_LastError();
+#elif defined(__LINUX__)
+    if (index.inotify_fd < 0) return;
+
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t len;
+    while ((len = read(index.inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + reinterpret_cast<struct inotify_event *>(ptr)->len) {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(ptr);
+            if (event->mask & IN_Q_OVERFLOW) {
+                index.valid = false;
+                continue;
+            }
+
+            auto watch = index.watches.find(event->wd);
+            if (watch == index.watches.end()) continue;
+
+            if (event->mask & IN_IGNORED) {
+                index.watches.erase(watch);
+                continue;
+            }
+
+            // folders added, removed or moved around, their whole content changes
+            if (event->mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                index.valid = false;
+                continue;
+            }
+
+            if (event->len) refresh_index_file(index, full_folder, watch->second + event->name);
+        }
+    }
+#endif
+}
+
 std::string Local_Storage::get_program_path()
 {
     return get_full_program_path();
@@ -551,6 +806,40 @@ Local_Storage::Local_Storage(const std::string &save_directory)
     }
 }
 
+Local_Storage::~Local_Storage()
+{
+    for (auto &index : indexes) {
+        close_index_watch(index.second);
+    }
+}
+
+// null if the folder isn't indexed or its index is outdated, lookups of a single file don't rescan the folder
+Local_Storage_Index *Local_Storage::find_index(const std::string &full_folder)
+{
+    auto index = indexes.find(full_folder);
+    if (index == indexes.end()) return nullptr;
+
+    read_index_changes(index->second, full_folder);
+    return index->second.valid ? &index->second : nullptr;
+}
+
+Local_Storage_Index &Local_Storage::get_index(const std::string &full_folder)
+{
+    Local_Storage_Index &index = indexes[full_folder];
+    read_index_changes(index, full_folder);
+    if (!index.valid) scan_index(index, full_folder);
+    return index;
+}
+
+// our own changes are applied right away, the OS reports them too later and they only refresh the same entries
+void Local_Storage::update_index(const std::string &full_folder, const std::string &file)
+{
+    auto index = indexes.find(full_folder);
+    if (index == indexes.end()) return;
+
+    refresh_index_file(index->second, full_folder, file);
+}
+
 const std::string& Local_Storage::get_current_save_directory() const
 {
     return this->save_directory;
@@ -594,6 +883,25 @@ std::string Local_Storage::get_path(std::string folder)
     return path;
 }
 
+std::string Local_Storage::get_file_path(std::string folder, std::string file)
+{
+    file = sanitize_file_name(file);
+    if (folder.size() && folder.back() != *PATH_SEPARATOR) {
+        folder.append(PATH_SEPARATOR);
+    }
+
+    return save_directory + appid + folder + file;
+}
+
+void Local_Storage::file_changed(std::string folder, std::string file)
+{
+    if (folder.size() && folder.back() != *PATH_SEPARATOR) {
+        folder.append(PATH_SEPARATOR);
+    }
+
+    update_index(save_directory + appid + folder, sanitize_file_name(file));
+}
+
 std::string Local_Storage::get_global_settings_path()
 {
     return save_directory + settings_storage_folder + PATH_SEPARATOR;
@@ -652,7 +960,36 @@ int Local_Storage::store_data(std::string folder, std::string file, char *data,
         folder.append(PATH_SEPARATOR);
     }
 
-    return store_file_data(save_directory + appid + folder, file, data, length);
+    int ret = store_file_data(save_directory + appid + folder, file, data, length);
+    update_index(save_directory + appid + folder, sanitize_file_name(file));
+    return ret;
+}
+
+int Local_Storage::store_data_atomic(std::string folder, std::string file, const char *data, unsigned int length)
+{
+    if (folder.size() && folder.back() != *PATH_SEPARATOR) {
+        folder.append(PATH_SEPARATOR);
+    }
+
+    file = sanitize_file_name(file);
+    std::string temp_file(file + ".tmp");
+    int ret = store_file_data(save_directory + appid + folder, temp_file, data, length);
+    if (ret != static_cast<int>(length)) {
+        update_index(save_directory + appid + folder, temp_file);
+        return -1;
+    }
+
+    std::error_code ec{};
+    std::filesystem::rename(std::filesystem::u8path(save_directory + appid + folder + temp_file), std::filesystem::u8path(save_directory + appid + folder + file), ec);
+    update_index(save_directory + appid + folder, temp_file);
+    update_index(save_directory + appid + folder, file);
+    reset_LastError();
+    if (ec) {
+        PRINT_DEBUG("failed to replace '%s': %s", file.c_str(), ec.message().c_str());
+        return -1;
+    }
+
+    return ret;
 }
 
 int Local_Storage::store_data_settings(std::string file, const char *data, unsigned int length)
@@ -705,7 +1042,7 @@ int Local_Storage::count_files(std::string folder)
         folder.append(PATH_SEPARATOR);
     }
 
-    return static_cast<int>(get_filenames_recursive(save_directory + appid + folder).size());
+    return static_cast<int>(get_index(save_directory + appid + folder).files.size());
 }
 
 bool Local_Storage::file_exists(std::string folder, std::string file)
@@ -715,6 +1052,9 @@ bool Local_Storage::file_exists(std::string folder, std::string file)
         folder.append(PATH_SEPARATOR);
     }
 
+    Local_Storage_Index *index = find_index(save_directory + appid + folder);
+    if (index) return index->files.count(file) != 0;
+
     std::string full_path(save_directory + appid + folder + file);
     return file_exists_(full_path);
 }
@@ -726,6 +1066,12 @@ unsigned int Local_Storage::file_size(std::string folder, std::string file)
         folder.append(PATH_SEPARATOR);
     }
 
+    Local_Storage_Index *index = find_index(save_directory + appid + folder);
+    if (index) {
+        auto entry = index->files.find(file);
+        return entry != index->files.end() ? static_cast<unsigned int>(entry->second.size) : 0;
+    }
+
     std::string full_path(save_directory + appid + folder + file);
     return file_size_(full_path);
 }
@@ -739,10 +1085,12 @@ bool Local_Storage::file_delete(std::string folder, std::string file)
 
     std::string full_path(save_directory + appid + folder + file);
 #if defined(STEAM_WIN32)
-    return _wremove(utf8_decode(full_path).c_str()) == 0;
+    bool deleted = _wremove(utf8_decode(full_path).c_str()) == 0;
 #else
-    return remove(full_path.c_str()) == 0;
+    bool deleted = remove(full_path.c_str()) == 0;
 #endif
+    update_index(save_directory + appid + folder, file);
+    return deleted;
 }
 
 uint64_t Local_Storage::file_timestamp(std::string folder, std::string file)
@@ -752,6 +1100,12 @@ uint64_t Local_Storage::file_timestamp(std::string folder, std::string file)
         folder.append(PATH_SEPARATOR);
     }
 
+    Local_Storage_Index *index = find_index(save_directory + appid + folder);
+    if (index) {
+        auto entry = index->files.find(file);
+        return entry != index->files.end() ? entry->second.timestamp : 0;
+    }
+
     std::string full_path(save_directory + appid + folder + file);
 
 #if defined(STEAM_WIN32)
@@ -770,11 +1124,18 @@ bool Local_Storage::iterate_file(std::string folder, int index, char *output_fil
         folder.append(PATH_SEPARATOR);
     }
 
-    std::vector<struct File_Data> files = get_filenames_recursive(save_directory + appid + folder);
-    if (index < 0 || static_cast<size_t>(index) >= files.size()) return false;
+    Local_Storage_Index &files = get_index(save_directory + appid + folder);
+    if (files.names_dirty) {
+        files.names.clear();
+        for (auto &f : files.files) files.names.push_back(f.first);
+        files.names_dirty = false;
+    }
 
-    std::string name(desanitize_file_name(files[index].name));
-    if (output_size) *output_size = file_size(folder, name);
+    if (index < 0 || static_cast<size_t>(index) >= files.names.size()) return false;
+
+    auto &file = files.files[files.names[index]];
+    std::string name(desanitize_file_name(files.names[index]));
+    if (output_size) *output_size = static_cast<int32>(file.size);
 #if defined(STEAM_WIN32)
     name = replace_with(name, PATH_SEPARATOR, "/");
 #endif
@@ -804,6 +1165,13 @@ bool Local_Storage::update_save_filenames(std::string folder)
         }
     }
 
+    if (folder.size() && folder.back() != *PATH_SEPARATOR) {
+        folder.append(PATH_SEPARATOR);
+    }
+
+    auto index = indexes.find(save_directory + appid + folder);
+    if (index != indexes.end()) index->second.valid = false;
+
     return true;
 }
 
@@ -18,6 +18,10 @@
 #include "dll/network.h"
 #include "dll/dll.h"
 
+#if !defined(__WINDOWS__)
+#include <sys/file.h> // flock
+#endif
+
 #define MAX_BROADCASTS 16
 static int number_broadcasts = -1;
 static IP_PORT broadcasts[MAX_BROADCASTS];
@@ -26,9 +30,41 @@ static uint32_t upper_range_ips[MAX_BROADCASTS];
 
 #define BROADCAST_INTERVAL 5.0
 #define HEARTBEAT_TIMEOUT 20.0
+#define UDP_HEARTBEAT_INTERVAL 1.0
 #define USER_TIMEOUT 20.0
 
 #define MAX_UDP_SIZE 16384
+// unreliable messages bigger than MAX_UDP_SIZE are split in fragments of this size, small enough to fit the usual MTU
+#define UDP_FRAGMENT_SIZE 1200
+// same as k_cbMaxSteamNetworkingSocketsMessageSizeSend, bigger unreliable messages still go over TCP
+#define MAX_UDP_FRAGMENTED_SIZE (512 * 1024)
+// drop a message if its fragments didn't all arrive in this time, in seconds
+#define UDP_FRAGMENT_TIMEOUT 1.0
+#define MAX_FRAGMENTED_MESSAGES 64
+// refuse to queue more than this on a single TCP socket, a peer that stops reading must not make us grow forever
+#define MAX_TCP_SEND_BUFFER (32 * 1024 * 1024)
+
+// size of the ring to a peer on the same host, one for each direction
+#define SHARED_MEMORY_RING_SIZE (4 * 1024 * 1024)
+// how often we try to open the ring of a peer which didn't create it yet
+#define SHARED_MEMORY_OPEN_INTERVAL 1.0
+#define SHARED_MEMORY_FLAG_RELIABLE 1
+// reliable messages bigger than a ring frame are split, every frame but the last one has this flag
+#define SHARED_MEMORY_FLAG_PARTIAL 2
+#define SHARED_MEMORY_NAME_PREFIX "gse_shm_"
+
+// source queries are received, answered and sent back by batches of this many packets
+#define SOURCE_QUERY_BATCH 64
+// queries are tiny, anything bigger isn't one
+#define SOURCE_QUERY_MAX_SIZE 1500
+
+// source queries we send to servers, each attempt waits this long for an answer, in seconds
+#define A2S_QUERY_TIMEOUT 1.0
+#define A2S_QUERY_ATTEMPTS 3
+// a server asking for a new challenge every time isn't going to answer
+#define A2S_QUERY_MAX_CHALLENGES 3
+// queries sent per Run(), the others wait so a big server list doesn't flood the socket
+#define A2S_QUERY_SENDS_PER_RUN 64
 
 #if defined(STEAM_WIN32)
 
@@ -327,6 +363,51 @@ static int receive_packet(sock_t sock, IP_PORT *ip_port, char *data, unsigned lo
     return -1;
 }
 
+static bool same_ip_port(const IP_PORT &a, const IP_PORT &b)
+{
+    return a.ip == b.ip && a.port == b.port;
+}
+
+// reads the little endian fields of a source query response
+struct A2S_Reader {
+    const char *data;
+    size_t left;
+    bool ok = true;
+
+    A2S_Reader(const char *data, size_t len) : data(data), left(len) {}
+
+    template<typename T>
+    T get()
+    {
+        T value{};
+        if (left < sizeof(T)) {
+            ok = false;
+            left = 0;
+            return value;
+        }
+
+        memcpy(&value, data, sizeof(T));
+        data += sizeof(T);
+        left -= sizeof(T);
+        return value;
+    }
+
+    std::string get_string()
+    {
+        const char *end = static_cast<const char *>(memchr(data, 0, left));
+        if (!end) {
+            ok = false;
+            left = 0;
+            return {};
+        }
+
+        std::string value(data, end - data);
+        left -= (end - data) + 1;
+        data = end + 1;
+        return value;
+    }
+};
+
 static bool send_broadcasts(sock_t sock, uint16 port, char *data, unsigned long length, std::vector<IP_PORT> *custom_broadcasts)
 {
     static std::chrono::high_resolution_clock::time_point last_get_broadcast_info;
@@ -441,14 +522,22 @@ static void send_tcp_pending(struct TCP_Socket &socket)
     socket.send_buffer.erase(socket.send_buffer.begin(), socket.send_buffer.begin() + len);
 }
 
-static void send_buffer_tcp(struct TCP_Socket &socket, Common_Message *msg)
+static bool send_buffer_tcp(struct TCP_Socket &socket, Common_Message *msg)
 {
     uint32 size = static_cast<uint32>(msg->ByteSizeLong()), old_size = static_cast<uint32>(socket.send_buffer.size());
+    if (old_size + sizeof(uint32) + size > MAX_TCP_SEND_BUFFER) {
+        PRINT_DEBUG("TCP send buffer full, dropping message of %u bytes", size);
+        send_tcp_pending(socket);
+        return false;
+    }
+
     socket.send_buffer.resize(old_size + sizeof(uint32) + size);
     memcpy(&(socket.send_buffer[old_size]), &size, sizeof(size));
     msg->SerializeToArray(&(socket.send_buffer[old_size + sizeof(uint32)]), size);
+    socket.bytes_queued += sizeof(uint32) + size;
 
     send_tcp_pending(socket);
+    return true;
 }
 
 static unsigned long peek_buffer_tcp(struct TCP_Socket &socket)
@@ -496,6 +585,83 @@ static bool recv_tcp(struct TCP_Socket &socket)
     return false;
 }
 
+// name of the ring written by writer_token and read by reader_token
+static std::string shared_memory_name(uint64 writer_token, uint64 reader_token)
+{
+    char name[64]{};
+    snprintf(name, sizeof(name), SHARED_MEMORY_NAME_PREFIX "%016llx_%016llx", (unsigned long long)writer_token, (unsigned long long)reader_token);
+    return name;
+}
+
+#if !defined(__WINDOWS__)
+// every process using rings holds an exclusive flock on this file for as long as it runs,
+// the kernel drops the lock when the process dies however it dies
+static std::string shared_memory_lock_path(uint64 token)
+{
+    char name[64]{};
+    snprintf(name, sizeof(name), "/dev/shm/" SHARED_MEMORY_NAME_PREFIX "%016llx.lock", (unsigned long long)token);
+    return name;
+}
+
+// returns the locked fd or -1, the token must not be in use by anyone else
+static int lock_shared_memory_owner(uint64 token)
+{
+    std::string path = shared_memory_lock_path(token);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+
+    // someone cleaning up could have taken the lock and removed the file before we locked it
+    struct stat locked{}, linked{};
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &locked) != 0 || stat(path.c_str(), &linked) != 0 ||
+        locked.st_dev != linked.st_dev || locked.st_ino != linked.st_ino) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// a missing lock file means the owner exited, one we can lock means it died
+static bool shared_memory_owner_alive(uint64 token)
+{
+    std::string path = shared_memory_lock_path(token);
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) return errno != ENOENT;
+
+    bool alive = flock(fd, LOCK_EX | LOCK_NB) != 0;
+    if (!alive) unlink(path.c_str());
+    close(fd);
+    return alive;
+}
+
+// rings and lock files left in /dev/shm by a process which crashed
+static void remove_stale_shared_memory(uint64 own_token)
+{
+    DIR *dir = opendir("/dev/shm");
+    if (!dir) return;
+
+    struct dirent *ep;
+    while ((ep = readdir(dir))) {
+        unsigned long long writer_token = 0, reader_token = 0;
+        char end = 0;
+        if (strncmp(ep->d_name, SHARED_MEMORY_NAME_PREFIX, sizeof(SHARED_MEMORY_NAME_PREFIX) - 1) != 0) continue;
+
+        const char *tokens = ep->d_name + sizeof(SHARED_MEMORY_NAME_PREFIX) - 1;
+        if (sscanf(tokens, "%16llx_%16llx%c", &writer_token, &reader_token, &end) == 2) {
+            if (writer_token != own_token && !shared_memory_owner_alive(writer_token)) {
+                PRINT_DEBUG("removing stale segment '%s'", ep->d_name);
+                unlink((std::string("/dev/shm/") + ep->d_name).c_str());
+            }
+        } else if (sscanf(tokens, "%16llx.lock%c", &writer_token, &end) == 1) {
+            // lock of a process that crashed without any ring left
+            if (writer_token != own_token) shared_memory_owner_alive(writer_token);
+        }
+    }
+
+    closedir(dir);
+}
+#endif
+
 static void socket_timeouts(struct TCP_Socket &socket, double extra_time)
 {
     if (check_timedout(socket.last_heartbeat_sent, HEARTBEAT_TIMEOUT / 2.0)) {
@@ -564,11 +730,21 @@ void Networking::do_callbacks_message(Common_Message *msg)
         run_callbacks(CALLBACK_ID_LOBBY, msg);
     }
 
+    if (msg->has_lobby_delta()) {
+        PRINT_DEBUG("has_lobby_delta");
+        run_callbacks(CALLBACK_ID_LOBBY, msg);
+    }
+
     if (msg->has_gameserver()) {
         PRINT_DEBUG("has_gameserver");
         run_callbacks(CALLBACK_ID_GAMESERVER, msg);
     }
 
+    if (msg->has_gameserver_update()) {
+        PRINT_DEBUG("has_gameserver_update");
+        run_callbacks(CALLBACK_ID_GAMESERVER, msg);
+    }
+
     if (msg->has_friend_()) {
         PRINT_DEBUG("has_friend_");
         run_callbacks(CALLBACK_ID_FRIEND, msg);
@@ -625,7 +801,10 @@ bool Networking::handle_tcp(Common_Message *msg, struct TCP_Socket &socket)
         }
     }
 
-    do_callbacks_message(msg);
+    if (!simulate(msg, true, true, 0, IP_PORT{})) {
+        do_callbacks_message(msg);
+    }
+
     return true;
 }
 
@@ -692,6 +871,10 @@ bool Networking::handle_announce(Common_Message *msg, IP_PORT ip_port)
     conn->tcp_ip_port = ip_port;
     conn->tcp_ip_port.port = htons(msg->announce().tcp_port());
     conn->appid = msg->announce().appid();
+    conn->udp_fragments = msg->announce().udp_fragments();
+    if (shm_enabled && msg->announce().shm_token() && msg->announce().shm_host() == shm_host) {
+        setup_shared_memory(conn, msg->announce().shm_token());
+    }
 
     for (int i = 0; i < msg->announce().ids_size(); ++i) {
         add_id_connection(conn, (uint64) msg->announce().ids(i));
@@ -758,14 +941,60 @@ bool Networking::handle_low_level_udp(Common_Message *msg, IP_PORT ip_port)
         case Low_Level::DISCONNECT:
             
             break;
-        case Low_Level::HEARTBEAT:
-            
-            break;
+        case Low_Level::HEARTBEAT: {
+            auto now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch());
+            if (msg->low_level().time_echo()) {
+                // reply to one of our heartbeats
+                std::chrono::microseconds sample = now - std::chrono::microseconds(msg->low_level().time_echo());
+                if (sample.count() < 0) break;
+
+                if (connection->rtt.count() == 0) {
+                    connection->rtt = sample;
+                } else {
+                    connection->rtt = (connection->rtt * 7 + sample) / 8;
+                }
+
+                connection->last_received = std::chrono::high_resolution_clock::now();
+            } else if (msg->low_level().time_sent()) {
+                Common_Message reply;
+                reply.set_source_id(ids[0].ConvertToUint64());
+                reply.set_allocated_low_level(new Low_Level());
+                reply.mutable_low_level()->set_type(Low_Level::HEARTBEAT);
+                reply.mutable_low_level()->set_time_echo(msg->low_level().time_sent());
+
+                size_t size = reply.ByteSizeLong();
+                std::vector<char> buffer(size, 0);
+                reply.SerializeToArray(&buffer[0], static_cast<int>(size));
+                send_packet_to(udp_socket, ip_port, &buffer[0], static_cast<unsigned long>(size));
+            }
+
+            return true;
+        }
     }
 
     return false;
 }
 
+void Networking::send_udp_heartbeats()
+{
+    for (auto &conn: connections) {
+        if (!conn.udp_pinged) continue;
+        if (!check_timedout(conn.last_udp_heartbeat_sent, UDP_HEARTBEAT_INTERVAL)) continue;
+
+        if (conn.ids.empty()) continue;
+
+        auto now = std::chrono::high_resolution_clock::now();
+        Common_Message msg;
+        msg.set_source_id(ids[0].ConvertToUint64());
+        msg.set_dest_id(conn.ids[0].ConvertToUint64());
+        msg.set_allocated_low_level(new Low_Level());
+        msg.mutable_low_level()->set_type(Low_Level::HEARTBEAT);
+        msg.mutable_low_level()->set_time_sent(std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count());
+        sendTo(&msg, false, &conn);
+        conn.last_udp_heartbeat_sent = now;
+    }
+}
+
 #define NUM_TCP_WAITING 128
 
 Networking::Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT> *custom_broadcasts, bool disable_sockets)
@@ -883,6 +1112,14 @@ Networking::~Networking()
 
     kill_socket(udp_socket);
     kill_socket(tcp_socket);
+    if (is_socket_valid(a2s_socket)) kill_socket(a2s_socket);
+
+#if !defined(__WINDOWS__)
+    if (shm_lock_fd >= 0) {
+        unlink(shared_memory_lock_path(shm_token).c_str());
+        close(shm_lock_fd);
+    }
+#endif
 
     curl_global_cleanup();
 }
@@ -909,6 +1146,11 @@ Common_Message Networking::create_announce(bool request)
 
     announce->set_tcp_port(tcp_port);
     announce->set_appid(this->appid);
+    announce->set_udp_fragments(true);
+    if (shm_enabled) {
+        announce->set_shm_host(shm_host);
+        announce->set_shm_token(shm_token);
+    }
     for (auto &id : ids) announce->add_ids(id.ConvertToUint64());
     Common_Message msg;
     msg.set_allocated_announce(announce);
@@ -932,6 +1174,320 @@ void Networking::send_announce_broadcasts()
     PRINT_DEBUG("sent broadcasts");
 }
 
+// answers every pending source query, the replies are sent in the order the queries arrived
+void Networking::run_source_query()
+{
+    Steam_GameServer *gameserver = get_steam_client()->steam_gameserver;
+    static char buffers[SOURCE_QUERY_BATCH][SOURCE_QUERY_MAX_SIZE];
+    std::vector<Gameserver_Outgoing_Packet> replies{};
+
+    while (true) {
+        int count = 0;
+#if defined(__LINUX__)
+        struct mmsghdr msgs[SOURCE_QUERY_BATCH]{};
+        struct iovec iovs[SOURCE_QUERY_BATCH]{};
+        struct sockaddr_in addrs[SOURCE_QUERY_BATCH]{};
+        for (int i = 0; i < SOURCE_QUERY_BATCH; ++i) {
+            iovs[i].iov_base = buffers[i];
+            iovs[i].iov_len = SOURCE_QUERY_MAX_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        count = recvmmsg(query_socket, msgs, SOURCE_QUERY_BATCH, MSG_DONTWAIT, NULL);
+        if (count <= 0) break;
+
+        PRINT_DEBUG("RECV Source Query %i", count);
+        for (int i = 0; i < count; ++i) {
+            gameserver->HandleIncomingPacket(buffers[i], static_cast<int>(msgs[i].msg_len), ntohl(addrs[i].sin_addr.s_addr), ntohs(addrs[i].sin_port));
+        }
+#else
+        IP_PORT ip_port;
+        int len;
+        while (count < SOURCE_QUERY_BATCH && (len = receive_packet(query_socket, &ip_port, buffers[count], SOURCE_QUERY_MAX_SIZE)) >= 0) {
+            gameserver->HandleIncomingPacket(buffers[count], len, htonl(ip_port.ip), htons(ip_port.port));
+            ++count;
+        }
+
+        if (count <= 0) break;
+        PRINT_DEBUG("RECV Source Query %i", count);
+#endif
+
+        replies.clear();
+        gameserver->take_outgoing_packets(replies);
+        PRINT_DEBUG("sending %zu Source Query replies", replies.size());
+
+#if defined(__LINUX__)
+        size_t sent = 0;
+        while (sent < replies.size()) {
+            unsigned int batch = static_cast<unsigned int>(std::min<size_t>(replies.size() - sent, SOURCE_QUERY_BATCH));
+            for (unsigned int i = 0; i < batch; ++i) {
+                auto &reply = replies[sent + i];
+                addrs[i] = {};
+                addrs[i].sin_family = AF_INET;
+                addrs[i].sin_addr.s_addr = htonl(reply.ip);
+                addrs[i].sin_port = htons(reply.port);
+                iovs[i].iov_base = reply.data.data();
+                iovs[i].iov_len = reply.data.size();
+                msgs[i].msg_hdr = {};
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            }
+
+            int res = sendmmsg(query_socket, msgs, batch, MSG_DONTWAIT);
+            // the socket buffer is full, the remaining replies are dropped like any lost UDP packet
+            if (res <= 0) break;
+            sent += static_cast<size_t>(res);
+        }
+#else
+        for (auto &reply : replies) {
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(reply.ip);
+            addr.sin_port = htons(reply.port);
+            sendto(query_socket, (const char *)reply.data.data(), static_cast<int>(reply.data.size()), 0, (sockaddr*)&addr, sizeof(addr));
+        }
+#endif
+
+        if (count < SOURCE_QUERY_BATCH) break;
+    }
+}
+
+bool Networking::send_a2s_query(A2S_Query &query)
+{
+    std::string packet("\xFF\xFF\xFF\xFF", 4);
+    switch (query.type) {
+    case A2S_QUERY_INFO:
+        packet += 'T';
+        packet.append("Source Engine Query", sizeof("Source Engine Query"));
+        // older servers don't want a challenge for this one
+        if (query.challenge != -1) packet.append(reinterpret_cast<const char *>(&query.challenge), sizeof(query.challenge));
+        break;
+
+    case A2S_QUERY_PLAYERS:
+        packet += 'U';
+        packet.append(reinterpret_cast<const char *>(&query.challenge), sizeof(query.challenge));
+        break;
+
+    case A2S_QUERY_RULES:
+        packet += 'V';
+        packet.append(reinterpret_cast<const char *>(&query.challenge), sizeof(query.challenge));
+        break;
+    }
+
+    query.last_sent = std::chrono::high_resolution_clock::now();
+    return send_packet_to(a2s_socket, query.ip_port, &packet[0], static_cast<unsigned long>(packet.size())) >= 0;
+}
+
+// a whole response, without the single packet header
+void Networking::handle_a2s_response(IP_PORT ip_port, const char *data, size_t len)
+{
+    A2S_Reader reader(data, len);
+    uint8 type = reader.get<uint8>();
+
+    if (type == 'A') {
+        int32 challenge = reader.get<int32>();
+        if (!reader.ok) return;
+
+        // the challenge is per source, every query to this server is sent again with it
+        for (auto &q : a2s_queries) {
+            A2S_Query &query = q.second;
+            if (query.done || !same_ip_port(query.ip_port, ip_port)) continue;
+
+            if (++query.challenges > A2S_QUERY_MAX_CHALLENGES) {
+                PRINT_DEBUG("A2S query %llu: too many challenges", (unsigned long long)q.first);
+                query.done = true;
+                continue;
+            }
+
+            query.challenge = challenge;
+            send_a2s_query(query);
+        }
+
+        return;
+    }
+
+    A2S_Query_Type query_type;
+    A2S_Result result{};
+    result.responded = true;
+
+    if (type == 'I') {
+        query_type = A2S_QUERY_INFO;
+        Gameserver &info = result.info;
+        info.set_ip(ntohl(ip_port.ip));
+        info.set_query_port(ntohs(ip_port.port));
+        info.set_port(ntohs(ip_port.port));
+
+        reader.get<uint8>(); // protocol
+        info.set_server_name(reader.get_string());
+        info.set_map_name(reader.get_string());
+        info.set_mod_dir(reader.get_string());
+        info.set_game_description(reader.get_string());
+        info.set_product(info.game_description());
+        uint16 appid = reader.get<uint16>();
+        info.set_appid(appid);
+        info.set_num_players(reader.get<uint8>());
+        info.set_max_player_count(reader.get<uint8>());
+        info.set_bot_player_count(reader.get<uint8>());
+        uint8 server_type = reader.get<uint8>();
+        info.set_dedicated_server(server_type == 'd' || server_type == 'p');
+        reader.get<uint8>(); // environment
+        info.set_password_protected(reader.get<uint8>() != 0);
+        info.set_secure(reader.get<uint8>() != 0);
+        if (appid == 2400) {
+            // The Ship: mode, witnesses and duration
+            reader.get<uint8>();
+            reader.get<uint8>();
+            reader.get<uint8>();
+        }
+
+        info.set_version(static_cast<uint32>(strtoul(reader.get_string().c_str(), NULL, 10)));
+
+        // extra data flags
+        if (reader.ok && reader.left) {
+            uint8 flags = reader.get<uint8>();
+            if (flags & 0x80) info.set_port(reader.get<uint16>());
+            if (flags & 0x10) info.set_id(reader.get<uint64>());
+            if (flags & 0x40) {
+                info.set_spectator_port(reader.get<uint16>());
+                info.set_spectator_server_name(reader.get_string());
+            }
+
+            if (flags & 0x20) info.set_tags(reader.get_string());
+            if (flags & 0x01) info.set_appid(CGameID((uint64)reader.get<uint64>()).AppID());
+        }
+
+        if (!reader.ok) {
+            PRINT_DEBUG("bad A2S_INFO response");
+            return;
+        }
+    } else if (type == 'D') {
+        query_type = A2S_QUERY_PLAYERS;
+        uint8 count = reader.get<uint8>();
+        // some servers cut the list short, keep the complete entries
+        for (unsigned i = 0; i < count && reader.ok; ++i) {
+            A2S_Player player{};
+            reader.get<uint8>(); // index
+            player.name = reader.get_string();
+            player.score = reader.get<int32>();
+            player.duration = reader.get<float>();
+            if (reader.ok) result.players.push_back(std::move(player));
+        }
+    } else if (type == 'E') {
+        query_type = A2S_QUERY_RULES;
+        uint16 count = reader.get<uint16>();
+        for (unsigned i = 0; i < count && reader.ok; ++i) {
+            std::string name = reader.get_string();
+            std::string value = reader.get_string();
+            if (reader.ok) result.rules.emplace_back(std::move(name), std::move(value));
+        }
+    } else {
+        PRINT_DEBUG("unknown A2S response %hhu", type);
+        return;
+    }
+
+    auto now = std::chrono::high_resolution_clock::now();
+    for (auto &q : a2s_queries) {
+        A2S_Query &query = q.second;
+        if (query.done || query.type != query_type || !same_ip_port(query.ip_port, ip_port)) continue;
+
+        query.result = result;
+        query.result.ping = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(now - query.last_sent).count());
+        query.done = true;
+        PRINT_DEBUG("A2S query %llu answered in %i ms", (unsigned long long)q.first, query.result.ping);
+    }
+}
+
+void Networking::handle_a2s_packet(IP_PORT ip_port, const char *data, size_t len)
+{
+    A2S_Reader reader(data, len);
+    int32 header = reader.get<int32>();
+    if (!reader.ok) return;
+
+    if (header == -1) {
+        handle_a2s_response(ip_port, reader.data, reader.left);
+        return;
+    }
+
+    if (header != -2) return;
+
+    uint32 split_id = reader.get<uint32>();
+    uint8 total = reader.get<uint8>();
+    uint8 number = reader.get<uint8>();
+    reader.get<uint16>(); // part size
+    if (!reader.ok || !reader.left || number >= total) return;
+
+    if (split_id & 0x80000000) {
+        // bzip2 compressed, only old engines send these, the query will time out
+        PRINT_DEBUG("compressed A2S response not supported");
+        return;
+    }
+
+    auto key = std::make_pair(ip_port, split_id);
+    A2S_Split_Response &split = a2s_split_responses[key];
+    if (split.parts.empty()) {
+        split.parts.resize(total);
+        split.first_received = std::chrono::high_resolution_clock::now();
+    }
+
+    if (split.parts.size() != total || split.parts[number].size()) return;
+
+    split.parts[number].assign(reader.data, reader.left);
+    if (++split.received < total) return;
+
+    std::string response{};
+    for (auto &part : split.parts) response += part;
+    a2s_split_responses.erase(key);
+
+    // the parts put together start with the single packet header
+    if (response.size() > sizeof(int32)) {
+        handle_a2s_response(ip_port, response.data() + sizeof(int32), response.size() - sizeof(int32));
+    }
+}
+
+void Networking::run_a2s_queries()
+{
+    if (!is_socket_valid(a2s_socket)) return;
+
+    IP_PORT ip_port;
+    char data[MAX_UDP_SIZE];
+    int len;
+    while ((len = receive_packet(a2s_socket, &ip_port, data, sizeof(data))) >= 0) {
+        handle_a2s_packet(ip_port, data, static_cast<size_t>(len));
+    }
+
+    unsigned sends = 0;
+    for (auto &q : a2s_queries) {
+        A2S_Query &query = q.second;
+        if (query.done) continue;
+        if (query.attempts && !check_timedout(query.last_sent, A2S_QUERY_TIMEOUT)) continue;
+
+        if (query.attempts >= A2S_QUERY_ATTEMPTS) {
+            PRINT_DEBUG("A2S query %llu timed out", (unsigned long long)q.first);
+            query.done = true;
+            continue;
+        }
+
+        if (sends >= A2S_QUERY_SENDS_PER_RUN) continue;
+        ++sends;
+        ++query.attempts;
+        send_a2s_query(query);
+    }
+
+    auto split = std::begin(a2s_split_responses);
+    while (split != std::end(a2s_split_responses)) {
+        if (check_timedout(split->second.first_received, A2S_QUERY_TIMEOUT)) {
+            split = a2s_split_responses.erase(split);
+        } else {
+            ++split;
+        }
+    }
+}
+
 void Networking::Run()
 {
     std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
@@ -948,28 +1504,20 @@ void Networking::Run()
         send_announce_broadcasts();
     }
 
+    send_udp_heartbeats();
+    run_delayed_packets();
+    expire_fragmented_messages();
+
     IP_PORT ip_port;
     char data[MAX_UDP_SIZE];
     int len;
 
     if (query_alive && is_socket_valid(query_socket)) {
-        PRINT_DEBUG("RECV Source Query");
-        Steam_Client* client = get_steam_client();
-        sockaddr_in addr;
-        addr.sin_family = AF_INET;
-
-        while ((len = receive_packet(query_socket, &ip_port, data, sizeof(data))) >= 0) {
-            PRINT_DEBUG("requesting Source Query server info from Steam_GameServer");
-            client->steam_gameserver->HandleIncomingPacket(data, len, htonl(ip_port.ip), htons(ip_port.port));
-            len = client->steam_gameserver->GetNextOutgoingPacket(data, sizeof(data), &ip_port.ip, &ip_port.port);
-
-            PRINT_DEBUG("sending Source Query server info");
-            addr.sin_addr.s_addr = htonl(ip_port.ip);
-            addr.sin_port        = htons(ip_port.port);
-            sendto(query_socket, data, len, 0, (sockaddr*)&addr, sizeof(addr));
-        }
+        run_source_query();
     }
 
+    run_a2s_queries();
+
     PRINT_DEBUG("RECV UDP");
     while((len = receive_packet(udp_socket, &ip_port, data, sizeof(data))) >= 0) {
         PRINT_DEBUG("recv %i %hhu.%hhu.%hhu.%hhu:%hu", len,
@@ -979,22 +1527,19 @@ void Networking::Run()
             if (msg.source_id()) {
                 if (msg.has_announce()) {
                     handle_announce(&msg, ip_port);
-                } else if (msg.has_low_level()) {
-                    handle_low_level_udp(&msg, ip_port);
-                } else {
-                    msg.set_source_ip(ntohl(ip_port.ip));
-                    msg.set_source_port(ntohs(ip_port.port));
-                    do_callbacks_message(&msg);
+                } else if (!simulate(&msg, true, false, 0, ip_port)) {
+                    handle_udp(&msg, ip_port);
                 }
             }
         }
     }
 
     PRINT_DEBUG("RECV LOCAL %zu", local_send.size());
-    std::vector<Common_Message> local_send_copy = local_send;
-    local_send.clear();
+    // callbacks can queue more local messages, those wait for the next run
+    std::vector<Common_Message> local_messages{};
+    local_messages.swap(local_send);
 
-    for (auto & m: local_send_copy) {
+    for (auto & m: local_messages) {
         m.set_source_ip(ntohl(own_ip));
         m.set_source_port(ntohs(udp_port));
         do_callbacks_message(&m);
@@ -1134,6 +1679,8 @@ void Networking::Run()
             conn.last_received = std::chrono::high_resolution_clock::now();
         }
 
+        run_shared_memory(conn);
+
         PRINT_DEBUG("RUN SOCKET4 %u %u", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
         socket_timeouts(conn.tcp_socket_outgoing, time_extra);
         socket_timeouts(conn.tcp_socket_incoming, time_extra);
@@ -1212,13 +1759,17 @@ uint32 Networking::getIP(CSteamID id)
     return 0;
 }
 
+// unreliable messages this big have to take TCP, the peer can't receive them over UDP
+static bool too_big_for_udp(const Connection *conn, size_t size)
+{
+    if (size < MAX_UDP_SIZE) return false;
+    return !(conn->udp_fragments && size <= MAX_UDP_FRAGMENTED_SIZE);
+}
+
 bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn)
 {
     if (!enabled) return false;
 
-    size_t size = msg->ByteSizeLong();
-    if (size >= MAX_UDP_SIZE) reliable = true; //too big for UDP
-
     bool ret = false;
     CSteamID dest_id((uint64)msg->dest_id());
     if (std::find(ids.begin(), ids.end(), dest_id) != ids.end()) {
@@ -1235,19 +1786,12 @@ bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn)
     }
 
     if (!ret && conn) {
-        if (reliable || !conn->udp_pinged) {
-            if (conn->tcp_socket_incoming.received_data) {
-                send_buffer_tcp(conn->tcp_socket_incoming, msg);
-                ret = true;
-            } else if (conn->tcp_socket_outgoing.received_data) {
-                send_buffer_tcp(conn->tcp_socket_outgoing, msg);
-                ret = true;
-            }
-        } else {
-            std::vector<char> buffer(size, 0);
-            msg->SerializeToArray(&buffer[0], static_cast<int>(size));
-            send_packet_to(udp_socket, conn->udp_ip_port, &buffer[0], static_cast<unsigned long>(size));
+        if (too_big_for_udp(conn, msg->ByteSizeLong())) reliable = true;
+
+        if (simulate(msg, false, reliable || !conn->udp_pinged, conn->appid, conn->udp_ip_port)) {
             ret = true;
+        } else {
+            ret = send_to_connection(msg, reliable, conn);
         }
     }
 
@@ -1255,6 +1799,332 @@ bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn)
     return ret;
 }
 
+bool Networking::sendTo(Common_Message &&msg, bool reliable)
+{
+    if (!enabled) return false;
+
+    CSteamID dest_id((uint64)msg.dest_id());
+    if (std::find(ids.begin(), ids.end(), dest_id) != ids.end()) {
+        PRINT_DEBUG("local send");
+        local_send.push_back(std::move(msg));
+        return true;
+    }
+
+    return sendTo(&msg, reliable);
+}
+
+bool Networking::send_to_connection(Common_Message *msg, bool reliable, Connection *conn)
+{
+    bool sent = false;
+    if (conn->shm && send_shared_memory(msg, reliable, conn, sent)) return sent;
+
+    size_t size = msg->ByteSizeLong();
+    if (too_big_for_udp(conn, size)) reliable = true;
+
+    if (reliable || !conn->udp_pinged) {
+        if (conn->tcp_socket_incoming.received_data) {
+            return send_buffer_tcp(conn->tcp_socket_incoming, msg);
+        } else if (conn->tcp_socket_outgoing.received_data) {
+            return send_buffer_tcp(conn->tcp_socket_outgoing, msg);
+        }
+    } else if (size >= MAX_UDP_SIZE) {
+        send_fragments(msg, conn);
+        return true;
+    } else {
+        std::vector<char> buffer(size, 0);
+        msg->SerializeToArray(&buffer[0], static_cast<int>(size));
+        send_packet_to(udp_socket, conn->udp_ip_port, &buffer[0], static_cast<unsigned long>(size));
+        return true;
+    }
+
+    return false;
+}
+
+void Networking::setup_shared_memory(Connection *conn, uint64 peer_token)
+{
+    if (peer_token == shm_token) return;
+    if (conn->shm && conn->shm->peer_token == peer_token) return;
+
+    // new peer on this host, or it restarted and the old rings are gone
+    auto link = std::make_shared<Shared_Memory_Link>();
+    link->peer_token = peer_token;
+    if (!link->send.create(shared_memory_name(shm_token, peer_token), SHARED_MEMORY_RING_SIZE)) {
+        PRINT_DEBUG("could not create the shared memory ring to %llu", conn->ids.empty() ? 0ULL : (unsigned long long)conn->ids[0].ConvertToUint64());
+    }
+
+    conn->shm = link;
+}
+
+// returns false if the message must go through the sockets instead, sent is the result otherwise
+bool Networking::send_shared_memory(Common_Message *msg, bool reliable, Connection *conn, bool &sent)
+{
+    Shared_Memory_Link *link = conn->shm.get();
+    if (!link->send.reader_attached()) return false;
+    // heartbeats measure the sockets
+    if (msg->has_low_level()) return false;
+    // reliable messages already queued on TCP must be received first
+    if (reliable && link->pending.empty() && (!conn->tcp_socket_incoming.send_buffer.empty() || !conn->tcp_socket_outgoing.send_buffer.empty())) return false;
+
+    size_t size = msg->ByteSizeLong();
+    size_t max_size = link->send.max_message_size();
+    // unreliable messages don't need to stay in order, the big ones take the sockets
+    if (!reliable && size > max_size) return false;
+
+    std::string buffer = msg->SerializeAsString();
+    uint32 flags = reliable ? SHARED_MEMORY_FLAG_RELIABLE : 0;
+    if (buffer.size() <= max_size && link->pending.empty() && link->send.write(buffer.data(), static_cast<uint32>(buffer.size()), flags)) {
+        sent = true;
+        return true;
+    }
+
+    // ring is full, unreliable messages can still take UDP
+    if (!reliable) return false;
+
+    if (link->pending_bytes + buffer.size() > MAX_TCP_SEND_BUFFER) {
+        PRINT_DEBUG("shared memory send buffer full");
+        sent = false;
+        return true;
+    }
+
+    // reliable messages never switch to TCP here, that would let them overtake the ones still in the ring
+    for (size_t offset = 0; offset < buffer.size(); offset += max_size) {
+        size_t frame_size = std::min(max_size, buffer.size() - offset);
+        uint32 frame_flags = flags | ((offset + frame_size < buffer.size()) ? SHARED_MEMORY_FLAG_PARTIAL : 0);
+        if (link->pending.empty() && link->send.write(buffer.data() + offset, static_cast<uint32>(frame_size), frame_flags)) continue;
+
+        link->pending_bytes += frame_size;
+        link->pending_bytes_queued += frame_size;
+        link->pending.emplace_back(buffer.substr(offset, frame_size), frame_flags);
+    }
+
+    sent = true;
+    return true;
+}
+
+void Networking::run_shared_memory(Connection &conn)
+{
+    Shared_Memory_Link *link = conn.shm.get();
+    if (!link) return;
+
+    if (!link->recv.is_open() && check_timedout(link->last_open_attempt, SHARED_MEMORY_OPEN_INTERVAL)) {
+        link->last_open_attempt = std::chrono::high_resolution_clock::now();
+        link->recv_partial.clear();
+        link->recv.open(shared_memory_name(link->peer_token, shm_token));
+    }
+
+    while (!link->pending.empty()) {
+        auto &pending = link->pending.front();
+        if (!link->send.write(pending.first.data(), static_cast<uint32>(pending.first.size()), pending.second)) break;
+        link->pending_bytes -= pending.first.size();
+        link->pending.pop_front();
+    }
+
+    std::string data;
+    uint32 flags = 0;
+    while (link->recv.read(data, flags)) {
+        if (flags & SHARED_MEMORY_FLAG_PARTIAL) {
+            link->recv_partial.append(data);
+            continue;
+        }
+
+        if (link->recv_partial.size()) {
+            link->recv_partial.append(data);
+            data.swap(link->recv_partial);
+            link->recv_partial.clear();
+        }
+
+        Common_Message msg;
+        if (!msg.ParseFromString(data) || !msg.source_id()) continue;
+
+        msg.set_source_ip(ntohl(conn.tcp_ip_port.ip));
+        conn.last_received = std::chrono::high_resolution_clock::now();
+        if (!simulate(&msg, true, flags & SHARED_MEMORY_FLAG_RELIABLE, 0, conn.udp_ip_port)) {
+            if (flags & SHARED_MEMORY_FLAG_RELIABLE) {
+                do_callbacks_message(&msg);
+            } else {
+                handle_udp(&msg, conn.udp_ip_port);
+            }
+        }
+    }
+
+    // the peer is going away, if it comes back it announces new rings
+    if (link->recv.writer_closed()) {
+        link->recv.close();
+    }
+}
+
+void Networking::send_fragments(Common_Message *msg, Connection *conn)
+{
+    std::string data = msg->SerializeAsString();
+    uint32 count = static_cast<uint32>((data.size() + UDP_FRAGMENT_SIZE - 1) / UDP_FRAGMENT_SIZE);
+    uint64 message_id = next_fragmented_message_id++;
+    PRINT_DEBUG("sending %zu bytes as %u fragments", data.size(), count);
+
+    Common_Message fragment_msg;
+    fragment_msg.set_source_id(msg->source_id());
+    fragment_msg.set_dest_id(msg->dest_id());
+    Fragment *fragment = fragment_msg.mutable_fragment();
+    fragment->set_message_id(message_id);
+    fragment->set_count(count);
+
+    std::vector<char> buffer;
+    for (uint32 i = 0; i < count; ++i) {
+        size_t offset = static_cast<size_t>(i) * UDP_FRAGMENT_SIZE;
+        fragment->set_index(i);
+        fragment->set_data(data.data() + offset, std::min(data.size() - offset, (size_t)UDP_FRAGMENT_SIZE));
+
+        size_t size = fragment_msg.ByteSizeLong();
+        buffer.resize(size);
+        fragment_msg.SerializeToArray(&buffer[0], static_cast<int>(size));
+        send_packet_to(udp_socket, conn->udp_ip_port, &buffer[0], static_cast<unsigned long>(size));
+    }
+}
+
+void Networking::handle_fragment(Common_Message *msg, IP_PORT ip_port)
+{
+    const Fragment &fragment = msg->fragment();
+    uint32 max_count = (MAX_UDP_FRAGMENTED_SIZE + UDP_FRAGMENT_SIZE - 1) / UDP_FRAGMENT_SIZE;
+    if (fragment.count() == 0 || fragment.count() > max_count || fragment.index() >= fragment.count()) return;
+
+    auto key = std::make_pair(msg->source_id(), fragment.message_id());
+    auto message = fragmented_messages.find(key);
+    if (message == fragmented_messages.end()) {
+        if (fragmented_messages.size() >= MAX_FRAGMENTED_MESSAGES) {
+            auto oldest = std::min_element(fragmented_messages.begin(), fragmented_messages.end(), [](const auto &a, const auto &b) {
+                return a.second.first_received < b.second.first_received;
+            });
+            PRINT_DEBUG("too many incomplete fragmented messages, dropping one");
+            fragmented_messages.erase(oldest);
+        }
+
+        message = fragmented_messages.emplace(key, Fragmented_Message{}).first;
+        message->second.fragments.resize(fragment.count());
+        message->second.first_received = std::chrono::high_resolution_clock::now();
+    }
+
+    auto &fragments = message->second.fragments;
+    if (fragments.size() != fragment.count()) return;
+    // an empty fragment would only be possible for an empty message
+    if (!fragments[fragment.index()].empty() || fragment.data().empty()) return;
+
+    fragments[fragment.index()] = fragment.data();
+    if (++message->second.received < fragment.count()) return;
+
+    std::string data;
+    for (const auto &part : fragments) data += part;
+    fragmented_messages.erase(message);
+
+    Common_Message full_msg;
+    if (!full_msg.ParseFromString(data) || full_msg.source_id() != msg->source_id() || full_msg.has_fragment()) return;
+    handle_udp(&full_msg, ip_port);
+}
+
+void Networking::expire_fragmented_messages()
+{
+    auto message = fragmented_messages.begin();
+    while (message != fragmented_messages.end()) {
+        if (check_timedout(message->second.first_received, UDP_FRAGMENT_TIMEOUT)) {
+            PRINT_DEBUG("fragmented message timed out, %u/%zu fragments received", message->second.received, message->second.fragments.size());
+            message = fragmented_messages.erase(message);
+        } else {
+            ++message;
+        }
+    }
+}
+
+void Networking::handle_udp(Common_Message *msg, IP_PORT ip_port)
+{
+    if (msg->has_low_level()) {
+        handle_low_level_udp(msg, ip_port);
+    } else if (msg->has_fragment()) {
+        handle_fragment(msg, ip_port);
+    } else {
+        msg->set_source_ip(ntohl(ip_port.ip));
+        msg->set_source_port(ntohs(ip_port.port));
+        do_callbacks_message(msg);
+    }
+}
+
+// returns true if the simulation took over the packet (dropped or delayed it)
+bool Networking::simulate(Common_Message *msg, bool incoming, bool reliable, uint32 appid, IP_PORT ip_port)
+{
+    CSteamID peer((uint64)(incoming ? msg->source_id() : msg->dest_id()));
+    auto peer_conditions = simulation_conditions_peers.find(peer);
+    const Network_Conditions &conditions = peer_conditions != simulation_conditions_peers.end() ? peer_conditions->second : simulation_conditions;
+
+    float loss = incoming ? conditions.loss_recv : conditions.loss_send;
+    int32 lag = incoming ? conditions.lag_recv : conditions.lag_send;
+    float reorder = incoming ? conditions.reorder_recv : conditions.reorder_send;
+    float dup = incoming ? conditions.dup_recv : conditions.dup_send;
+    if (loss <= 0.0f && lag <= 0 && reorder <= 0.0f && dup <= 0.0f) return false;
+
+    std::uniform_real_distribution<float> percent(0.0f, 100.0f);
+    auto now = std::chrono::high_resolution_clock::now();
+    auto due = now + std::chrono::milliseconds(std::max(lag, 0));
+
+    Delayed_Packet packet{};
+    packet.incoming = incoming;
+    packet.reliable = reliable;
+    packet.peer = peer;
+    packet.appid = appid;
+    packet.ip_port = ip_port;
+
+    // TCP already guarantees delivery and order, only the lag applies to it
+    if (reliable) {
+        auto &last_due = incoming ? last_reliable_recv_due : last_reliable_send_due;
+        due = std::max(due, last_due);
+        last_due = due;
+        packet.msg = *msg;
+        delayed_packets.emplace(due, std::move(packet));
+        return true;
+    }
+
+    if (loss > 0.0f && percent(simulation_rng) < loss) {
+        PRINT_DEBUG("simulation dropped %s packet of " "%" PRIu64, incoming ? "incoming" : "outgoing", peer.ConvertToUint64());
+        return true;
+    }
+
+    bool duplicate = dup > 0.0f && percent(simulation_rng) < dup;
+    if (duplicate) {
+        std::uniform_int_distribution<int32> extra(0, std::max(conditions.dup_time_max, 0));
+        Delayed_Packet copy = packet;
+        copy.msg = *msg;
+        delayed_packets.emplace(due + std::chrono::milliseconds(extra(simulation_rng)), std::move(copy));
+    }
+
+    if (reorder > 0.0f && percent(simulation_rng) < reorder) {
+        std::uniform_int_distribution<int32> extra(0, std::max(conditions.reorder_time, 0));
+        due += std::chrono::milliseconds(extra(simulation_rng));
+    } else if (due == now && !duplicate) {
+        return false;
+    }
+
+    packet.msg = *msg;
+    delayed_packets.emplace(due, std::move(packet));
+    return true;
+}
+
+void Networking::run_delayed_packets()
+{
+    auto now = std::chrono::high_resolution_clock::now();
+    while (!delayed_packets.empty() && delayed_packets.begin()->first <= now) {
+        Delayed_Packet packet = std::move(delayed_packets.begin()->second);
+        delayed_packets.erase(delayed_packets.begin());
+
+        if (packet.incoming) {
+            if (!packet.reliable) {
+                handle_udp(&packet.msg, packet.ip_port);
+            } else {
+                do_callbacks_message(&packet.msg);
+            }
+        } else {
+            // the connection might have been replaced or timed out meanwhile
+            Connection *conn = find_connection(packet.peer, packet.appid);
+            if (conn) send_to_connection(&packet.msg, packet.reliable, conn);
+        }
+    }
+}
+
 bool Networking::sendToAllIndividuals(Common_Message *msg, bool reliable)
 {
     for (auto &conn: connections) {
@@ -1356,11 +2226,172 @@ void Networking::rmCallback(Callback_Ids id, CSteamID steam_id, void (*message_c
     target_cb.erase(itrm, target_cb.end());
 }
 
+int Networking::getPing(CSteamID id)
+{
+    if (std::find(ids.begin(), ids.end(), id) != ids.end()) return 0;
+
+    Connection *conn = find_connection(id, this->appid);
+    if (!conn || conn->rtt.count() == 0) return -1;
+
+    return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(conn->rtt).count());
+}
+
+size_t Networking::getPendingSendBytes(CSteamID id)
+{
+    Connection *conn = find_connection(id, this->appid);
+    if (!conn) return 0;
+
+    size_t bytes = conn->tcp_socket_incoming.send_buffer.size() + conn->tcp_socket_outgoing.send_buffer.size();
+    if (conn->shm) bytes += conn->shm->pending_bytes;
+    return bytes;
+}
+
+uint64 Networking::getSendQueuePosition(CSteamID id)
+{
+    Connection *conn = find_connection(id, this->appid);
+    if (!conn) return 0;
+
+    uint64 position = conn->tcp_socket_incoming.bytes_queued + conn->tcp_socket_outgoing.bytes_queued;
+    if (conn->shm) position += conn->shm->pending_bytes_queued;
+    return position;
+}
+
+uint64 Networking::getSendQueueDrained(CSteamID id)
+{
+    return getSendQueuePosition(id) - getPendingSendBytes(id);
+}
+
+size_t Networking::getDelayedSendBytes(CSteamID id, bool reliable, const std::function<size_t(const Common_Message &)> &message_bytes)
+{
+    size_t bytes = 0;
+    for (const auto &delayed : delayed_packets) {
+        const Delayed_Packet &packet = delayed.second;
+        if (packet.incoming || packet.reliable != reliable || packet.peer != id) continue;
+        bytes += message_bytes(packet.msg);
+    }
+
+    return bytes;
+}
+
+Network_Conditions Networking::getSimulationConditions(CSteamID peer)
+{
+    auto peer_conditions = simulation_conditions_peers.find(peer);
+    if (peer_conditions != simulation_conditions_peers.end()) return peer_conditions->second;
+    return simulation_conditions;
+}
+
+void Networking::setSimulationConditions(const Network_Conditions &conditions, CSteamID peer)
+{
+    if (peer == k_steamIDNil) {
+        simulation_conditions = conditions;
+    } else {
+        simulation_conditions_peers[peer] = conditions;
+    }
+}
+
+void Networking::resetSimulationConditions(CSteamID peer)
+{
+    if (peer == k_steamIDNil) {
+        simulation_conditions = Network_Conditions{};
+    } else {
+        simulation_conditions_peers.erase(peer);
+    }
+}
+
+void Networking::setSimulationSeed(uint32 seed)
+{
+    simulation_rng.seed(seed);
+}
+
+void Networking::setSharedMemory(bool enabled)
+{
+    shm_enabled = enabled && this->enabled;
+    if (!shm_enabled) {
+        for (auto &conn : connections) conn.shm.reset();
+        return;
+    }
+
+    if (!shm_token) {
+        uint64 token = 0;
+        while (!token) randombytes((char *)&token, sizeof(token));
+#if defined(__WINDOWS__)
+        // named mappings go away with the last handle, nothing can be left behind
+        shm_token = token;
+#else
+        // the lock tells the next runs whether our rings still have an owner
+        shm_lock_fd = lock_shared_memory_owner(token);
+        if (shm_lock_fd < 0) {
+            PRINT_DEBUG("can't lock '%s'", shared_memory_lock_path(token).c_str());
+            shm_enabled = false;
+            return;
+        }
+
+        shm_token = token;
+        remove_stale_shared_memory(shm_token);
+#endif
+    }
+    if (shm_host.empty()) {
+        // peers announcing the same host name get a ring, opening it is what proves they really are on this host
+        char name[256]{};
+        if (gethostname(name, sizeof(name) - 1) == 0) shm_host = name;
+    }
+
+    if (shm_host.empty()) shm_enabled = false;
+    PRINT_DEBUG("shared memory transport %u, host '%s'", (unsigned)shm_enabled, shm_host.c_str());
+}
+
 uint32 Networking::getOwnIP()
 {
     return own_ip;
 }
 
+uint64 Networking::a2sQuery(uint32 ip, uint16 port, A2S_Query_Type type)
+{
+    uint64 id = next_a2s_query_id++;
+    A2S_Query &query = a2s_queries[id];
+    query.type = type;
+    query.ip_port.ip = htonl(ip);
+    query.ip_port.port = htons(port);
+
+    if (enabled && !is_socket_valid(a2s_socket)) {
+        sock_t sock = static_cast<sock_t>(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP));
+        if (is_socket_valid(sock) && set_socket_nonblocking(sock) && bind_socket(sock, 0)) {
+            buffers_set(sock);
+            a2s_socket = sock;
+            PRINT_DEBUG("A2S socket created");
+        } else {
+            if (is_socket_valid(sock)) kill_socket(sock);
+            reset_last_error();
+        }
+    }
+
+    // it will never be sent, reported like a server that didn't answer
+    if (!is_socket_valid(a2s_socket)) query.done = true;
+
+    PRINT_DEBUG("A2S query %llu type %i", (unsigned long long)id, (int)type);
+    return id;
+}
+
+bool Networking::a2sResult(uint64 id, A2S_Result &result)
+{
+    auto query = a2s_queries.find(id);
+    if (query == a2s_queries.end()) {
+        result = A2S_Result();
+        return true;
+    }
+
+    if (!query->second.done) return false;
+
+    result = std::move(query->second.result);
+    a2s_queries.erase(query);
+    return true;
+}
+
+void Networking::a2sCancel(uint64 id)
+{
+    a2s_queries.erase(id);
+}
+
 void Networking::startQuery(IP_PORT ip_port)
 {
     if (ip_port.port <= 1024)
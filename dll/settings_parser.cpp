@@ -1396,6 +1396,15 @@ static void parse_simple_features(class Settings *settings_client, class Setting
     settings_client->disable_networking = ini.GetBoolValue("main::connectivity", "disable_networking", settings_client->disable_networking);
     settings_server->disable_networking = ini.GetBoolValue("main::connectivity", "disable_networking", settings_server->disable_networking);
 
+    settings_client->networking_sockets_reliable_udp = ini.GetBoolValue("main::connectivity", "networking_sockets_reliable_udp", settings_client->networking_sockets_reliable_udp);
+    settings_server->networking_sockets_reliable_udp = ini.GetBoolValue("main::connectivity", "networking_sockets_reliable_udp", settings_server->networking_sockets_reliable_udp);
+
+    settings_client->network_simulation_seed = static_cast<uint32>(ini.GetLongValue("main::connectivity", "network_simulation_seed", settings_client->network_simulation_seed));
+    settings_server->network_simulation_seed = static_cast<uint32>(ini.GetLongValue("main::connectivity", "network_simulation_seed", settings_server->network_simulation_seed));
+
+    settings_client->networking_shared_memory = ini.GetBoolValue("main::connectivity", "networking_shared_memory", settings_client->networking_shared_memory);
+    settings_server->networking_shared_memory = ini.GetBoolValue("main::connectivity", "networking_shared_memory", settings_server->networking_shared_memory);
+
     settings_client->disable_sharing_stats_with_gameserver = ini.GetBoolValue("main::connectivity", "disable_sharing_stats_with_gameserver", settings_client->disable_sharing_stats_with_gameserver);
     settings_server->disable_sharing_stats_with_gameserver = ini.GetBoolValue("main::connectivity", "disable_sharing_stats_with_gameserver", settings_server->disable_sharing_stats_with_gameserver);
     
@@ -1408,6 +1417,14 @@ static void parse_simple_features(class Settings *settings_client, class Setting
     settings_client->disable_lobby_creation = ini.GetBoolValue("main::connectivity", "disable_lobby_creation", settings_client->disable_lobby_creation);
     settings_server->disable_lobby_creation = ini.GetBoolValue("main::connectivity", "disable_lobby_creation", settings_server->disable_lobby_creation);
 
+    {
+        long val = ini.GetLongValue("main::connectivity", "lobby_chat_history_size", settings_client->lobby_chat_history_size);
+        if (val > 0) {
+            settings_client->lobby_chat_history_size = static_cast<uint32>(val);
+            settings_server->lobby_chat_history_size = static_cast<uint32>(val);
+        }
+    }
+
     settings_client->download_steamhttp_requests = ini.GetBoolValue("main::connectivity", "download_steamhttp_requests", settings_client->download_steamhttp_requests);
     settings_server->download_steamhttp_requests = ini.GetBoolValue("main::connectivity", "download_steamhttp_requests", settings_server->download_steamhttp_requests);
 
@@ -0,0 +1,277 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "dll/shared_memory.h"
+#include "dll/common_includes.h"
+
+#if !defined(__WINDOWS__)
+#include <sys/mman.h>
+#endif
+
+#define SHARED_MEMORY_RING_MAGIC 0x47534D52 // "GSMR"
+// every message is prefixed by its size and flags
+#define SHARED_MEMORY_FRAME_HEADER (2 * sizeof(uint32))
+
+
+Shared_Memory_Ring::~Shared_Memory_Ring()
+{
+    close();
+}
+
+bool Shared_Memory_Ring::map(bool create, uint32 capacity)
+{
+    size_t size = sizeof(Shared_Memory_Ring_Header) + capacity;
+    void *mem = nullptr;
+
+#if defined(__WINDOWS__)
+    std::string full_name = "Local\\" + name;
+    if (create) {
+        mapping = (void *)CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, static_cast<DWORD>(size), full_name.c_str());
+        if (mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+            CloseHandle((HANDLE)mapping);
+            mapping = nullptr;
+        }
+    } else {
+        mapping = (void *)OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, full_name.c_str());
+    }
+
+    if (!mapping) return false;
+
+    mem = MapViewOfFile((HANDLE)mapping, FILE_MAP_ALL_ACCESS, 0, 0, create ? size : 0);
+    if (mem && !create) {
+        MEMORY_BASIC_INFORMATION info{};
+        VirtualQuery(mem, &info, sizeof(info));
+        size = info.RegionSize;
+    }
+
+    if (!mem) {
+        CloseHandle((HANDLE)mapping);
+        mapping = nullptr;
+        return false;
+    }
+#else
+    std::string path = "/dev/shm/" + name;
+    int fd = create ? ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600) : ::open(path.c_str(), O_RDWR);
+    if (fd < 0) return false;
+
+    linked = true;
+    if (create) {
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ::close(fd);
+            unlink();
+            return false;
+        }
+    } else {
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Shared_Memory_Ring_Header))) {
+            ::close(fd);
+            linked = false;
+            return false;
+        }
+
+        size = static_cast<size_t>(st.st_size);
+    }
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+        if (create) unlink();
+        linked = false;
+        return false;
+    }
+#endif
+
+    mapped_size = size;
+    header = static_cast<Shared_Memory_Ring_Header *>(mem);
+    ring = static_cast<uint8 *>(mem) + sizeof(Shared_Memory_Ring_Header);
+    return true;
+}
+
+void Shared_Memory_Ring::unlink()
+{
+#if !defined(__WINDOWS__)
+    // the mappings stay valid, this only removes the name so nothing is left behind in /dev/shm
+    if (linked) {
+        ::unlink(("/dev/shm/" + name).c_str());
+        linked = false;
+    }
+#endif
+}
+
+void Shared_Memory_Ring::copy_in(uint32 pos, const void *data, uint32 size)
+{
+    uint32 offset = pos & (capacity - 1);
+    uint32 first = std::min(size, capacity - offset);
+    memcpy(ring + offset, data, first);
+    if (first < size) memcpy(ring, static_cast<const uint8 *>(data) + first, size - first);
+}
+
+void Shared_Memory_Ring::copy_out(uint32 pos, void *data, uint32 size) const
+{
+    uint32 offset = pos & (capacity - 1);
+    uint32 first = std::min(size, capacity - offset);
+    memcpy(data, ring + offset, first);
+    if (first < size) memcpy(static_cast<uint8 *>(data) + first, ring, size - first);
+}
+
+bool Shared_Memory_Ring::create(const std::string &name, uint32 capacity)
+{
+    close();
+    if (!capacity || (capacity & (capacity - 1))) return false;
+
+    this->name = name;
+    if (!map(true, capacity)) return false;
+
+    header = new (header) Shared_Memory_Ring_Header();
+    header->capacity = capacity;
+    this->capacity = capacity;
+    header->magic.store(SHARED_MEMORY_RING_MAGIC, std::memory_order_release);
+    writer = true;
+    PRINT_DEBUG("created '%s' %u", name.c_str(), capacity);
+    return true;
+}
+
+bool Shared_Memory_Ring::open(const std::string &name)
+{
+    close();
+    this->name = name;
+    if (!map(false, 0)) return false;
+
+    // read once, after the magic, everything else only uses this copy
+    bool ready = header->magic.load(std::memory_order_acquire) == SHARED_MEMORY_RING_MAGIC;
+    uint32 capacity = header->capacity;
+    if (!ready || !capacity || (capacity & (capacity - 1)) ||
+        sizeof(Shared_Memory_Ring_Header) + capacity > mapped_size) {
+        // not ready yet or not one of ours
+        PRINT_DEBUG("bad segment '%s'", name.c_str());
+#if !defined(__WINDOWS__)
+        linked = false;
+#endif
+        close();
+        return false;
+    }
+
+    writer = false;
+    this->capacity = capacity;
+    header->reader_attached.store(1, std::memory_order_release);
+    unlink();
+    PRINT_DEBUG("opened '%s' %u", name.c_str(), capacity);
+    return true;
+}
+
+void Shared_Memory_Ring::close()
+{
+    if (header) {
+        if (writer) header->writer_closed.store(1, std::memory_order_release);
+
+#if defined(__WINDOWS__)
+        UnmapViewOfFile(header);
+#else
+        munmap(header, mapped_size);
+#endif
+    }
+
+#if defined(__WINDOWS__)
+    if (mapping) {
+        CloseHandle((HANDLE)mapping);
+        mapping = nullptr;
+    }
+#endif
+
+    if (writer) unlink();
+    header = nullptr;
+    ring = nullptr;
+    mapped_size = 0;
+    capacity = 0;
+    writer = false;
+}
+
+bool Shared_Memory_Ring::is_open() const
+{
+    return header != nullptr;
+}
+
+bool Shared_Memory_Ring::reader_attached() const
+{
+    return header && header->reader_attached.load(std::memory_order_acquire);
+}
+
+bool Shared_Memory_Ring::writer_closed() const
+{
+    return header && header->writer_closed.load(std::memory_order_acquire);
+}
+
+uint32 Shared_Memory_Ring::max_message_size() const
+{
+    if (!header) return 0;
+    return capacity / 2 - SHARED_MEMORY_FRAME_HEADER;
+}
+
+bool Shared_Memory_Ring::write(const void *data, uint32 size, uint32 flags)
+{
+    if (!header || !writer || size > max_message_size()) return false;
+
+    uint32 frame_size = static_cast<uint32>(SHARED_MEMORY_FRAME_HEADER) + size;
+    uint32 head = header->head.load(std::memory_order_relaxed);
+    uint32 tail = header->tail.load(std::memory_order_acquire);
+    uint32 used = head - tail;
+    if (used > capacity) {
+        // the reader never moves the tail past the head, the segment is corrupted
+        PRINT_DEBUG("bad tail %u in '%s'", tail, name.c_str());
+        return false;
+    }
+
+    if (capacity - used < frame_size) return false;
+
+    uint32 frame_header[2] = { size, flags };
+    copy_in(head, frame_header, sizeof(frame_header));
+    if (size) copy_in(head + sizeof(frame_header), data, size);
+    header->head.store(head + frame_size, std::memory_order_release);
+    return true;
+}
+
+bool Shared_Memory_Ring::read(std::string &data, uint32 &flags)
+{
+    if (!header || writer) return false;
+
+    uint32 tail = header->tail.load(std::memory_order_relaxed);
+    uint32 head = header->head.load(std::memory_order_acquire);
+    uint32 available = head - tail;
+    if (available > capacity) {
+        PRINT_DEBUG("bad head %u in '%s'", head, name.c_str());
+        header->tail.store(head, std::memory_order_release);
+        return false;
+    }
+
+    if (available < SHARED_MEMORY_FRAME_HEADER) return false;
+
+    uint32 frame_header[2]{};
+    copy_out(tail, frame_header, sizeof(frame_header));
+    uint32 size = frame_header[0];
+    if (size > available - SHARED_MEMORY_FRAME_HEADER) {
+        // the writer never publishes partial frames, the segment is corrupted
+        PRINT_DEBUG("bad frame size %u in '%s'", size, name.c_str());
+        header->tail.store(head, std::memory_order_release);
+        return false;
+    }
+
+    data.resize(size);
+    if (size) copy_out(tail + sizeof(frame_header), &data[0], size);
+    flags = frame_header[1];
+    header->tail.store(tail + static_cast<uint32>(SHARED_MEMORY_FRAME_HEADER) + size, std::memory_order_release);
+    return true;
+}
@@ -18,9 +18,22 @@
 #include "dll/source_query.h"
 #include "dll/dll.h"
 
+// a new challenge secret is picked this often, challenges made with the previous one are still accepted
+#define SOURCE_QUERY_CHALLENGE_LIFETIME 60.0
+// the players response has the time each player has been connected, it's not reused for longer than this
+#define SOURCE_QUERY_PLAYERS_CACHE_TIME 1.0
+// queries per second allowed from a single IP, and how many can come at once
+#define SOURCE_QUERY_RATE 20.0
+#define SOURCE_QUERY_BURST 40.0
+#define SOURCE_QUERY_MAX_SOURCES 4096
+#define SOURCE_QUERY_RATES_CLEANUP_INTERVAL 10.0
+// bigger responses are split, each part (with its header) is at most SOURCE_QUERY_SPLIT_SIZE
+#define SOURCE_QUERY_MAX_PACKET 1400
+#define SOURCE_QUERY_SPLIT_SIZE 1248
+
 enum class source_query_magic : uint32_t {
     simple = 0xFFFFFFFFul,
-    multi  = 0xFFFFFFFEul, // <--- TODO ?
+    multi  = 0xFFFFFFFEul,
 };
 
 enum class source_query_header : uint8_t {
@@ -123,73 +136,247 @@ void serialize_response(std::vector <uint8_t>& buffer, char(&str)[N])
     serialize_response(buffer, reinterpret_cast<uint8_t const*>(str), N);
 }
 
-void get_challenge(std::vector<uint8_t> &challenge_buff)
+// header of every part of a split response
+static constexpr const size_t source_split_header_size = sizeof(source_query_magic) + sizeof(uint32_t) + 2 * sizeof(uint8_t) + sizeof(uint16_t);
+
+static void get_challenge(std::vector<uint8_t> &challenge_buff, uint32_t challenge)
 {
-    // TODO: generate the challenge id
     serialize_response(challenge_buff, source_query_magic::simple);
     serialize_response(challenge_buff, source_response_header::A2S_CHALLENGE);
-    serialize_response(challenge_buff, static_cast<uint32_t>(0x00112233ul));
+    serialize_response(challenge_buff, challenge);
 }
 
-std::vector<uint8_t> Source_Query::handle_source_query(const void* buffer, size_t len, Gameserver const& gs)
+static uint32 mix_challenge(uint32 h)
 {
-    std::vector<uint8_t> output_buffer{};
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bul;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35ul;
+    h ^= h >> 16;
+    return h;
+}
 
-    if (len < source_query_header_size) // its not at least 5 bytes long (0xFF 0xFF 0xFF 0xFF 0x??)
-        return output_buffer;
+static void serialize_info(std::vector<uint8_t> &output_buffer, Gameserver const& gs, size_t num_players)
+{
+    serialize_response(output_buffer, source_query_magic::simple);
+    serialize_response(output_buffer, source_response_header::A2S_INFO);
+    serialize_response(output_buffer, static_cast<uint8_t>(2));
+    serialize_response(output_buffer, gs.server_name());
+    serialize_response(output_buffer, gs.map_name());
+    serialize_response(output_buffer, gs.mod_dir());
+    serialize_response(output_buffer, gs.product());
+    serialize_response(output_buffer, static_cast<uint16_t>(gs.appid()));
+    serialize_response(output_buffer, static_cast<uint8_t>(num_players));
+    serialize_response(output_buffer, static_cast<uint8_t>(gs.max_player_count()));
+    serialize_response(output_buffer, static_cast<uint8_t>(gs.bot_player_count()));
+    serialize_response(output_buffer, (gs.dedicated_server() ? source_server_type::dedicated : source_server_type::non_dedicated));;
+    serialize_response(output_buffer, my_server_env);
+    serialize_response(output_buffer, (gs.password_protected() ? source_server_visibility::_private : source_server_visibility::_public));
+    serialize_response(output_buffer, (gs.secure() ? source_server_vac::secured : source_server_vac::unsecured));
+    serialize_response(output_buffer, std::to_string(gs.version()));
 
-    source_query_data const& query = *reinterpret_cast<source_query_data const*>(buffer);
+    uint8_t flags = source_server_extra_flag::none;
 
-    // || gs.max_player_count() == 0
-    if (gs.offline() || query.magic != source_query_magic::simple) return output_buffer;
+    if (gs.port() != 0) flags |= source_server_extra_flag::port;
 
-    switch (query.header)
-    {
-    case source_query_header::A2S_INFO: {
-        PRINT_DEBUG("got request for server info");
-        if (len >= a2s_query_info_size && !strncmp(query.a2s_info_payload, a2s_info_payload, a2s_info_payload_size)) {
-            std::vector<std::pair<CSteamID, Gameserver_Player_Info_t>> const& players = *get_steam_client()->steam_gameserver->get_players();
+    if (gs.spectator_port() != 0) flags |= source_server_extra_flag::spectator;
+
+    if (CGameID(gs.appid()).IsValid()) flags |= source_server_extra_flag::gameid;
 
-            serialize_response(output_buffer, source_query_magic::simple);
-            serialize_response(output_buffer, source_response_header::A2S_INFO);
-            serialize_response(output_buffer, static_cast<uint8_t>(2));
-            serialize_response(output_buffer, gs.server_name());
-            serialize_response(output_buffer, gs.map_name());
-            serialize_response(output_buffer, gs.mod_dir());
-            serialize_response(output_buffer, gs.product());
-            serialize_response(output_buffer, static_cast<uint16_t>(gs.appid()));
-            serialize_response(output_buffer, static_cast<uint8_t>(players.size()));
-            serialize_response(output_buffer, static_cast<uint8_t>(gs.max_player_count()));
-            serialize_response(output_buffer, static_cast<uint8_t>(gs.bot_player_count()));
-            serialize_response(output_buffer, (gs.dedicated_server() ? source_server_type::dedicated : source_server_type::non_dedicated));;
-            serialize_response(output_buffer, my_server_env);
-            serialize_response(output_buffer, (gs.password_protected() ? source_server_visibility::_private : source_server_visibility::_public));
-            serialize_response(output_buffer, (gs.secure() ? source_server_vac::secured : source_server_vac::unsecured));
-            serialize_response(output_buffer, std::to_string(gs.version()));
+    if (flags != source_server_extra_flag::none) serialize_response(output_buffer, flags);
 
-            uint8_t flags = source_server_extra_flag::none;
+    if (flags & source_server_extra_flag::port) serialize_response(output_buffer, static_cast<uint16_t>(gs.port()));
 
-            if (gs.port() != 0) flags |= source_server_extra_flag::port;
+    // add steamid
 
-            if (gs.spectator_port() != 0) flags |= source_server_extra_flag::spectator;
+    if (flags & source_server_extra_flag::spectator) {
+        serialize_response(output_buffer, static_cast<uint16_t>(gs.spectator_port()));
+        serialize_response(output_buffer, gs.spectator_server_name());
+    }
 
-            if (CGameID(gs.appid()).IsValid()) flags |= source_server_extra_flag::gameid;
+    // keywords
+
+    if (flags & source_server_extra_flag::gameid) serialize_response(output_buffer, CGameID(gs.appid()).ToUint64());
+}
 
-            if (flags != source_server_extra_flag::none) serialize_response(output_buffer, flags);
+static void serialize_players(std::vector<uint8_t> &output_buffer, std::vector<std::pair<CSteamID, Gameserver_Player_Info_t>> const& players)
+{
+    serialize_response(output_buffer, source_query_magic::simple);
+    serialize_response(output_buffer, source_response_header::A2S_PLAYER);
+    serialize_response(output_buffer, static_cast<uint8_t>(players.size())); // num_players
+
+    for (unsigned i = 0; i < players.size(); ++i) {
+        serialize_response(output_buffer, static_cast<uint8_t>(i)); // player index
+        serialize_response(output_buffer, players[i].second.name); // player name
+        serialize_response(output_buffer, players[i].second.score); // player score
+        serialize_response(output_buffer, static_cast<float>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - players[i].second.join_time).count()));
+    }
+}
 
-            if (flags & source_server_extra_flag::port) serialize_response(output_buffer, static_cast<uint16_t>(gs.port()));
+static void serialize_rules(std::vector<uint8_t> &output_buffer, Gameserver const& gs)
+{
+    auto const& values = gs.values();
 
-            // add steamid
+    serialize_response(output_buffer, source_query_magic::simple);
+    serialize_response(output_buffer, source_response_header::A2S_RULES);
+    serialize_response(output_buffer, static_cast<uint16_t>(values.size()));
 
-            if (flags & source_server_extra_flag::spectator) {
-                serialize_response(output_buffer, static_cast<uint16_t>(gs.spectator_port()));
-                serialize_response(output_buffer, gs.spectator_server_name());
+    for (const auto &i : values) {
+        serialize_response(output_buffer, i.first);
+        serialize_response(output_buffer, i.second);
+    }
+}
+
+
+Source_Query::Source_Query()
+{
+    randombytes((char *)&challenge_secret, sizeof(challenge_secret));
+    old_challenge_secret = challenge_secret;
+    challenge_secret_time = std::chrono::steady_clock::now();
+    randombytes((char *)&next_split_id, sizeof(next_split_id));
+}
+
+uint32 Source_Query::make_challenge(uint32 secret, uint32 ip, uint16 port) const
+{
+    uint32 challenge = mix_challenge(secret ^ mix_challenge(ip) ^ (static_cast<uint32>(port) << 8));
+    // 0xFFFFFFFF is how clients ask for a challenge
+    if (challenge == 0xFFFFFFFFul) challenge = 0;
+    return challenge;
+}
+
+bool Source_Query::check_challenge(uint32 challenge, uint32 ip, uint16 port)
+{
+    return challenge == make_challenge(challenge_secret, ip, port) || challenge == make_challenge(old_challenge_secret, ip, port);
+}
+
+// token bucket per source IP
+bool Source_Query::allow_query(uint32 ip)
+{
+    auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration_cast<std::chrono::duration<double>>(now - last_rates_cleanup).count() > SOURCE_QUERY_RATES_CLEANUP_INTERVAL) {
+        // sources that would have a full bucket again don't need to be remembered
+        auto r = std::begin(rates);
+        while (r != std::end(rates)) {
+            if (std::chrono::duration_cast<std::chrono::duration<double>>(now - r->second.last).count() * SOURCE_QUERY_RATE + r->second.tokens >= SOURCE_QUERY_BURST) {
+                r = rates.erase(r);
+            } else {
+                ++r;
             }
+        }
+
+        last_rates_cleanup = now;
+    }
+
+    auto rate = rates.find(ip);
+    if (rate == rates.end()) {
+        if (rates.size() >= SOURCE_QUERY_MAX_SOURCES) return false;
+
+        rate = rates.emplace(ip, Source_Query_Rate{ SOURCE_QUERY_BURST, now }).first;
+    }
 
-            // keywords
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(now - rate->second.last).count();
+    rate->second.tokens = std::min(SOURCE_QUERY_BURST, rate->second.tokens + elapsed * SOURCE_QUERY_RATE);
+    rate->second.last = now;
+    if (rate->second.tokens < 1.0) return false;
 
-            if (flags & source_server_extra_flag::gameid) serialize_response(output_buffer, CGameID(gs.appid()).ToUint64());
+    rate->second.tokens -= 1.0;
+    return true;
+}
+
+void Source_Query::update_cache(uint64 server_version)
+{
+    if (std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - challenge_secret_time).count() > SOURCE_QUERY_CHALLENGE_LIFETIME) {
+        old_challenge_secret = challenge_secret;
+        randombytes((char *)&challenge_secret, sizeof(challenge_secret));
+        challenge_secret_time = std::chrono::steady_clock::now();
+    }
+
+    if (!cached_server_valid || cached_server_version != server_version) {
+        cached_server_version = server_version;
+        cached_server_valid = true;
+        info_response.clear();
+        rules_response.clear();
+    }
+}
+
+// splits the response into the multi-packet format if it's too big for a single packet
+void Source_Query::add_response(std::vector<uint8_t> const& response, std::vector<std::vector<uint8_t>> &packets)
+{
+    if (response.size() <= SOURCE_QUERY_MAX_PACKET) {
+        packets.push_back(response);
+        return;
+    }
+
+    const size_t part_size = SOURCE_QUERY_SPLIT_SIZE - source_split_header_size;
+    size_t total = (response.size() + part_size - 1) / part_size;
+    if (total > 0xFF) {
+        PRINT_DEBUG("response too big %zu, truncated", response.size());
+        total = 0xFF;
+    }
+
+    // the highest bit means the parts are compressed
+    uint32_t id = next_split_id++ & 0x7FFFFFFFul;
+    for (size_t i = 0; i < total; ++i) {
+        std::vector<uint8_t> packet{};
+        size_t offset = i * part_size;
+        size_t size = std::min(part_size, response.size() - offset);
+        packet.reserve(source_split_header_size + size);
+        serialize_response(packet, source_query_magic::multi);
+        serialize_response(packet, id);
+        serialize_response(packet, static_cast<uint8_t>(total));
+        serialize_response(packet, static_cast<uint8_t>(i));
+        serialize_response(packet, static_cast<uint16_t>(SOURCE_QUERY_SPLIT_SIZE));
+        serialize_response(packet, response.data() + offset, size);
+        packets.push_back(std::move(packet));
+    }
+
+    PRINT_DEBUG("split response of %zu bytes in %zu packets", response.size(), total);
+}
+
+std::vector<std::vector<uint8_t>> Source_Query::handle_source_query(const void* buffer, size_t len, uint32 ip, uint16 port, Gameserver const& gs, uint64 server_version, std::vector<std::pair<CSteamID, Gameserver_Player_Info_t>> const& players)
+{
+    std::vector<std::vector<uint8_t>> packets{};
+
+    if (len < source_query_header_size) // its not at least 5 bytes long (0xFF 0xFF 0xFF 0xFF 0x??)
+        return packets;
 
+    source_query_data query{};
+    memcpy(&query, buffer, std::min(len, sizeof(query)));
+
+    // || gs.max_player_count() == 0
+    if (gs.offline() || query.magic != source_query_magic::simple) return packets;
+
+    if (!allow_query(ip)) {
+        PRINT_DEBUG("too many queries from %X", ip);
+        return packets;
+    }
+
+    update_cache(server_version);
+
+    std::vector<uint8_t> challenge_buff{};
+    switch (query.header)
+    {
+    case source_query_header::A2S_INFO: {
+        PRINT_DEBUG("got request for server info");
+        if (len >= a2s_query_info_size && !strncmp(query.a2s_info_payload, a2s_info_payload, a2s_info_payload_size)) {
+            // newer clients send a challenge after the payload, older ones are still answered without it
+            if (len >= a2s_query_info_size + sizeof(uint32_t)) {
+                uint32_t challenge{};
+                memcpy(&challenge, static_cast<const uint8_t *>(buffer) + a2s_query_info_size, sizeof(challenge));
+                if (!check_challenge(challenge, ip, port)) {
+                    get_challenge(challenge_buff, make_challenge(challenge_secret, ip, port));
+                    packets.push_back(std::move(challenge_buff));
+                    break;
+                }
+            }
+
+            if (info_response.empty() || info_response_players != players.size()) {
+                info_response.clear();
+                serialize_info(info_response, gs, players.size());
+                info_response_players = players.size();
+            }
+
+            add_response(info_response, packets);
         }
     }
     break;
@@ -197,21 +384,19 @@ std::vector<uint8_t> Source_Query::handle_source_query(const void* buffer, size_
     case source_query_header::A2S_PLAYER: {
         PRINT_DEBUG("got request for player info");
         if (len >= a2s_query_challenge_size) {
-            if (query.challenge == 0xFFFFFFFFul) {
-                get_challenge(output_buffer);
-            } else if (query.challenge == 0x00112233ul) {
-                std::vector<std::pair<CSteamID, Gameserver_Player_Info_t>> const& players = *get_steam_client()->steam_gameserver->get_players();
-
-                serialize_response(output_buffer, source_query_magic::simple);
-                serialize_response(output_buffer, source_response_header::A2S_PLAYER);
-                serialize_response(output_buffer, static_cast<uint8_t>(players.size())); // num_players
-
-                for (unsigned i = 0; i < players.size(); ++i) {
-                    serialize_response(output_buffer, static_cast<uint8_t>(i)); // player index
-                    serialize_response(output_buffer, players[i].second.name); // player name
-                    serialize_response(output_buffer, players[i].second.score); // player score
-                    serialize_response(output_buffer, static_cast<float>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - players[i].second.join_time).count()));
+            if (!check_challenge(query.challenge, ip, port)) {
+                get_challenge(challenge_buff, make_challenge(challenge_secret, ip, port));
+                packets.push_back(std::move(challenge_buff));
+            } else {
+                if (player_response.empty() || player_response_players != players.size() ||
+                    std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - player_response_time).count() > SOURCE_QUERY_PLAYERS_CACHE_TIME) {
+                    player_response.clear();
+                    serialize_players(player_response, players);
+                    player_response_players = players.size();
+                    player_response_time = std::chrono::steady_clock::now();
                 }
+
+                add_response(player_response, packets);
             }
         }
     }
@@ -220,19 +405,13 @@ std::vector<uint8_t> Source_Query::handle_source_query(const void* buffer, size_
     case source_query_header::A2S_RULES: {
         PRINT_DEBUG("got request for rules info");
         if (len >= a2s_query_challenge_size) {
-            if (query.challenge == 0xFFFFFFFFul) {
-                get_challenge(output_buffer);
-            } else if (query.challenge == 0x00112233ul) {
-                auto values = gs.values();
-
-                serialize_response(output_buffer, source_query_magic::simple);
-                serialize_response(output_buffer, source_response_header::A2S_RULES);
-                serialize_response(output_buffer, static_cast<uint16_t>(values.size()));
-
-                for (const auto &i : values) {
-                    serialize_response(output_buffer, i.first);
-                    serialize_response(output_buffer, i.second);
-                }
+            if (!check_challenge(query.challenge, ip, port)) {
+                get_challenge(challenge_buff, make_challenge(challenge_secret, ip, port));
+                packets.push_back(std::move(challenge_buff));
+            } else {
+                if (rules_response.empty()) serialize_rules(rules_response, gs);
+
+                add_response(rules_response, packets);
             }
         }
     }
@@ -241,5 +420,5 @@ std::vector<uint8_t> Source_Query::handle_source_query(const void* buffer, size_
     default: PRINT_DEBUG("got unknown request"); break;
     }
 
-    return output_buffer;
+    return packets;
 }
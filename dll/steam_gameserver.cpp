@@ -18,7 +18,37 @@
 #include "dll/steam_gameserver.h"
 #include "dll/source_query.h"
 
+// heartbeats to every peer, with the current revision
 #define SEND_SERVER_RATE 5.0
+// changes to the interested peers
+#define SEND_SERVER_DELTA_RATE 0.1
+// peers keep getting the changes for this long after they browsed servers
+#define SERVER_BROWSER_TIMEOUT 30.0
+
+// every Gameserver field besides the values map, with its field number
+#define GAMESERVER_DELTA_FIELDS(X) \
+    X(game_description, 2) \
+    X(mod_dir, 3) \
+    X(dedicated_server, 4) \
+    X(max_player_count, 5) \
+    X(bot_player_count, 6) \
+    X(server_name, 7) \
+    X(map_name, 8) \
+    X(password_protected, 9) \
+    X(spectator_port, 10) \
+    X(spectator_server_name, 11) \
+    X(tags, 13) \
+    X(gamedata, 14) \
+    X(region, 15) \
+    X(product, 16) \
+    X(secure, 17) \
+    X(num_players, 18) \
+    X(version, 19) \
+    X(ip, 32) \
+    X(port, 33) \
+    X(query_port, 34) \
+    X(appid, 35) \
+    X(type, 49)
 
 
 Steam_GameServer::Steam_GameServer(class Settings *settings, class Networking *network, class SteamCallBacks *callbacks)
@@ -27,14 +57,20 @@ Steam_GameServer::Steam_GameServer(class Settings *settings, class Networking *n
     this->settings = settings;
     this->callbacks = callbacks;
     auth_manager = new Auth_Manager(settings, network, callbacks);
+    source_query = new Source_Query();
     
     server_data.set_id(settings->get_local_steam_id().ConvertToUint64());
+
+    this->network->setCallback(CALLBACK_ID_GAMESERVER, settings->get_local_steam_id(), &Steam_GameServer::steam_gameserver_network_callback, this);
 }
 
 Steam_GameServer::~Steam_GameServer()
 {
+    this->network->rmCallback(CALLBACK_ID_GAMESERVER, settings->get_local_steam_id(), &Steam_GameServer::steam_gameserver_network_callback, this);
     delete auth_manager;
     auth_manager = nullptr;
+    delete source_query;
+    source_query = nullptr;
 }
 
 
@@ -43,6 +79,66 @@ std::vector<std::pair<CSteamID, Gameserver_Player_Info_t>>* Steam_GameServer::ge
     return &players;
 }
 
+Gameserver &Steam_GameServer::edit_server_data()
+{
+    ++server_data_version;
+    return server_data;
+}
+
+// fills update with what changed between the two, returns false if nothing did
+bool Steam_GameServer::make_gameserver_delta(const Gameserver &old_server, const Gameserver &server, Gameserver_Update *update)
+{
+    Gameserver *changed = update->mutable_changed();
+
+#define GAMESERVER_DIFF_FIELD(name, number) \
+    if (old_server.name() != server.name()) { \
+        changed->set_##name(server.name()); \
+        update->add_changed_fields(number); \
+    }
+
+    GAMESERVER_DELTA_FIELDS(GAMESERVER_DIFF_FIELD)
+#undef GAMESERVER_DIFF_FIELD
+
+    for (auto const &value : server.values()) {
+        auto old_value = old_server.values().find(value.first);
+        if (old_value == old_server.values().end() || old_value->second != value.second) {
+            (*changed->mutable_values())[value.first] = value.second;
+        }
+    }
+
+    for (auto const &old_value : old_server.values()) {
+        if (!server.values().count(old_value.first)) {
+            update->add_removed_values(old_value.first);
+        }
+    }
+
+    return update->changed_fields_size() || changed->values_size() || update->removed_values_size();
+}
+
+void Steam_GameServer::apply_gameserver_delta(Gameserver *server, const Gameserver_Update &update)
+{
+    const Gameserver &changed = update.changed();
+    for (auto field : update.changed_fields()) {
+        switch (field) {
+#define GAMESERVER_APPLY_FIELD(name, number) \
+        case number: server->set_##name(changed.name()); break;
+
+        GAMESERVER_DELTA_FIELDS(GAMESERVER_APPLY_FIELD)
+#undef GAMESERVER_APPLY_FIELD
+        }
+    }
+
+    for (auto const &value : changed.values()) {
+        (*server->mutable_values())[value.first] = value.second;
+    }
+
+    for (auto const &key : update.removed_values()) {
+        server->mutable_values()->erase(key);
+    }
+
+    server->set_revision(update.revision());
+}
+
 //
 // Basic server data.  These properties, if set, must be set before before calling LogOn.  They
 // may not be changed after logged in.
@@ -64,17 +160,17 @@ bool Steam_GameServer::InitGameServer( uint32 unIP, uint16 usGamePort, uint16 us
 
     try {
         auto ver = std::stoul(version);
-        server_data.set_version(ver);
+        edit_server_data().set_version(ver);
         PRINT_DEBUG("set version to %lu", ver);
     } catch (...) {
         PRINT_DEBUG("not a number: %s", pchVersionString);
-        server_data.set_version(0);
+        edit_server_data().set_version(0);
     }
 
-    server_data.set_ip(unIP);
-    server_data.set_port(usGamePort);
-    server_data.set_query_port(usQueryPort);
-    server_data.set_offline(false);
+    edit_server_data().set_ip(unIP);
+    edit_server_data().set_port(usGamePort);
+    edit_server_data().set_query_port(usQueryPort);
+    edit_server_data().set_offline(false);
 
     if (!settings->disable_source_query)
         network->startQuery({ unIP, usQueryPort });
@@ -98,7 +194,7 @@ void Steam_GameServer::SetProduct( const char *pszProduct )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     // pszGameDescription should be used instead of pszProduct for accurate information
     // Example: 'Counter-Strike: Source' instead of 'cstrike'
-    server_data.set_product(pszProduct);
+    edit_server_data().set_product(pszProduct);
 }
 
 
@@ -108,7 +204,7 @@ void Steam_GameServer::SetGameDescription( const char *pszGameDescription )
 {
     PRINT_DEBUG("%s", pszGameDescription);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_game_description(pszGameDescription);
+    edit_server_data().set_game_description(pszGameDescription);
     //server_data.set_product(pszGameDescription);
 }
 
@@ -121,7 +217,7 @@ void Steam_GameServer::SetModDir( const char *pszModDir )
 {
     PRINT_DEBUG("%s", pszModDir);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_mod_dir(pszModDir);
+    edit_server_data().set_mod_dir(pszModDir);
 }
 
 
@@ -130,7 +226,7 @@ void Steam_GameServer::SetDedicatedServer( bool bDedicated )
 {
     PRINT_DEBUG("%i", bDedicated);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_dedicated_server(bDedicated);
+    edit_server_data().set_dedicated_server(bDedicated);
 }
 
 
@@ -205,11 +301,11 @@ bool Steam_GameServer::BSecure()
     PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (!policy_response_called) {
-      server_data.set_secure(0);
+      edit_server_data().set_secure(0);
       return false;
     }
     const bool res = !!(flags & k_unServerFlagSecure);
-    server_data.set_secure(res);
+    edit_server_data().set_secure(res);
     return res;
 }
  
@@ -241,7 +337,7 @@ void Steam_GameServer::SetMaxPlayerCount( int cPlayersMax )
 {
     PRINT_DEBUG("%i", cPlayersMax);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_max_player_count(cPlayersMax);
+    edit_server_data().set_max_player_count(cPlayersMax);
 }
 
 
@@ -250,7 +346,7 @@ void Steam_GameServer::SetBotPlayerCount( int cBotplayers )
 {
     PRINT_DEBUG("%i", cBotplayers);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_bot_player_count(cBotplayers);
+    edit_server_data().set_bot_player_count(cBotplayers);
 }
 
 
@@ -261,7 +357,7 @@ void Steam_GameServer::SetServerName( const char *pszServerName )
 {
     PRINT_DEBUG("%s", pszServerName);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_server_name(pszServerName);
+    edit_server_data().set_server_name(pszServerName);
 }
 
 
@@ -272,7 +368,7 @@ void Steam_GameServer::SetMapName( const char *pszMapName )
 {
     PRINT_DEBUG("%s", pszMapName);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_map_name(pszMapName);
+    edit_server_data().set_map_name(pszMapName);
 }
 
 
@@ -281,7 +377,7 @@ void Steam_GameServer::SetPasswordProtected( bool bPasswordProtected )
 {
     PRINT_DEBUG("%i", bPasswordProtected);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_password_protected(bPasswordProtected);
+    edit_server_data().set_password_protected(bPasswordProtected);
 }
 
 
@@ -291,7 +387,7 @@ void Steam_GameServer::SetSpectatorPort( uint16 unSpectatorPort )
 {
     PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_spectator_port(unSpectatorPort);
+    edit_server_data().set_spectator_port(unSpectatorPort);
 }
 
 
@@ -302,7 +398,7 @@ void Steam_GameServer::SetSpectatorServerName( const char *pszSpectatorServerNam
 {
     PRINT_DEBUG("%s", pszSpectatorServerName);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_spectator_server_name(pszSpectatorServerName);
+    edit_server_data().set_spectator_server_name(pszSpectatorServerName);
 }
 
 
@@ -311,7 +407,7 @@ void Steam_GameServer::ClearAllKeyValues()
 {
     PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.clear_values();
+    edit_server_data().clear_values();
 }
 
 
@@ -320,7 +416,7 @@ void Steam_GameServer::SetKeyValue( const char *pKey, const char *pValue )
 {
     PRINT_DEBUG("%s %s", pKey, pValue);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    (*server_data.mutable_values())[std::string(pKey)] = std::string(pValue);
+    (*edit_server_data().mutable_values())[std::string(pKey)] = std::string(pValue);
 }
 
 
@@ -332,7 +428,7 @@ void Steam_GameServer::SetGameTags( const char *pchGameTags )
 {
     PRINT_DEBUG("%s", pchGameTags);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_tags(pchGameTags);
+    edit_server_data().set_tags(pchGameTags);
 }
 
 
@@ -346,7 +442,7 @@ void Steam_GameServer::SetGameData( const char *pchGameData )
 {
     PRINT_DEBUG("%s", pchGameData);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_gamedata(pchGameData);
+    edit_server_data().set_gamedata(pchGameData);
 }
 
 
@@ -355,7 +451,7 @@ void Steam_GameServer::SetRegion( const char *pszRegion )
 {
     PRINT_DEBUG("%s", pszRegion);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_region(pszRegion);
+    edit_server_data().set_region(pszRegion);
 }
 
 
@@ -487,15 +583,15 @@ bool Steam_GameServer::BSetServerType( uint32 unServerFlags, uint32 unGameIP, ui
 {
     PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_ip(unGameIP);
-    server_data.set_port(unGamePort);
-    server_data.set_query_port(usQueryPort);
-    server_data.set_spectator_port(unSpectatorPort);
+    edit_server_data().set_ip(unGameIP);
+    edit_server_data().set_port(unGamePort);
+    edit_server_data().set_query_port(usQueryPort);
+    edit_server_data().set_spectator_port(unSpectatorPort);
 
     std::string version(pchVersion);
     version.erase(std::remove(version.begin(), version.end(), ' '), version.end());
     version.erase(std::remove(version.begin(), version.end(), '.'), version.end());
-    server_data.set_version(stoi(version));
+    edit_server_data().set_version(stoi(version));
     flags = unServerFlags;
 
     //TODO?
@@ -515,12 +611,12 @@ void Steam_GameServer::UpdateServerStatus( int cPlayers, int cPlayersMax, int cB
 {
     PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    server_data.set_num_players(cPlayers);
-    server_data.set_max_player_count(cPlayersMax);
-    server_data.set_bot_player_count(cBotPlayers);
-    server_data.set_server_name(pchServerName);
-    server_data.set_spectator_server_name(pSpectatorServerName);
-    server_data.set_map_name(pchMapName);
+    edit_server_data().set_num_players(cPlayers);
+    edit_server_data().set_max_player_count(cPlayersMax);
+    edit_server_data().set_bot_player_count(cBotPlayers);
+    edit_server_data().set_server_name(pchServerName);
+    edit_server_data().set_spectator_server_name(pSpectatorServerName);
+    edit_server_data().set_map_name(pchMapName);
 }
 
 // This can be called if spectator goes away or comes back (passing 0 means there is no spectator server now).
@@ -703,16 +799,19 @@ bool Steam_GameServer::HandleIncomingPacket( const void *pData, int cbData, uint
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (settings->disable_source_query) return true;
 
-    Gameserver_Outgoing_Packet packet;
-    packet.data = std::move(Source_Query::handle_source_query(pData, cbData, server_data));
-    if (packet.data.empty())
+    auto responses = source_query->handle_source_query(pData, cbData, srcIP, srcPort, server_data, server_data_version, players);
+    if (responses.empty())
         return false;
 
+    for (auto &response : responses) {
+        Gameserver_Outgoing_Packet packet;
+        packet.data = std::move(response);
+        packet.ip = srcIP;
+        packet.port = srcPort;
 
-    packet.ip = srcIP;
-    packet.port = srcPort;
+        outgoing_packets.emplace_back(std::move(packet));
+    }
 
-    outgoing_packets.emplace_back(std::move(packet));
     return true;
 }
 
@@ -729,17 +828,29 @@ int Steam_GameServer::GetNextOutgoingPacket( void *pOut, int cbMaxOut, uint32 *p
     if (outgoing_packets.empty()) return 0;
 
     if (cbMaxOut > 0) {
-        if (outgoing_packets.back().data.size() < static_cast<size_t>(cbMaxOut)) {
-            cbMaxOut = static_cast<int>(outgoing_packets.back().data.size());
+        if (outgoing_packets.front().data.size() < static_cast<size_t>(cbMaxOut)) {
+            cbMaxOut = static_cast<int>(outgoing_packets.front().data.size());
         }
-        if (pOut) memcpy(pOut, outgoing_packets.back().data.data(), cbMaxOut);
+        if (pOut) memcpy(pOut, outgoing_packets.front().data.data(), cbMaxOut);
     }
-    if (pNetAdr) *pNetAdr = outgoing_packets.back().ip;
-    if (pPort) *pPort = outgoing_packets.back().port;
-    outgoing_packets.pop_back();
+    if (pNetAdr) *pNetAdr = outgoing_packets.front().ip;
+    if (pPort) *pPort = outgoing_packets.front().port;
+    outgoing_packets.pop_front();
     return cbMaxOut;
 }
 
+void Steam_GameServer::take_outgoing_packets(std::vector<struct Gameserver_Outgoing_Packet> &packets)
+{
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    if (settings->disable_source_query) {
+        outgoing_packets.clear();
+        return;
+    }
+
+    packets.insert(packets.end(), std::make_move_iterator(outgoing_packets.begin()), std::make_move_iterator(outgoing_packets.end()));
+    outgoing_packets.clear();
+}
+
 
 //
 // Control heartbeats / advertisement with master server
@@ -833,13 +944,23 @@ void Steam_GameServer::RunCallbacks()
         policy_response_called = true;
     }
 
+    if (logged_in && check_timedout(last_sent_server_delta, SEND_SERVER_DELTA_RATE)) {
+        sync_server_data();
+        last_sent_server_delta = std::chrono::high_resolution_clock::now();
+    }
+
     if (logged_in && check_timedout(last_sent_server_info, SEND_SERVER_RATE)) {
-        PRINT_DEBUG("Sending Gameserver");
+        // only the peers browsing servers get the whole state, the others learn that we are still here and at which revision
+        PRINT_DEBUG("Sending Gameserver heartbeat %llu", server_revision);
         Common_Message msg;
         msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
-        server_data.set_appid(settings->get_local_game_id().AppID());
-        msg.set_allocated_gameserver(new Gameserver(server_data));
-        msg.mutable_gameserver()->set_num_players(auth_manager->countInboundAuth());
+        Gameserver_Update *update = new Gameserver_Update();
+        update->set_type(Gameserver_Update::DELTA);
+        update->set_id(server_data.id());
+        update->set_appid(settings->get_local_game_id().AppID());
+        update->set_base_revision(server_revision);
+        update->set_revision(server_revision);
+        msg.set_allocated_gameserver_update(update);
         network->sendToAllIndividuals(&msg, true);
         last_sent_server_info = std::chrono::high_resolution_clock::now();
     }
@@ -855,6 +976,9 @@ void Steam_GameServer::RunCallbacks()
             msg.set_allocated_gameserver(new Gameserver(server_data));
             msg.mutable_gameserver()->set_offline(true);
             network->sendToAllIndividuals(&msg, true);
+            // everyone starts over with the whole state if we log on again
+            synced_peers.clear();
+            server_browsers.clear();
             // Shutdown Source Query
             network->shutDownQuery();
             // And empty the queue if needed
@@ -862,3 +986,86 @@ void Steam_GameServer::RunCallbacks()
         }
     }
 }
+
+// sends the changes of server_data to the peers browsing servers and to the players
+void Steam_GameServer::sync_server_data()
+{
+    auto browser = std::begin(server_browsers);
+    while (browser != std::end(server_browsers)) {
+        if (check_timedout(browser->second, SERVER_BROWSER_TIMEOUT)) {
+            browser = server_browsers.erase(browser);
+        } else {
+            ++browser;
+        }
+    }
+
+    std::set<uint64> interested{};
+    for (auto const &b : server_browsers) {
+        interested.insert(b.first);
+    }
+
+    for (auto const &p : players) {
+        if (p.first.BIndividualAccount()) interested.insert(p.first.ConvertToUint64());
+    }
+
+    uint32 appid = settings->get_local_game_id().AppID();
+    uint32 num_players = auth_manager->countInboundAuth();
+    if (server_data.appid() != appid) edit_server_data().set_appid(appid);
+    if (server_data.num_players() != num_players) edit_server_data().set_num_players(num_players);
+
+    Gameserver_Update *update = new Gameserver_Update();
+    bool changed = !server_revision || make_gameserver_delta(synced_server_data, server_data, update);
+    if (changed) {
+        update->set_type(Gameserver_Update::DELTA);
+        update->set_id(server_data.id());
+        update->set_appid(server_data.appid());
+        update->set_base_revision(server_revision);
+        ++server_revision;
+        update->set_revision(server_revision);
+        server_data.set_revision(server_revision);
+        synced_server_data = server_data;
+    }
+
+    Common_Message delta_msg;
+    delta_msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    delta_msg.set_allocated_gameserver_update(update);
+
+    for (auto id : interested) {
+        if (!synced_peers.count(id)) {
+            PRINT_DEBUG("whole state to %llu, revision %llu", id, server_revision);
+            Common_Message msg;
+            msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+            msg.set_dest_id(id);
+            msg.set_allocated_gameserver(new Gameserver(synced_server_data));
+            network->sendTo(&msg, true);
+        } else if (changed) {
+            delta_msg.set_dest_id(id);
+            network->sendTo(&delta_msg, true);
+        }
+    }
+
+    synced_peers = std::move(interested);
+}
+
+void Steam_GameServer::Callback(Common_Message *msg)
+{
+    if (msg->has_gameserver_update() && msg->gameserver_update().type() == Gameserver_Update::REQUEST) {
+        const Gameserver_Update &request = msg->gameserver_update();
+        if (!logged_in) return;
+        if (request.appid() && request.appid() != settings->get_local_game_id().AppID()) return;
+
+        PRINT_DEBUG("server list request from %llu", (uint64)msg->source_id());
+        server_browsers[msg->source_id()] = std::chrono::high_resolution_clock::now();
+        // the peer might have missed some changes, it gets the whole state again right away
+        synced_peers.erase(msg->source_id());
+        last_sent_server_delta = std::chrono::high_resolution_clock::time_point();
+    }
+}
+
+void Steam_GameServer::steam_gameserver_network_callback(void *object, Common_Message *msg)
+{
+    // PRINT_DEBUG_ENTRY();
+
+    Steam_GameServer *obj = (Steam_GameServer *)object;
+    obj->Callback(msg);
+}
@@ -18,6 +18,9 @@
 #include "dll/steam_matchmaking.h"
 
 #define SEND_LOBBY_RATE 5.0
+// owners keep sending lobby changes to a peer for this long after it searched for lobbies
+#define LOBBY_SEARCHER_TIMEOUT 30.0
+#define LOBBY_SNAPSHOT_REQUEST_INTERVAL 1.0
 
 #define PENDING_JOIN_TIMEOUT 10.0
 #define REQUEST_LOBBY_DATA_TIMEOUT 6.0
@@ -28,6 +31,10 @@
 #define FILTER_MAX_DEFAULT 4096
 
 #define LOBBY_SEARCH_TIMEOUT 0.2 //Tested on real steam
+// searches don't end before we've been up this long, the peers found by the first broadcasts need time to connect and reply
+#define LOBBY_SEARCH_STARTUP_WAIT 1.5
+// peers connecting during a search extend it, up to this long in total
+#define LOBBY_SEARCH_MAX_TIMEOUT 3.0
 
 
 google::protobuf::Map<std::string,std::string>::const_iterator Steam_Matchmaking::caseinsensitive_find(const ::google::protobuf::Map< ::std::string, ::std::string >& map, std::string key)
@@ -55,23 +62,375 @@ Lobby* Steam_Matchmaking::get_lobby(CSteamID id)
     return &(*lobby);
 }
 
+// same parsing as std::stoll(value, 0, 0), an empty value counts as 0
+static bool parse_lobby_int(const std::string &value, long long &out)
+{
+    out = 0;
+    if (value.empty()) return true;
+
+    char *end = nullptr;
+    errno = 0;
+    out = std::strtoll(value.c_str(), &end, 0);
+    return end != value.c_str() && errno != ERANGE;
+}
+
+// the lobby value is on the left side, the filter value on the right side
+static bool lobby_comparison_matches(int cmp, ELobbyComparison type)
+{
+    switch (type) {
+    case k_ELobbyComparisonEqualToOrLessThan: return cmp <= 0;
+    case k_ELobbyComparisonLessThan: return cmp < 0;
+    case k_ELobbyComparisonEqual: return cmp == 0;
+    case k_ELobbyComparisonGreaterThan: return cmp > 0;
+    case k_ELobbyComparisonEqualToOrGreaterThan: return cmp >= 0;
+    case k_ELobbyComparisonNotEqual: return cmp != 0;
+    }
+
+    PRINT_DEBUG("unknown compare type %i", (int)type);
+    return true;
+}
+
+// value is null when the lobby doesn't have the key
+static bool lobby_filter_matches(const Filter_Values &f, const std::string *value)
+{
+    //TODO: check if this is how real steam behaves
+    if (!value) return f.eComparisonType == k_ELobbyComparisonNotEqual;
+
+    int cmp = 0;
+    if (f.is_int) {
+        long long compare_to = 0;
+        if (!parse_lobby_int(*value, compare_to)) return false;
+        cmp = (compare_to > f.value_int) - (compare_to < f.value_int);
+    } else {
+        int res = value->compare(f.value_string);
+        cmp = (res > 0) - (res < 0);
+    }
+
+    return lobby_comparison_matches(cmp, f.eComparisonType);
+}
+
+bool Steam_Matchmaking::lobby_matches_query(const Lobby &lobby, const Lobby_Query &query)
+{
+    if (!lobby.joinable() || lobby.deleted()) return false;
+    if (lobby.type() != k_ELobbyTypePublic && lobby.type() != k_ELobbyTypeInvisible && lobby.type() != k_ELobbyTypeFriendsOnly) return false;
+
+    if (query.slots_available >= 0 && lobby.member_limit() > 0 &&
+        static_cast<int>(lobby.member_limit()) - lobby.members_size() < query.slots_available) {
+        return false;
+    }
+
+    if (query.filters.empty()) return true;
+
+    std::vector<bool> found(query.filters.size());
+    for (auto const &value : lobby.values()) {
+        auto indexes = query.filters_by_key.find(common_helpers::ascii_to_lowercase(value.first));
+        if (indexes == query.filters_by_key.end()) continue;
+
+        for (size_t i : indexes->second) {
+            if (found[i]) continue;
+            found[i] = true;
+            if (!lobby_filter_matches(query.filters[i], &value.second)) return false;
+        }
+    }
+
+    for (size_t i = 0; i < query.filters.size(); ++i) {
+        if (!found[i] && !lobby_filter_matches(query.filters[i], nullptr)) return false;
+    }
+
+    return true;
+}
+
+// the running search evaluates the lobby again on the next frame
+void Steam_Matchmaking::search_lobby_changed(uint64 room_id)
+{
+    if (searching) search_dirty.insert(room_id);
+}
+
+void Steam_Matchmaking::finish_lobby_search()
+{
+    struct Search_Result {
+        uint64 room_id;
+        std::vector<long long> distances;
+    };
+
+    std::vector<Search_Result> results{};
+    for (auto const &l : lobbies) {
+        if (!search_matches.count(l.room_id())) continue;
+
+        Search_Result result{ l.room_id(), {} };
+        for (auto const &near : search_query.near_filters) {
+            // lobbies without the key go last
+            long long distance = LLONG_MAX;
+            for (auto const &value : l.values()) {
+                long long lobby_value = 0;
+                if (common_helpers::ascii_to_lowercase(value.first) == near.key && parse_lobby_int(value.second, lobby_value)) {
+                    distance = std::llabs(lobby_value - near.value);
+                    break;
+                }
+            }
+
+            result.distances.push_back(distance);
+        }
+
+        results.push_back(std::move(result));
+    }
+
+    if (search_query.near_filters.size()) {
+        std::stable_sort(results.begin(), results.end(), [](const Search_Result &a, const Search_Result &b) {
+            return a.distances < b.distances;
+        });
+    }
+
+    if (results.size() > static_cast<size_t>(std::max(search_query.max_results, 0))) {
+        results.resize(static_cast<size_t>(std::max(search_query.max_results, 0)));
+    }
+
+    filtered_lobbies.clear();
+    for (auto const &result : results) {
+        filtered_lobbies.push_back((uint64)result.room_id);
+    }
+
+    PRINT_DEBUG("returning lobby search results, count=%zu", filtered_lobbies.size());
+    LobbyMatchList_t data{};
+    data.m_nLobbiesMatching = static_cast<uint32>(filtered_lobbies.size());
+    callback_results->addCallResult(search_call_api_id, data.k_iCallback, &data, sizeof(data));
+    callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
+    searching = false;
+    search_call_api_id = 0;
+    search_matches.clear();
+    search_dirty.clear();
+}
+
 void Steam_Matchmaking::send_lobby_data()
 {
     if (lobbies.size()) {
         PRINT_DEBUG("lobbies %zu", lobbies.size());
     }
 
+    auto searcher = std::begin(lobby_searchers);
+    while (searcher != std::end(lobby_searchers)) {
+        if (check_timedout(searcher->second, LOBBY_SEARCHER_TIMEOUT)) {
+            searcher = lobby_searchers.erase(searcher);
+        } else {
+            ++searcher;
+        }
+    }
+
+    // catch changes made without a trigger_lobby_dataupdate(), nothing is sent if there are none
     for(auto & l: lobbies) {
         if (get_lobby_member(&l, settings->get_local_steam_id()) && l.owner() == settings->get_local_steam_id().ConvertToUint64() && !l.deleted()) {
-            PRINT_DEBUG("lobby " "%" PRIu64 "", l.room_id());
-            Common_Message msg = Common_Message();
-            msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
-            msg.set_allocated_lobby(new Lobby(l));
-            network->sendToAllIndividuals(&msg, true);
+            sync_lobby(&l);
         }
     }
 }
 
+// returns true if anything changed, members_reordered is set if the order of the members which are in both can't be kept with a delta
+bool Steam_Matchmaking::make_lobby_delta(const Lobby &old_lobby, const Lobby &lobby, Lobby_Delta *delta, bool *members_reordered)
+{
+    bool changed = false;
+    *members_reordered = false;
+
+    for (auto const &value : lobby.values()) {
+        auto old_value = old_lobby.values().find(value.first);
+        if (old_value == old_lobby.values().end() || old_value->second != value.second) {
+            (*delta->mutable_values())[value.first] = value.second;
+            changed = true;
+        }
+    }
+
+    for (auto const &old_value : old_lobby.values()) {
+        if (!lobby.values().count(old_value.first)) {
+            delta->add_removed_values(old_value.first);
+            changed = true;
+        }
+    }
+
+    std::vector<uint64> kept_old_order{}, kept_new_order{};
+    for (auto const &member : lobby.members()) {
+        auto old_member = std::find_if(old_lobby.members().begin(), old_lobby.members().end(), [&member](Lobby_Member const &item) { return item.id() == member.id(); });
+        if (old_member == old_lobby.members().end()) {
+            Lobby_Delta_Member_Change *change = delta->add_members();
+            change->set_id(member.id());
+            *change->mutable_values() = member.values();
+            changed = true;
+            continue;
+        }
+
+        kept_new_order.push_back(member.id());
+        Lobby_Delta_Member_Change change{};
+        for (auto const &value : member.values()) {
+            auto old_value = old_member->values().find(value.first);
+            if (old_value == old_member->values().end() || old_value->second != value.second) {
+                (*change.mutable_values())[value.first] = value.second;
+            }
+        }
+
+        for (auto const &old_value : old_member->values()) {
+            if (!member.values().count(old_value.first)) change.add_removed_values(old_value.first);
+        }
+
+        if (change.values_size() || change.removed_values_size()) {
+            change.set_id(member.id());
+            *delta->add_members() = std::move(change);
+            changed = true;
+        }
+    }
+
+    for (auto const &old_member : old_lobby.members()) {
+        auto member = std::find_if(lobby.members().begin(), lobby.members().end(), [&old_member](Lobby_Member const &item) { return item.id() == old_member.id(); });
+        if (member == lobby.members().end()) {
+            delta->add_removed_members(old_member.id());
+            changed = true;
+        } else {
+            kept_old_order.push_back(old_member.id());
+        }
+    }
+
+    if (kept_old_order != kept_new_order) *members_reordered = true;
+
+    if (old_lobby.owner() != lobby.owner() ||
+        old_lobby.member_limit() != lobby.member_limit() ||
+        old_lobby.type() != lobby.type() ||
+        old_lobby.joinable() != lobby.joinable() ||
+        !protobuf_message_equal(old_lobby.gameserver(), lobby.gameserver())) {
+        changed = true;
+    }
+
+    delta->set_room_id(lobby.room_id());
+    delta->set_owner(lobby.owner());
+    delta->set_appid(lobby.appid());
+    *delta->mutable_gameserver() = lobby.gameserver();
+    delta->set_member_limit(lobby.member_limit());
+    delta->set_type(lobby.type());
+    delta->set_joinable(lobby.joinable());
+    return changed;
+}
+
+void Steam_Matchmaking::apply_lobby_delta(Lobby *lobby, const Lobby_Delta &delta)
+{
+    for (auto const &value : delta.values()) {
+        (*lobby->mutable_values())[value.first] = value.second;
+    }
+
+    for (auto const &key : delta.removed_values()) {
+        lobby->mutable_values()->erase(key);
+    }
+
+    for (auto id : delta.removed_members()) {
+        leave_lobby(lobby, (uint64)id);
+    }
+
+    for (auto const &change : delta.members()) {
+        Lobby_Member *member = get_lobby_member(lobby, (uint64)change.id());
+        if (!member) {
+            member = lobby->add_members();
+            member->set_id(change.id());
+        }
+
+        for (auto const &value : change.values()) {
+            (*member->mutable_values())[value.first] = value.second;
+        }
+
+        for (auto const &key : change.removed_values()) {
+            member->mutable_values()->erase(key);
+        }
+    }
+
+    lobby->set_owner(delta.owner());
+    lobby->set_appid(delta.appid());
+    *lobby->mutable_gameserver() = delta.gameserver();
+    lobby->set_member_limit(delta.member_limit());
+    lobby->set_type(delta.type());
+    lobby->set_joinable(delta.joinable());
+    lobby->set_version(delta.version());
+}
+
+// sends the changes of an owned lobby to its members and to the peers searching for lobbies
+void Steam_Matchmaking::sync_lobby(Lobby *lobby)
+{
+    uint64 room_id = lobby->room_id();
+    search_lobby_changed(room_id);
+    if (lobby->owner() != settings->get_local_steam_id().ConvertToUint64() || lobby->deleted()) {
+        lobby_synced_state.erase(room_id);
+        return;
+    }
+
+    auto synced = lobby_synced_state.find(room_id);
+    Lobby_Delta *delta = new Lobby_Delta();
+    bool members_reordered = false;
+    if (synced != lobby_synced_state.end() && !make_lobby_delta(synced->second, *lobby, delta, &members_reordered)) {
+        delete delta;
+        return;
+    }
+
+    lobby->set_version(lobby->version() + 1);
+    // peers without the previous state get the whole lobby
+    bool send_snapshots = synced == lobby_synced_state.end() || members_reordered;
+
+    Common_Message msg;
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    if (!send_snapshots) {
+        delta->set_base_version(synced->second.version());
+        delta->set_version(lobby->version());
+        msg.set_allocated_lobby_delta(delta);
+    } else {
+        delete delta;
+    }
+
+    std::set<uint64> recipients{};
+    for (auto const &member : lobby->members()) {
+        if (member.id() != settings->get_local_steam_id().ConvertToUint64()) recipients.insert(member.id());
+    }
+
+    for (auto const &searcher : lobby_searchers) {
+        recipients.insert(searcher.first);
+    }
+
+    PRINT_DEBUG("lobby %llu version %llu to %zu peers, snapshot %u", room_id, lobby->version(), recipients.size(), (unsigned)send_snapshots);
+    for (auto id : recipients) {
+        bool new_member = !send_snapshots && get_lobby_member(lobby, (uint64)id) && !get_lobby_member(&synced->second, (uint64)id);
+        if (send_snapshots || new_member) {
+            send_lobby_snapshot(*lobby, (uint64)id);
+        } else {
+            msg.set_dest_id(id);
+            network->sendTo(&msg, true);
+        }
+    }
+
+    lobby_synced_state[room_id] = *lobby;
+}
+
+void Steam_Matchmaking::send_lobby_snapshot(const Lobby &lobby, CSteamID dest)
+{
+    Common_Message msg;
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    msg.set_dest_id(dest.ConvertToUint64());
+    msg.set_allocated_lobby(new Lobby(lobby));
+    network->sendTo(std::move(msg), true);
+}
+
+// owner can be nil if we don't know it yet, the request is broadcasted then
+void Steam_Matchmaking::request_lobby_snapshot(CSteamID lobby_id, CSteamID owner)
+{
+    auto last = lobby_snapshot_requests.find(lobby_id.ConvertToUint64());
+    if (last != lobby_snapshot_requests.end() && !check_timedout(last->second, LOBBY_SNAPSHOT_REQUEST_INTERVAL)) return;
+    lobby_snapshot_requests[lobby_id.ConvertToUint64()] = std::chrono::high_resolution_clock::now();
+
+    PRINT_DEBUG("lobby %llu owner %llu", lobby_id.ConvertToUint64(), owner.ConvertToUint64());
+    Common_Message msg;
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    Lobby_Messages *message = new Lobby_Messages();
+    message->set_type(Lobby_Messages::SNAPSHOT_REQUEST);
+    message->set_id(lobby_id.ConvertToUint64());
+    msg.set_allocated_lobby_messages(message);
+    if (owner == k_steamIDNil) {
+        network->sendToAllIndividuals(&msg, true);
+    } else {
+        msg.set_dest_id(owner.ConvertToUint64());
+        network->sendTo(&msg, true);
+    }
+}
+
 void Steam_Matchmaking::trigger_lobby_dataupdate(CSteamID lobby, CSteamID member, bool success, double cb_timeout, bool send_changed_lobby)
 {
     PRINT_DEBUG("%llu %llu", lobby.ConvertToUint64(), member.ConvertToUint64());
@@ -91,11 +450,8 @@ void Steam_Matchmaking::trigger_lobby_dataupdate(CSteamID lobby, CSteamID member
     Lobby *l = get_lobby(lobby);
     if (l && l->owner() == settings->get_local_steam_id().ConvertToUint64()) {
         if (send_changed_lobby) {
-            PRINT_DEBUG("resending new data");
-            Common_Message msg = Common_Message();
-            msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
-            msg.set_allocated_lobby(new Lobby(*l));
-            network->sendToAllIndividuals(&msg, true);
+            PRINT_DEBUG("sending changes");
+            sync_lobby(l);
         }
     }
 }
@@ -266,9 +622,10 @@ Steam_Matchmaking::Steam_Matchmaking(class Settings *settings, class Local_Stora
     this->callbacks = callbacks;
     this->run_every_runcb = run_every_runcb;
     
-    this->filter_max_results = FILTER_MAX_DEFAULT;
+    pending_query.max_results = FILTER_MAX_DEFAULT;
     search_call_api_id = 0;
     searching = false;
+    started = std::chrono::high_resolution_clock::now();
 
     this->network->setCallback(CALLBACK_ID_LOBBY, settings->get_local_steam_id(), &Steam_Matchmaking::steam_matchmaking_callback, this);
     this->network->setCallback(CALLBACK_ID_USER_STATUS, settings->get_local_steam_id(), &Steam_Matchmaking::steam_matchmaking_callback, this);
@@ -475,13 +832,30 @@ SteamAPICall_t Steam_Matchmaking::RequestLobbyList()
 
     filtered_lobbies.clear();
     lobby_last_search = std::chrono::high_resolution_clock::now();
-    filter_values_copy = filter_values;
-    filter_max_results_copy = filter_max_results;
-    filter_values.clear();
-    filter_max_results = FILTER_MAX_DEFAULT;
+    double uptime = std::chrono::duration<double>(lobby_last_search - started).count();
+    search_timeout = std::max(LOBBY_SEARCH_TIMEOUT, LOBBY_SEARCH_STARTUP_WAIT - uptime);
+    search_query = std::move(pending_query);
+    pending_query = Lobby_Query{};
+    pending_query.max_results = FILTER_MAX_DEFAULT;
     searching = true;
+
+    // every known lobby is evaluated once, after that only the ones that change
+    search_matches.clear();
+    search_dirty.clear();
+    for (auto const &l : lobbies) {
+        search_dirty.insert(l.room_id());
+    }
+
     if (search_call_api_id) callback_results->rmCallBack(search_call_api_id, NULL);
     search_call_api_id = callback_results->reserveCallResult();
+
+    // lobby owners reply with their lobbies and keep us updated for a while
+    Common_Message msg;
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    Lobby_Messages *message = new Lobby_Messages();
+    message->set_type(Lobby_Messages::SEARCH);
+    msg.set_allocated_lobby_messages(message);
+    network->sendToAllIndividuals(&msg, true);
     
     return search_call_api_id;
 }
@@ -499,13 +873,16 @@ void Steam_Matchmaking::AddRequestLobbyListStringFilter( const char *pchKeyToMat
     PRINT_DEBUG("'%s'=='%s' %i", pchKeyToMatch, pchValueToMatch, eComparisonType);
     if (!pchValueToMatch) return;
 
+    if (!pchKeyToMatch) return;
+
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     struct Filter_Values fv;
-    fv.key = std::string(pchKeyToMatch);
+    fv.key = common_helpers::ascii_to_lowercase(pchKeyToMatch);
     fv.value_string = std::string(pchValueToMatch);
     fv.is_int = false;
     fv.eComparisonType = eComparisonType;
-    filter_values.push_back(fv);
+    pending_query.filters_by_key[fv.key].push_back(pending_query.filters.size());
+    pending_query.filters.push_back(fv);
 
 }
 
@@ -513,13 +890,16 @@ void Steam_Matchmaking::AddRequestLobbyListStringFilter( const char *pchKeyToMat
 void Steam_Matchmaking::AddRequestLobbyListNumericalFilter( const char *pchKeyToMatch, int nValueToMatch, ELobbyComparison eComparisonType )
 {
     PRINT_DEBUG("'%s'==%i %i", pchKeyToMatch, nValueToMatch, eComparisonType);
+    if (!pchKeyToMatch) return;
+
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     struct Filter_Values fv;
-    fv.key = std::string(pchKeyToMatch);
+    fv.key = common_helpers::ascii_to_lowercase(pchKeyToMatch);
     fv.value_int = nValueToMatch;
     fv.is_int = true;
     fv.eComparisonType = eComparisonType;
-    filter_values.push_back(fv);
+    pending_query.filters_by_key[fv.key].push_back(pending_query.filters.size());
+    pending_query.filters.push_back(fv);
 
 }
 
@@ -527,9 +907,13 @@ void Steam_Matchmaking::AddRequestLobbyListNumericalFilter( const char *pchKeyTo
 void Steam_Matchmaking::AddRequestLobbyListNearValueFilter( const char *pchKeyToMatch, int nValueToBeCloseTo )
 {
     PRINT_DEBUG("'%s'==%u", pchKeyToMatch, nValueToBeCloseTo);
-    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    if (!pchKeyToMatch) return;
 
-    
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    struct Near_Filter nf;
+    nf.key = common_helpers::ascii_to_lowercase(pchKeyToMatch);
+    nf.value = nValueToBeCloseTo;
+    pending_query.near_filters.push_back(nf);
 }
 
 // returns only lobbies with the specified number of slots available
@@ -537,8 +921,7 @@ void Steam_Matchmaking::AddRequestLobbyListFilterSlotsAvailable( int nSlotsAvail
 {
     PRINT_DEBUG("%i", nSlotsAvailable);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-
-    
+    pending_query.slots_available = nSlotsAvailable;
 }
 
 // sets the distance for which we should search for lobbies (based on users IP address to location map on the Steam backed)
@@ -546,8 +929,7 @@ void Steam_Matchmaking::AddRequestLobbyListDistanceFilter( ELobbyDistanceFilter
 {
     PRINT_DEBUG("%i", eLobbyDistanceFilter);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-
-    
+    pending_query.distance = eLobbyDistanceFilter;
 }
 
 // sets how many results to return, the lower the count the faster it is to download the lobby results & details to the client
@@ -555,8 +937,8 @@ void Steam_Matchmaking::AddRequestLobbyListResultCountFilter( int cMaxResults )
 {
     PRINT_DEBUG("%i", cMaxResults);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    filter_max_results = cMaxResults;
-    
+    pending_query.max_results = cMaxResults;
+
 }
 
 
@@ -580,9 +962,7 @@ void Steam_Matchmaking::AddRequestLobbyListNumericalFilter( const char *pchKeyTo
 
 void Steam_Matchmaking::AddRequestLobbyListSlotsAvailableFilter()
 {
-    PRINT_DEBUG_TODO();
-    std::lock_guard<std::recursive_mutex> lock(global_mutex);
-
+    AddRequestLobbyListFilterSlotsAvailable(1);
 }
 
 // returns the CSteamID of a lobby, as retrieved by a RequestLobbyList call
@@ -709,6 +1089,7 @@ void Steam_Matchmaking::LeaveLobby( CSteamID steamIDLobby )
                 } else {
                     send_clients_packet(steamIDLobby, message);
                     lobby->set_deleted(true);
+                    search_lobby_changed(lobby->room_id());
                     lobby->set_time_deleted(std::chrono::duration_cast<std::chrono::duration<uint64>>(std::chrono::system_clock::now().time_since_epoch()).count());
                 }
             }
@@ -1005,14 +1386,21 @@ int Steam_Matchmaking::GetLobbyChatEntry( CSteamID steamIDLobby, int iChatID, ST
 {
     PRINT_DEBUG("%llu %i %p %p %i %p", steamIDLobby.ConvertToUint64(), iChatID, pSteamIDUser, pvData, cubData, peChatEntryType);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    if (iChatID < 0 || cubData < 0 || static_cast<size_t>(iChatID) >= chat_entries.size()) return 0;
-    if (chat_entries[iChatID].lobby_id != steamIDLobby) return 0;
-    if (pSteamIDUser) *pSteamIDUser = chat_entries[iChatID].user_id;
-    if (peChatEntryType) *peChatEntryType = chat_entries[iChatID].type;
+    if (iChatID < 0 || cubData < 0) return 0;
+
+    auto history = chat_history.find(steamIDLobby.ConvertToUint64());
+    if (history == chat_history.end() || history->second.entries.empty()) return 0;
+
+    // ids that were overwritten by newer messages don't match their slot anymore
+    auto &entry = history->second.entries[static_cast<size_t>(iChatID) % history->second.entries.size()];
+    if (entry.id != iChatID) return 0;
+
+    if (pSteamIDUser) *pSteamIDUser = entry.user_id;
+    if (peChatEntryType) *peChatEntryType = entry.type;
     if (pvData) {
-        if (chat_entries[iChatID].message.size() <= static_cast<size_t>(cubData)) {
-            cubData = static_cast<int>(chat_entries[iChatID].message.size());
-            memcpy(pvData, chat_entries[iChatID].message.data(), cubData);
+        if (entry.message.size() <= static_cast<size_t>(cubData)) {
+            cubData = static_cast<int>(entry.message.size());
+            memcpy(pvData, entry.message.data(), cubData);
             PRINT_DEBUG("  Returned chat of len: %i", cubData);
             return cubData;
         }
@@ -1038,6 +1426,14 @@ bool Steam_Matchmaking::RequestLobbyData( CSteamID steamIDLobby )
     requested.lobby_id = steamIDLobby;
     requested.requested = std::chrono::high_resolution_clock::now();
     data_requested.push_back(requested);
+
+    Lobby *lobby = get_lobby(steamIDLobby);
+    if (!lobby) {
+        request_lobby_snapshot(steamIDLobby, k_steamIDNil);
+    } else if (lobby->owner() != settings->get_local_steam_id().ConvertToUint64()) {
+        request_lobby_snapshot(steamIDLobby, (uint64)lobby->owner());
+    }
+
     return true;
 }
 
@@ -1250,6 +1646,10 @@ void Steam_Matchmaking::remove_lobbies()
         if (g->members().size() == 0 || (g->deleted() && (g->time_deleted() + LOBBY_DELETED_TIMEOUT < current_time))) {
             PRINT_DEBUG("LOBBY " "%" PRIu64 "", g->room_id());
             self_lobby_member_data.erase(g->room_id());
+            lobby_synced_state.erase(g->room_id());
+            lobby_snapshot_requests.erase(g->room_id());
+            search_matches.erase(g->room_id());
+            chat_history.erase(g->room_id());
             g = lobbies.erase(g);
         } else {
             ++g;
@@ -1272,6 +1672,7 @@ void Steam_Matchmaking::create_pending_lobbies()
             lobby.set_appid(settings->get_local_game_id().AppID());
             add_member_to_lobby(&lobby, settings->get_local_steam_id());
             lobbies.push_back(lobby);
+            search_lobby_changed(lobby.room_id());
 
             if (settings->disable_lobby_creation) {
                 LobbyCreated_t data;
@@ -1324,90 +1725,39 @@ void Steam_Matchmaking::RunCallbacks()
 {
     run_background();
 
-    if (searching) {
-        PRINT_DEBUG("for lobbies %zu", lobbies.size());
-        for(auto & l: lobbies) {
-            bool use = l.joinable() && (l.type() == k_ELobbyTypePublic || l.type() == k_ELobbyTypeInvisible || l.type() == k_ELobbyTypeFriendsOnly) && !l.deleted();
-            PRINT_DEBUG("use lobby: %u, filters: %zu, joinable: %u, type: %u, deleted: %u", use, filter_values_copy.size(), l.joinable(), l.type(), l.deleted());
-            for (auto & f : filter_values_copy) {
-                PRINT_DEBUG("'%s':'%s'/%i %u %i", f.key.c_str(), f.value_string.c_str(), f.value_int, f.is_int, f.eComparisonType);
-                auto value = caseinsensitive_find(l.values(), f.key);
-                if (value != l.values().end()) {
-                    //TODO: eComparisonType
-                    if (!f.is_int) {
-                        PRINT_DEBUG("Compare Values %s %s", value->second.c_str(), f.value_string.c_str());
-                        if (f.eComparisonType == k_ELobbyComparisonEqual) {
-                            if (value->second == f.value_string) {
-                                PRINT_DEBUG("Equal (non-int)");
-                                //use = use;
-                            } else {
-                                PRINT_DEBUG("Not Equal (non-int)");
-                                use = false;
-                            }
-                        } else {
-                            PRINT_DEBUG("TODO UNSUPPORTED compare type (non-int) %i", (int)f.eComparisonType);
-                        }
-                    } else {
-                        try {
-                            PRINT_DEBUG("%s", value->second.c_str());
-                            int compare_to = 0;
-                            //TODO: check if this is how real steam behaves
-                            if (value->second.size()) {
-                                compare_to = static_cast<int>(std::stoll(value->second, 0, 0));
-                            }
-                            PRINT_DEBUG("Compare Values %i %i", compare_to, f.value_int);
-                            if (f.eComparisonType == k_ELobbyComparisonEqual) {
-                                if (compare_to == f.value_int) {
-                                    PRINT_DEBUG("Equal (int)");
-                                    //use = use;
-                                } else {
-                                    PRINT_DEBUG("Not Equal (int)");
-                                    use = false;
-                                }
-                            } else {
-                                PRINT_DEBUG("TODO UNSUPPORTED compare type (int) %i", (int)f.eComparisonType);
-                            }
-                        } catch (...) {
-                            //Same case as if the key is not in the lobby?
-                            use = false;
-                        }
-                        //TODO: add more comparisons
-                    }
-                } else {
-                    PRINT_DEBUG("Compare Key not in lobby");
-                    if (f.eComparisonType == k_ELobbyComparisonEqual) {
-                        //If the key is not in the lobby do we take it into account?
-                        use = false;
-                    }
-                }
-            }
+    if (searching && search_dirty.size()) {
+        PRINT_DEBUG("evaluating %zu of %zu lobbies, filters: %zu", search_dirty.size(), lobbies.size(), search_query.filters.size());
+        for (auto const &l : lobbies) {
+            if (!search_dirty.count(l.room_id())) continue;
 
+            bool use = lobby_matches_query(l, search_query);
             PRINT_DEBUG("Lobby " "%" PRIu64 " use %u", l.room_id(), use);
-            if (use) PUSH_BACK_IF_NOT_IN(filtered_lobbies, (uint64)l.room_id());
-            if (filtered_lobbies.size() >= static_cast<size_t>(filter_max_results_copy)) {
-                PRINT_DEBUG("returning lobby search results, count=%zu", filtered_lobbies.size());
-                searching = false;
-                LobbyMatchList_t data{};
-                data.m_nLobbiesMatching = static_cast<uint32>(filtered_lobbies.size());
-                callback_results->addCallResult(search_call_api_id, data.k_iCallback, &data, sizeof(data));
-                callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
-                search_call_api_id = 0;
+            if (use) {
+                search_matches.insert(l.room_id());
+            } else {
+                search_matches.erase(l.room_id());
             }
         }
+
+        search_dirty.clear();
+        // results closest to the near values can only be picked once every lobby had the time to reply
+        if (search_query.near_filters.empty() && search_matches.size() >= static_cast<size_t>(std::max(search_query.max_results, 0))) {
+            finish_lobby_search();
+        }
     }
 
-    if (searching && check_timedout(lobby_last_search, LOBBY_SEARCH_TIMEOUT)) {
-        PRINT_DEBUG("LOBBY_SEARCH_TIMEOUT %zu", filtered_lobbies.size());
-        LobbyMatchList_t data{};
-        data.m_nLobbiesMatching = static_cast<uint32>(filtered_lobbies.size());
-        callback_results->addCallResult(search_call_api_id, data.k_iCallback, &data, sizeof(data));
-        callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
-        searching = false;
-        search_call_api_id = 0;
+    if (searching && check_timedout(lobby_last_search, search_timeout)) {
+        PRINT_DEBUG("LOBBY_SEARCH_TIMEOUT %zu", search_matches.size());
+        finish_lobby_search();
     }
 
     auto g = std::begin(pending_joins);
     while (g != std::end(pending_joins)) {
+        if (!get_lobby(g->lobby_id)) {
+            // the owner isn't known until we have the lobby
+            request_lobby_snapshot(g->lobby_id, k_steamIDNil);
+        }
+
         if (!g->message_sent) {
             PRINT_DEBUG("resending join lobby");
             Lobby_Messages *message = new Lobby_Messages();
@@ -1467,100 +1817,152 @@ void Steam_Matchmaking::RunCallbacks()
             continue;
         }
 
+        request_lobby_snapshot(dr->lobby_id, k_steamIDNil);
+
         ++dr;
     }
 }
 
 
+// stores a chat message of a lobby we are in and returns its id
+int Steam_Matchmaking::add_chat_entry(struct Chat_Entry &&entry)
+{
+    auto &history = chat_history[entry.lobby_id.ConvertToUint64()];
+    if (history.entries.empty()) history.entries.resize(std::max(settings->lobby_chat_history_size, (uint32)1));
 
-void Steam_Matchmaking::Callback(Common_Message *msg)
+    int id = history.next_id;
+    history.next_id = history.next_id == INT_MAX ? 0 : history.next_id + 1;
+    entry.id = id;
+    history.entries[static_cast<size_t>(id) % history.entries.size()] = std::move(entry);
+    return id;
+}
+
+// a whole lobby from its owner, either sent as is or rebuilt from a delta
+void Steam_Matchmaking::on_lobby_received(Lobby *new_lobby)
 {
-    if (msg->has_lobby()) {
-        PRINT_DEBUG("GOT A LOBBY appid: %u " "%" PRIu64 "", msg->lobby().appid(), msg->lobby().owner());
-        if (msg->lobby().owner() != settings->get_local_steam_id().ConvertToUint64() && msg->lobby().appid() == settings->get_local_game_id().AppID()) {
-            Lobby *lobby = get_lobby((uint64)msg->lobby().room_id());
-            if (!lobby) {
-                size_t old_size = lobbies.size();
-                lobbies.resize(old_size + 1);
-                lobbies[old_size].set_room_id(msg->lobby().room_id());
-                lobby = &(lobbies[old_size]);
-            }
+    search_lobby_changed(new_lobby->room_id());
+    Lobby *lobby = get_lobby((uint64)new_lobby->room_id());
+    if (!lobby) {
+        size_t old_size = lobbies.size();
+        lobbies.resize(old_size + 1);
+        lobbies[old_size].set_room_id(new_lobby->room_id());
+        lobby = &(lobbies[old_size]);
+    }
 
-            if (!lobby->deleted()) {
-                if (!protobuf_message_equal(*lobby, msg->lobby())) {
-                    bool we_are_in_lobby = !!get_lobby_member(lobby, settings->get_local_steam_id());
-                    if (we_are_in_lobby) trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
+    if (!lobby->deleted()) {
+        // late snapshot, we already applied newer changes from the same owner
+        if (lobby->owner() == new_lobby->owner() && new_lobby->version() < lobby->version()) return;
+        lobby->set_version(new_lobby->version());
 
-                    for (auto & m : lobby->members()) {
-                        int count = 0;
-                        Lobby_Member *member = get_lobby_member(msg->mutable_lobby(), (uint64)m.id());
+        if (!protobuf_message_equal(*lobby, *new_lobby)) {
+            bool we_are_in_lobby = !!get_lobby_member(lobby, settings->get_local_steam_id());
+            if (we_are_in_lobby) trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
 
-                        if (we_are_in_lobby) {
-                            if (!member) {
-                                trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)m.id(), true, true, 0.2);
-                            } else if (!protobuf_message_equal(*member, m)) {
-                                trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)m.id(), true);
-                            }
-                        }
+            for (auto & m : lobby->members()) {
+                int count = 0;
+                Lobby_Member *member = get_lobby_member(new_lobby, (uint64)m.id());
+
+                if (we_are_in_lobby) {
+                    if (!member) {
+                        trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)m.id(), true, true, 0.2);
+                    } else if (!protobuf_message_equal(*member, m)) {
+                        trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)m.id(), true);
                     }
+                }
+            }
 
-                    bool joined = false;
-                    for (auto & m : msg->lobby().members()) {
-                        Lobby_Member *member = get_lobby_member(lobby, (uint64)m.id());
-                        if (!member) {
-                            if (m.id() == settings->get_local_steam_id().ConvertToUint64()) {
-                                CSteamID id((uint64)lobby->room_id());
-                                auto pd = pending_joins.begin();
-                                while (pd != pending_joins.end()) {
-                                    if (pd->lobby_id == id) {
-                                        bool success = true;
-                                        LobbyEnter_t data;
-                                        data.m_ulSteamIDLobby = lobby->room_id();
-                                        data.m_rgfChatPermissions = 0; //Unused - Always 0
-                                        data.m_bLocked = false;
-                                        data.m_EChatRoomEnterResponse = success ? k_EChatRoomEnterResponseSuccess : k_EChatRoomEnterResponseError;
-                                        callback_results->addCallResult(pd->api_id, data.k_iCallback, &data, sizeof(data));
-                                        callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
-                                        pd = pending_joins.erase(pd);
-                                        joined = true;
-                                    } else {
-                                        ++pd;
-                                    }
-                                }
-                                if (joined) {
-                                    on_self_enter_leave_lobby((uint64)lobby->room_id(), lobby->type(), false);
-                                    trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
-                                }
+            bool joined = false;
+            for (auto & m : new_lobby->members()) {
+                Lobby_Member *member = get_lobby_member(lobby, (uint64)m.id());
+                if (!member) {
+                    if (m.id() == settings->get_local_steam_id().ConvertToUint64()) {
+                        CSteamID id((uint64)lobby->room_id());
+                        auto pd = pending_joins.begin();
+                        while (pd != pending_joins.end()) {
+                            if (pd->lobby_id == id) {
+                                bool success = true;
+                                LobbyEnter_t data;
+                                data.m_ulSteamIDLobby = lobby->room_id();
+                                data.m_rgfChatPermissions = 0; //Unused - Always 0
+                                data.m_bLocked = false;
+                                data.m_EChatRoomEnterResponse = success ? k_EChatRoomEnterResponseSuccess : k_EChatRoomEnterResponseError;
+                                callback_results->addCallResult(pd->api_id, data.k_iCallback, &data, sizeof(data));
+                                callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
+                                pd = pending_joins.erase(pd);
+                                joined = true;
                             } else {
-                                if (we_are_in_lobby) trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)m.id(), false, true);
+                                ++pd;
                             }
                         }
+                        if (joined) {
+                            on_self_enter_leave_lobby((uint64)lobby->room_id(), lobby->type(), false);
+                            trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
+                        }
+                    } else {
+                        if (we_are_in_lobby) trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)m.id(), false, true);
                     }
+                }
+            }
 
-                    if (joined) {
-                        for (auto & m : msg->lobby().members()) {
-                            if (m.id() != settings->get_local_steam_id().ConvertToUint64()) {
-                                //TODO: is this good?
-                                //trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)m.id(), false, true);
-                                if (m.values().size()) {
-                                    //TODO: check if this is what steam does
-                                    //trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)m.id(), true);
-                                }
-                            }
+            if (joined) {
+                for (auto & m : new_lobby->members()) {
+                    if (m.id() != settings->get_local_steam_id().ConvertToUint64()) {
+                        //TODO: is this good?
+                        //trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)m.id(), false, true);
+                        if (m.values().size()) {
+                            //TODO: check if this is what steam does
+                            //trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)m.id(), true);
                         }
                     }
+                }
+            }
 
-                    if ((joined && msg->lobby().gameserver().num_update()) || (we_are_in_lobby && (lobby->gameserver().num_update() != msg->lobby().gameserver().num_update()))) {
-                        send_gameservercreated_cb(lobby->room_id(), msg->lobby().gameserver().id(), msg->lobby().gameserver().ip(), msg->lobby().gameserver().port());
-                        trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
-                    }
+            if ((joined && new_lobby->gameserver().num_update()) || (we_are_in_lobby && (lobby->gameserver().num_update() != new_lobby->gameserver().num_update()))) {
+                send_gameservercreated_cb(lobby->room_id(), new_lobby->gameserver().id(), new_lobby->gameserver().ip(), new_lobby->gameserver().port());
+                trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
+            }
 
-                    *lobby = msg->lobby();
-                }
+            *lobby = *new_lobby;
+        }
+    }
+}
+
+void Steam_Matchmaking::Callback(Common_Message *msg)
+{
+    if (msg->has_lobby()) {
+        PRINT_DEBUG("GOT A LOBBY appid: %u " "%" PRIu64 "", msg->lobby().appid(), msg->lobby().owner());
+        if (msg->lobby().owner() != settings->get_local_steam_id().ConvertToUint64() && msg->lobby().appid() == settings->get_local_game_id().AppID()) {
+            on_lobby_received(msg->mutable_lobby());
+        }
+    }
+
+    if (msg->has_lobby_delta()) {
+        const Lobby_Delta &delta = msg->lobby_delta();
+        PRINT_DEBUG("GOT A LOBBY DELTA %llu version %llu -> %llu", (uint64)delta.room_id(), (uint64)delta.base_version(), (uint64)delta.version());
+        if (delta.owner() != settings->get_local_steam_id().ConvertToUint64() && delta.appid() == settings->get_local_game_id().AppID()) {
+            Lobby *lobby = get_lobby((uint64)delta.room_id());
+            if (!lobby || lobby->version() != delta.base_version()) {
+                // we missed a change, the delta is useless without the state it was made against
+                request_lobby_snapshot((uint64)delta.room_id(), (uint64)msg->source_id());
+            } else if (!lobby->deleted()) {
+                Lobby new_lobby = *lobby;
+                apply_lobby_delta(&new_lobby, delta);
+                on_lobby_received(&new_lobby);
             }
         }
     }
 
+    if (msg->has_lobby_messages() && msg->lobby_messages().type() == Lobby_Messages::SEARCH) {
+        PRINT_DEBUG("LOBBY MESSAGE: SEARCH from=%llu", (uint64)msg->source_id());
+        // pending changes go out first so the snapshots below are the synced state
+        send_lobby_data();
+        lobby_searchers[msg->source_id()] = std::chrono::high_resolution_clock::now();
+        for (auto & l: lobbies) {
+            if (get_lobby_member(&l, settings->get_local_steam_id()) && l.owner() == settings->get_local_steam_id().ConvertToUint64() && !l.deleted()) {
+                send_lobby_snapshot(l, (uint64)msg->source_id());
+            }
+        }
+    }
 
     if (msg->has_lobby_messages()) {
         PRINT_DEBUG("LOBBY MESSAGE %u " "%" PRIu64 "", msg->lobby_messages().type(), msg->lobby_messages().id());
@@ -1568,6 +1970,12 @@ void Steam_Matchmaking::Callback(Common_Message *msg)
         if (lobby && !lobby->deleted()) {
             bool we_are_in_lobby = !!get_lobby_member(lobby, settings->get_local_steam_id());
             if (lobby->owner() == settings->get_local_steam_id().ConvertToUint64()) {
+                if (msg->lobby_messages().type() == Lobby_Messages::SNAPSHOT_REQUEST) {
+                    PRINT_DEBUG("LOBBY MESSAGE: SNAPSHOT_REQUEST, lobby=%llu from=%llu", (uint64)lobby->room_id(), (uint64)msg->source_id());
+                    sync_lobby(lobby);
+                    send_lobby_snapshot(*lobby, (uint64)msg->source_id());
+                }
+
                 if (msg->lobby_messages().type() == Lobby_Messages::JOIN) {
                     PRINT_DEBUG("LOBBY MESSAGE: JOIN, lobby=%llu from=%llu", (uint64)lobby->room_id(), (uint64)msg->source_id());
                     if (add_member_to_lobby(lobby, (uint64)msg->source_id())) {
@@ -1618,8 +2026,7 @@ void Steam_Matchmaking::Callback(Common_Message *msg)
                     data.m_ulSteamIDLobby = msg->lobby_messages().id();
                     data.m_ulSteamIDUser = msg->source_id();
                     data.m_eChatEntryType = entry.type;
-                    data.m_iChatID = static_cast<uint32>(chat_entries.size());
-                    chat_entries.push_back(entry);
+                    data.m_iChatID = static_cast<uint32>(add_chat_entry(std::move(entry)));
                     callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
                 }
             }
@@ -1628,7 +2035,26 @@ void Steam_Matchmaking::Callback(Common_Message *msg)
 
     if (msg->has_low_level()) {
         if (msg->low_level().type() == Low_Level::CONNECT) {
-            
+            // the peer missed our search and the snapshots of our lobbies, it only gets them now
+            for (auto &l : lobbies) {
+                if (l.owner() == settings->get_local_steam_id().ConvertToUint64() && !l.deleted()) {
+                    send_lobby_snapshot(l, (uint64)msg->source_id());
+                }
+            }
+
+            if (searching) {
+                Common_Message search_msg;
+                search_msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+                search_msg.set_dest_id(msg->source_id());
+                Lobby_Messages *message = new Lobby_Messages();
+                message->set_type(Lobby_Messages::SEARCH);
+                search_msg.set_allocated_lobby_messages(message);
+                network->sendTo(&search_msg, true);
+
+                // give its reply the same time the others had
+                double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - lobby_last_search).count();
+                search_timeout = std::min(std::max(search_timeout, elapsed + LOBBY_SEARCH_TIMEOUT), LOBBY_SEARCH_MAX_TIMEOUT);
+            }
         }
 
         if (msg->low_level().type() == Low_Level::DISCONNECT) {
@@ -18,9 +18,69 @@
 #include "dll/dll.h"
 
 #define SERVER_TIMEOUT 10.0
+// how long a server list request waits for the LAN gameservers we only got heartbeats from
+#define SERVER_LIST_WAIT 1.0
+// results reported to the game per frame, the rest is left for the next frames
+#define SERVER_LIST_REPORTS_PER_FRAME 32
+#define SERVER_LIST_FRAME_BUDGET 0.002
 #define DIRECT_IP_DELAY 0.05
+// artificial latency given when we don't know the real one
+#define MIN_LATENCY 2
 
 
+static uint64 gameserver_address(uint32 ip, uint16 query_port)
+{
+    return (static_cast<uint64>(ip) << 16) | query_port;
+}
+
+static uint16 gameserver_query_port(Gameserver const& server)
+{
+    uint16 query_port = server.query_port();
+    if (query_port == 0xFFFF) {
+        query_port = server.port();
+    }
+
+    return query_port;
+}
+
+static void gameserver_to_item(const Gameserver *g, gameserveritem_t *server, int latency)
+{
+    server->m_NetAdr.Init(g->ip(), gameserver_query_port(*g), g->port());
+    server->m_nPing = latency;
+    server->m_bHadSuccessfulResponse = true;
+    server->m_bDoNotRefresh = false;
+
+    server->m_nAppID = g->appid();
+    server->m_nPlayers = g->num_players();
+    server->m_nMaxPlayers = g->max_player_count();
+    server->m_nBotPlayers = g->bot_player_count();
+    server->m_bPassword = g->password_protected();
+    server->m_bSecure = g->secure();
+    server->m_ulTimeLastPlayed = 0;
+    server->m_nServerVersion = g->version();
+    server->SetName(g->server_name().c_str());
+    server->m_steamID = CSteamID((uint64)g->id());
+    
+    memset(server->m_szGameDir, 0, sizeof(server->m_szGameDir));
+    g->mod_dir().copy(server->m_szGameDir, sizeof(server->m_szGameDir) - 1);
+
+    memset(server->m_szMap, 0, sizeof(server->m_szMap));
+    g->map_name().copy(server->m_szMap, sizeof(server->m_szMap) - 1);
+
+    memset(server->m_szGameDescription, 0, sizeof(server->m_szGameDescription));
+    g->game_description().copy(server->m_szGameDescription, sizeof(server->m_szGameDescription) - 1);
+
+    memset(server->m_szGameTags, 0, sizeof(server->m_szGameTags));
+    g->tags().copy(server->m_szGameTags, sizeof(server->m_szGameTags) - 1);
+}
+
+static A2S_Query_Type direct_ip_query_type(const Steam_Matchmaking_Servers_Direct_IP_Request &r)
+{
+    if (r.rules_response) return A2S_QUERY_RULES;
+    if (r.players_response) return A2S_QUERY_PLAYERS;
+    return A2S_QUERY_INFO;
+}
+
 static HServerQuery new_server_query()
 {
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
@@ -79,10 +139,14 @@ HServerListRequest Steam_Matchmaking_Servers::RequestServerList(AppId_t iApp, IS
     request.completed = false;
     request.type = type;
     request.id = id;
-    requests.push_back(request);
-    PRINT_DEBUG("pushed new request with id: %p", request.id);
+    request.created = std::chrono::high_resolution_clock::now();
+    requests.push_back(std::move(request));
+    PRINT_DEBUG("pushed new request with id: %p", requests.back().id);
 
-    if (type == eLANServer) return id;
+    if (type == eLANServer) {
+        request_gameserver_state(iApp, k_steamIDNil);
+        return id;
+    }
 
     if (type == eFriendsServer) {
         for (auto &g : gameservers_friends) {
@@ -97,7 +161,8 @@ HServerListRequest Steam_Matchmaking_Servers::RequestServerList(AppId_t iApp, IS
                 g2.last_recv = std::chrono::high_resolution_clock::now();
                 g2.server = server;
                 g2.type = type;
-                gameservers.push_back(g2);
+                gameservers.push_back(std::make_shared<Steam_Matchmaking_Servers_Gameserver>(std::move(g2)));
+                gameservers_by_address_dirty = true;
                 PRINT_DEBUG("  eFriendsServer SERVER ADDED");
             }
         }
@@ -159,8 +224,9 @@ HServerListRequest Steam_Matchmaking_Servers::RequestServerList(AppId_t iApp, IS
         g.last_recv = std::chrono::high_resolution_clock::now();
         g.server = server;
         g.type = type;
-        gameservers.push_back(g);
         PRINT_DEBUG("  SERVER ADDED %i", (int)g.type);
+        gameservers.push_back(std::make_shared<Steam_Matchmaking_Servers_Gameserver>(std::move(g)));
+        gameservers_by_address_dirty = true;
 
         list_ip = "";
     }
@@ -230,8 +296,14 @@ void Steam_Matchmaking_Servers::RequestOldServerList(AppId_t iApp, ISteamMatchma
     request.completed = false;
     request.type = type;
     request.id = (void *)type;
-    requests.push_back(request);
-    PRINT_DEBUG("pushed new request with id: %p", request.id);
+    request.created = std::chrono::high_resolution_clock::now();
+    requests.push_back(std::move(request));
+    PRINT_DEBUG("pushed new request with id: %p", requests.back().id);
+
+    // gameservers only send their full details to browsers asking for them
+    if (type == eLANServer) {
+        request_gameserver_state(iApp, k_steamIDNil);
+    }
 }
 
 void Steam_Matchmaking_Servers::RequestInternetServerList( AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse001 *pRequestServersResponse )
@@ -377,26 +449,23 @@ gameserveritem_t *Steam_Matchmaking_Servers::GetServerDetails( HServerListReques
     PRINT_DEBUG("%p %i", hRequest, iServer);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
 
-    std::vector <struct Steam_Matchmaking_Servers_Gameserver> gameservers_filtered;
     auto g = std::begin(requests);
     while (g != std::end(requests)) {
         PRINT_DEBUG("  equal? %p %p", hRequest, g->id);
         if (g->id == hRequest) {
-            gameservers_filtered = g->gameservers_filtered;
-            PRINT_DEBUG("  found %zu", gameservers_filtered.size());
+            PRINT_DEBUG("  found %zu", g->servers.size());
             break;
         }
 
         ++g;
     }
 
-    if (iServer < 0 || static_cast<size_t>(iServer) >= gameservers_filtered.size()) {
+    if (g == std::end(requests) || iServer < 0 || static_cast<size_t>(iServer) >= g->servers.size()) {
         return NULL;
     }
 
-    Gameserver *gs = &gameservers_filtered[iServer].server;
-    gameserveritem_t *server = new gameserveritem_t(); //TODO: is the new here ok?
-    server_details(gs, server);
+    // owned by the request, valid until it's released
+    gameserveritem_t *server = get_request_server_details(*g, iServer);
     PRINT_DEBUG("  Returned server details");
     return server;
 }
@@ -431,6 +500,15 @@ void Steam_Matchmaking_Servers::CancelQuery( HServerListRequest hRequest )
 void Steam_Matchmaking_Servers::RefreshQuery( HServerListRequest hRequest )
 {
     PRINT_DEBUG("%p", hRequest);
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    for (auto &r : requests) {
+        if (r.id != hRequest || r.cancelled || !r.listed) continue;
+
+        // the same servers are reported again with their current details
+        r.servers_details_current.assign(r.servers.size(), false);
+        r.responded = 0;
+        r.completed = false;
+    }
 }
  
 
@@ -438,6 +516,11 @@ void Steam_Matchmaking_Servers::RefreshQuery( HServerListRequest hRequest )
 bool Steam_Matchmaking_Servers::IsRefreshing( HServerListRequest hRequest )
 {
     PRINT_DEBUG("%p", hRequest);
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    for (auto &r : requests) {
+        if (r.id == hRequest) return !r.cancelled && !r.completed;
+    }
+
     return false;
 }
  
@@ -451,7 +534,7 @@ int Steam_Matchmaking_Servers::GetServerCount( HServerListRequest hRequest )
     auto g = std::begin(requests);
     while (g != std::end(requests)) {
         if (g->id == hRequest) {
-            size = static_cast<int>(g->gameservers_filtered.size());
+            size = static_cast<int>(g->servers.size());
             break;
         }
 
@@ -466,8 +549,13 @@ int Steam_Matchmaking_Servers::GetServerCount( HServerListRequest hRequest )
 // Refresh a single server inside of a query (rather than all the servers )
 void Steam_Matchmaking_Servers::RefreshServer( HServerListRequest hRequest, int iServer )
 {
-    PRINT_DEBUG("%p", hRequest);
-    //TODO
+    PRINT_DEBUG("%p %i", hRequest, iServer);
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    for (auto &r : requests) {
+        if (r.id == hRequest && !r.cancelled && iServer >= 0 && static_cast<size_t>(iServer) < r.servers.size()) {
+            r.refresh_servers.push_back(iServer);
+        }
+    }
 }
 
 
@@ -579,218 +667,180 @@ void Steam_Matchmaking_Servers::CancelServerQuery( HServerQuery hServerQuery )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     auto r = std::find_if(direct_ip_requests.begin(), direct_ip_requests.end(), [&hServerQuery](Steam_Matchmaking_Servers_Direct_IP_Request const& item) { return item.id == hServerQuery; });
     if (direct_ip_requests.end() == r) return;
+    if (r->a2s_query) network->a2sCancel(r->a2s_query);
     direct_ip_requests.erase(r);
 }
 
 
 
-void Steam_Matchmaking_Servers::server_details(Gameserver *g, gameserveritem_t *server)
+// the fields of an A2S_INFO answer, what the gameserver told us about itself stays
+static void apply_source_query_info(Gameserver *g, const Gameserver &info)
 {
-    PRINT_DEBUG_ENTRY();
-    constexpr const static int MIN_LATENCY = 2;
+    if (info.id()) g->set_id(info.id());
+    g->set_game_description(info.game_description());
+    g->set_mod_dir(info.mod_dir());
+    g->set_dedicated_server(info.dedicated_server());
+    g->set_max_player_count(info.max_player_count());
+    g->set_bot_player_count(info.bot_player_count());
+    g->set_server_name(info.server_name());
+    g->set_map_name(info.map_name());
+    g->set_password_protected(info.password_protected());
+    if (info.spectator_port()) {
+        g->set_spectator_port(info.spectator_port());
+        g->set_spectator_server_name(info.spectator_server_name());
+    }
+    g->set_product(info.product());
+    g->set_secure(info.secure());
+    g->set_num_players(info.num_players());
+    g->set_version(info.version());
+    // without the port in the answer it's only the query port again
+    if (info.port() != info.query_port()) g->set_port(info.port());
+    g->set_appid(info.appid());
+    g->set_offline(false);
+}
 
-    int latency = MIN_LATENCY;
+// true while the server is being asked for its info, its details can't be reported yet
+// the source query is sent the first time the details are needed and answered in read_server_details_queries()
+bool Steam_Matchmaking_Servers::server_details_pending(Steam_Matchmaking_Servers_Gameserver &g)
+{
+    if (!settings->matchmaking_server_details_via_source_query || g.details) return false;
 
-    if (settings->matchmaking_server_details_via_source_query && !(g->ip() < 0) && !(g->query_port() < 0)) {
-        unsigned char ip[4]{};
-        char newip[24]{};
-        ip[0] = g->ip() & 0xFF;
-        ip[1] = (g->ip() >> 8) & 0xFF;
-        ip[2] = (g->ip() >> 16) & 0xFF;
-        ip[3] = (g->ip() >> 24) & 0xFF;
-        snprintf(newip, sizeof(newip), "%d.%d.%d.%d", ip[3], ip[2], ip[1], ip[0]);
-
-        PRINT_DEBUG("  connecting to ssq server on %s:%u", newip, g->query_port());
-        SSQ_SERVER *ssq = ssq_server_new(newip, g->query_port());
-        if (ssq != NULL && ssq_server_eok(ssq)) {
-            PRINT_DEBUG("  ssq server connection ok");
-            ssq_server_timeout(ssq, (SSQ_TIMEOUT_SELECTOR)(SSQ_TIMEOUT_RECV | SSQ_TIMEOUT_SEND), 1200);
-
-            std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
-            A2S_INFO *ssq_a2s_info = ssq_info(ssq);
-            std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
-            latency = (int)std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
-
-            // TODO I don't know if low latency is problematic or not, hence this artificial latency
-            if (latency < MIN_LATENCY) latency = MIN_LATENCY;
-
-            if (ssq_server_eok(ssq)) {
-                PRINT_DEBUG("  ssq server info ok");
-                if (ssq_info_has_steamid(ssq_a2s_info)) g->set_id(ssq_a2s_info->steamid);
-                g->set_game_description(ssq_a2s_info->game);
-                g->set_mod_dir(ssq_a2s_info->folder);
-                if (ssq_a2s_info->server_type == A2S_SERVER_TYPE_DEDICATED) g->set_dedicated_server(true);
-                else if (ssq_a2s_info->server_type == A2S_SERVER_TYPE_STV_RELAY) g->set_dedicated_server(true);
-                else g->set_dedicated_server(false);
-                g->set_max_player_count(ssq_a2s_info->max_players);
-                g->set_bot_player_count(ssq_a2s_info->bots);
-                g->set_server_name(ssq_a2s_info->name);
-                g->set_map_name(ssq_a2s_info->map);
-                if (ssq_a2s_info->visibility) g->set_password_protected(true);
-                else g->set_password_protected(false);
-                if (ssq_info_has_stv(ssq_a2s_info)) {
-                    g->set_spectator_port(ssq_a2s_info->stv_port);
-                    g->set_spectator_server_name(ssq_a2s_info->stv_name);
-                }
-                //g->set_tags(ssq_a2s_info->keywords);
-                //g->set_gamedata();
-                //g->set_region();
-                g->set_product(ssq_a2s_info->game);
-                if (ssq_a2s_info->vac) g->set_secure(true);
-                else g->set_secure(false);
-                g->set_num_players(ssq_a2s_info->players);
-                g->set_version(static_cast<uint32_t>(std::stoull(ssq_a2s_info->version, NULL, 0)));
-                if (ssq_info_has_port(ssq_a2s_info)) g->set_port(ssq_a2s_info->port);
-
-                if (ssq_info_has_gameid(ssq_a2s_info)) g->set_appid(CGameID((uint64)ssq_a2s_info->gameid).AppID());
-                else g->set_appid(ssq_a2s_info->id);
-                
-                g->set_offline(false);
-            } else {
-                PRINT_DEBUG("  ssq server info failed: %s", ssq_server_emsg(ssq));
-            }
+    if (!g.a2s_query) {
+        PRINT_DEBUG("source query for %u:%hu", g.server.ip(), gameserver_query_port(g.server));
+        g.a2s_query = network->a2sQuery(g.server.ip(), gameserver_query_port(g.server), A2S_QUERY_INFO);
+    }
 
-            if (ssq_a2s_info != NULL) ssq_info_free(ssq_a2s_info);
-        } else {
-            PRINT_DEBUG("  ssq server connection failed: %s", (ssq ? ssq_server_emsg(ssq) : "NULL instance"));
-        }
+    return true;
+}
 
-        if (ssq != NULL) ssq_server_free(ssq);
-    }
+void Steam_Matchmaking_Servers::read_server_details_queries()
+{
+    for (auto &g : gameservers) {
+        if (!g->a2s_query) continue;
+
+        A2S_Result result{};
+        if (!network->a2sResult(g->a2s_query, result)) continue;
+
+        g->a2s_query = 0;
+        PRINT_DEBUG("source query answer: %u:%hu %i", g->server.ip(), gameserver_query_port(g->server), (int)result.responded);
+        if (result.responded) {
+            apply_source_query_info(&g->server, result.info);
+            g->query_ping = std::max(result.ping, MIN_LATENCY);
+            gameservers_by_address_dirty = true;
+        }
 
-    uint16 query_port = g->query_port();
-    if (g->query_port() == 0xFFFF) {
-        query_port = g->port();
+        // built now even when the server didn't answer, it's reported with what we already know
+        g->details = std::make_shared<gameserveritem_t>();
+        server_details(*g, g->details.get());
     }
+}
 
-    server->m_NetAdr.Init(g->ip(), query_port, g->port());
-    server->m_nPing = latency;
-    server->m_bHadSuccessfulResponse = true;
-    server->m_bDoNotRefresh = false;
+void Steam_Matchmaking_Servers::server_details(Steam_Matchmaking_Servers_Gameserver &g, gameserveritem_t *server)
+{
+    PRINT_DEBUG_ENTRY();
+    int latency = g.query_ping;
+    if (!latency) latency = std::max(network->getPing(CSteamID((uint64)g.server.id())), MIN_LATENCY);
 
-    server->m_nAppID = g->appid();
-    server->m_nPlayers = g->num_players();
-    server->m_nMaxPlayers = g->max_player_count();
-    server->m_nBotPlayers = g->bot_player_count();
-    server->m_bPassword = g->password_protected();
-    server->m_bSecure = g->secure();
-    server->m_ulTimeLastPlayed = 0;
-    server->m_nServerVersion = g->version();
-    server->SetName(g->server_name().c_str());
-    server->m_steamID = CSteamID((uint64)g->id());
-    
-    memset(server->m_szGameDir, 0, sizeof(server->m_szGameDir));
-    g->mod_dir().copy(server->m_szGameDir, sizeof(server->m_szGameDir) - 1);
+    gameserver_to_item(&g.server, server, latency);
+    PRINT_DEBUG("  " "%" PRIu64 "", g.server.id());
+}
 
-    memset(server->m_szMap, 0, sizeof(server->m_szMap));
-    g->map_name().copy(server->m_szMap, sizeof(server->m_szMap) - 1);
+void Steam_Matchmaking_Servers::server_details_players(Gameserver *g, Steam_Matchmaking_Servers_Direct_IP_Request *r)
+{
+    uint32_t number_players = g->num_players();
+    PRINT_DEBUG("  players: %u", number_players);
+    const auto &players = get_steam_client()->steam_gameserver->get_players();
+    auto player = players->cbegin();
+    for (uint32_t i = 0; i < number_players && player != players->end(); ++i, ++player) {
+        auto duration = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - player->second.join_time);
+        float playtime = static_cast<float>(duration.count());
+        PRINT_DEBUG("  PLAYER [%u] '%s' %u %f", i, player->second.name.c_str(), player->second.score, playtime);
+        r->players_response->AddPlayerToList(player->second.name.c_str(), player->second.score, playtime);
+    }
 
-    memset(server->m_szGameDescription, 0, sizeof(server->m_szGameDescription));
-    g->game_description().copy(server->m_szGameDescription, sizeof(server->m_szGameDescription) - 1);
+    PRINT_DEBUG("  " "%" PRIu64 "", g->id());
+}
 
-    memset(server->m_szGameTags, 0, sizeof(server->m_szGameTags));
-    g->tags().copy(server->m_szGameTags, sizeof(server->m_szGameTags) - 1);
+void Steam_Matchmaking_Servers::server_details_rules(Gameserver *g, Steam_Matchmaking_Servers_Direct_IP_Request *r)
+{
+    int number_rules = (int)g->values().size();
+    PRINT_DEBUG("  rules: %i", number_rules);
+    auto rule = g->values().begin();
+    for (int i = 0; i < number_rules; ++i) {
+        PRINT_DEBUG("  RULE '%s'='%s'", rule->first.c_str(), rule->second.c_str());
+        r->rules_response->RulesResponded(rule->first.c_str(), rule->second.c_str());
+        ++rule;
+    }
 
     PRINT_DEBUG("  " "%" PRIu64 "", g->id());
 }
 
-void Steam_Matchmaking_Servers::server_details_players(Gameserver *g, Steam_Matchmaking_Servers_Direct_IP_Request *r)
+// picks the servers of the list
+void Steam_Matchmaking_Servers::list_request_servers(Steam_Matchmaking_Request &request)
 {
-    if (settings->matchmaking_server_details_via_source_query && !(g->ip() < 0) && !(g->query_port() < 0)) {
-        unsigned char ip[4]{};
-        char newip[24];
-        ip[0] = g->ip() & 0xFF;
-        ip[1] = (g->ip() >> 8) & 0xFF;
-        ip[2] = (g->ip() >> 16) & 0xFF;
-        ip[3] = (g->ip() >> 24) & 0xFF;
-        snprintf(newip, sizeof(newip), "%d.%d.%d.%d", ip[3], ip[2], ip[1], ip[0]);
-
-        PRINT_DEBUG("  connecting to ssq server on  %s:%u", newip, g->query_port());
-        SSQ_SERVER *ssq = ssq_server_new(newip, g->query_port());
-        if (ssq != NULL && ssq_server_eok(ssq)) {
-            PRINT_DEBUG("  ssq server connection ok");
-            ssq_server_timeout(ssq, (SSQ_TIMEOUT_SELECTOR)(SSQ_TIMEOUT_RECV | SSQ_TIMEOUT_SEND), 1200);
-
-            uint8_t ssq_a2s_player_count = 0;
-            A2S_PLAYER *ssq_a2s_player = ssq_player(ssq, &ssq_a2s_player_count);
-
-            if (ssq_server_eok(ssq)) {
-                PRINT_DEBUG("  ssq server players ok");
-                for (int i = 0; i < ssq_a2s_player_count; i++) {
-                    r->players_response->AddPlayerToList(ssq_a2s_player[i].name, ssq_a2s_player[i].score, ssq_a2s_player[i].duration);
-                }
-            } else {
-                PRINT_DEBUG("  ssq server players failed: %s", ssq_server_emsg(ssq));
-            }
-
-            if (ssq_a2s_player != NULL) ssq_player_free(ssq_a2s_player, ssq_a2s_player_count);
-        } else {
-            PRINT_DEBUG("  ssq server connection failed: %s", (ssq ? ssq_server_emsg(ssq) : "NULL instance"));
+    request.servers.clear();
+    for (auto &g : gameservers) {
+        if (!g->has_details) continue;
+        PRINT_DEBUG("%u==%u | %i==%i", g->server.appid(), request.appid, (int)g->type, (int)request.type);
+        if ((g->server.appid() == request.appid) && (g->type == request.type || settings->matchmaking_server_list_always_lan_type)) {
+            PRINT_DEBUG("server found");
+            request.servers.push_back(g);
+            // every source query goes out now, they are answered in parallel
+            server_details_pending(*g);
         }
+    }
 
-        if (ssq != NULL) ssq_server_free(ssq);
-    } else if (!settings->matchmaking_server_details_via_source_query) { // original behavior
-        uint32_t number_players = g->num_players();
-        PRINT_DEBUG("  players: %u", number_players);
-        const auto &players = get_steam_client()->steam_gameserver->get_players();
-        auto player = players->cbegin();
-        for (uint32_t i = 0; i < number_players && player != players->end(); ++i, ++player) {
-            auto duration = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - player->second.join_time);
-            float playtime = static_cast<float>(duration.count());
-            PRINT_DEBUG("  PLAYER [%u] '%s' %u %f", i, player->second.name.c_str(), player->second.score, playtime);
-            r->players_response->AddPlayerToList(player->second.name.c_str(), player->second.score, playtime);
-        }
+    request.servers_details.clear();
+    for (size_t i = 0; i < request.servers.size(); ++i) {
+        request.servers_details.push_back(std::make_unique<gameserveritem_t>());
     }
 
-    PRINT_DEBUG("  " "%" PRIu64 "", g->id());
+    request.servers_details_current.assign(request.servers.size(), false);
+    request.responded = 0;
+    request.listed = true;
 }
 
-void Steam_Matchmaking_Servers::server_details_rules(Gameserver *g, Steam_Matchmaking_Servers_Direct_IP_Request *r)
+std::shared_ptr<gameserveritem_t> Steam_Matchmaking_Servers::get_server_details(Steam_Matchmaking_Servers_Gameserver &g)
 {
-    if (settings->matchmaking_server_details_via_source_query && !(g->ip() < 0) && !(g->query_port() < 0)) {
-        unsigned char ip[4]{};
-        char newip[24];
-        ip[0] = g->ip() & 0xFF;
-        ip[1] = (g->ip() >> 8) & 0xFF;
-        ip[2] = (g->ip() >> 16) & 0xFF;
-        ip[3] = (g->ip() >> 24) & 0xFF;
-        snprintf(newip, sizeof(newip), "%d.%d.%d.%d", ip[3], ip[2], ip[1], ip[0]);
-
-        PRINT_DEBUG("  connecting to ssq server on %s:%u", newip, g->query_port());
-        SSQ_SERVER *ssq = ssq_server_new(newip, g->query_port());
-        if (ssq != NULL && ssq_server_eok(ssq)) {
-            ssq_server_timeout(ssq, (SSQ_TIMEOUT_SELECTOR)(SSQ_TIMEOUT_RECV | SSQ_TIMEOUT_SEND), 1200);
-
-            uint16_t ssq_a2s_rules_count = 0;
-            A2S_RULES *ssq_a2s_rules = ssq_rules(ssq, &ssq_a2s_rules_count);
-
-            if (ssq_server_eok(ssq)) {
-                PRINT_DEBUG("  ssq server rules ok");
-                for (int i = 0; i < ssq_a2s_rules_count; i++) {
-                    r->rules_response->RulesResponded(ssq_a2s_rules[i].name, ssq_a2s_rules[i].value);
-                }
-            } else {
-                PRINT_DEBUG("  ssq server rules failed: %s", ssq_server_emsg(ssq));
-            }
+    if (!g.details) {
+        g.details = std::make_shared<gameserveritem_t>();
+        server_details(g, g.details.get());
+    }
 
-            if (ssq_a2s_rules != NULL) ssq_rules_free(ssq_a2s_rules, ssq_a2s_rules_count);
-        } else {
-            PRINT_DEBUG("  ssq server connection failed: %s", (ssq ? ssq_server_emsg(ssq) : "NULL instance"));
-        }
+    return g.details;
+}
+
+gameserveritem_t *Steam_Matchmaking_Servers::get_request_server_details(Steam_Matchmaking_Request &request, int index)
+{
+    if (!request.servers_details_current[index]) update_request_server_details(request, index);
+    return request.servers_details[index].get();
+}
 
-        if (ssq != NULL) ssq_server_free(ssq);
-    } else if (!settings->matchmaking_server_details_via_source_query) { // original behavior
-        int number_rules = (int)g->values().size();
-        PRINT_DEBUG("  rules: %i", number_rules);
-        auto rule = g->values().begin();
-        for (int i = 0; i < number_rules; ++i) {
-            PRINT_DEBUG("  RULE '%s'='%s'", rule->first.c_str(), rule->second.c_str());
-            r->rules_response->RulesResponded(rule->first.c_str(), rule->second.c_str());
-            ++rule;
+// copies the current details of the server into the object the game may already hold
+void Steam_Matchmaking_Servers::update_request_server_details(Steam_Matchmaking_Request &request, int index)
+{
+    *request.servers_details[index] = *get_server_details(*request.servers[index]);
+    request.servers_details_current[index] = true;
+}
+
+std::vector<std::shared_ptr<struct Steam_Matchmaking_Servers_Gameserver>> Steam_Matchmaking_Servers::find_gameservers(uint32 ip, uint16 query_port)
+{
+    if (gameservers_by_address_dirty) {
+        gameservers_by_address.clear();
+        for (auto &g : gameservers) {
+            gameservers_by_address.emplace(gameserver_address(g->server.ip(), gameserver_query_port(g->server)), g);
         }
+
+        gameservers_by_address_dirty = false;
     }
 
-    PRINT_DEBUG("  " "%" PRIu64 "", g->id());
+    std::vector<std::shared_ptr<struct Steam_Matchmaking_Servers_Gameserver>> found{};
+    auto range = gameservers_by_address.equal_range(gameserver_address(ip, query_port));
+    for (auto it = range.first; it != range.second; ++it) {
+        found.push_back(it->second);
+    }
+
+    return found;
 }
 
 void Steam_Matchmaking_Servers::RunCallbacks()
@@ -800,8 +850,10 @@ void Steam_Matchmaking_Servers::RunCallbacks()
     {
         auto g = std::begin(gameservers);
         while (g != std::end(gameservers)) {
-            if (check_timedout(g->last_recv, SERVER_TIMEOUT)) {
+            if (check_timedout((*g)->last_recv, SERVER_TIMEOUT)) {
+                if ((*g)->a2s_query) network->a2sCancel((*g)->a2s_query);
                 g = gameservers.erase(g);
+                gameservers_by_address_dirty = true;
                 PRINT_DEBUG("SERVER REMOVED, TIMEOUT");
             } else {
                 ++g;
@@ -809,100 +861,167 @@ void Steam_Matchmaking_Servers::RunCallbacks()
         }
     }
 
+    read_server_details_queries();
+
     if (requests.size() || gameservers.size()) {
         PRINT_DEBUG("requests count = %zu, servers count = %zu", requests.size(), gameservers.size());
     }
 
-    for (auto &r : requests) {
-        if (r.cancelled || r.completed) continue;
-
-        r.gameservers_filtered.clear();
-        for (auto &g : gameservers) {
-            PRINT_DEBUG("%u==%u | %i==%i", g.server.appid(), r.appid, (int)g.type, (int)r.type);
-            if ((g.server.appid() == r.appid) && (g.type == r.type || settings->matchmaking_server_list_always_lan_type)) {
-                PRINT_DEBUG("server found");
-                r.gameservers_filtered.push_back(g);
+    // the results are spread over multiple frames so a big list doesn't freeze the game
+    auto frame_start = std::chrono::high_resolution_clock::now();
+    unsigned reports = 0;
+    auto budget_left = [&]() {
+        return reports < SERVER_LIST_REPORTS_PER_FRAME && !check_timedout(frame_start, SERVER_LIST_FRAME_BUDGET);
+    };
+
+    // the callbacks can add requests, which moves them around
+    for (size_t i = 0; i < requests.size() && budget_left(); ++i) {
+        if (requests[i].cancelled) continue;
+
+        while (requests[i].refresh_servers.size() && budget_left()) {
+            int index = requests[i].refresh_servers.front();
+            Steam_Matchmaking_Request &r = requests[i];
+            Gameserver const& listed_server = r.servers[index]->server;
+            auto found = find_gameservers(listed_server.ip(), gameserver_query_port(listed_server));
+            // the next ones wait behind it, they are answered in the order they were asked
+            if (found.size() && server_details_pending(*found.front())) break;
+
+            r.refresh_servers.erase(r.refresh_servers.begin());
+            ++reports;
+
+            HServerListRequest id = r.id;
+            ISteamMatchmakingServerListResponse *callbacks = r.callbacks;
+            ISteamMatchmakingServerListResponse001 *old_callbacks = r.old_callbacks;
+            if (found.size()) {
+                r.servers[index] = found.front();
+                update_request_server_details(r, index);
+                if (callbacks) callbacks->ServerResponded(id, index);
+                if (old_callbacks) old_callbacks->ServerResponded(index);
+            } else {
+                if (callbacks) callbacks->ServerFailedToRespond(id, index);
+                if (old_callbacks) old_callbacks->ServerFailedToRespond(index);
             }
+
+            if (requests[i].cancelled) break;
         }
-    }
 
-    std::vector <struct Steam_Matchmaking_Request> requests_temp(requests);
-    for (auto &r : requests) {
+        if (requests[i].cancelled || requests[i].completed) continue;
+        if (!requests[i].listed) {
+            if (waiting_for_gameservers(requests[i])) continue;
+            list_request_servers(requests[i]);
+        }
+
+        while (requests[i].responded < requests[i].servers.size() && budget_left()) {
+            Steam_Matchmaking_Request &r = requests[i];
+            if (!r.servers_details_current[r.responded] && server_details_pending(*r.servers[r.responded])) break;
+
+            int index = static_cast<int>(r.responded++);
+            get_request_server_details(r, index);
+            ++reports;
+
+            PRINT_DEBUG("server responded cb %p", r.id);
+            HServerListRequest id = r.id;
+            ISteamMatchmakingServerListResponse001 *old_callbacks = r.old_callbacks;
+            if (r.callbacks) r.callbacks->ServerResponded(id, index);
+            if (old_callbacks) old_callbacks->ServerResponded(index);
+            if (requests[i].cancelled) break;
+        }
+
+        Steam_Matchmaking_Request &r = requests[i];
+        if (r.cancelled || r.responded < r.servers.size()) continue;
+
         r.completed = true;
+        EMatchMakingServerResponse response = r.servers.size() ? eServerResponded : eNoServersListedOnMasterServer;
+        HServerListRequest id = r.id;
+        ISteamMatchmakingServerListResponse001 *old_callbacks = r.old_callbacks;
+        if (r.callbacks) r.callbacks->RefreshComplete(id, response);
+        if (old_callbacks) old_callbacks->RefreshComplete(response);
     }
 
-    for (auto &r : requests_temp) {
-        if (r.cancelled || r.completed) continue;
-        int i = 0;
-
-        if (r.callbacks) {
-            for (auto &g : r.gameservers_filtered) {
-                PRINT_DEBUG("server responded cb %p", r.id);
-                r.callbacks->ServerResponded(r.id, i);
-                ++i;
+    // known gameservers are answered from what they sent us, the others get a source query
+    std::vector <struct Steam_Matchmaking_Servers_Direct_IP_Request> direct_ip_requests_temp;
+    std::vector <std::pair<struct Steam_Matchmaking_Servers_Direct_IP_Request, A2S_Result>> direct_ip_requests_queried;
+    auto dip = std::begin(direct_ip_requests);
+    while (dip != std::end(direct_ip_requests) && (direct_ip_requests_temp.size() + direct_ip_requests_queried.size()) < SERVER_LIST_REPORTS_PER_FRAME) {
+        if (dip->a2s_query) {
+            A2S_Result result{};
+            if (network->a2sResult(dip->a2s_query, result)) {
+                direct_ip_requests_queried.emplace_back(*dip, std::move(result));
+                dip = direct_ip_requests.erase(dip);
+            } else {
+                ++dip;
             }
-
-            if (i) {
-                r.callbacks->RefreshComplete(r.id, eServerResponded);
+        } else if (check_timedout(dip->created, DIRECT_IP_DELAY)) {
+            if (settings->matchmaking_server_details_via_source_query || find_gameservers(dip->ip, dip->port).empty()) {
+                dip->a2s_query = network->a2sQuery(dip->ip, dip->port, direct_ip_query_type(*dip));
+                ++dip;
             } else {
-                r.callbacks->RefreshComplete(r.id, eNoServersListedOnMasterServer);
+                direct_ip_requests_temp.push_back(*dip);
+                dip = direct_ip_requests.erase(dip);
             }
+        } else {
+            ++dip;
         }
+    }
 
-        if (r.old_callbacks) {
-            for (auto &g : r.gameservers_filtered) {
-                PRINT_DEBUG("REQUESTS server responded cb %p", r.id);
-                r.old_callbacks->ServerResponded(i);
-                ++i;
+    for (auto &q : direct_ip_requests_queried) {
+        auto &r = q.first;
+        auto &result = q.second;
+        PRINT_DEBUG("source query answer: %u:%hu %i", r.ip, r.port, (int)result.responded);
+        if (r.rules_response) {
+            if (result.responded) {
+                for (auto &rule : result.rules) {
+                    r.rules_response->RulesResponded(rule.first.c_str(), rule.second.c_str());
+                }
+
+                r.rules_response->RulesRefreshComplete();
+            } else {
+                r.rules_response->RulesFailedToRespond();
             }
+        }
 
-            if (i) {
-                r.old_callbacks->RefreshComplete(eServerResponded);
+        if (r.players_response) {
+            if (result.responded) {
+                for (auto &player : result.players) {
+                    r.players_response->AddPlayerToList(player.name.c_str(), player.score, player.duration);
+                }
+
+                r.players_response->PlayersRefreshComplete();
             } else {
-                r.old_callbacks->RefreshComplete(eNoServersListedOnMasterServer);
+                r.players_response->PlayersFailedToRespond();
             }
         }
-    }
 
-    std::vector <struct Steam_Matchmaking_Servers_Direct_IP_Request> direct_ip_requests_temp;
-    auto dip = std::begin(direct_ip_requests);
-    while (dip != std::end(direct_ip_requests)) {
-        if (check_timedout(dip->created, DIRECT_IP_DELAY)) {
-            direct_ip_requests_temp.push_back(*dip);
-            dip = direct_ip_requests.erase(dip);
-        } else {
-            ++dip;
+        if (r.ping_response) {
+            if (result.responded) {
+                gameserveritem_t server{};
+                gameserver_to_item(&result.info, &server, std::max(result.ping, MIN_LATENCY));
+                r.ping_response->ServerResponded(server);
+            } else {
+                r.ping_response->ServerFailedToRespond();
+            }
         }
     }
 
     for (auto &r : direct_ip_requests_temp) {
         PRINT_DEBUG("request: %u:%hu", r.ip, r.port);
-        for (auto &g : gameservers) {
-            PRINT_DEBUG("%u:%u", g.server.ip(), g.server.query_port());
-            uint16 query_port = g.server.query_port();
-            if (query_port == 0xFFFF) {
-                query_port = g.server.port();
+        for (auto &g : find_gameservers(r.ip, r.port)) {
+            if (r.rules_response) {
+                server_details_rules(&(g->server), &r);
+                r.rules_response->RulesRefreshComplete();
+                r.rules_response = NULL;
             }
 
-            if (query_port == r.port && g.server.ip() == r.ip) {
-                if (r.rules_response) {
-                    server_details_rules(&(g.server), &r);
-                    r.rules_response->RulesRefreshComplete();
-                    r.rules_response = NULL;
-                }
-
-                if (r.players_response) {
-                    server_details_players(&(g.server), &r);
-                    r.players_response->PlayersRefreshComplete();
-                    r.players_response = NULL;
-                }
+            if (r.players_response) {
+                server_details_players(&(g->server), &r);
+                r.players_response->PlayersRefreshComplete();
+                r.players_response = NULL;
+            }
 
-                if (r.ping_response) {
-                    gameserveritem_t server{};
-                    server_details(&(g.server), &server);
-                    r.ping_response->ServerResponded(server);
-                    r.ping_response = NULL;
-                }
+            if (r.ping_response) {
+                auto details = get_server_details(*g);
+                r.ping_response->ServerResponded(*details);
+                r.ping_response = NULL;
             }
         }
 
@@ -912,25 +1031,59 @@ void Steam_Matchmaking_Servers::RunCallbacks()
     }
 }
 
+// asks the gameserver (or every gameserver if server_id is nil) for its whole state, it keeps sending us its changes for a while
+void Steam_Matchmaking_Servers::request_gameserver_state(AppId_t appid, CSteamID server_id)
+{
+    Common_Message msg;
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    Gameserver_Update *update = new Gameserver_Update();
+    update->set_type(Gameserver_Update::REQUEST);
+    update->set_appid(appid);
+    msg.set_allocated_gameserver_update(update);
+    if (server_id == k_steamIDNil) {
+        network->sendToAllGameservers(&msg, true);
+    } else {
+        msg.set_dest_id(server_id.ConvertToUint64());
+        network->sendTo(&msg, true);
+    }
+}
+
+// LAN requests give the gameservers some time to reply with their state
+bool Steam_Matchmaking_Servers::waiting_for_gameservers(const Steam_Matchmaking_Request &request)
+{
+    if (request.type != eLANServer && !settings->matchmaking_server_list_always_lan_type) return false;
+    if (check_timedout(request.created, SERVER_LIST_WAIT)) return false;
+
+    for (auto &g : gameservers) {
+        if (g->type != eLANServer || g->server.appid() != request.appid) continue;
+        if (!g->has_details || g->server.revision() != g->latest_revision) return true;
+    }
+
+    return false;
+}
+
 void Steam_Matchmaking_Servers::Callback(Common_Message *msg)
 {
     if (msg->has_gameserver() && msg->gameserver().type() != eFriendsServer) {
         PRINT_DEBUG("got SERVER " "%" PRIu64 ", offline:%u", msg->gameserver().id(), msg->gameserver().offline());
         if (msg->gameserver().offline()) {
             for (auto &g : gameservers) {
-                if (g.server.id() == msg->gameserver().id()) {
-                    g.last_recv = std::chrono::high_resolution_clock::time_point();
-                    g.type = eLANServer;
+                if (g->server.id() == msg->gameserver().id()) {
+                    g->last_recv = std::chrono::high_resolution_clock::time_point();
+                    g->type = eLANServer;
                 }
             }
         } else {
             bool already = false;
             for (auto &g : gameservers) {
-                if (g.server.id() == msg->gameserver().id()) {
-                    g.last_recv = std::chrono::high_resolution_clock::now();
-                    g.server = msg->gameserver();
-                    g.server.set_ip(msg->source_ip());
-                    g.type = eLANServer;
+                if (g->server.id() == msg->gameserver().id()) {
+                    g->last_recv = std::chrono::high_resolution_clock::now();
+                    g->server = msg->gameserver();
+                    g->server.set_ip(msg->source_ip());
+                    g->type = eLANServer;
+                    g->latest_revision = std::max<uint64>(g->latest_revision, g->server.revision());
+                    g->has_details = true;
+                    g->details.reset();
                     already = true;
                 }
             }
@@ -941,9 +1094,56 @@ void Steam_Matchmaking_Servers::Callback(Common_Message *msg)
                 g.server = msg->gameserver();
                 g.server.set_ip(msg->source_ip());
                 g.type = eLANServer;
-                gameservers.push_back(g);
+                g.latest_revision = g.server.revision();
+                gameservers.push_back(std::make_shared<Steam_Matchmaking_Servers_Gameserver>(std::move(g)));
                 PRINT_DEBUG("  eLANServer SERVER ADDED");
             }
+
+            gameservers_by_address_dirty = true;
+        }
+    }
+
+    if (msg->has_gameserver_update() && msg->gameserver_update().type() == Gameserver_Update::DELTA) {
+        const Gameserver_Update &update = msg->gameserver_update();
+        PRINT_DEBUG("got SERVER UPDATE " "%" PRIu64 " revision %llu -> %llu", update.id(), (uint64)update.base_revision(), (uint64)update.revision());
+        Steam_Matchmaking_Servers_Gameserver *server = nullptr;
+        for (auto &g : gameservers) {
+            if (g->server.id() == update.id() && g->type == eLANServer) {
+                server = g.get();
+                break;
+            }
+        }
+
+        if (!server) {
+            // only the heartbeat for now, the whole state is requested when browsing servers
+            struct Steam_Matchmaking_Servers_Gameserver g{};
+            g.server.set_id(update.id());
+            g.server.set_appid(update.appid());
+            g.type = eLANServer;
+            g.has_details = false;
+            gameservers.push_back(std::make_shared<Steam_Matchmaking_Servers_Gameserver>(std::move(g)));
+            gameservers_by_address_dirty = true;
+            server = gameservers.back().get();
+            PRINT_DEBUG("  eLANServer SERVER HEARD OF");
+        }
+
+        server->last_recv = std::chrono::high_resolution_clock::now();
+        if (server->has_details && update.base_revision() != update.revision() && server->server.revision() == update.base_revision()) {
+            Steam_GameServer::apply_gameserver_delta(&server->server, update);
+            server->server.set_ip(msg->source_ip());
+            server->details.reset();
+            gameservers_by_address_dirty = true;
+        }
+
+        server->latest_revision = std::max<uint64>(server->latest_revision, update.revision());
+        if (server->server.revision() != server->latest_revision) {
+            // missed some changes, only worth asking for the state again if it's going to be shown
+            for (auto &r : requests) {
+                if (!r.cancelled && !r.completed && r.appid == server->server.appid()) {
+                    request_gameserver_state(server->server.appid(), (uint64)update.id());
+                    break;
+                }
+            }
         }
     }
 
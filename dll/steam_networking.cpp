@@ -31,53 +31,65 @@
 bool Steam_Networking::connection_exists(CSteamID id)
 {
     std::lock_guard<std::recursive_mutex> lock(connections_edit_mutex);
-    return std::find_if(connections.begin(), connections.end(), [&id](struct Steam_Networking_Connection const& conn) { return conn.remote == id;}) != connections.end();
+    return connections.find(id.ConvertToUint64()) != connections.end();
 }
 
 struct Steam_Networking_Connection* Steam_Networking::get_or_create_connection(CSteamID id)
 {
-    std::lock_guard<std::recursive_mutex> lock(connections_edit_mutex);
-    auto conn = std::find_if(connections.begin(), connections.end(), [&id](struct Steam_Networking_Connection const& conn) { return conn.remote == id;});
+    struct Steam_Networking_Connection *connection = nullptr;
+    bool created = false;
+    {
+        std::lock_guard<std::recursive_mutex> lock(connections_edit_mutex);
+        auto conn = connections.find(id.ConvertToUint64());
+        if (connections.end() == conn) {
+            conn = connections.emplace(id.ConvertToUint64(), Steam_Networking_Connection{}).first;
+            conn->second.remote = id;
+            created = true;
+        }
 
-    if (connections.end() == conn) {
-        struct Steam_Networking_Connection connection;
-        connection.remote = id;
-        connections.push_back(connection);
-        return &(connections[connections.size() - 1]);
-    } else {
-        return &(*conn);
+        connection = &conn->second;
+    }
+
+    // the packets that arrived before the session existed can be read now
+    if (created) {
+        std::lock_guard<std::recursive_mutex> lock(messages_mutex);
+        auto orphaned = orphaned_messages.find(id);
+        if (orphaned != orphaned_messages.end()) {
+            for (auto &packet : orphaned->second) {
+                connection->open_channels.insert(packet.channel);
+                channel_messages[packet.channel].push_back(std::move(packet));
+            }
+
+            orphaned_messages.erase(orphaned);
+        }
+    }
+
+    return connection;
+}
+
+void Steam_Networking::remove_messages(CSteamID id)
+{
+    std::lock_guard<std::recursive_mutex> lock(messages_mutex);
+    for (auto &channel : channel_messages) {
+        auto &queue = channel.second;
+        queue.erase(std::remove_if(queue.begin(), queue.end(), [&id](const P2P_Packet &packet) { return packet.remote == id; }), queue.end());
     }
+
+    orphaned_messages.erase(id);
 }
 
 void Steam_Networking::remove_connection(CSteamID id)
 {
     {
         std::lock_guard<std::recursive_mutex> lock(connections_edit_mutex);
-        auto conn = std::begin(connections);
-        while (conn != std::end(connections)) {
-            if (conn->remote == id) {
-
-                conn = connections.erase(conn);
-            } else {
-                ++conn;
-            }
-        }
+        connections.erase(id.ConvertToUint64());
     }
 
     //pretty sure steam also clears the entire queue of messages for that connection
-    {
-        std::lock_guard<std::recursive_mutex> lock(messages_mutex);
-        auto msg = std::begin(messages);
-        while (msg != std::end(messages)) {
-            if (msg->source_id() == id.ConvertToUint64()) {
-                msg = messages.erase(msg);
-            } else {
-                ++msg;
-            }
-        }
-    }
+    remove_messages(id);
 
     {
+        std::lock_guard<std::recursive_mutex> lock(messages_mutex);
         auto msg = std::begin(unprocessed_messages);
         while (msg != std::end(unprocessed_messages)) {
             if (msg->source_id() == id.ConvertToUint64()) {
@@ -192,7 +204,7 @@ Steam_Networking::Steam_Networking(class Settings *settings, class Networking *n
     this->network->setCallback(CALLBACK_ID_USER_STATUS, settings->get_local_steam_id(), &Steam_Networking::steam_networking_callback, this);
     this->run_every_runcb->add(&Steam_Networking::steam_networking_run_every_runcp, this);
 
-    PRINT_DEBUG("user id %llu messages: %p", settings->get_local_steam_id().ConvertToUint64(), &messages);
+    PRINT_DEBUG("user id %llu messages: %p", settings->get_local_steam_id().ConvertToUint64(), &channel_messages);
 }
 
 Steam_Networking::~Steam_Networking()
@@ -239,8 +251,8 @@ bool Steam_Networking::SendP2PPacket( CSteamID steamIDRemote, const void *pubDat
     new_connection_times.erase(steamIDRemote);
 
     conn->open_channels.insert(nChannel);
-    bool ret = network->sendTo(&msg, reliable);
-    PRINT_DEBUG("Sent message with size: %zu %u", msg.network().data().size(), ret);
+    bool ret = network->sendTo(std::move(msg), reliable);
+    PRINT_DEBUG("Sent message with size: %u %u", cubData, ret);
     return ret;
 }
 
@@ -260,14 +272,12 @@ bool Steam_Networking::IsP2PPacketAvailable( uint32 *pcubMsgSize, int nChannel)
     //this->network->Run();
     //RunCallbacks();
 
-    PRINT_DEBUG("Messages %zu %p", messages.size(), &messages);
-    for (auto &msg : messages) {
-        if (connection_exists((uint64)msg.source_id()) && msg.mutable_network()->channel() == nChannel && msg.network().processed()) {
-            uint32 size = static_cast<uint32>(msg.mutable_network()->data().size());
-            if (pcubMsgSize) *pcubMsgSize = size;
-            PRINT_DEBUG("available with size: %u", size);
-            return true;
-        }
+    auto channel = channel_messages.find(nChannel);
+    if (channel != channel_messages.end() && !channel->second.empty()) {
+        uint32 size = static_cast<uint32>(channel->second.front().data.size());
+        if (pcubMsgSize) *pcubMsgSize = size;
+        PRINT_DEBUG("available with size: %u, %zu packets queued", size, channel->second.size());
+        return true;
     }
 
     PRINT_DEBUG("(not available)");
@@ -294,26 +304,21 @@ bool Steam_Networking::ReadP2PPacket( void *pubDest, uint32 cubDest, uint32 *pcu
     //this->network->Run();
     //RunCallbacks();
 
-    bool read = false;
-    PRINT_DEBUG("Number messages %zu", messages.size());
-    auto msg = std::begin(messages);
-    while (msg != std::end(messages)) {
-        if (connection_exists((uint64)msg->source_id()) && msg->network().channel() == nChannel && msg->network().processed()) {
-            uint32 msg_size = static_cast<uint32>(msg->network().data().size());
-            if (msg_size > cubDest) msg_size = cubDest;
-            if (pcubMsgSize) *pcubMsgSize = msg_size;
-            memcpy(pubDest, msg->network().data().data(), msg_size);
-
-            PRINT_DEBUG("%s",
-                common_helpers::uint8_vector_to_hex_string(std::vector<uint8_t>((uint8_t*)pubDest, (uint8_t*)pubDest + msg_size)).c_str());
-            
-            *psteamIDRemote = CSteamID((uint64)msg->source_id());
-            PRINT_DEBUG("len %u channel: %u from: " "%" PRIu64 "", msg_size, nChannel, msg->source_id());
-            msg = messages.erase(msg);
-            return true;
-        }
+    auto channel = channel_messages.find(nChannel);
+    if (channel != channel_messages.end() && !channel->second.empty()) {
+        const P2P_Packet &packet = channel->second.front();
+        uint32 msg_size = static_cast<uint32>(packet.data.size());
+        if (msg_size > cubDest) msg_size = cubDest;
+        if (pcubMsgSize) *pcubMsgSize = msg_size;
+        memcpy(pubDest, packet.data.data(), msg_size);
 
-        ++msg;
+        PRINT_DEBUG("%s",
+            common_helpers::uint8_vector_to_hex_string(std::vector<uint8_t>((uint8_t*)pubDest, (uint8_t*)pubDest + msg_size)).c_str());
+
+        *psteamIDRemote = packet.remote;
+        PRINT_DEBUG("len %u channel: %u from: " "%" PRIu64 "", msg_size, nChannel, packet.remote.ConvertToUint64());
+        channel->second.pop_front();
+        return true;
     }
 
     if (pcubMsgSize) *pcubMsgSize = 0;
@@ -575,7 +580,7 @@ bool Steam_Networking::SendDataOnSocket( SNetSocket_t hSocket, void *pubData, ui
     msg.mutable_network_old()->set_type(Network_Old::DATA);
     msg.mutable_network_old()->set_connection_id(socket->other_id);
     msg.mutable_network_old()->set_data(pubData, cubData);
-    return network->sendTo(&msg, bReliable);
+    return network->sendTo(std::move(msg), bReliable);
 }
 
 
@@ -779,39 +784,40 @@ void Steam_Networking::RunCallbacks()
     {
         auto msg = std::begin(unprocessed_messages);
         while (msg != std::end(unprocessed_messages)) {
-            CSteamID source_id((uint64)msg->source_id());
-            if (!connection_exists(source_id)) {
-                if (new_connection_times.find(source_id) == new_connection_times.end()) {
-                    new_connections_to_call_cb.push(source_id);
-                    new_connection_times[source_id] = std::chrono::high_resolution_clock::now();
+            struct P2P_Packet packet{};
+            packet.remote = CSteamID((uint64)msg->source_id());
+            packet.channel = msg->network().channel();
+            packet.data = std::move(*msg->mutable_network()->mutable_data());
+            packet.time_processed = current_time;
+
+            if (!connection_exists(packet.remote)) {
+                if (new_connection_times.find(packet.remote) == new_connection_times.end()) {
+                    new_connections_to_call_cb.push(packet.remote);
+                    new_connection_times[packet.remote] = std::chrono::high_resolution_clock::now();
                 }
+
+                orphaned_messages[packet.remote].push_back(std::move(packet));
             } else {
-                struct Steam_Networking_Connection *conn = get_or_create_connection(source_id);
-                conn->open_channels.insert(msg->network().channel());
+                struct Steam_Networking_Connection *conn = get_or_create_connection(packet.remote);
+                conn->open_channels.insert(packet.channel);
+                channel_messages[packet.channel].push_back(std::move(packet));
             }
 
-            msg->mutable_network()->set_processed(true);
-            msg->mutable_network()->set_time_processed(current_time);
-            messages.push_back(*msg);
             msg = unprocessed_messages.erase(msg);
         }
     }
 
-    auto msg = std::begin(messages);
-    while (msg != std::end(messages)) {
-        bool deleted = false;
-        if (msg->network().processed()) {
-            if (!connection_exists((uint64)msg->source_id())) {
-                if (msg->network().time_processed() + ORPHANED_PACKET_TIMEOUT < current_time) {
-                    deleted = true;
-                }
-            }
+    auto orphaned = std::begin(orphaned_messages);
+    while (orphaned != std::end(orphaned_messages)) {
+        auto &queue = orphaned->second;
+        while (!queue.empty() && queue.front().time_processed + ORPHANED_PACKET_TIMEOUT < current_time) {
+            queue.pop_front();
         }
 
-        if (deleted) {
-            msg = messages.erase(msg);
+        if (queue.empty()) {
+            orphaned = orphaned_messages.erase(orphaned);
         } else {
-            ++msg;
+            ++orphaned;
         }
     }
 
@@ -852,8 +858,8 @@ void Steam_Networking::RunCallbacks()
 void Steam_Networking::Callback(Common_Message *msg)
 {
     if (msg->has_network()) {
-        PRINT_DEBUG("got msg from: " "%" PRIu64 " to: " "%" PRIu64 " size %zu type %u | messages %p: %zu",
-            msg->source_id(), msg->dest_id(), msg->network().data().size(), msg->network().type(), &messages, messages.size()
+        PRINT_DEBUG("got msg from: " "%" PRIu64 " to: " "%" PRIu64 " size %zu type %u | unprocessed messages: %zu",
+            msg->source_id(), msg->dest_id(), msg->network().data().size(), msg->network().type(), unprocessed_messages.size()
         );
         PRINT_DEBUG("msg data: '%s'",
             common_helpers::uint8_vector_to_hex_string(std::vector<uint8_t>(msg->network().data().begin(), msg->network().data().end())).c_str());
@@ -863,16 +869,8 @@ void Steam_Networking::Callback(Common_Message *msg)
         }
 
         if (msg->network().type() == Network_pb::NEW_CONNECTION) {
-            std::lock_guard<std::recursive_mutex> lock(messages_mutex);
-            auto msg_temp = std::begin(messages);
-            while (msg_temp != std::end(messages)) {
-                //only delete processed to handle unreliable message arriving at the same time.
-                if (msg_temp->source_id() == msg->source_id() && msg_temp->network().processed()) {
-                    msg_temp = messages.erase(msg_temp);
-                } else {
-                    ++msg_temp;
-                }
-            }
+            //only delete processed to handle unreliable message arriving at the same time.
+            remove_messages((uint64)msg->source_id());
         }
     }
 
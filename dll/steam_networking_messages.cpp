@@ -39,14 +39,16 @@ void Steam_Networking_Messages::steam_run_every_runcb(void *object)
 
 void Steam_Networking_Messages::free_steam_message_data(SteamNetworkingMessage_t *pMsg)
 {
-    free(pMsg->m_pData);
+    Steam_Message_Received *received = static_cast<Steam_Message_Received *>(pMsg);
+    std::string().swap(received->payload);
     pMsg->m_pData = NULL;
+    pMsg->m_cbSize = 0;
 }
 
 void Steam_Networking_Messages::delete_steam_message(SteamNetworkingMessage_t *pMsg)
 {
     if (pMsg->m_pfnFreeData) pMsg->m_pfnFreeData(pMsg);
-    delete pMsg;
+    delete static_cast<Steam_Message_Received *>(pMsg);
 }
 
 void Steam_Networking_Messages::end_connection(CSteamID steam_id)
@@ -57,10 +59,30 @@ void Steam_Networking_Messages::end_connection(CSteamID steam_id)
     }
 }
 
+void Steam_Networking_Messages::remove_messages(CSteamID steam_id)
+{
+    for (auto &chan : channel_messages) {
+        auto &queue = chan.second;
+        auto msg = std::begin(queue);
+        while (msg != std::end(queue)) {
+            if ((*msg)->m_identityPeer.GetSteamID() == steam_id) {
+                (*msg)->Release();
+                msg = queue.erase(msg);
+            } else {
+                ++msg;
+            }
+        }
+    }
+}
+
 std::map<CSteamID, Steam_Message_Connection>::iterator Steam_Networking_Messages::find_or_create_message_connection(SteamNetworkingIdentity identityRemote, bool incoming, bool restartbroken)
 {
     auto conn = connections.find(identityRemote.GetSteamID());
     if (conn == connections.end() || (conn->second.dead && restartbroken)) {
+        if (conn != connections.end()) {
+            remove_messages(conn->first);
+        }
+
         ++id_counter;
         struct Steam_Message_Connection con;
         con.remote_identity = identityRemote;
@@ -117,6 +139,12 @@ Steam_Networking_Messages::~Steam_Networking_Messages()
     this->network->rmCallback(CALLBACK_ID_NETWORKING_MESSAGES, settings->get_local_steam_id(), &Steam_Networking_Messages::steam_callback, this);
     this->network->rmCallback(CALLBACK_ID_USER_STATUS, settings->get_local_steam_id(), &Steam_Networking_Messages::steam_callback, this);
     this->run_every_runcb->remove(&Steam_Networking_Messages::steam_run_every_runcb, this);
+
+    for (auto &chan : channel_messages) {
+        for (auto msg : chan.second) {
+            msg->Release();
+        }
+    }
 }
 
 
@@ -202,7 +230,7 @@ EResult Steam_Networking_Messages::SendMessageToUser( const SteamNetworkingIdent
     msg.mutable_networking_messages()->set_id_from(conn->second.id);
     msg.mutable_networking_messages()->set_data(pubData, cubData);
 
-    network->sendTo(&msg, reliable);
+    network->sendTo(std::move(msg), reliable);
     return k_EResultOK;
 }
 
@@ -216,34 +244,13 @@ int Steam_Networking_Messages::ReceiveMessagesOnChannel( int nLocalChannel, Stea
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     int message_counter = 0;
 
-    for (auto & conn : connections) {
-        auto chan = conn.second.data.find(nLocalChannel);
-        if (chan != conn.second.data.end()) {
-            while (!chan->second.empty() && message_counter < nMaxMessages) {
-                SteamNetworkingMessage_t *pMsg = new SteamNetworkingMessage_t(); //TODO size is wrong
-                unsigned long size = static_cast<unsigned long>(chan->second.front().size());
-                pMsg->m_pData = malloc(size);
-                pMsg->m_cbSize = size;
-                memcpy(pMsg->m_pData, chan->second.front().data(), size);
-                pMsg->m_conn = conn.second.id;
-                pMsg->m_identityPeer = conn.second.remote_identity;
-                pMsg->m_nConnUserData = -1;
-                pMsg->m_usecTimeReceived = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - created).count();
-                //TODO: messagenumber?
-                // pMsg->m_nMessageNumber = connect_socket->second.packet_receive_counter;
-                // ++connect_socket->second.packet_receive_counter;
-
-                pMsg->m_pfnFreeData = &free_steam_message_data;
-                pMsg->m_pfnRelease = &delete_steam_message;
-                pMsg->m_nChannel = nLocalChannel;
-                ppOutMessages[message_counter] = pMsg;
-                ++message_counter;
-                chan->second.pop();
-            }
-        }
-
-        if (message_counter >= nMaxMessages) {
-            break;
+    auto chan = channel_messages.find(nLocalChannel);
+    if (chan != channel_messages.end()) {
+        // the queued messages already own their payload, ownership goes to the game as is
+        while (!chan->second.empty() && message_counter < nMaxMessages) {
+            ppOutMessages[message_counter] = chan->second.front();
+            ++message_counter;
+            chan->second.pop_front();
         }
     }
 
@@ -294,6 +301,7 @@ bool Steam_Networking_Messages::CloseSessionWithUser( const SteamNetworkingIdent
     msg.mutable_networking_messages()->set_id_from(conn->second.id);
     network->sendTo(&msg, true);
 
+    remove_messages(conn->first);
     connections.erase(conn);
     return true;
 }
@@ -356,22 +364,33 @@ ESteamNetworkingConnectionState Steam_Networking_Messages::GetSessionConnectionI
 
 void Steam_Networking_Messages::RunCallbacks()
 {
-    auto msg = std::begin(incoming_data);
-    while (msg != std::end(incoming_data)) {
-        CSteamID source_id((uint64)msg->source_id());
-
-        auto conn = connections.find(source_id);
-        if (conn != connections.end()) {
-            if (conn->second.remote_id == msg->networking_messages().id_from())
-                conn->second.data[msg->networking_messages().channel()].push(msg->networking_messages().data());
+    while (!incoming_data.empty()) {
+        Steam_Message_Incoming &incoming = incoming_data.front();
+
+        auto conn = connections.find(incoming.source_id);
+        if (conn != connections.end() && conn->second.remote_id == incoming.id_from) {
+            Steam_Message_Received *pMsg = new Steam_Message_Received();
+            pMsg->payload = std::move(incoming.payload);
+            pMsg->m_pData = &pMsg->payload[0];
+            pMsg->m_cbSize = static_cast<int>(pMsg->payload.size());
+            pMsg->m_conn = conn->second.id;
+            pMsg->m_identityPeer = conn->second.remote_identity;
+            pMsg->m_nConnUserData = -1;
+            pMsg->m_usecTimeReceived = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - created).count();
+            //TODO: messagenumber?
+            pMsg->m_pfnFreeData = &free_steam_message_data;
+            pMsg->m_pfnRelease = &delete_steam_message;
+            pMsg->m_nChannel = incoming.channel;
+            channel_messages[incoming.channel].push_back(pMsg);
         }
 
-        msg = incoming_data.erase(msg);
+        incoming_data.pop_front();
     }
 
     auto conn = std::begin(connections);
     while (conn != std::end(connections)) {
         if (!conn->second.accepted && check_timedout(conn->second.created, NETWORKING_MESSAGES_TIMEOUT)) {
+            remove_messages(conn->first);
             conn = connections.erase(conn);
         } else {
             ++conn;
@@ -413,7 +432,13 @@ void Steam_Networking_Messages::Callback(Common_Message *msg)
         }
 
         if (msg->networking_messages().type() == Networking_Messages::DATA) {
-            incoming_data.push_back(Common_Message(*msg));
+            // only this interface consumes networking messages, so the payload can be moved out
+            Steam_Message_Incoming incoming{};
+            incoming.source_id = CSteamID((uint64)msg->source_id());
+            incoming.id_from = msg->networking_messages().id_from();
+            incoming.channel = msg->networking_messages().channel();
+            incoming.payload = std::move(*msg->mutable_networking_messages()->mutable_data());
+            incoming_data.push_back(std::move(incoming));
         }
     }
 }
@@ -17,6 +17,26 @@
 
 #include "dll/steam_networking_sockets.h"
 
+// payload bytes per segment on the reliable UDP channel, keeps every datagram below the usual MTU
+#define RELIABLE_UDP_SEGMENT_SIZE 1200
+// congestion window, in segments
+#define RELIABLE_UDP_INITIAL_CWND 4.0
+#define RELIABLE_UDP_MIN_CWND 2.0
+#define RELIABLE_UDP_MAX_CWND 1024.0
+// segments further ahead than this are dropped instead of buffered, the sender never has more than its max window in flight
+#define RELIABLE_UDP_RECV_WINDOW 1024
+// retransmit a segment once this many later segments were acked
+#define RELIABLE_UDP_FAST_RETRANSMIT 3
+// give up on the connection after retransmitting a single segment this many times
+#define RELIABLE_UDP_MAX_RETRANSMITS 15
+// retransmission timeout bounds, in milliseconds
+#define RELIABLE_UDP_INITIAL_RTO_MS 500
+#define RELIABLE_UDP_MIN_RTO_MS 50
+#define RELIABLE_UDP_MAX_RTO_MS 3000
+// a closed connection stops waiting for its reliable UDP data to be acked after this long
+#define RELIABLE_UDP_LINGER_MS 10000
+// how often the per second rates and the local connection quality of a connection are recalculated
+#define CONNECTION_STATS_INTERVAL_MS 1000
 
 void Steam_Networking_Sockets::steam_callback(void *object, Common_Message *msg)
 {
@@ -78,7 +98,7 @@ unsigned long Steam_Networking_Sockets::get_socket_id()
     return socket_id;
 }
 
-HSteamNetConnection Steam_Networking_Sockets::new_connect_socket(SteamNetworkingIdentity remote_identity, int virtual_port, int real_port, enum connect_socket_status status, HSteamListenSocket listen_socket_id, HSteamNetConnection remote_id)
+HSteamNetConnection Steam_Networking_Sockets::new_connect_socket(SteamNetworkingIdentity remote_identity, int virtual_port, int real_port, enum connect_socket_status status, HSteamListenSocket listen_socket_id, HSteamNetConnection remote_id, int32 send_buffer_size)
 {
     Connect_Socket socket = {};
     socket.remote_identity = remote_identity;
@@ -93,6 +113,13 @@ HSteamNetConnection Steam_Networking_Sockets::new_connect_socket(SteamNetworking
     socket.connect_request_last_sent = std::chrono::steady_clock::now();
     socket.connect_requests_sent = 0;
     socket.packet_send_counter = 1;
+    // only a wish until the handshake, both ends must have it enabled
+    socket.reliable_udp = settings->networking_sockets_reliable_udp;
+    socket.reliable_channel.cwnd = RELIABLE_UDP_INITIAL_CWND;
+    socket.reliable_channel.ssthresh = RELIABLE_UDP_MAX_CWND;
+    socket.reliable_channel.rto = std::chrono::milliseconds(RELIABLE_UDP_INITIAL_RTO_MS);
+    socket.stats.interval_start = std::chrono::steady_clock::now();
+    socket.send_buffer_size = send_buffer_size > 0 ? send_buffer_size : sbcs->send_buffer_size;
 
     HSteamNetConnection socket_id = get_socket_id();
     if (socket_id == k_HSteamNetConnection_Invalid) ++socket_id;
@@ -131,6 +158,7 @@ bool Steam_Networking_Sockets::send_packet_new_connection(HSteamNetConnection m_
     msg.mutable_networking_sockets()->set_real_port(connect_socket->second.real_port);
     msg.mutable_networking_sockets()->set_connection_id_from(connect_socket->first);
     msg.mutable_networking_sockets()->set_connection_id(connect_socket->second.remote_id);
+    msg.mutable_networking_sockets()->set_reliable_udp(connect_socket->second.reliable_udp);
 
     uint64_t steam_id = connect_socket->second.remote_identity.GetSteamID64();
     if (steam_id) {
@@ -146,12 +174,376 @@ bool Steam_Networking_Sockets::send_packet_new_connection(HSteamNetConnection m_
     return false;
 }
 
+int32 Steam_Networking_Sockets::send_buffer_size_from_options(int nOptions, const SteamNetworkingConfigValue_t *pOptions)
+{
+    int32 send_buffer_size = sbcs->send_buffer_size;
+    if (!pOptions) return send_buffer_size;
+
+    for (int i = 0; i < nOptions; ++i) {
+        if (pOptions[i].m_eValue != k_ESteamNetworkingConfig_SendBufferSize) continue;
+        if (pOptions[i].m_eDataType != k_ESteamNetworkingConfig_Int32) continue;
+        if (pOptions[i].m_val.m_int32 > 0) send_buffer_size = pOptions[i].m_val.m_int32;
+    }
+
+    return send_buffer_size;
+}
+
+// bytes of this connection still waiting in the send queue to the peer, the other traffic to the same peer doesn't count
+size_t Steam_Networking_Sockets::get_tcp_pending_bytes(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, bool reliable)
+{
+    auto &tcp_pending = connect_socket->second.tcp_pending;
+    if (tcp_pending.size()) {
+        CSteamID peer = connect_socket->second.remote_identity.GetSteamID();
+        uint64 position = network->getSendQueuePosition(peer);
+        uint64 drained = network->getSendQueueDrained(peer);
+        // positions past the end are from a connection to the peer that was lost, the queue went with it
+        while (tcp_pending.size() && (tcp_pending.front().position <= drained || tcp_pending.front().position > position)) {
+            if (tcp_pending.front().reliable) connect_socket->second.tcp_pending_reliable_bytes -= tcp_pending.front().size;
+            else connect_socket->second.tcp_pending_unreliable_bytes -= tcp_pending.front().size;
+            tcp_pending.pop_front();
+        }
+    }
+
+    return reliable ? connect_socket->second.tcp_pending_reliable_bytes : connect_socket->second.tcp_pending_unreliable_bytes;
+}
+
+// sends a DATA message through the network layer, remembering where it waits in the send queue to the peer
+bool Steam_Networking_Sockets::send_data(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, Common_Message &&msg, bool reliable)
+{
+    uint32 size = static_cast<uint32>(msg.networking_sockets().data().size());
+    CSteamID peer = connect_socket->second.remote_identity.GetSteamID();
+    uint64 queue_position = network->getSendQueuePosition(peer);
+    if (!network->sendTo(std::move(msg), reliable)) return false;
+
+    // the position doesn't move for messages written straight to the shared memory ring, they never wait
+    if (network->getSendQueuePosition(peer) != queue_position) {
+        Connect_Socket_Queued_Send queued{};
+        queued.position = network->getSendQueuePosition(peer);
+        queued.size = size;
+        queued.reliable = reliable;
+        connect_socket->second.tcp_pending.push_back(queued);
+        if (reliable) connect_socket->second.tcp_pending_reliable_bytes += size;
+        else connect_socket->second.tcp_pending_unreliable_bytes += size;
+    }
+
+    connect_socket->second.stats.out_packets += 1;
+    connect_socket->second.stats.out_bytes += size;
+    return true;
+}
+
+// reliable messages sent before the connection was accepted, they go out on whichever transport the handshake picked
+void Steam_Networking_Sockets::send_held_reliable(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket)
+{
+    auto held = std::move(connect_socket->second.held_reliable);
+    connect_socket->second.held_reliable.clear();
+    connect_socket->second.held_reliable_bytes = 0;
+
+    for (auto &msg : held) {
+        msg.mutable_networking_sockets()->set_connection_id(connect_socket->second.remote_id);
+        if (connect_socket->second.reliable_udp) {
+            reliable_udp_send(connect_socket, msg.networking_sockets());
+        } else {
+            send_data(connect_socket, std::move(msg), true);
+        }
+    }
+}
+
+// messages of this connection held back by the fake network conditions, the reliable UDP segments are counted by their channel
+size_t Steam_Networking_Sockets::get_delayed_send_bytes(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, bool reliable)
+{
+    HSteamNetConnection id = connect_socket->first;
+    return network->getDelayedSendBytes(connect_socket->second.remote_identity.GetSteamID(), reliable, [id](const Common_Message &msg) -> size_t {
+        if (!msg.has_networking_sockets()) return 0;
+
+        const Networking_Sockets &data = msg.networking_sockets();
+        if (data.type() != Networking_Sockets::DATA || data.connection_id_from() != id || data.reliable_seq()) return 0;
+        return data.data().size();
+    });
+}
+
+// bytes queued but not delivered yet, on the reliable UDP channel and in the TCP stream to the peer
+size_t Steam_Networking_Sockets::get_pending_send_bytes(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket)
+{
+    const auto &channel = connect_socket->second.reliable_channel;
+    return connect_socket->second.held_reliable_bytes + channel.send_queue_bytes + channel.in_flight_bytes +
+        get_tcp_pending_bytes(connect_socket, true) + get_tcp_pending_bytes(connect_socket, false);
+}
+
+Common_Message Steam_Networking_Sockets::create_connection_message(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, Networking_Sockets::Types type)
+{
+    Common_Message msg;
+    msg.set_source_id(connect_socket->second.created_by.ConvertToUint64());
+    msg.set_dest_id(connect_socket->second.remote_identity.GetSteamID64());
+    msg.set_allocated_networking_sockets(new Networking_Sockets);
+    msg.mutable_networking_sockets()->set_type(type);
+    msg.mutable_networking_sockets()->set_virtual_port(connect_socket->second.virtual_port);
+    msg.mutable_networking_sockets()->set_real_port(connect_socket->second.real_port);
+    msg.mutable_networking_sockets()->set_connection_id_from(connect_socket->first);
+    msg.mutable_networking_sockets()->set_connection_id(connect_socket->second.remote_id);
+    return msg;
+}
+
+void Steam_Networking_Sockets::reliable_udp_send(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, const Networking_Sockets &message)
+{
+    auto &channel = connect_socket->second.reliable_channel;
+    const std::string &data = message.data();
+
+    size_t offset = 0;
+    do {
+        size_t len = std::min(data.size() - offset, (size_t)RELIABLE_UDP_SEGMENT_SIZE);
+        Networking_Sockets segment;
+        segment.set_type(message.type());
+        segment.set_virtual_port(message.virtual_port());
+        segment.set_real_port(message.real_port());
+        segment.set_connection_id(message.connection_id());
+        segment.set_connection_id_from(message.connection_id_from());
+        segment.set_message_number(message.message_number());
+        segment.set_data(data.data() + offset, len);
+        segment.set_reliable_seq(channel.next_seq);
+        segment.set_reliable_partial(offset + len < data.size());
+        channel.send_queue.push(std::move(segment));
+        channel.send_queue_bytes += len;
+
+        ++channel.next_seq;
+        offset += len;
+    } while (offset < data.size());
+
+    reliable_udp_fill_window(connect_socket);
+}
+
+void Steam_Networking_Sockets::reliable_udp_transmit(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, Reliable_UDP_Segment &segment)
+{
+    Common_Message msg;
+    msg.set_source_id(connect_socket->second.created_by.ConvertToUint64());
+    msg.set_dest_id(connect_socket->second.remote_identity.GetSteamID64());
+    msg.set_allocated_networking_sockets(new Networking_Sockets(segment.data));
+    network->sendTo(std::move(msg), false);
+
+    segment.last_sent = std::chrono::steady_clock::now();
+    connect_socket->second.stats.out_packets += 1;
+    connect_socket->second.stats.out_bytes += segment.data.data().size();
+    connect_socket->second.reliable_channel.segments_sent += 1;
+    if (segment.retransmits) connect_socket->second.reliable_channel.segments_retransmitted += 1;
+}
+
+void Steam_Networking_Sockets::reliable_udp_fill_window(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket)
+{
+    auto &channel = connect_socket->second.reliable_channel;
+    while (!channel.send_queue.empty() && channel.in_flight.size() < (size_t)channel.cwnd) {
+        uint64 seq = channel.send_queue.front().reliable_seq();
+        // the receiver drops segments this far ahead of what it still waits for
+        uint64 oldest_unacked = channel.in_flight.empty() ? seq : channel.in_flight.begin()->first;
+        if (seq - oldest_unacked >= RELIABLE_UDP_RECV_WINDOW) break;
+
+        Reliable_UDP_Segment &segment = channel.in_flight[seq];
+        segment.data = std::move(channel.send_queue.front());
+        channel.send_queue.pop();
+        channel.send_queue_bytes -= segment.data.data().size();
+        channel.in_flight_bytes += segment.data.data().size();
+
+        segment.first_sent = std::chrono::steady_clock::now();
+        reliable_udp_transmit(connect_socket, segment);
+    }
+}
+
+void Steam_Networking_Sockets::reliable_udp_receive(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, const Networking_Sockets &segment)
+{
+    auto &channel = connect_socket->second.reliable_channel;
+    // always ack, even duplicates, the previous ack might have been lost
+    channel.ack_pending = true;
+
+    if (segment.reliable_seq() < channel.recv_next) return;
+    if (segment.reliable_seq() - channel.recv_next >= RELIABLE_UDP_RECV_WINDOW) {
+        PRINT_DEBUG("reliable udp segment " "%" PRIu64 " outside of the receive window on connection %u", segment.reliable_seq(), connect_socket->first);
+        return;
+    }
+
+    channel.recv_out_of_order.emplace(segment.reliable_seq(), segment);
+
+    auto next = channel.recv_out_of_order.begin();
+    while (next != channel.recv_out_of_order.end() && next->first == channel.recv_next) {
+        channel.recv_partial.append(next->second.data());
+        if (!next->second.reliable_partial()) {
+            Networking_Sockets message = std::move(next->second);
+            message.set_data(std::move(channel.recv_partial));
+            message.clear_reliable_seq();
+            channel.recv_partial.clear();
+
+            PRINT_DEBUG("reliable udp message len %zu, num " "%" PRIu64 " on connection %u", message.data().size(), message.message_number(), connect_socket->first);
+            connect_socket->second.data.push(std::move(message));
+        }
+
+        ++channel.recv_next;
+        next = channel.recv_out_of_order.erase(next);
+    }
+}
+
+void Steam_Networking_Sockets::reliable_udp_handle_ack(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, const Networking_Sockets &ack)
+{
+    auto &channel = connect_socket->second.reliable_channel;
+    auto now = std::chrono::steady_clock::now();
+
+    uint64 highest_acked = 0;
+    unsigned newly_acked = 0;
+    auto segment = channel.in_flight.begin();
+    while (segment != channel.in_flight.end()) {
+        uint64 seq = segment->first;
+        bool acked = seq <= ack.ack_seq();
+        if (!acked) {
+            uint64 bit = seq - ack.ack_seq() - 1;
+            acked = bit < 64 && ((ack.ack_bits() >> bit) & 1);
+        }
+
+        if (!acked) {
+            ++segment;
+            continue;
+        }
+
+        // Karn's algorithm, retransmitted segments give ambiguous samples
+        if (!segment->second.retransmits) {
+            auto sample = std::chrono::duration_cast<std::chrono::microseconds>(now - segment->second.first_sent);
+            if (channel.srtt.count() == 0) {
+                channel.srtt = sample;
+                channel.rttvar = sample / 2;
+            } else {
+                channel.rttvar = (channel.rttvar * 3 + std::chrono::abs(channel.srtt - sample)) / 4;
+                channel.srtt = (channel.srtt * 7 + sample) / 8;
+            }
+
+            channel.rto = std::clamp<std::chrono::microseconds>(
+                channel.srtt + channel.rttvar * 4,
+                std::chrono::milliseconds(RELIABLE_UDP_MIN_RTO_MS),
+                std::chrono::milliseconds(RELIABLE_UDP_MAX_RTO_MS)
+            );
+        }
+
+        highest_acked = seq;
+        ++newly_acked;
+        channel.in_flight_bytes -= segment->second.data.data().size();
+        segment = channel.in_flight.erase(segment);
+    }
+
+    // slow start, then additive increase
+    for (unsigned i = 0; i < newly_acked; ++i) {
+        if (channel.cwnd < channel.ssthresh) channel.cwnd += 1.0;
+        else channel.cwnd += 1.0 / channel.cwnd;
+    }
+    channel.cwnd = std::min(channel.cwnd, RELIABLE_UDP_MAX_CWND);
+
+    // segments older than the newest acked one were most likely lost
+    for (auto &in_flight : channel.in_flight) {
+        if (in_flight.first >= highest_acked) break;
+        if (++in_flight.second.times_skipped != RELIABLE_UDP_FAST_RETRANSMIT) continue;
+
+        // multiplicative decrease, once per window
+        if (in_flight.first >= channel.recovery_seq) {
+            channel.ssthresh = std::max(channel.cwnd / 2.0, RELIABLE_UDP_MIN_CWND);
+            channel.cwnd = channel.ssthresh;
+            channel.recovery_seq = channel.next_seq;
+        }
+
+        ++in_flight.second.retransmits;
+        reliable_udp_transmit(connect_socket, in_flight.second);
+    }
+
+    reliable_udp_fill_window(connect_socket);
+}
+
+bool Steam_Networking_Sockets::reliable_udp_run(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, std::chrono::steady_clock::time_point now)
+{
+    auto &channel = connect_socket->second.reliable_channel;
+
+    if (channel.ack_pending) {
+        uint64 ack_seq = channel.recv_next - 1;
+        uint64 ack_bits = 0;
+        for (const auto &segment : channel.recv_out_of_order) {
+            uint64 bit = segment.first - ack_seq - 1;
+            if (bit >= 64) break;
+            ack_bits |= 1ULL << bit;
+        }
+
+        Common_Message msg = create_connection_message(connect_socket, Networking_Sockets::ACK);
+        msg.mutable_networking_sockets()->set_ack_seq(ack_seq);
+        msg.mutable_networking_sockets()->set_ack_bits(ack_bits);
+        network->sendTo(&msg, false);
+        channel.ack_pending = false;
+    }
+
+    bool timed_out = false;
+    for (auto &segment : channel.in_flight) {
+        if ((now - segment.second.last_sent) < channel.rto) continue;
+        if (segment.second.retransmits >= RELIABLE_UDP_MAX_RETRANSMITS) return false;
+
+        timed_out = true;
+        ++segment.second.retransmits;
+        reliable_udp_transmit(connect_socket, segment.second);
+    }
+
+    if (timed_out) {
+        // nothing got through for a whole timeout, back off and probe again
+        channel.ssthresh = std::max(channel.cwnd / 2.0, RELIABLE_UDP_MIN_CWND);
+        channel.cwnd = RELIABLE_UDP_MIN_CWND;
+        channel.recovery_seq = channel.next_seq;
+        channel.rto = std::min<std::chrono::microseconds>(channel.rto * 2, std::chrono::milliseconds(RELIABLE_UDP_MAX_RTO_MS));
+    }
+
+    reliable_udp_fill_window(connect_socket);
+    return true;
+}
+
+void Steam_Networking_Sockets::receive_data(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, Networking_Sockets &data)
+{
+    auto &stats = connect_socket->second.stats;
+    stats.in_packets += 1;
+    stats.in_bytes += data.data().size();
+
+    // every segment of a message has the same number, retransmits and late packets have old ones
+    uint64 message_number = data.message_number();
+    if (message_number > stats.highest_message_number) {
+        stats.messages_lost += message_number - stats.highest_message_number - 1;
+        stats.highest_message_number = message_number;
+        stats.messages_received += 1;
+    } else if (message_number < stats.highest_message_number && stats.messages_lost && !data.reliable_seq()) {
+        // reordered, not lost
+        stats.messages_lost -= 1;
+        stats.messages_received += 1;
+    }
+
+    if (data.reliable_seq()) {
+        reliable_udp_receive(connect_socket, data);
+    } else {
+        connect_socket->second.data.push(std::move(data));
+    }
+}
+
+void Steam_Networking_Sockets::update_stats(std::map<HSteamNetConnection, Connect_Socket>::iterator connect_socket, std::chrono::steady_clock::time_point now)
+{
+    auto &stats = connect_socket->second.stats;
+    auto elapsed = std::chrono::duration_cast<std::chrono::duration<float>>(now - stats.interval_start);
+    if (elapsed < std::chrono::milliseconds(CONNECTION_STATS_INTERVAL_MS)) return;
+
+    stats.out_packets_per_sec = stats.out_packets / elapsed.count();
+    stats.out_bytes_per_sec = stats.out_bytes / elapsed.count();
+    stats.in_packets_per_sec = stats.in_packets / elapsed.count();
+    stats.in_bytes_per_sec = stats.in_bytes / elapsed.count();
+    stats.out_packets = stats.out_bytes = stats.in_packets = stats.in_bytes = 0;
+
+    // keep the last quality if nothing arrived during this interval
+    uint64 expected = stats.messages_received + stats.messages_lost;
+    if (expected) {
+        stats.quality_local = static_cast<float>(stats.messages_received) / expected;
+    }
+
+    stats.messages_received = stats.messages_lost = 0;
+    stats.interval_start = now;
+}
+
 shared_between_client_server* Steam_Networking_Sockets::get_shared_between_client_server()
 {
     return sbcs;
 }
 
-HSteamListenSocket Steam_Networking_Sockets::new_listen_socket(int nSteamConnectVirtualPort, int real_port)
+HSteamListenSocket Steam_Networking_Sockets::new_listen_socket(int nSteamConnectVirtualPort, int real_port, int32 send_buffer_size)
 {
     HSteamListenSocket socket_id = get_socket_id();
     if (socket_id == k_HSteamListenSocket_Invalid) ++socket_id;
@@ -165,6 +557,7 @@ HSteamListenSocket Steam_Networking_Sockets::new_listen_socket(int nSteamConnect
     listen_socket.virtual_port = nSteamConnectVirtualPort;
     listen_socket.real_port = real_port;
     listen_socket.created_by = steam_id;
+    listen_socket.send_buffer_size = send_buffer_size;
     sbcs->listen_sockets.push_back(listen_socket);
     return socket_id;
 }
@@ -281,7 +674,7 @@ HSteamListenSocket Steam_Networking_Sockets::CreateListenSocket( int nSteamConne
 {
     PRINT_DEBUG("%i %u %u", nSteamConnectVirtualPort, nIP, nPort);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return new_listen_socket(nSteamConnectVirtualPort, nPort);
+    return new_listen_socket(nSteamConnectVirtualPort, nPort, sbcs->send_buffer_size);
 }
 
 /// Creates a "server" socket that listens for clients to connect to by 
@@ -302,21 +695,21 @@ HSteamListenSocket Steam_Networking_Sockets::CreateListenSocketIP( const SteamNe
 {
     PRINT_DEBUG("old");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return new_listen_socket(SNS_DISABLED_PORT, localAddress.m_port);
+    return new_listen_socket(SNS_DISABLED_PORT, localAddress.m_port, sbcs->send_buffer_size);
 }
 
 HSteamListenSocket Steam_Networking_Sockets::CreateListenSocketIP( const SteamNetworkingIPAddr *localAddress )
 {
     PRINT_DEBUG("old1");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return new_listen_socket(SNS_DISABLED_PORT, localAddress->m_port);
+    return new_listen_socket(SNS_DISABLED_PORT, localAddress->m_port, sbcs->send_buffer_size);
 }
 
 HSteamListenSocket Steam_Networking_Sockets::CreateListenSocketIP( const SteamNetworkingIPAddr &localAddress, int nOptions, const SteamNetworkingConfigValue_t *pOptions )
 {
     PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return new_listen_socket(SNS_DISABLED_PORT, localAddress.m_port);
+    return new_listen_socket(SNS_DISABLED_PORT, localAddress.m_port, send_buffer_size_from_options(nOptions, pOptions));
 }
 
 /// Creates a connection and begins talking to a "server" over UDP at the
@@ -343,7 +736,7 @@ HSteamNetConnection Steam_Networking_Sockets::ConnectByIPAddress( const SteamNet
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     SteamNetworkingIdentity ip_id;
     ip_id.SetIPAddr(address);
-    HSteamNetConnection socket = new_connect_socket(ip_id, SNS_DISABLED_PORT, address.m_port);
+    HSteamNetConnection socket = new_connect_socket(ip_id, SNS_DISABLED_PORT, address.m_port, CONNECT_SOCKET_CONNECTING, k_HSteamListenSocket_Invalid, k_HSteamNetConnection_Invalid, sbcs->send_buffer_size);
     send_packet_new_connection(socket);
     return socket;
 }
@@ -354,7 +747,7 @@ HSteamNetConnection Steam_Networking_Sockets::ConnectByIPAddress( const SteamNet
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     SteamNetworkingIdentity ip_id;
     ip_id.SetIPAddr(*address);
-    HSteamNetConnection socket = new_connect_socket(ip_id, SNS_DISABLED_PORT, address->m_port);
+    HSteamNetConnection socket = new_connect_socket(ip_id, SNS_DISABLED_PORT, address->m_port, CONNECT_SOCKET_CONNECTING, k_HSteamListenSocket_Invalid, k_HSteamNetConnection_Invalid, sbcs->send_buffer_size);
     send_packet_new_connection(socket);
     return socket;
 }
@@ -365,7 +758,7 @@ HSteamNetConnection Steam_Networking_Sockets::ConnectByIPAddress( const SteamNet
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     SteamNetworkingIdentity ip_id;
     ip_id.SetIPAddr(address);
-    HSteamNetConnection socket = new_connect_socket(ip_id, SNS_DISABLED_PORT, address.m_port);
+    HSteamNetConnection socket = new_connect_socket(ip_id, SNS_DISABLED_PORT, address.m_port, CONNECT_SOCKET_CONNECTING, k_HSteamListenSocket_Invalid, k_HSteamNetConnection_Invalid, send_buffer_size_from_options(nOptions, pOptions));
     send_packet_new_connection(socket);
     return socket;
 }
@@ -384,15 +777,15 @@ HSteamListenSocket Steam_Networking_Sockets::CreateListenSocketP2P( int nVirtual
 {
     PRINT_DEBUG("old %i", nVirtualPort);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return new_listen_socket(nVirtualPort, SNS_DISABLED_PORT);
+    return new_listen_socket(nVirtualPort, SNS_DISABLED_PORT, sbcs->send_buffer_size);
 }
 
 HSteamListenSocket Steam_Networking_Sockets::CreateListenSocketP2P( int nVirtualPort, int nOptions, const SteamNetworkingConfigValue_t *pOptions )
 {
     PRINT_DEBUG("%i", nVirtualPort);
-    //TODO config options
+    //TODO rest of the config options
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return new_listen_socket(nVirtualPort, SNS_DISABLED_PORT);
+    return new_listen_socket(nVirtualPort, SNS_DISABLED_PORT, send_buffer_size_from_options(nOptions, pOptions));
 }
 
 /// Begin connecting to a server that is identified using a platform-specific identifier.
@@ -409,6 +802,19 @@ HSteamListenSocket Steam_Networking_Sockets::CreateListenSocketP2P( int nVirtual
 HSteamNetConnection Steam_Networking_Sockets::ConnectP2P( const SteamNetworkingIdentity &identityRemote, int nVirtualPort )
 {
     PRINT_DEBUG("old %i", nVirtualPort);
+    return ConnectP2P(identityRemote, nVirtualPort, 0, NULL);
+}
+
+HSteamNetConnection Steam_Networking_Sockets::ConnectP2P( const SteamNetworkingIdentity *identityRemote, int nVirtualPort )
+{
+    PRINT_DEBUG("old1");
+    return ConnectP2P(*identityRemote, nVirtualPort);
+}
+
+HSteamNetConnection Steam_Networking_Sockets::ConnectP2P( const SteamNetworkingIdentity &identityRemote, int nVirtualPort, int nOptions, const SteamNetworkingConfigValue_t *pOptions )
+{
+    PRINT_DEBUG("%i", nVirtualPort);
+    //TODO rest of the config options
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
 
     const SteamNetworkingIPAddr *ip = identityRemote.GetIPAddr();
@@ -423,24 +829,11 @@ HSteamNetConnection Steam_Networking_Sockets::ConnectP2P( const SteamNetworkingI
         return k_HSteamNetConnection_Invalid;
     }
 
-    HSteamNetConnection socket = new_connect_socket(identityRemote, nVirtualPort, SNS_DISABLED_PORT);
+    HSteamNetConnection socket = new_connect_socket(identityRemote, nVirtualPort, SNS_DISABLED_PORT, CONNECT_SOCKET_CONNECTING, k_HSteamListenSocket_Invalid, k_HSteamNetConnection_Invalid, send_buffer_size_from_options(nOptions, pOptions));
     send_packet_new_connection(socket);
     return socket;
 }
 
-HSteamNetConnection Steam_Networking_Sockets::ConnectP2P( const SteamNetworkingIdentity *identityRemote, int nVirtualPort )
-{
-    PRINT_DEBUG("old1");
-    return ConnectP2P(*identityRemote, nVirtualPort);
-}
-
-HSteamNetConnection Steam_Networking_Sockets::ConnectP2P( const SteamNetworkingIdentity &identityRemote, int nVirtualPort, int nOptions, const SteamNetworkingConfigValue_t *pOptions )
-{
-    PRINT_DEBUG("%i", nVirtualPort);
-    //TODO config options
-    return ConnectP2P(identityRemote, nVirtualPort);
-}
-
 /// Creates a connection and begins talking to a remote destination.  The remote host
 /// must be listening with a matching call to CreateListenSocket.
 ///
@@ -545,16 +938,19 @@ bool Steam_Networking_Sockets::CloseConnection( HSteamNetConnection hPeer, int n
     if (connect_socket == sbcs->connect_sockets.end()) return false;
 
     if (connect_socket->second.status != CONNECT_SOCKET_CLOSED && connect_socket->second.status != CONNECT_SOCKET_TIMEDOUT) {
+        // CONNECTION_END goes over TCP and would overtake the reliable UDP data, it's sent once everything is acked
+        // the TCP stream always delivers what was queued before it, so this lingers even if bEnableLinger is false
+        auto &channel = connect_socket->second.reliable_channel;
+        if (channel.send_queue.size() || channel.in_flight.size()) {
+            PRINT_DEBUG("connection %u lingers until its reliable udp data is acked", hPeer);
+            connect_socket->second.linger_start = std::chrono::steady_clock::now();
+            connect_socket->second.data = {};
+            sbcs->lingering_sockets.insert(sbcs->connect_sockets.extract(connect_socket));
+            return true;
+        }
+
         //TODO send/nReason and pszDebug
-        Common_Message msg;
-        msg.set_source_id(connect_socket->second.created_by.ConvertToUint64());
-        msg.set_dest_id(connect_socket->second.remote_identity.GetSteamID64());
-        msg.set_allocated_networking_sockets(new Networking_Sockets);
-        msg.mutable_networking_sockets()->set_type(Networking_Sockets::CONNECTION_END);
-        msg.mutable_networking_sockets()->set_virtual_port(connect_socket->second.virtual_port);
-        msg.mutable_networking_sockets()->set_real_port(connect_socket->second.real_port);
-        msg.mutable_networking_sockets()->set_connection_id_from(connect_socket->first);
-        msg.mutable_networking_sockets()->set_connection_id(connect_socket->second.remote_id);
+        Common_Message msg = create_connection_message(connect_socket, Networking_Sockets::CONNECTION_END);
         network->sendTo(&msg, true);
     }
 
@@ -729,15 +1125,12 @@ EResult Steam_Networking_Sockets::SendMessageToConnection( HSteamNetConnection h
     if (connect_socket->second.status == CONNECT_SOCKET_TIMEDOUT) return k_EResultNoConnection;
     if (connect_socket->second.status != CONNECT_SOCKET_CONNECTED && connect_socket->second.status != CONNECT_SOCKET_CONNECTING) return k_EResultInvalidState;
 
-    Common_Message msg;
-    msg.set_source_id(connect_socket->second.created_by.ConvertToUint64());
-    msg.set_dest_id(connect_socket->second.remote_identity.GetSteamID64());
-    msg.set_allocated_networking_sockets(new Networking_Sockets);
-    msg.mutable_networking_sockets()->set_type(Networking_Sockets::DATA);
-    msg.mutable_networking_sockets()->set_virtual_port(connect_socket->second.virtual_port);
-    msg.mutable_networking_sockets()->set_real_port(connect_socket->second.real_port);
-    msg.mutable_networking_sockets()->set_connection_id_from(connect_socket->first);
-    msg.mutable_networking_sockets()->set_connection_id(connect_socket->second.remote_id);
+    if (get_pending_send_bytes(connect_socket) + cbData > static_cast<size_t>(connect_socket->second.send_buffer_size)) {
+        PRINT_DEBUG("send buffer of connection %u is full", hConn);
+        return k_EResultLimitExceeded;
+    }
+
+    Common_Message msg = create_connection_message(connect_socket, Networking_Sockets::DATA);
     msg.mutable_networking_sockets()->set_data(pData, cbData);
     uint64 message_number = connect_socket->second.packet_send_counter;
     msg.mutable_networking_sockets()->set_message_number(message_number);
@@ -745,7 +1138,20 @@ EResult Steam_Networking_Sockets::SendMessageToConnection( HSteamNetConnection h
 
     bool reliable = false;
     if (nSendFlags & k_nSteamNetworkingSend_Reliable) reliable = true;
-    if (network->sendTo(&msg, reliable)) {
+    if (reliable && connect_socket->second.reliable_udp) {
+        if (connect_socket->second.status == CONNECT_SOCKET_CONNECTED) {
+            reliable_udp_send(connect_socket, msg.networking_sockets());
+        } else {
+            // the handshake decides between TCP and the reliable UDP channel, sending on one before would let the other overtake it
+            connect_socket->second.held_reliable_bytes += cbData;
+            connect_socket->second.held_reliable.push_back(std::move(msg));
+        }
+
+        if (pOutMessageNumber) *pOutMessageNumber = message_number;
+        return k_EResultOK;
+    }
+
+    if (send_data(connect_socket, std::move(msg), reliable)) {
         if (pOutMessageNumber) *pOutMessageNumber = message_number;
         return k_EResultOK;
     }
@@ -929,17 +1335,44 @@ EResult Steam_Networking_Sockets::GetConnectionRealTimeStatus( HSteamNetConnecti
     if (connect_socket == sbcs->connect_sockets.end()) return k_EResultNoConnection;
 
     if (pStatus) {
+        const auto &stats = connect_socket->second.stats;
+        const auto &channel = connect_socket->second.reliable_channel;
+
+        int ping = network->getPing(connect_socket->second.remote_identity.GetSteamID());
+        if (ping < 0 && channel.srtt.count()) {
+            ping = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(channel.srtt).count());
+        }
+
+        // the TCP stream has no acks, everything still in its buffer counts as pending
+        int pending_reliable = static_cast<int>(connect_socket->second.held_reliable_bytes + channel.send_queue_bytes + get_tcp_pending_bytes(connect_socket, true) + get_delayed_send_bytes(connect_socket, true));
+        // unreliable messages wait only in the TCP stream before UDP works, or for the fake lag
+        int pending_unreliable = static_cast<int>(get_tcp_pending_bytes(connect_socket, false) + get_delayed_send_bytes(connect_socket, false));
+        int sent_unacked_reliable = static_cast<int>(channel.in_flight_bytes);
+
         pStatus->m_eState = convert_status(connect_socket->second.status);
-        pStatus->m_nPing = 10; //TODO: calculate real numbers?
-        pStatus->m_flConnectionQualityLocal = 1.0;
-        pStatus->m_flConnectionQualityRemote = 1.0;
-        //TODO: rest
-        pStatus->m_flOutPacketsPerSec = 0.0;
-        pStatus->m_flOutBytesPerSec = 0.0;
-        pStatus->m_flInPacketsPerSec = 0.0;
-        pStatus->m_flInBytesPerSec = 0.0;
-        pStatus->m_cbSentUnackedReliable = 0;
-        pStatus->m_usecQueueTime = 0;
+        pStatus->m_nPing = ping;
+        pStatus->m_flConnectionQualityLocal = stats.quality_local;
+        // the peer doesn't report what it received, only the reliable channel acks tell us how many of our packets got through
+        if (channel.segments_sent) {
+            pStatus->m_flConnectionQualityRemote = 1.0f - static_cast<float>(channel.segments_retransmitted) / channel.segments_sent;
+        } else {
+            pStatus->m_flConnectionQualityRemote = -1.0f;
+        }
+
+        pStatus->m_flOutPacketsPerSec = stats.out_packets_per_sec;
+        pStatus->m_flOutBytesPerSec = stats.out_bytes_per_sec;
+        pStatus->m_flInPacketsPerSec = stats.in_packets_per_sec;
+        pStatus->m_flInBytesPerSec = stats.in_bytes_per_sec;
+        pStatus->m_nSendRateBytesPerSecond = static_cast<int>(stats.out_bytes_per_sec);
+        pStatus->m_cbPendingUnreliable = pending_unreliable;
+        pStatus->m_cbPendingReliable = pending_reliable;
+        pStatus->m_cbSentUnackedReliable = sent_unacked_reliable;
+        // rough estimate of how long the reliable backlog takes to drain at the current send rate
+        if (pending_reliable && stats.out_bytes_per_sec > 0.0f) {
+            pStatus->m_usecQueueTime = static_cast<SteamNetworkingMicroseconds>(pending_reliable / stats.out_bytes_per_sec * 1000000.0f);
+        } else {
+            pStatus->m_usecQueueTime = 0;
+        }
 
         //Note some games (volcanoids) might not allocate a struct the whole size of SteamNetworkingQuickConnectionStatus
         //keep this in mind in future interface updates
@@ -1118,6 +1551,9 @@ bool Steam_Networking_Sockets::CreateSocketPair( HSteamNetConnection *pOutConnec
     HSteamNetConnection con1 = new_connect_socket(remote_identity, 0, SNS_DISABLED_PORT, CONNECT_SOCKET_CONNECTED, k_HSteamListenSocket_Invalid, k_HSteamNetConnection_Invalid);
     HSteamNetConnection con2 = new_connect_socket(remote_identity, 0, SNS_DISABLED_PORT, CONNECT_SOCKET_CONNECTED, k_HSteamListenSocket_Invalid, con1);
     sbcs->connect_sockets[con1].remote_id = con2;
+    // both ends live in this process, nothing goes over the network
+    sbcs->connect_sockets[con1].reliable_udp = false;
+    sbcs->connect_sockets[con2].reliable_udp = false;
     *pOutConnection1 = con1;
     *pOutConnection2 = con2;
     return true;
@@ -1568,7 +2004,7 @@ HSteamListenSocket Steam_Networking_Sockets::CreateHostedDedicatedServerListenSo
 {
     PRINT_DEBUG("old %i", nVirtualPort);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return new_listen_socket(nVirtualPort, SNS_DISABLED_PORT);
+    return new_listen_socket(nVirtualPort, SNS_DISABLED_PORT, sbcs->send_buffer_size);
 }
 
 /// Create a listen socket on the specified virtual port.  The physical UDP port to use
@@ -1583,9 +2019,9 @@ HSteamListenSocket Steam_Networking_Sockets::CreateHostedDedicatedServerListenSo
 HSteamListenSocket Steam_Networking_Sockets::CreateHostedDedicatedServerListenSocket( int nVirtualPort, int nOptions, const SteamNetworkingConfigValue_t *pOptions )
 {
     PRINT_DEBUG("old %i", nVirtualPort);
-    //TODO config options
+    //TODO rest of the config options
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return new_listen_socket(nVirtualPort, SNS_DISABLED_PORT);
+    return new_listen_socket(nVirtualPort, SNS_DISABLED_PORT, send_buffer_size_from_options(nOptions, pOptions));
 }
 
 
@@ -2018,8 +2454,34 @@ void Steam_Networking_Sockets::RunCallbacks()
             socket_conn->second.connect_requests_sent += 1;
         }
 
+        update_stats(socket_conn, current_time);
+
+        if (socket_conn->second.status != CONNECT_SOCKET_CLOSED && socket_conn->second.status != CONNECT_SOCKET_TIMEDOUT) {
+            if (!reliable_udp_run(socket_conn, current_time)) {
+                PRINT_DEBUG("reliable udp channel of connection %u timed out", socket_conn->first);
+                enum connect_socket_status old_status = socket_conn->second.status;
+                socket_conn->second.status = CONNECT_SOCKET_TIMEDOUT;
+                launch_callback(socket_conn->first, old_status);
+            }
+        }
+
         ++socket_conn;
     }
+
+    auto lingering = std::begin(sbcs->lingering_sockets);
+    while (lingering != std::end(sbcs->lingering_sockets)) {
+        auto &channel = lingering->second.reliable_channel;
+        bool flushed = channel.send_queue.empty() && channel.in_flight.empty();
+        if (!flushed && (current_time - lingering->second.linger_start) < std::chrono::milliseconds(RELIABLE_UDP_LINGER_MS) && reliable_udp_run(lingering, current_time)) {
+            ++lingering;
+            continue;
+        }
+
+        PRINT_DEBUG("lingering connection %u done, flushed %i", lingering->first, (int)flushed);
+        Common_Message msg = create_connection_message(lingering, Networking_Sockets::CONNECTION_END);
+        network->sendTo(&msg, true);
+        lingering = sbcs->lingering_sockets.erase(lingering);
+    }
 }
 
 
@@ -2040,6 +2502,15 @@ void Steam_Networking_Sockets::Callback(Common_Message *msg)
                     launch_callback(connect_socket.first, old_status);
                 }
             }
+
+            auto lingering = std::begin(sbcs->lingering_sockets);
+            while (lingering != std::end(sbcs->lingering_sockets)) {
+                if (lingering->second.remote_identity.GetSteamID64() == msg->source_id()) {
+                    lingering = sbcs->lingering_sockets.erase(lingering);
+                } else {
+                    ++lingering;
+                }
+            }
         }
     }
 
@@ -2061,7 +2532,9 @@ void Steam_Networking_Sockets::Callback(Common_Message *msg)
                 if (connect_socket == sbcs->connect_sockets.end()) {
                     SteamNetworkingIdentity identity;
                     identity.SetSteamID64(msg->source_id());
-                    HSteamNetConnection new_connection = new_connect_socket(identity, virtual_port, real_port, CONNECT_SOCKET_NOT_ACCEPTED, conn->socket_id, static_cast<HSteamNetConnection>(msg->networking_sockets().connection_id_from()));
+                    HSteamNetConnection new_connection = new_connect_socket(identity, virtual_port, real_port, CONNECT_SOCKET_NOT_ACCEPTED, conn->socket_id, static_cast<HSteamNetConnection>(msg->networking_sockets().connection_id_from()), conn->send_buffer_size);
+                    auto &new_socket = sbcs->connect_sockets[new_connection];
+                    new_socket.reliable_udp = new_socket.reliable_udp && msg->networking_sockets().reliable_udp();
                     launch_callback(new_connection, CONNECT_SOCKET_NO_CONNECTION);
                 }
             }
@@ -2075,7 +2548,9 @@ void Steam_Networking_Sockets::Callback(Common_Message *msg)
 
                 if (connect_socket->second.remote_identity.GetSteamID64() == msg->source_id() && connect_socket->second.status == CONNECT_SOCKET_CONNECTING) {
                     connect_socket->second.remote_id = static_cast<HSteamNetConnection>(msg->networking_sockets().connection_id_from());
+                    connect_socket->second.reliable_udp = connect_socket->second.reliable_udp && msg->networking_sockets().reliable_udp();
                     connect_socket->second.status = CONNECT_SOCKET_CONNECTED;
+                    send_held_reliable(connect_socket);
                     launch_callback(connect_socket->first, CONNECT_SOCKET_CONNECTING);
                 }
             }
@@ -2084,16 +2559,34 @@ void Steam_Networking_Sockets::Callback(Common_Message *msg)
             if (connect_socket != sbcs->connect_sockets.end()) {
                 if (connect_socket->second.remote_identity.GetSteamID64() == msg->source_id() && (connect_socket->second.status == CONNECT_SOCKET_CONNECTED)) {
                     PRINT_DEBUG("got data len %zu, num " "%" PRIu64 " on connection %u", msg->networking_sockets().data().size(), msg->networking_sockets().message_number(), connect_socket->first);
-                    connect_socket->second.data.push(msg->networking_sockets());
+                    receive_data(connect_socket, *msg->mutable_networking_sockets());
                 }
             } else {
                 connect_socket = std::find_if(sbcs->connect_sockets.begin(), sbcs->connect_sockets.end(), [msg](const auto &in) {return in.second.remote_identity.GetSteamID64() == msg->source_id() && (in.second.status == CONNECT_SOCKET_NOT_ACCEPTED || in.second.status == CONNECT_SOCKET_CONNECTED) && in.second.remote_id == msg->networking_sockets().connection_id_from();});
                 if (connect_socket != sbcs->connect_sockets.end()) {
                     PRINT_DEBUG("got data len %zu, num " "%" PRIu64 " on not accepted connection %u", msg->networking_sockets().data().size(), msg->networking_sockets().message_number(), connect_socket->first);
-                    connect_socket->second.data.push(msg->networking_sockets());
+                    receive_data(connect_socket, *msg->mutable_networking_sockets());
+                }
+            }
+        } else if (msg->networking_sockets().type() == Networking_Sockets::ACK) {
+            auto connect_socket = sbcs->connect_sockets.find(static_cast<HSteamNetConnection>(msg->networking_sockets().connection_id()));
+            if (connect_socket != sbcs->connect_sockets.end()) {
+                if (connect_socket->second.remote_identity.GetSteamID64() == msg->source_id() && connect_socket->second.status == CONNECT_SOCKET_CONNECTED) {
+                    reliable_udp_handle_ack(connect_socket, msg->networking_sockets());
+                }
+            } else {
+                connect_socket = sbcs->lingering_sockets.find(static_cast<HSteamNetConnection>(msg->networking_sockets().connection_id()));
+                if (connect_socket != sbcs->lingering_sockets.end() && connect_socket->second.remote_identity.GetSteamID64() == msg->source_id()) {
+                    reliable_udp_handle_ack(connect_socket, msg->networking_sockets());
                 }
             }
         } else if (msg->networking_sockets().type() == Networking_Sockets::CONNECTION_END) {
+            // the other side is gone, nothing left to flush to it
+            auto lingering = sbcs->lingering_sockets.find(static_cast<HSteamNetConnection>(msg->networking_sockets().connection_id()));
+            if (lingering != sbcs->lingering_sockets.end() && lingering->second.remote_identity.GetSteamID64() == msg->source_id()) {
+                sbcs->lingering_sockets.erase(lingering);
+            }
+
             auto connect_socket = sbcs->connect_sockets.find(static_cast<HSteamNetConnection>(msg->networking_sockets().connection_id()));
             if (connect_socket != sbcs->connect_sockets.end()) {
                 if (connect_socket->second.remote_identity.GetSteamID64() == msg->source_id() && connect_socket->second.status == CONNECT_SOCKET_CONNECTED) {
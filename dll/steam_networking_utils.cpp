@@ -16,6 +16,7 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "dll/steam_networking_utils.h"
+#include "dll/dll.h"
 
 void Steam_Networking_Utils::steam_callback(void *object, Common_Message *msg)
 {
@@ -51,6 +52,78 @@ Steam_Networking_Utils::~Steam_Networking_Utils()
     this->run_every_runcb->remove(&Steam_Networking_Utils::steam_run_every_runcb, this);
 }
 
+float *Steam_Networking_Utils::simulation_float_value(Network_Conditions &conditions, ESteamNetworkingConfigValue eValue)
+{
+    switch (eValue) {
+        case k_ESteamNetworkingConfig_FakePacketLoss_Send: return &conditions.loss_send;
+        case k_ESteamNetworkingConfig_FakePacketLoss_Recv: return &conditions.loss_recv;
+        case k_ESteamNetworkingConfig_FakePacketReorder_Send: return &conditions.reorder_send;
+        case k_ESteamNetworkingConfig_FakePacketReorder_Recv: return &conditions.reorder_recv;
+        case k_ESteamNetworkingConfig_FakePacketDup_Send: return &conditions.dup_send;
+        case k_ESteamNetworkingConfig_FakePacketDup_Recv: return &conditions.dup_recv;
+        default: return NULL;
+    }
+}
+
+int32 *Steam_Networking_Utils::simulation_int32_value(Network_Conditions &conditions, ESteamNetworkingConfigValue eValue)
+{
+    switch (eValue) {
+        case k_ESteamNetworkingConfig_FakePacketLag_Send: return &conditions.lag_send;
+        case k_ESteamNetworkingConfig_FakePacketLag_Recv: return &conditions.lag_recv;
+        case k_ESteamNetworkingConfig_FakePacketReorder_Time: return &conditions.reorder_time;
+        case k_ESteamNetworkingConfig_FakePacketDup_TimeMax: return &conditions.dup_time_max;
+        default: return NULL;
+    }
+}
+
+// the real library only has these as global values, we also allow them on a connection to simulate a single bad peer
+bool Steam_Networking_Utils::simulation_peer(ESteamNetworkingConfigScope eScopeType, intptr_t scopeObj, CSteamID *peer)
+{
+    if (eScopeType == k_ESteamNetworkingConfig_Global) {
+        *peer = k_steamIDNil;
+        return true;
+    }
+
+    if (eScopeType == k_ESteamNetworkingConfig_Connection) {
+        Steam_Client *client = get_steam_client();
+        if (!client->steam_networking_sockets) return false;
+
+        auto sbcs = client->steam_networking_sockets->get_shared_between_client_server();
+        auto connect_socket = sbcs->connect_sockets.find(static_cast<HSteamNetConnection>(scopeObj));
+        if (connect_socket == sbcs->connect_sockets.end()) return false;
+
+        *peer = connect_socket->second.remote_identity.GetSteamID();
+        return true;
+    }
+
+    return false;
+}
+
+int32 *Steam_Networking_Utils::send_buffer_size_value(ESteamNetworkingConfigScope eScopeType, intptr_t scopeObj)
+{
+    Steam_Client *client = get_steam_client();
+    if (!client->steam_networking_sockets) return NULL;
+
+    auto sbcs = client->steam_networking_sockets->get_shared_between_client_server();
+    if (eScopeType == k_ESteamNetworkingConfig_Global) {
+        return &sbcs->send_buffer_size;
+    }
+
+    if (eScopeType == k_ESteamNetworkingConfig_ListenSocket) {
+        auto listen_socket = std::find_if(sbcs->listen_sockets.begin(), sbcs->listen_sockets.end(), [scopeObj](const Listen_Socket &listen_socket) { return listen_socket.socket_id == static_cast<HSteamListenSocket>(scopeObj); });
+        if (listen_socket == sbcs->listen_sockets.end()) return NULL;
+        return &listen_socket->send_buffer_size;
+    }
+
+    if (eScopeType == k_ESteamNetworkingConfig_Connection) {
+        auto connect_socket = sbcs->connect_sockets.find(static_cast<HSteamNetConnection>(scopeObj));
+        if (connect_socket == sbcs->connect_sockets.end()) return NULL;
+        return &connect_socket->second.send_buffer_size;
+    }
+
+    return NULL;
+}
+
 void Steam_Networking_Utils::free_steam_message_data(SteamNetworkingMessage_t *pMsg)
 {
     free(pMsg->m_pData);
@@ -358,8 +431,52 @@ bool Steam_Networking_Utils::SetConnectionConfigValueString( HSteamNetConnection
 bool Steam_Networking_Utils::SetConfigValue( ESteamNetworkingConfigValue eValue, ESteamNetworkingConfigScope eScopeType, intptr_t scopeObj,
     ESteamNetworkingConfigDataType eDataType, const void *pArg )
 {
-    PRINT_DEBUG("TODO %i %i " "%" PRIdPTR " %i %p", eValue, eScopeType, scopeObj, eDataType, pArg);
+    PRINT_DEBUG("%i %i " "%" PRIdPTR " %i %p", eValue, eScopeType, scopeObj, eDataType, pArg);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
+
+    CSteamID peer{};
+    Network_Conditions conditions{};
+    if (simulation_float_value(conditions, eValue) || simulation_int32_value(conditions, eValue)) {
+        if (!simulation_peer(eScopeType, scopeObj, &peer)) return false;
+
+        conditions = network->getSimulationConditions(peer);
+        float *float_value = simulation_float_value(conditions, eValue);
+        int32 *int32_value = simulation_int32_value(conditions, eValue);
+        if (!pArg) {
+            // NULL restores the default, for a connection that is the global value
+            Network_Conditions defaults = peer == k_steamIDNil ? Network_Conditions{} : network->getSimulationConditions();
+            if (float_value) *float_value = *simulation_float_value(defaults, eValue);
+            else *int32_value = *simulation_int32_value(defaults, eValue);
+        } else if (float_value) {
+            if (eDataType != k_ESteamNetworkingConfig_Float) return false;
+            *float_value = std::clamp(*(const float *)pArg, 0.0f, 100.0f);
+        } else {
+            if (eDataType != k_ESteamNetworkingConfig_Int32) return false;
+            *int32_value = std::max(*(const int32 *)pArg, 0);
+        }
+
+        network->setSimulationConditions(conditions, peer);
+        return true;
+    }
+
+    if (eValue == k_ESteamNetworkingConfig_SendBufferSize) {
+        int32 *send_buffer_size = send_buffer_size_value(eScopeType, scopeObj);
+        if (!send_buffer_size) return false;
+
+        if (!pArg) {
+            // NULL restores the inherited value, which is the global one
+            int32 *global_size = send_buffer_size_value(k_ESteamNetworkingConfig_Global, 0);
+            *send_buffer_size = eScopeType == k_ESteamNetworkingConfig_Global ? DEFAULT_SEND_BUFFER_SIZE : *global_size;
+            return true;
+        }
+
+        if (eDataType != k_ESteamNetworkingConfig_Int32) return false;
+        if (*(const int32 *)pArg <= 0) return false;
+        *send_buffer_size = *(const int32 *)pArg;
+        return true;
+    }
+
+    PRINT_DEBUG_TODO();
     return true;
 }
 
@@ -374,8 +491,48 @@ bool Steam_Networking_Utils::SetConfigValue( ESteamNetworkingConfigValue eValue,
 ESteamNetworkingGetConfigValueResult Steam_Networking_Utils::GetConfigValue( ESteamNetworkingConfigValue eValue, ESteamNetworkingConfigScope eScopeType, intptr_t scopeObj,
     ESteamNetworkingConfigDataType *pOutDataType, void *pResult, size_t *cbResult )
 {
-    PRINT_DEBUG_TODO();
+    PRINT_DEBUG("%i %i " "%" PRIdPTR " %p %p %p", eValue, eScopeType, scopeObj, pOutDataType, pResult, cbResult);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
+
+    CSteamID peer{};
+    Network_Conditions conditions{};
+    if (simulation_float_value(conditions, eValue) || simulation_int32_value(conditions, eValue)) {
+        if (!simulation_peer(eScopeType, scopeObj, &peer)) return k_ESteamNetworkingGetConfigValue_BadScopeObj;
+
+        conditions = network->getSimulationConditions(peer);
+        float *float_value = simulation_float_value(conditions, eValue);
+        int32 *int32_value = simulation_int32_value(conditions, eValue);
+        size_t size = float_value ? sizeof(float) : sizeof(int32);
+        if (pOutDataType) *pOutDataType = float_value ? k_ESteamNetworkingConfig_Float : k_ESteamNetworkingConfig_Int32;
+        if (!cbResult) return k_ESteamNetworkingGetConfigValue_BufferTooSmall;
+        if (!pResult || *cbResult < size) {
+            *cbResult = size;
+            return k_ESteamNetworkingGetConfigValue_BufferTooSmall;
+        }
+
+        if (float_value) memcpy(pResult, float_value, size);
+        else memcpy(pResult, int32_value, size);
+        *cbResult = size;
+        return k_ESteamNetworkingGetConfigValue_OK;
+    }
+
+    if (eValue == k_ESteamNetworkingConfig_SendBufferSize) {
+        int32 *send_buffer_size = send_buffer_size_value(eScopeType, scopeObj);
+        if (!send_buffer_size) return k_ESteamNetworkingGetConfigValue_BadScopeObj;
+
+        if (pOutDataType) *pOutDataType = k_ESteamNetworkingConfig_Int32;
+        if (!cbResult) return k_ESteamNetworkingGetConfigValue_BufferTooSmall;
+        if (!pResult || *cbResult < sizeof(int32)) {
+            *cbResult = sizeof(int32);
+            return k_ESteamNetworkingGetConfigValue_BufferTooSmall;
+        }
+
+        memcpy(pResult, send_buffer_size, sizeof(int32));
+        *cbResult = sizeof(int32);
+        return k_ESteamNetworkingGetConfigValue_OK;
+    }
+
+    PRINT_DEBUG_TODO();
     return k_ESteamNetworkingGetConfigValue_BadValue;
 }
 
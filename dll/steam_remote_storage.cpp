@@ -17,6 +17,11 @@
 
 #include "dll/steam_remote_storage.h"
 
+// threads doing the async reads/writes and UGC copies
+#define FILE_IO_WORKERS 2
+// queued ops before the async calls start blocking
+#define FILE_IO_MAX_QUEUED 64
+
 
 Downloaded_File::Downloaded_File(DownloadSource src)
     :source(src)
@@ -27,30 +32,85 @@ Downloaded_File::DownloadSource Downloaded_File::get_source() const
     return source;
 }
 
-static void copy_file(const std::string &src_filepath, const std::string &dst_filepath)
+static bool copy_file(const std::string &src_filepath, const std::string &dst_filepath)
 {
     try
     {
         PRINT_DEBUG("copying file '%s' to '%s'", src_filepath.c_str(), dst_filepath.c_str());
         const auto src_p(std::filesystem::u8path(src_filepath));
         
-        if (!common_helpers::file_exist(src_p)) return;
+        if (!common_helpers::file_exist(src_p)) return false;
         
         const auto dst_p(std::filesystem::u8path(dst_filepath));
         std::filesystem::create_directories(dst_p.parent_path()); // make the folder tree if needed
-        std::filesystem::copy_file(src_p, dst_p, std::filesystem::copy_options::overwrite_existing);
+        return std::filesystem::copy_file(src_p, dst_p, std::filesystem::copy_options::overwrite_existing);
     } catch(...) {}
+
+    return false;
+}
+
+void Steam_Remote_Storage::steam_remote_storage_run_every_runcb(void *object)
+{
+    // PRINT_DEBUG_ENTRY();
+
+    auto inst = (Steam_Remote_Storage *)object;
+    inst->RunCallbacks();
 }
 
-Steam_Remote_Storage::Steam_Remote_Storage(class Settings *settings, class Ugc_Remote_Storage_Bridge *ugc_bridge, class Local_Storage *local_storage, class SteamCallResults *callback_results, class SteamCallBacks *callbacks)
+Steam_Remote_Storage::Steam_Remote_Storage(class Settings *settings, class Ugc_Remote_Storage_Bridge *ugc_bridge, class Local_Storage *local_storage, class SteamCallResults *callback_results, class SteamCallBacks *callbacks, class RunEveryRunCB *run_every_runcb)
 {
     this->settings = settings;
     this->ugc_bridge = ugc_bridge;
     this->local_storage = local_storage;
     this->callback_results = callback_results;
     this->callbacks = callbacks;
+    this->run_every_runcb = run_every_runcb;
+    this->file_io = new File_IO_Pool(FILE_IO_WORKERS, FILE_IO_MAX_QUEUED);
 
     steam_cloud_enabled = true;
+
+    this->run_every_runcb->add(&Steam_Remote_Storage::steam_remote_storage_run_every_runcb, this);
+}
+
+Steam_Remote_Storage::~Steam_Remote_Storage()
+{
+    this->run_every_runcb->remove(&Steam_Remote_Storage::steam_remote_storage_run_every_runcb, this);
+
+    // pending writes still reach the disk
+    delete file_io;
+    file_io = nullptr;
+
+    // streams the game never closed
+    for (auto &stream_write : stream_writes) {
+        if (stream_write.temp_file->file.is_open()) stream_write.temp_file->file.close();
+        std::error_code ec{};
+        std::filesystem::remove(std::filesystem::u8path(stream_write.temp_path), ec);
+    }
+}
+
+std::string Steam_Remote_Storage::file_io_key(const std::string &file) const
+{
+    return local_storage->get_file_path(Local_Storage::remote_storage_folder, file);
+}
+
+void Steam_Remote_Storage::wait_file_io(const std::string &key)
+{
+    file_io->wait(key);
+    file_io->run_completions();
+}
+
+void Steam_Remote_Storage::close_stream_write(Stream_Write &stream_write)
+{
+    wait_file_io(stream_write.temp_path);
+    if (stream_write.temp_file->file.is_open()) {
+        stream_write.temp_file->file.close();
+        if (!stream_write.temp_file->file) stream_write.temp_file->failed = true;
+    }
+}
+
+void Steam_Remote_Storage::RunCallbacks()
+{
+    file_io->run_completions();
 }
 
 // NOTE
@@ -70,6 +130,7 @@ bool Steam_Remote_Storage::FileWrite( const char *pchFile, const void *pvData, i
         return false;
     }
 
+    wait_file_io(file_io_key(pchFile));
     int data_stored = local_storage->store_data(Local_Storage::remote_storage_folder, pchFile, (char* )pvData, cubData);
     PRINT_DEBUG("%i, %u", data_stored, data_stored == cubData);
     return data_stored == cubData;
@@ -81,6 +142,7 @@ int32 Steam_Remote_Storage::FileRead( const char *pchFile, void *pvData, int32 c
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
 
     if (!pchFile || !pchFile[0] || !pvData || !cubDataToRead) return 0;
+    wait_file_io(file_io_key(pchFile));
     int read_data = local_storage->get_data(Local_Storage::remote_storage_folder, pchFile, (char* )pvData, cubDataToRead);
     if (read_data < 0) read_data = 0;
     PRINT_DEBUG("  Read %i", read_data);
@@ -97,13 +159,25 @@ SteamAPICall_t Steam_Remote_Storage::FileWriteAsync( const char *pchFile, const
         return k_uAPICallInvalid;
     }
 
-    bool success = local_storage->store_data(Local_Storage::remote_storage_folder, pchFile, (char* )pvData, cubData) == cubData;
-    RemoteStorageFileWriteAsyncComplete_t data;
-    data.m_eResult = success ? k_EResultOK : k_EResultFail;
+    // the caller's buffer is only valid during this call
+    auto file_data = std::make_shared<std::vector<char>>((const char *)pvData, (const char *)pvData + cubData);
+    auto success = std::make_shared<bool>(false);
+    std::string folder(local_storage->get_path(Local_Storage::remote_storage_folder));
+    std::string file_name(pchFile);
+    SteamAPICall_t api_call = callback_results->reserveCallResult();
 
-    auto ret = callback_results->addCallResult(data.k_iCallback, &data, sizeof(data), 0.01);
-    callbacks->addCBResult(data.k_iCallback, &data, sizeof(data), 0.01);
-    return ret;
+    file_io->submit(file_io_key(file_name), [=]{
+        *success = Local_Storage::store_file_data(folder, file_name, file_data->data(), static_cast<unsigned int>(file_data->size())) == static_cast<int>(file_data->size());
+    }, [=]{
+        local_storage->file_changed(Local_Storage::remote_storage_folder, file_name);
+
+        RemoteStorageFileWriteAsyncComplete_t data{};
+        data.m_eResult = *success ? k_EResultOK : k_EResultFail;
+        callback_results->addCallResult(api_call, data.k_iCallback, &data, sizeof(data));
+        callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
+    });
+
+    return api_call;
 }
 
 
@@ -114,9 +188,11 @@ SteamAPICall_t Steam_Remote_Storage::FileReadAsync( const char *pchFile, uint32
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
 
     if (!pchFile || !pchFile[0]) return k_uAPICallInvalid;
+    std::string key(file_io_key(pchFile));
+    // the size must include the async writes of this file queued before us
+    wait_file_io(key);
     unsigned int size = local_storage->file_size(Local_Storage::remote_storage_folder, pchFile);
 
-    RemoteStorageFileReadAsyncComplete_t data;
     if (size <= nOffset) {
      return k_uAPICallInvalid;
     }
@@ -124,18 +200,39 @@ SteamAPICall_t Steam_Remote_Storage::FileReadAsync( const char *pchFile, uint32
     if ((size - nOffset) < cubToRead) cubToRead = size - nOffset;
 
     struct Async_Read a_read{};
-    data.m_eResult = k_EResultOK;
-    a_read.offset = data.m_nOffset = nOffset;
-    a_read.api_call = data.m_hFileReadAsync = callback_results->reserveCallResult();
-    a_read.to_read = data.m_cubRead = cubToRead;
+    a_read.offset = nOffset;
+    a_read.api_call = callback_results->reserveCallResult();
+    a_read.to_read = cubToRead;
     a_read.file_name = std::string(pchFile);
     a_read.size = size;
-
     async_reads.push_back(a_read);
 
-    callback_results->addCallResult(data.m_hFileReadAsync, data.k_iCallback, &data, sizeof(data), 0.0);
-    callbacks->addCBResult(data.k_iCallback, &data, sizeof(data), 0.0);
-    return data.m_hFileReadAsync;
+    // only the requested range is read, straight from its offset
+    auto range = std::make_shared<std::vector<char>>(cubToRead);
+    auto read_data = std::make_shared<int>(-1);
+    SteamAPICall_t api_call = a_read.api_call;
+    file_io->submit(key, [=]{
+        *read_data = Local_Storage::get_file_data(key, range->data(), static_cast<unsigned int>(range->size()), nOffset);
+    }, [=]{
+        RemoteStorageFileReadAsyncComplete_t data{};
+        data.m_hFileReadAsync = api_call;
+        data.m_nOffset = nOffset;
+        data.m_cubRead = *read_data > 0 ? static_cast<uint32>(*read_data) : 0;
+        data.m_eResult = *read_data >= 0 ? k_EResultOK : k_EResultFileNotFound;
+
+        auto a_read = std::find_if(async_reads.begin(), async_reads.end(), [api_call](Async_Read const& item) { return item.api_call == api_call; });
+        if (async_reads.end() != a_read) {
+            range->resize(data.m_cubRead);
+            a_read->data = std::move(*range);
+            a_read->to_read = data.m_cubRead;
+            a_read->completed = true;
+        }
+
+        callback_results->addCallResult(api_call, data.k_iCallback, &data, sizeof(data), 0.0);
+        callbacks->addCBResult(data.k_iCallback, &data, sizeof(data), 0.0);
+    });
+
+    return api_call;
 }
 
 bool Steam_Remote_Storage::FileReadAsyncComplete( SteamAPICall_t hReadCall, void *pvBuffer, uint32 cubToRead )
@@ -145,19 +242,13 @@ bool Steam_Remote_Storage::FileReadAsyncComplete( SteamAPICall_t hReadCall, void
     if (!pvBuffer) return false;
 
     auto a_read = std::find_if(async_reads.begin(), async_reads.end(), [&hReadCall](Async_Read const& item) { return item.api_call == hReadCall; });
-    if (async_reads.end() == a_read)
+    if (async_reads.end() == a_read || !a_read->completed)
         return false;
 
     if (cubToRead < a_read->to_read)
         return false;
 
-    std::vector<char> temp(a_read->size);
-    int read_data = local_storage->get_data(Local_Storage::remote_storage_folder, a_read->file_name, (char* )&temp[0], a_read->size);
-    if (read_data < 0 || (static_cast<uint32>(read_data) < (a_read->to_read + a_read->offset))) {
-        return false;
-    }
-
-    memcpy(pvBuffer, &temp[0] + a_read->offset, a_read->to_read);
+    if (a_read->to_read) memcpy(pvBuffer, a_read->data.data(), a_read->to_read);
     async_reads.erase(a_read);
     return true;
 }
@@ -178,6 +269,7 @@ bool Steam_Remote_Storage::FileDelete( const char *pchFile )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (!pchFile || !pchFile[0]) return false;
     
+    wait_file_io(file_io_key(pchFile));
     return local_storage->file_delete(Local_Storage::remote_storage_folder, pchFile);
 }
 
@@ -189,6 +281,7 @@ SteamAPICall_t Steam_Remote_Storage::FileShare( const char *pchFile )
     if (!pchFile || !pchFile[0]) return k_uAPICallInvalid;
 
     RemoteStorageFileShareResult_t data = {};
+    wait_file_io(file_io_key(pchFile));
     if (local_storage->file_exists(Local_Storage::remote_storage_folder, pchFile)) {
         data.m_eResult = k_EResultOK;
         data.m_hFile = generate_steam_api_call_id();
@@ -227,6 +320,15 @@ UGCFileWriteStreamHandle_t Steam_Remote_Storage::FileWriteStreamOpen( const char
     struct Stream_Write stream_write{};
     stream_write.file_name = std::string(pchFile);
     stream_write.write_stream_handle = handle;
+    // kept out of the remote folder so the game never sees a partial file
+    stream_write.temp_path = local_storage->get_path(Local_Storage::remote_storage_temp_folder) + PATH_SEPARATOR + "stream_" + std::to_string(handle) + ".tmp";
+    stream_write.temp_file = std::make_shared<Stream_Write_File>();
+    stream_write.temp_file->file.open(std::filesystem::u8path(stream_write.temp_path), std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!stream_write.temp_file->file.is_open()) {
+        PRINT_DEBUG("failed to create '%s'", stream_write.temp_path.c_str());
+        return k_UGCFileStreamHandleInvalid;
+    }
+
     stream_writes.push_back(stream_write);
     return stream_write.write_stream_handle;
 }
@@ -241,7 +343,18 @@ bool Steam_Remote_Storage::FileWriteStreamWriteChunk( UGCFileWriteStreamHandle_t
     if (stream_writes.end() == request)
         return false;
 
-    std::copy((char *)pvData, (char *)pvData + cubData, std::back_inserter(request->file_data));
+    if (!cubData) return true;
+
+    // written by the pool in the order the chunks were given, only this chunk is kept in memory meanwhile
+    auto chunk = std::make_shared<std::vector<char>>((const char *)pvData, (const char *)pvData + cubData);
+    auto temp_file = request->temp_file;
+    file_io->submit(request->temp_path, [=]{
+        if (temp_file->failed) return;
+
+        temp_file->file.write(chunk->data(), static_cast<std::streamsize>(chunk->size()));
+        if (!temp_file->file) temp_file->failed = true;
+    }, nullptr);
+
     return true;
 }
 
@@ -253,9 +366,28 @@ bool Steam_Remote_Storage::FileWriteStreamClose( UGCFileWriteStreamHandle_t writ
     if (stream_writes.end() == request)
         return false;
 
-    local_storage->store_data(Local_Storage::remote_storage_folder, request->file_name, request->file_data.data(), static_cast<unsigned int>(request->file_data.size()));
+    close_stream_write(*request);
+    std::error_code ec{};
+    if (!request->temp_file->failed) {
+        std::string key(file_io_key(request->file_name));
+        wait_file_io(key);
+
+        const auto file_p(std::filesystem::u8path(key));
+        std::filesystem::create_directories(file_p.parent_path(), ec);
+        ec.clear();
+        std::filesystem::rename(std::filesystem::u8path(request->temp_path), file_p, ec);
+        local_storage->file_changed(Local_Storage::remote_storage_folder, request->file_name);
+    }
+
+    bool success = !request->temp_file->failed && !ec;
+    if (!success) {
+        PRINT_DEBUG("failed to write '%s' %s", request->file_name.c_str(), ec.message().c_str());
+        std::filesystem::remove(std::filesystem::u8path(request->temp_path), ec);
+    }
+
     stream_writes.erase(request);
-    return true;
+    reset_LastError();
+    return success;
 }
 
 bool Steam_Remote_Storage::FileWriteStreamCancel( UGCFileWriteStreamHandle_t writeHandle )
@@ -266,6 +398,9 @@ bool Steam_Remote_Storage::FileWriteStreamCancel( UGCFileWriteStreamHandle_t wri
     if (stream_writes.end() == request)
         return false;
 
+    close_stream_write(*request);
+    std::error_code ec{};
+    std::filesystem::remove(std::filesystem::u8path(request->temp_path), ec);
     stream_writes.erase(request);
     return true;
 }
@@ -277,6 +412,7 @@ bool Steam_Remote_Storage::FileExists( const char *pchFile )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (!pchFile || !pchFile[0]) return false;
     
+    wait_file_io(file_io_key(pchFile));
     return local_storage->file_exists(Local_Storage::remote_storage_folder, pchFile);
 }
 
@@ -286,6 +422,7 @@ bool Steam_Remote_Storage::FilePersisted( const char *pchFile )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (!pchFile || !pchFile[0]) return false;
     
+    wait_file_io(file_io_key(pchFile));
     return local_storage->file_exists(Local_Storage::remote_storage_folder, pchFile);
 }
 
@@ -295,6 +432,7 @@ int32 Steam_Remote_Storage::GetFileSize( const char *pchFile )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (!pchFile || !pchFile[0]) return 0;
     
+    wait_file_io(file_io_key(pchFile));
     return local_storage->file_size(Local_Storage::remote_storage_folder, pchFile);
 }
 
@@ -304,6 +442,7 @@ int64 Steam_Remote_Storage::GetFileTimestamp( const char *pchFile )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (!pchFile || !pchFile[0]) return 0;
     
+    wait_file_io(file_io_key(pchFile));
     return local_storage->file_timestamp(Local_Storage::remote_storage_folder, pchFile);
 }
 
@@ -519,50 +658,67 @@ int32 Steam_Remote_Storage::UGCRead( UGCHandle_t hContent, void *pvData, int32 c
     }
 
     int read_data = -1;
-    uint64 total_size = 0;
     Downloaded_File &dwf = f_itr->second;
-
-    // depending on the download source, we have to decide where to grab the content/data
-    switch (dwf.get_source())
-    {
-    case Downloaded_File::DownloadSource::AfterFileShare: {
-        PRINT_DEBUG("  source = AfterFileShare '%s'", dwf.file.c_str());
-        read_data = local_storage->get_data(Local_Storage::remote_storage_folder, dwf.file, (char *)pvData, cubDataToRead, cOffset);
-        total_size = dwf.total_size;
-    }
-    break;
-    
-    case Downloaded_File::DownloadSource::AfterSendQueryUGCRequest:
-    case Downloaded_File::DownloadSource::FromUGCDownloadToLocation: {
-        PRINT_DEBUG("  source = AfterSendQueryUGCRequest || FromUGCDownloadToLocation [%i]", (int)dwf.get_source());
-        auto mod = settings->getMod(dwf.mod_query_info.mod_id);
-        auto &mod_name = dwf.mod_query_info.is_primary_file
-            ? mod.primaryFileName
-            : mod.previewFileName;
-
-        std::string mod_fullpath{};
-        if (dwf.get_source() == Downloaded_File::DownloadSource::AfterSendQueryUGCRequest) {
-            std::string mod_base_path = dwf.mod_query_info.is_primary_file
-                ? mod.path
-                : Local_Storage::get_game_settings_path() + "mod_images" + PATH_SEPARATOR + std::to_string(mod.id);
-
-            mod_fullpath = common_helpers::to_absolute(mod_name, mod_base_path);
-        } else { // Downloaded_File::DownloadSource::FromUGCDownloadToLocation
-            mod_fullpath = dwf.download_to_location_fullpath;
+    uint64 total_size = dwf.total_size;
+
+    if (!dwf.read_handle) {
+        // depending on the download source, we have to decide where to grab the content/data
+        switch (dwf.get_source())
+        {
+        case Downloaded_File::DownloadSource::AfterFileShare: {
+            PRINT_DEBUG("  source = AfterFileShare '%s'", dwf.file.c_str());
+            dwf.read_fullpath = file_io_key(dwf.file);
+            wait_file_io(dwf.read_fullpath);
         }
+        break;
         
-        read_data = Local_Storage::get_file_data(mod_fullpath, (char *)pvData, cubDataToRead, cOffset);
-        PRINT_DEBUG("  mod file '%s' [%i]", mod_fullpath.c_str(), read_data);
-        total_size = dwf.total_size;
+        case Downloaded_File::DownloadSource::AfterSendQueryUGCRequest:
+        case Downloaded_File::DownloadSource::FromUGCDownloadToLocation: {
+            PRINT_DEBUG("  source = AfterSendQueryUGCRequest || FromUGCDownloadToLocation [%i]", (int)dwf.get_source());
+            if (dwf.get_source() == Downloaded_File::DownloadSource::AfterSendQueryUGCRequest) {
+                auto mod = settings->getMod(dwf.mod_query_info.mod_id);
+                auto &mod_name = dwf.mod_query_info.is_primary_file
+                    ? mod.primaryFileName
+                    : mod.previewFileName;
+                std::string mod_base_path = dwf.mod_query_info.is_primary_file
+                    ? mod.path
+                    : Local_Storage::get_game_settings_path() + "mod_images" + PATH_SEPARATOR + std::to_string(mod.id);
+
+                dwf.read_fullpath = common_helpers::to_absolute(mod_name, mod_base_path);
+            } else { // Downloaded_File::DownloadSource::FromUGCDownloadToLocation
+                dwf.read_fullpath = dwf.download_to_location_fullpath;
+            }
+        }
+        break;
+        
+        default:
+            PRINT_DEBUG("  unhandled download source %i", (int)dwf.get_source());
+            return -1; //TODO: is this the right return value?
+        break;
+        }
+
+        // one handle for all the chunks, big items are read in many small calls
+        auto handle = std::make_shared<std::ifstream>(std::filesystem::u8path(dwf.read_fullpath), std::ios::binary | std::ios::in);
+        reset_LastError();
+        if (!handle->is_open()) {
+            PRINT_DEBUG("  failed to open '%s'", dwf.read_fullpath.c_str());
+            return -1; //TODO: is this the right return value?
+        }
+
+        PRINT_DEBUG("  opened '%s'", dwf.read_fullpath.c_str());
+        dwf.read_handle = handle;
     }
-    break;
-    
-    default:
-        PRINT_DEBUG("  unhandled download source %i", (int)dwf.get_source());
-        return -1; //TODO: is this the right return value?
-    break;
+
+    if (cubDataToRead) {
+        // a previous read hitting the end leaves the stream in a failed state
+        dwf.read_handle->clear();
+        dwf.read_handle->seekg(cOffset, std::ios::beg);
+        dwf.read_handle->read((char *)pvData, cubDataToRead);
+        read_data = static_cast<int>(dwf.read_handle->gcount());
+    } else {
+        read_data = 0;
     }
-    
+
     PRINT_DEBUG("  read bytes = %i", read_data);
     if (read_data < 0) return -1; //TODO: is this the right return value?
 
@@ -1142,6 +1298,7 @@ SteamAPICall_t Steam_Remote_Storage::UGCDownloadToLocation( UGCHandle_t hContent
 
     auto query_res = ugc_bridge->get_ugc_query_result(hContent);
     if (query_res) {
+        SteamAPICall_t api_call = callback_results->reserveCallResult();
         auto mod = settings->getMod(query_res.value().mod_id);
         auto &mod_name = query_res.value().is_primary_file
             ? mod.primaryFileName
@@ -1161,18 +1318,28 @@ SteamAPICall_t Steam_Remote_Storage::UGCDownloadToLocation( UGCHandle_t hContent
 
         mod_name.copy(data.m_pchFileName, sizeof(data.m_pchFileName) - 1);
         
-        // copy the file
+        // copy the file on the pool, the result is posted once it's there
         const auto mod_fullpath = common_helpers::to_absolute(mod_name, mod_base_path);
-        copy_file(mod_fullpath, pchLocation);
-
-        // TODO not sure about this though
-        auto [ele_itr, _] = downloaded_files.insert_or_assign(hContent, Downloaded_File::DownloadSource::FromUGCDownloadToLocation);
-        auto &ele = ele_itr->second;
-        ele.file = mod_name;
-        ele.total_size = mod_size;
-        ele.mod_query_info = query_res.value();
-        ele.download_to_location_fullpath = pchLocation;
-        
+        std::string location(pchLocation);
+        auto copied = std::make_shared<bool>(false);
+        Downloaded_File dwf(Downloaded_File::DownloadSource::FromUGCDownloadToLocation);
+        dwf.file = mod_name;
+        dwf.total_size = mod_size;
+        dwf.mod_query_info = query_res.value();
+        dwf.download_to_location_fullpath = location;
+
+        file_io->submit(location, [=]{
+            *copied = copy_file(mod_fullpath, location);
+        }, [=]() mutable {
+            PRINT_DEBUG("UGCDownloadToLocation %llu copied %i", hContent, (int)*copied);
+            // TODO not sure about this though
+            downloaded_files.insert_or_assign(hContent, dwf);
+
+            callback_results->addCallResult(api_call, data.k_iCallback, &data, sizeof(data));
+            callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
+        });
+
+        return api_call;
     } else {
         data.m_eResult = k_EResultFileNotFound; //TODO: not sure if this is the right result
     }
@@ -49,6 +49,7 @@ Steam_User_Stats::Steam_User_Stats(Settings *settings, class Networking *network
 {
     load_achievements_db(); // steam_settings/achievements.json
     load_achievements(); // %appdata%/<emu saves folder>/<app id>/achievements.json
+    load_stats(); // %appdata%/<emu saves folder>/<app id>/stats.bin
 
     // discard achievements without a "name"
     auto x = defined_achievements.begin();
@@ -60,6 +61,17 @@ Steam_User_Stats::Steam_User_Stats(Settings *settings, class Networking *network
         }
     }
 
+    // names are case insensitive, the first achievement wins if 2 of them only differ by case
+    if (defined_achievements.is_array()) {
+        defined_achievements_index.reserve(defined_achievements.size());
+        for (size_t idx = 0; idx < defined_achievements.size(); ++idx) {
+            try {
+                const auto &name = defined_achievements[idx]["name"].get_ref<const std::string &>();
+                defined_achievements_index.emplace(common_helpers::ascii_to_lowercase(name), idx);
+            } catch(...) {}
+        }
+    }
+
     for (auto & it : defined_achievements) {
         try {
             std::string name = static_cast<std::string const&>(it["name"]);
@@ -119,6 +131,8 @@ Steam_User_Stats::Steam_User_Stats(Settings *settings, class Networking *network
 
 Steam_User_Stats::~Steam_User_Stats()
 {
+    save_stats(true);
+
     if (!settings->disable_sharing_stats_with_gameserver) {
         this->network->rmCallback(CALLBACK_ID_GAMESERVER_STATS, settings->get_local_steam_id(), &Steam_User_Stats::steam_user_stats_network_stats, this);
     }
@@ -156,6 +170,7 @@ SteamAPICall_t Steam_User_Stats::GetNumberOfCurrentPlayers()
 
 void Steam_User_Stats::steam_run_callback()
 {
+    save_stats(false);
     send_updated_stats();
     load_achievements_icons();
 }
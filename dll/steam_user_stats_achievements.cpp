@@ -117,13 +117,10 @@ int Steam_User_Stats::load_ach_icon(nlohmann::json &defined_ach, bool achieved)
 
 nlohmann::detail::iter_impl<nlohmann::json> Steam_User_Stats::defined_achievements_find(const std::string &key)
 {
-    return std::find_if(
-        defined_achievements.begin(), defined_achievements.end(),
-        [&key](const nlohmann::json& item) {
-            const std::string &name = static_cast<const std::string &>( item.value("name", std::string()) );
-            return common_helpers::str_cmp_insensitive(key, name);
-        }
-    );
+    auto idx = defined_achievements_index.find(common_helpers::ascii_to_lowercase(key));
+    if (defined_achievements_index.end() == idx) return defined_achievements.end();
+
+    return defined_achievements.begin() + static_cast<std::ptrdiff_t>(idx->second);
 }
 
 std::string Steam_User_Stats::get_value_for_language(const nlohmann::json &json, std::string_view key, std::string_view language)
@@ -303,7 +300,7 @@ bool Steam_User_Stats::GetAchievement( const char *pchName, bool *pbAchieved )
 
     *pbAchieved = false;
     try {
-        std::string pch_name = it->value("name", std::string());
+        const auto &pch_name = (*it)["name"].get_ref<const std::string &>();
         auto ach = user_achievements.find(pch_name);
         if (user_achievements.end() != ach) {
             *pbAchieved = ach->value("earned", false);
@@ -366,7 +363,7 @@ bool Steam_User_Stats::GetAchievementAndUnlockTime( const char *pchName, bool *p
     if (punUnlockTime) *punUnlockTime = 0;
     
     try {
-        std::string pch_name = it->value("name", std::string());
+        const auto &pch_name = (*it)["name"].get_ref<const std::string &>();
         auto ach = user_achievements.find(pch_name);
         if (user_achievements.end() != ach) {
             if (pbAchieved) *pbAchieved = ach->value("earned", false);
@@ -18,50 +18,137 @@
 #include "dll/steam_user_stats.h"
 #include <random>
 
+// downloaded entries handles kept around, the oldest ones become invalid
+#define MAX_LEADERBOARD_DOWNLOADS 64
+// https://partner.steamgames.com/doc/api/ISteamUserStats#DownloadLeaderboardEntriesForUsers
+#define MAX_LEADERBOARD_DOWNLOAD_USERS 100
+
 
 // --- Steam_Leaderboard ---
 
-Steam_Leaderboard_Entry* Steam_Leaderboard::find_recent_entry(const CSteamID &steamid) const
+bool Steam_Leaderboard::ranks_before(int32 score1, int32 score2) const
+{
+    if (sort_method == k_ELeaderboardSortMethodAscending) {
+        return score1 < score2;
+    } else { // k_ELeaderboardSortMethodDescending
+        return score1 > score2;
+    }
+}
+
+std::vector<Steam_Leaderboard_Entry>::const_iterator Steam_Leaderboard::find_entry(const CSteamID &steamid) const
 {
-    auto my_it = std::find_if(entries.begin(), entries.end(), [&steamid](const Steam_Leaderboard_Entry &item) {
+    auto score_it = entries_index.find(steamid.ConvertToUint64());
+    if (entries_index.end() == score_it) return entries.end();
+
+    auto first = entries.begin();
+    auto last = entries.end();
+    if (sort_method != k_ELeaderboardSortMethodNone) {
+        // only the users with the same score need to be checked
+        int32 score = score_it->second;
+        first = std::lower_bound(entries.begin(), entries.end(), score, [this](const Steam_Leaderboard_Entry &item, int32 score) {
+            return ranks_before(item.score, score);
+        });
+        last = std::upper_bound(first, entries.end(), score, [this](int32 score, const Steam_Leaderboard_Entry &item) {
+            return ranks_before(score, item.score);
+        });
+    }
+
+    return std::find_if(first, last, [&steamid](const Steam_Leaderboard_Entry &item) {
         return item.steam_id == steamid;
     });
+}
+
+Steam_Leaderboard_Entry* Steam_Leaderboard::find_recent_entry(const CSteamID &steamid) const
+{
+    auto my_it = find_entry(steamid);
     if (entries.end() == my_it) return nullptr;
     return const_cast<Steam_Leaderboard_Entry*>(&*my_it);
 }
 
-void Steam_Leaderboard::remove_entries(const CSteamID &steamid)
+int Steam_Leaderboard::find_rank(const CSteamID &steamid) const
 {
-    auto rm_it = std::remove_if(entries.begin(), entries.end(), [&](const Steam_Leaderboard_Entry &item){
-        return item.steam_id == steamid;
-    });
-    if (entries.end() != rm_it) entries.erase(rm_it, entries.end());
+    auto my_it = find_entry(steamid);
+    if (entries.end() == my_it) return 0;
+    return 1 + (int)(my_it - entries.begin());
 }
 
-void Steam_Leaderboard::remove_duplicate_entries()
+Steam_Leaderboard_Entry* Steam_Leaderboard::upsert_entry(const Steam_Leaderboard_Entry &entry)
 {
-    if (entries.size() <= 1) return;
+    auto old_it = find_entry(entry.steam_id);
+    if (entries.end() != old_it) {
+        // same rank, no need to move anything
+        if (sort_method == k_ELeaderboardSortMethodNone || old_it->score == entry.score) {
+            auto user_entry = const_cast<Steam_Leaderboard_Entry*>(&*old_it);
+            *user_entry = entry;
+            return user_entry;
+        }
 
-    auto rm = std::remove_if(entries.begin(), entries.end(), [&](const Steam_Leaderboard_Entry& item) {
-        auto recent = find_recent_entry(item.steam_id);
-        return &item != recent;
-    });
-    if (entries.end() != rm) entries.erase(rm, entries.end());
+        entries.erase(old_it);
+    }
+
+    auto new_it = entries.end();
+    if (sort_method != k_ELeaderboardSortMethodNone) {
+        new_it = std::upper_bound(entries.begin(), entries.end(), entry.score, [this](int32 score, const Steam_Leaderboard_Entry &item) {
+            return ranks_before(score, item.score);
+        });
+    }
+
+    entries_index[entry.steam_id.ConvertToUint64()] = entry.score;
+    return &*entries.insert(new_it, entry);
 }
 
-void Steam_Leaderboard::sort_entries()
+void Steam_Leaderboard::load_entries(const std::vector<Steam_Leaderboard_Entry> &loaded)
 {
-    if (sort_method == k_ELeaderboardSortMethodNone) return;
-    if (entries.size() <= 1) return;
+    std::vector<Steam_Leaderboard_Entry> all(entries.begin(), entries.end());
+    std::vector<bool> replaced(all.size());
+    std::unordered_map<uint64, size_t> positions{};
+    for (size_t i = 0; i < all.size(); ++i) {
+        positions[all[i].steam_id.ConvertToUint64()] = i;
+    }
+
+    for (const auto &entry : loaded) {
+        auto old = positions.find(entry.steam_id.ConvertToUint64());
+        if (positions.end() != old) {
+            // same rank, the entry stays where it is
+            if (sort_method == k_ELeaderboardSortMethodNone || all[old->second].score == entry.score) {
+                all[old->second] = entry;
+                continue;
+            }
 
-    std::sort(entries.begin(), entries.end(), [this](const Steam_Leaderboard_Entry &item1, const Steam_Leaderboard_Entry &item2) {
-        if (sort_method == k_ELeaderboardSortMethodAscending) {
-            return item1.score < item2.score;
-        } else { // k_ELeaderboardSortMethodDescending
-            return item1.score > item2.score;
+            replaced[old->second] = true;
         }
-    });
 
+        positions[entry.steam_id.ConvertToUint64()] = all.size();
+        all.push_back(entry);
+        replaced.push_back(false);
+    }
+
+    entries.clear();
+    entries.reserve(all.size() - std::count(replaced.begin(), replaced.end(), true));
+    for (size_t i = 0; i < all.size(); ++i) {
+        if (!replaced[i]) entries.push_back(std::move(all[i]));
+    }
+
+    if (sort_method != k_ELeaderboardSortMethodNone) {
+        std::stable_sort(entries.begin(), entries.end(), [this](const Steam_Leaderboard_Entry &a, const Steam_Leaderboard_Entry &b) {
+            return ranks_before(a.score, b.score);
+        });
+    }
+
+    entries_index.clear();
+    entries_index.reserve(entries.size());
+    for (const auto &entry : entries) {
+        entries_index[entry.steam_id.ConvertToUint64()] = entry.score;
+    }
+}
+
+void Steam_Leaderboard::remove_entries(const CSteamID &steamid)
+{
+    auto rm_it = find_entry(steamid);
+    if (entries.end() == rm_it) return;
+
+    entries.erase(rm_it);
+    entries_index.erase(steamid.ConvertToUint64());
 }
 
 // --- Steam_Leaderboard ---
@@ -140,25 +227,14 @@ void Steam_User_Stats::save_my_leaderboard_entry(const Steam_Leaderboard &leader
 
     std::string leaderboard_name(common_helpers::ascii_to_lowercase(leaderboard.name));
     unsigned int buffer_size = static_cast<unsigned int>(output.size() * sizeof(output[0])); // in bytes
-    local_storage->store_data(Local_Storage::leaderboard_storage_folder, leaderboard_name, (char* )&output[0], buffer_size);
+    local_storage->store_data_atomic(Local_Storage::leaderboard_storage_folder, leaderboard_name, (char* )&output[0], buffer_size);
 }
 
 Steam_Leaderboard_Entry* Steam_User_Stats::update_leaderboard_entry(Steam_Leaderboard &leaderboard, const Steam_Leaderboard_Entry &entry, bool overwrite)
 {
-    bool added = false;
     auto user_entry = leaderboard.find_recent_entry(entry.steam_id);
-    if (!user_entry) { // user doesn't have an entry yet, create one
-        added = true;
-        leaderboard.entries.push_back(entry);
-        user_entry = &leaderboard.entries.back();
-    } else if (overwrite) {
-        added = true;
-        *user_entry = entry;
-    }
-
-    if (added) { // if we added a new entry then we have to sort and find the target entry again
-        leaderboard.sort_entries();
-        user_entry = leaderboard.find_recent_entry(entry.steam_id);
+    if (!user_entry || overwrite) { // user doesn't have an entry yet, or we have to replace it
+        user_entry = leaderboard.upsert_entry(entry);
         PRINT_DEBUG("added/updated entry for user %llu", entry.steam_id.ConvertToUint64());
     }
     
@@ -189,10 +265,8 @@ unsigned int Steam_User_Stats::cache_leaderboard_ifneeded(const std::string &nam
     new_board.name = name;
     new_board.sort_method = eLeaderboardSortMethod;
     new_board.display_type = eLeaderboardDisplayType;
-    new_board.entries = load_leaderboard_entries(name);
-
-    new_board.sort_entries();
-    new_board.remove_duplicate_entries();
+    // later records of the same user replace the earlier ones
+    new_board.load_entries(load_leaderboard_entries(name));
 
     // save it in memory for later
     cached_leaderboards.push_back(new_board);
@@ -262,6 +336,43 @@ void Steam_User_Stats::request_user_leaderboard_entry(const Steam_Leaderboard &b
 }
 
 
+void Steam_User_Stats::add_leaderboard_rows(Steam_Leaderboard_Download &download, const Steam_Leaderboard &board, int64 first_rank, int64 last_rank)
+{
+    first_rank = std::max<int64>(first_rank, 1);
+    last_rank = std::min<int64>(last_rank, (int64)board.entries.size());
+    if (first_rank > last_rank) return;
+
+    download.ranks.reserve(download.ranks.size() + static_cast<size_t>(last_rank - first_rank + 1));
+    download.entries.reserve(download.entries.size() + static_cast<size_t>(last_rank - first_rank + 1));
+    for (int rank = (int)first_rank; rank <= (int)last_rank; ++rank) {
+        download.ranks.push_back(rank);
+        download.entries.push_back(board.entries[rank - 1]);
+    }
+}
+
+SteamAPICall_t Steam_User_Stats::add_leaderboard_download(SteamLeaderboard_t hSteamLeaderboard, Steam_Leaderboard_Download &&download)
+{
+    ++last_leaderboard_download;
+    if (!last_leaderboard_download) last_leaderboard_download = 1;
+    download.handle = last_leaderboard_download;
+
+    LeaderboardScoresDownloaded_t data{};
+    data.m_hSteamLeaderboard = hSteamLeaderboard;
+    data.m_hSteamLeaderboardEntries = download.handle;
+    data.m_cEntryCount = (int)download.entries.size();
+    PRINT_DEBUG("leaderboard %llu, entries handle %llu, count %i", hSteamLeaderboard, data.m_hSteamLeaderboardEntries, data.m_cEntryCount);
+
+    leaderboard_downloads.push_back(std::move(download));
+    while (leaderboard_downloads.size() > MAX_LEADERBOARD_DOWNLOADS) {
+        leaderboard_downloads.pop_front();
+    }
+
+    auto ret = callback_results->addCallResult(data.k_iCallback, &data, sizeof(data), 0.1); // TODO is this timing ok?
+    callbacks->addCBResult(data.k_iCallback, &data, sizeof(data), 0.1);
+    return ret;
+}
+
+
 void Steam_User_Stats::steam_user_stats_network_leaderboards(void *object, Common_Message *msg)
 {
     // PRINT_DEBUG_ENTRY();
@@ -399,21 +510,33 @@ SteamAPICall_t Steam_User_Stats::DownloadLeaderboardEntries( SteamLeaderboard_t
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (hSteamLeaderboard > cached_leaderboards.size() || hSteamLeaderboard <= 0) return k_uAPICallInvalid; //might return callresult even if hSteamLeaderboard is invalid
 
-    int entries_count = (int)cached_leaderboards[static_cast<unsigned>(hSteamLeaderboard - 1)].entries.size();
+    const auto &board = cached_leaderboards[static_cast<unsigned>(hSteamLeaderboard - 1)];
+    Steam_Leaderboard_Download download{};
     // https://partner.steamgames.com/doc/api/ISteamUserStats#ELeaderboardDataRequest
-    if (eLeaderboardDataRequest != k_ELeaderboardDataRequestFriends) {
-        int required_count = nRangeEnd - nRangeStart + 1;
-        if (required_count < 0) required_count = 0;
-        
-        if (required_count < entries_count) entries_count = required_count;
+    switch (eLeaderboardDataRequest)
+    {
+    case k_ELeaderboardDataRequestGlobal:
+        add_leaderboard_rows(download, board, nRangeStart, nRangeEnd);
+    break;
+
+    case k_ELeaderboardDataRequestGlobalAroundUser: {
+        // nothing is returned if we don't have an entry
+        int my_rank = board.find_rank(settings->get_local_steam_id());
+        if (my_rank) add_leaderboard_rows(download, board, (int64)my_rank + nRangeStart, (int64)my_rank + nRangeEnd);
     }
-    LeaderboardScoresDownloaded_t data{};
-    data.m_hSteamLeaderboard = hSteamLeaderboard;
-    data.m_hSteamLeaderboardEntries = hSteamLeaderboard;
-    data.m_cEntryCount = entries_count;
-    auto ret = callback_results->addCallResult(data.k_iCallback, &data, sizeof(data), 0.1); // TODO is this timing ok?
-    callbacks->addCBResult(data.k_iCallback, &data, sizeof(data), 0.1);
-    return ret;
+    break;
+
+    // everyone on the board is either us or someone we share leaderboards with
+    case k_ELeaderboardDataRequestFriends:
+        add_leaderboard_rows(download, board, 1, (int)board.entries.size());
+    break;
+
+    default:
+        PRINT_DEBUG("unhandled request type %i", (int)eLeaderboardDataRequest);
+    break;
+    }
+
+    return add_leaderboard_download(hSteamLeaderboard, std::move(download));
 }
 
 // as above, but downloads leaderboard entries for an arbitrary set of users - ELeaderboardDataRequest is k_ELeaderboardDataRequestUsers
@@ -430,7 +553,7 @@ SteamAPICall_t Steam_User_Stats::DownloadLeaderboardEntriesForUsers( SteamLeader
 
     auto& board = cached_leaderboards[static_cast<unsigned>(hSteamLeaderboard - 1)];
     bool ok = true;
-    int total_count = 0;
+    std::vector<int> ranks{};
     if (prgUsers && cUsers > 0) {
         for (int i = 0; i < cUsers; ++i) {
             const auto &user_steamid = prgUsers[i];
@@ -439,23 +562,25 @@ SteamAPICall_t Steam_User_Stats::DownloadLeaderboardEntriesForUsers( SteamLeader
                 PRINT_DEBUG("bad userid %llu", user_steamid.ConvertToUint64());
                 break;
             }
-            if (board.find_recent_entry(user_steamid)) ++total_count;
+            int rank = board.find_rank(user_steamid);
+            if (rank) ranks.push_back(rank);
 
             request_user_leaderboard_entry(board, user_steamid);
         }
     }
 
-    PRINT_DEBUG("total count %i", total_count);
-    // https://partner.steamgames.com/doc/api/ISteamUserStats#DownloadLeaderboardEntriesForUsers
-    if (!ok || total_count > 100) return k_uAPICallInvalid;
+    PRINT_DEBUG("total count %zu", ranks.size());
+    if (!ok || ranks.size() > MAX_LEADERBOARD_DOWNLOAD_USERS) return k_uAPICallInvalid;
 
-    LeaderboardScoresDownloaded_t data{};
-    data.m_hSteamLeaderboard = hSteamLeaderboard;
-    data.m_hSteamLeaderboardEntries = hSteamLeaderboard;
-    data.m_cEntryCount = total_count;
-    auto ret = callback_results->addCallResult(data.k_iCallback, &data, sizeof(data), 0.1); // TODO is this timing ok?
-    callbacks->addCBResult(data.k_iCallback, &data, sizeof(data), 0.1);
-    return ret;
+    // returned in rank order, each user once
+    std::sort(ranks.begin(), ranks.end());
+    ranks.erase(std::unique(ranks.begin(), ranks.end()), ranks.end());
+    Steam_Leaderboard_Download download{};
+    for (int rank : ranks) {
+        add_leaderboard_rows(download, board, rank, rank);
+    }
+
+    return add_leaderboard_download(hSteamLeaderboard, std::move(download));
 }
 
 
@@ -477,18 +602,21 @@ bool Steam_User_Stats::GetDownloadedLeaderboardEntry( SteamLeaderboardEntries_t
 {
     PRINT_DEBUG("[%i] (%i) %llu %p %p", index, cDetailsMax, hSteamLeaderboardEntries, pLeaderboardEntry, pDetails);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    if (hSteamLeaderboardEntries > cached_leaderboards.size() || hSteamLeaderboardEntries <= 0) return false;
-    
-    const auto &board = cached_leaderboards[static_cast<unsigned>(hSteamLeaderboardEntries - 1)];
-    if (index < 0 || static_cast<size_t>(index) >= board.entries.size()) return false;
+    auto download = std::find_if(leaderboard_downloads.begin(), leaderboard_downloads.end(), [hSteamLeaderboardEntries](const Steam_Leaderboard_Download &item) {
+        return item.handle == hSteamLeaderboardEntries;
+    });
+    if (leaderboard_downloads.end() == download) return false;
+    if (index < 0 || static_cast<size_t>(index) >= download->entries.size()) return false;
 
-    const auto &target_entry = board.entries[index];
+    const auto &target_entry = download->entries[index];
     
     if (pLeaderboardEntry) {
         LeaderboardEntry_t entry{};
         entry.m_steamIDUser = target_entry.steam_id;
-        entry.m_nGlobalRank = 1 + (int)(&target_entry - &board.entries[0]);
+        entry.m_nGlobalRank = download->ranks[index];
         entry.m_nScore = target_entry.score;
+        entry.m_cDetails = (int32)target_entry.score_details.size();
+        entry.m_hUGC = k_UGCHandleInvalid;
         
         *pLeaderboardEntry = entry;
     }
@@ -516,9 +644,7 @@ SteamAPICall_t Steam_User_Stats::UploadLeaderboardScore( SteamLeaderboard_t hSte
 
     auto &board = cached_leaderboards[static_cast<unsigned>(hSteamLeaderboard - 1)];
     auto my_entry = board.find_recent_entry(settings->get_local_steam_id());
-    int current_rank = my_entry
-        ? 1 + (int)(my_entry - &board.entries[0])
-        : 0;
+    int current_rank = board.find_rank(settings->get_local_steam_id());
     int new_rank = current_rank;
 
     bool score_updated = false;
@@ -556,7 +682,7 @@ SteamAPICall_t Steam_User_Stats::UploadLeaderboardScore( SteamLeaderboard_t hSte
         }
         
         update_leaderboard_entry(board, new_entry);
-        new_rank = 1 + (int)(board.find_recent_entry(settings->get_local_steam_id()) - &board.entries[0]);
+        new_rank = board.find_rank(settings->get_local_steam_id());
 
         // check again in case this was a forced update
         // avoid disk write if score is the same
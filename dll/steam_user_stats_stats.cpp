@@ -18,8 +18,176 @@
 #include "dll/steam_user_stats.h"
 #include <random>
 
+// stats_user_file: magic, version and count, then the type, name size, name and value of each stat
+#define STATS_FILE_MAGIC 0x54535347 // "GSST"
+#define STATS_FILE_VERSION 1
+// changed stats are written this long after the first change, StoreStats() writes them right away
+#define STATS_WRITE_DELAY 5.0
 
 
+void Steam_User_Stats::load_stats()
+{
+    std::string file_data{};
+    unsigned int size = local_storage->file_size("", stats_user_file);
+    if (size) {
+        file_data.resize(size);
+        if (local_storage->get_data("", stats_user_file, &file_data[0], size) != static_cast<int>(size)) file_data.clear();
+    }
+
+    size_t pos = 0;
+    auto read = [&](void *out, size_t out_size) {
+        if (file_data.size() - pos < out_size) return false;
+        memcpy(out, file_data.data() + pos, out_size);
+        pos += out_size;
+        return true;
+    };
+
+    uint32 header[3]{};
+    if (read(header, sizeof(header)) && header[0] == STATS_FILE_MAGIC && header[1] == STATS_FILE_VERSION) {
+        for (uint32 i = 0; i < header[2]; ++i) {
+            uint8 type = 0;
+            uint16 name_size = 0;
+            if (!read(&type, sizeof(type)) || !read(&name_size, sizeof(name_size)) || file_data.size() - pos < name_size) break;
+            std::string stat_name(file_data.data() + pos, name_size);
+            pos += name_size;
+
+            bool ok = false;
+            switch (type)
+            {
+            case GameServerStats_Messages::StatInfo::STAT_TYPE_INT: {
+                int32 value = 0;
+                ok = read(&value, sizeof(value));
+                if (ok) stats_cache_int[stat_name] = value;
+            }
+            break;
+
+            case GameServerStats_Messages::StatInfo::STAT_TYPE_FLOAT: {
+                float value = 0;
+                ok = read(&value, sizeof(value));
+                if (ok) stats_cache_float[stat_name] = value;
+            }
+            break;
+
+            case GameServerStats_Messages::StatInfo::STAT_TYPE_AVGRATE: {
+                float value = 0;
+                std::pair<float, double> totals{};
+                ok = read(&value, sizeof(value)) && read(&totals.first, sizeof(totals.first)) && read(&totals.second, sizeof(totals.second));
+                if (ok) {
+                    stats_cache_float[stat_name] = value;
+                    stats_avgrate_totals[stat_name] = totals;
+                }
+            }
+            break;
+            }
+
+            if (!ok) {
+                PRINT_DEBUG("bad stat %u in '%s'", i, stats_user_file);
+                break;
+            }
+        }
+    } else if (file_data.size()) {
+        PRINT_DEBUG("bad '%s'", stats_user_file);
+    }
+
+    // older versions saved each stat in its own file, those are moved to the packed file
+    for (const auto &stat : settings->getStats()) {
+        std::string stat_name(common_helpers::ascii_to_lowercase(stat.first));
+        if (stats_cache_int.count(stat_name) || stats_cache_float.count(stat_name)) continue;
+        load_legacy_stat(stat_name, stat.second.type);
+    }
+
+    PRINT_DEBUG("loaded %zu int and %zu float stats", stats_cache_int.size(), stats_cache_float.size());
+}
+
+// reads the file of a stat saved by older versions
+bool Steam_User_Stats::load_legacy_stat(const std::string &stat_name, GameServerStats_Messages::StatInfo::Stat_Type type)
+{
+    char data[sizeof(float) + sizeof(float) + sizeof(double)]{};
+    int read_data = local_storage->get_data(Local_Storage::stats_storage_folder, stat_name, data, sizeof(data));
+    if (read_data < static_cast<int>(sizeof(int32))) return false;
+
+    switch (type)
+    {
+    case GameServerStats_Messages::StatInfo::STAT_TYPE_INT:
+        memcpy(&stats_cache_int[stat_name], data, sizeof(int32));
+    break;
+
+    case GameServerStats_Messages::StatInfo::STAT_TYPE_FLOAT:
+    case GameServerStats_Messages::StatInfo::STAT_TYPE_AVGRATE:
+        memcpy(&stats_cache_float[stat_name], data, sizeof(float));
+        if (type == GameServerStats_Messages::StatInfo::STAT_TYPE_AVGRATE && read_data == sizeof(data)) {
+            auto &totals = stats_avgrate_totals[stat_name];
+            memcpy(&totals.first, data + sizeof(float), sizeof(totals.first));
+            memcpy(&totals.second, data + sizeof(float) + sizeof(float), sizeof(totals.second));
+        }
+    break;
+
+    default: return false;
+    }
+
+    PRINT_DEBUG("migrated '%s'", stat_name.c_str());
+    set_stats_dirty();
+    return true;
+}
+
+void Steam_User_Stats::save_stats(bool now)
+{
+    if (!stats_dirty) return;
+    if (!now && !check_timedout(stats_dirty_since, STATS_WRITE_DELAY)) return;
+
+    std::string file_data{};
+    auto write = [&file_data](const void *data, size_t size) {
+        file_data.append(static_cast<const char *>(data), size);
+    };
+
+    uint32 header[3] = { STATS_FILE_MAGIC, STATS_FILE_VERSION, 0 };
+    write(header, sizeof(header));
+    auto write_name = [&](uint8 type, const std::string &stat_name) {
+        if (stat_name.size() > UINT16_MAX) return false;
+
+        uint16 name_size = static_cast<uint16>(stat_name.size());
+        write(&type, sizeof(type));
+        write(&name_size, sizeof(name_size));
+        write(stat_name.data(), stat_name.size());
+        ++header[2];
+        return true;
+    };
+
+    for (auto &stat : stats_cache_int) {
+        if (write_name(GameServerStats_Messages::StatInfo::STAT_TYPE_INT, stat.first)) write(&stat.second, sizeof(stat.second));
+    }
+
+    for (auto &stat : stats_cache_float) {
+        auto totals = stats_avgrate_totals.find(stat.first);
+        if (totals == stats_avgrate_totals.end()) {
+            if (write_name(GameServerStats_Messages::StatInfo::STAT_TYPE_FLOAT, stat.first)) write(&stat.second, sizeof(stat.second));
+        } else if (write_name(GameServerStats_Messages::StatInfo::STAT_TYPE_AVGRATE, stat.first)) {
+            write(&stat.second, sizeof(stat.second));
+            write(&totals->second.first, sizeof(totals->second.first));
+            write(&totals->second.second, sizeof(totals->second.second));
+        }
+    }
+
+    memcpy(&file_data[0], header, sizeof(header));
+    unsigned int size = static_cast<unsigned int>(file_data.size());
+    if (local_storage->store_data_atomic("", stats_user_file, file_data.data(), size) == static_cast<int>(size)) {
+        PRINT_DEBUG("saved %u stats", header[2]);
+        stats_dirty = false;
+    } else {
+        // try again later
+        PRINT_DEBUG("failed to save stats");
+        stats_dirty_since = std::chrono::high_resolution_clock::now();
+    }
+}
+
+void Steam_User_Stats::set_stats_dirty()
+{
+    if (stats_dirty) return;
+
+    stats_dirty = true;
+    stats_dirty_since = std::chrono::high_resolution_clock::now();
+}
+
 // change stats without sending back to server
 bool Steam_User_Stats::clear_stats_internal()
 {
@@ -44,7 +212,7 @@ bool Steam_User_Stats::clear_stats_internal()
 
             stats_cache_int[stat_name] = data;
             
-            if (needs_disk_write) local_storage->store_data(Local_Storage::stats_storage_folder, stat_name, (char *)&data, sizeof(data));
+            if (needs_disk_write) set_stats_dirty();
         }
         break;
 
@@ -60,8 +228,9 @@ bool Steam_User_Stats::clear_stats_internal()
             }
 
             stats_cache_float[stat_name] = data;
+            if (stats_avgrate_totals.erase(stat_name)) needs_disk_write = true;
             
-            if (needs_disk_write) local_storage->store_data(Local_Storage::stats_storage_folder, stat_name, (char *)&data, sizeof(data));
+            if (needs_disk_write) set_stats_dirty();
         }
         break;
         
@@ -135,13 +304,10 @@ Steam_User_Stats::InternalSetResult<int32> Steam_User_Stats::set_stat_internal(
         }
     }
 
-    if (local_storage->store_data(Local_Storage::stats_storage_folder, stat_name, (char* )&nData, sizeof(nData)) == sizeof(nData)) {
-        stats_cache_int[stat_name] = nData;
-        result.success = true;
-        result.notify_server = !settings->disable_sharing_stats_with_gameserver;
-        return result;
-    }
-
+    stats_cache_int[stat_name] = nData;
+    set_stats_dirty();
+    result.success = true;
+    result.notify_server = !settings->disable_sharing_stats_with_gameserver;
     return result;
 }
 
@@ -209,13 +375,10 @@ Steam_User_Stats::InternalSetResult<std::pair<GameServerStats_Messages::StatInfo
         }
     }
 
-    if (local_storage->store_data(Local_Storage::stats_storage_folder, stat_name, (char* )&fData, sizeof(fData)) == sizeof(fData)) {
-        stats_cache_float[stat_name] = fData;
-        result.success = true;
-        result.notify_server = !settings->disable_sharing_stats_with_gameserver;
-        return result;
-    }
-
+    stats_cache_float[stat_name] = fData;
+    set_stats_dirty();
+    result.success = true;
+    result.notify_server = !settings->disable_sharing_stats_with_gameserver;
     return result;
 }
 
@@ -242,33 +405,19 @@ Steam_User_Stats::InternalSetResult<std::pair<GameServerStats_Messages::StatInfo
 
     result.internal_name = stat_name;
 
-    char data[sizeof(float) + sizeof(float) + sizeof(double)];
-    int read_data = local_storage->get_data(Local_Storage::stats_storage_folder, stat_name, (char* )data, sizeof(*data));
-    float oldcount = 0;
-    double oldsessionlength = 0;
-    if (read_data == sizeof(data)) {
-        memcpy(&oldcount, data + sizeof(float), sizeof(oldcount));
-        memcpy(&oldsessionlength, data + sizeof(float) + sizeof(float), sizeof(oldsessionlength));
-    }
-
-    oldcount += flCountThisSession;
-    oldsessionlength += dSessionLength;
+    auto &totals = stats_avgrate_totals[stat_name];
+    totals.first += flCountThisSession;
+    totals.second += dSessionLength;
 
-    float average = static_cast<float>(oldcount / oldsessionlength);
-    memcpy(data, &average, sizeof(average));
-    memcpy(data + sizeof(float), &oldcount, sizeof(oldcount));
-    memcpy(data + sizeof(float) * 2, &oldsessionlength, sizeof(oldsessionlength));
+    float average = static_cast<float>(totals.first / totals.second);
 
     result.current_val.first = stats_data->second.type;
     result.current_val.second = average;
 
-    if (local_storage->store_data(Local_Storage::stats_storage_folder, stat_name, data, sizeof(data)) == sizeof(data)) {
-        stats_cache_float[stat_name] = average;
-        result.success = true;
-        result.notify_server = !settings->disable_sharing_stats_with_gameserver;
-        return result;
-    }
-
+    stats_cache_float[stat_name] = average;
+    set_stats_dirty();
+    result.success = true;
+    result.notify_server = !settings->disable_sharing_stats_with_gameserver;
     return result;
 }
 
@@ -325,11 +474,8 @@ bool Steam_User_Stats::GetStat( const char *pchName, int32 *pData )
         return true;
     }
 
-    int32 output = 0;
-    int read_data = local_storage->get_data(Local_Storage::stats_storage_folder, stat_name, (char* )&output, sizeof(output));
-    if (read_data == sizeof(int32)) {
-        stats_cache_int[stat_name] = output;
-        if (pData) *pData = output;
+    if (load_legacy_stat(stat_name, stats_data->second.type)) {
+        if (pData) *pData = stats_cache_int[stat_name];
         return true;
     }
 
@@ -364,11 +510,8 @@ bool Steam_User_Stats::GetStat( const char *pchName, float *pData )
         return true;
     }
 
-    float output = 0.0;
-    int read_data = local_storage->get_data(Local_Storage::stats_storage_folder, stat_name, (char* )&output, sizeof(output));
-    if (read_data == sizeof(float)) {
-        stats_cache_float[stat_name] = output;
-        if (pData) *pData = output;
+    if (load_legacy_stat(stat_name, stats_data->second.type)) {
+        if (pData) *pData = stats_cache_float[stat_name];
         return true;
     }
 
@@ -444,6 +587,8 @@ bool Steam_User_Stats::StoreStats()
     PRINT_DEBUG_ENTRY();
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
 
+    save_stats(true);
+
     UserStatsStored_t data{};
     data.m_eResult = k_EResultOK;
     data.m_nGameID = settings->get_local_game_id().ToUint64();
@@ -1570,6 +1570,152 @@ project "test_crash_printer_sa_sigaction"
     }
 -- End test_crash_printer_sa_sigaction
 
+
+-- Project lib_emu_tests
+---------
+-- the emu code built once for all the tests and benchmarks in tests/
+project "lib_emu_tests"
+    kind "StaticLib"
+    location "%{wks.location}/%{prj.name}"
+    targetdir("build/" .. os_iden .. "/%{_ACTION}/%{cfg.buildcfg}/tests/emu/lib")
+    targetname "emu_tests_%{cfg.platform}"
+
+
+    -- include dir
+    ---------
+    -- x32 include dir
+    filter { "platforms:x32", }
+        includedirs {
+            x32_deps_include,
+        }
+    -- x64 include dir
+    filter { "platforms:x64", }
+        includedirs {
+            x64_deps_include,
+        }
+
+
+    -- common source & header files
+    ---------
+    filter {} -- reset the filter and remove all active keywords
+    files { -- added to all filters, later defines will be appended
+        common_files,
+    }
+    removefiles {
+        detours_files,
+    }
+-- End lib_emu_tests
+
+
+-- a console app in tests/ linked with lib_emu_tests
+-- tests are run once they're built like the crash printer tests, benchmarks are run by hand
+local function emu_test_project(name, run_after_build)
+project(name)
+    kind "ConsoleApp"
+    location "%{wks.location}/%{prj.name}"
+    targetdir("build/" .. os_iden .. "/%{_ACTION}/%{cfg.buildcfg}/tests/emu")
+    targetname(name .. "_%{cfg.platform}")
+
+
+    -- include dir
+    ---------
+    -- x32 include dir
+    filter { "platforms:x32", }
+        includedirs {
+            x32_deps_include,
+        }
+    -- x64 include dir
+    filter { "platforms:x64", }
+        includedirs {
+            x64_deps_include,
+        }
+
+
+    -- common source & header files
+    ---------
+    filter {} -- reset the filter and remove all active keywords
+    files {
+        'tests/emu_test.hpp',
+        'tests/' .. name .. '.cpp',
+    }
+
+
+    -- libs to link
+    ---------
+    filter {} -- reset the filter and remove all active keywords
+    links {
+        'lib_emu_tests',
+        common_link_linux,
+    }
+
+    -- libs search dir
+    ---------
+    -- x32 libs search dir
+    filter { "platforms:x32", }
+        libdirs {
+            x32_deps_libdir,
+        }
+    -- x64 libs search dir
+    filter { "platforms:x64", }
+        libdirs {
+            x64_deps_libdir,
+        }
+
+
+    -- post build
+    ---------
+    if run_after_build then
+        filter {} -- reset the filter and remove all active keywords
+        postbuildcommands {
+            '%[%{!cfg.buildtarget.abspath}]',
+        }
+    end
+
+    filter {} -- reset the filter and remove all active keywords
+end
+
+
+-- Project test_networking_sockets_flood
+---------
+emu_test_project("test_networking_sockets_flood", true)
+-- End test_networking_sockets_flood
+
+
+-- Project test_source_query
+---------
+emu_test_project("test_source_query", true)
+-- End test_source_query
+
+
+-- Project bench_lobby_search
+---------
+emu_test_project("bench_lobby_search", false)
+-- End bench_lobby_search
+
+
+-- Project bench_source_query_load
+---------
+emu_test_project("bench_source_query_load", false)
+-- End bench_source_query_load
+
+
+-- Project bench_user_stats
+---------
+emu_test_project("bench_user_stats", false)
+-- End bench_user_stats
+
+
+-- Project bench_ugc_read
+---------
+emu_test_project("bench_ugc_read", false)
+-- End bench_ugc_read
+
+
+-- Project bench_leaderboards
+---------
+emu_test_project("bench_leaderboards", false)
+-- End bench_leaderboards
+
 end
 -- End LINUX ONLY TARGETS
 
@@ -0,0 +1,105 @@
+// times loading a leaderboard of 1M entries and downloading ranges of it, around the local user too
+
+#include "emu_test.hpp"
+#include "dll/steam_user_stats.h"
+
+#define BENCH_BOARD "Bench_Board"
+#define BENCH_ENTRIES 1000000
+#define BENCH_DOWNLOADS 1000
+#define BENCH_RANGE 100
+#define BENCH_AROUND_USER 10
+// nobody else has this score, the rank of the local user is known
+#define BENCH_MY_SCORE 500000
+
+static void check_rows(Steam_User_Stats &user_stats, const LeaderboardScoresDownloaded_t &result, int first_rank, int count)
+{
+    if (result.m_cEntryCount != count) emu_test::fail("got " + std::to_string(result.m_cEntryCount) + " rows instead of " + std::to_string(count));
+
+    int32 last_score = INT32_MAX;
+    for (int i = 0; i < result.m_cEntryCount; ++i) {
+        LeaderboardEntry_t entry{};
+        if (!user_stats.GetDownloadedLeaderboardEntry(result.m_hSteamLeaderboardEntries, i, &entry, nullptr, 0)) emu_test::fail("missing row " + std::to_string(i));
+        if (entry.m_nGlobalRank != first_rank + i) emu_test::fail("wrong rank in row " + std::to_string(i));
+        if (entry.m_nScore > last_score) emu_test::fail("the rows aren't sorted by score");
+        last_score = entry.m_nScore;
+    }
+}
+
+int main()
+{
+    std::string save_dir = emu_test::temp_dir("bench_leaderboards");
+    emu_test::Peer peer(emu_test::random_user_id(), nullptr, true);
+    Local_Storage local_storage(save_dir);
+    local_storage.setAppId(EMU_TEST_APPID);
+
+    // same layout as save_my_leaderboard_entry(), one record per user
+    std::mt19937 rng(1234);
+    std::vector<uint32> file{};
+    file.reserve(BENCH_ENTRIES * 4 + 2);
+    int my_rank = 1;
+    for (uint32 i = 0; i < BENCH_ENTRIES; ++i) {
+        uint64 id = (i == BENCH_ENTRIES / 2) ? peer.settings.get_local_steam_id().ConvertToUint64() : CSteamID(i + 1, k_EUniversePublic, k_EAccountTypeIndividual).ConvertToUint64();
+        int32 score = static_cast<int32>(rng() % 1000000);
+        if (score == BENCH_MY_SCORE) ++score;
+        if (i == BENCH_ENTRIES / 2) score = BENCH_MY_SCORE;
+        else if (score > BENCH_MY_SCORE) ++my_rank;
+
+        file.push_back(static_cast<uint32>(id & 0xFFFFFFFF));
+        file.push_back(static_cast<uint32>(id >> 32));
+        file.push_back(static_cast<uint32>(score));
+        file.push_back(0);
+    }
+
+    std::string file_name(common_helpers::ascii_to_lowercase(BENCH_BOARD));
+    unsigned int file_size = static_cast<unsigned int>(file.size() * sizeof(file[0]));
+    if (local_storage.store_data(Local_Storage::leaderboard_storage_folder, file_name, (char *)file.data(), file_size) != static_cast<int>(file_size)) {
+        emu_test::fail("couldn't write the leaderboard");
+    }
+
+    Steam_User_Stats user_stats(&peer.settings, &peer.network, &local_storage, &peer.callback_results, &peer.callbacks, &peer.run_every_runcb, nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+    SteamAPICall_t find = user_stats.FindOrCreateLeaderboard(BENCH_BOARD, k_ELeaderboardSortMethodDescending, k_ELeaderboardDisplayTypeNumeric);
+    double load_time = emu_test::seconds_since(start);
+
+    LeaderboardFindResult_t board{};
+    if (!emu_test::wait_call_result(peer, find, board) || !board.m_bLeaderboardFound) emu_test::fail("the leaderboard wasn't found");
+    if (user_stats.GetLeaderboardEntryCount(board.m_hSteamLeaderboard) != BENCH_ENTRIES) emu_test::fail("wrong entry count");
+
+    start = std::chrono::steady_clock::now();
+    SteamAPICall_t global{};
+    int global_first = 0;
+    for (int i = 0; i < BENCH_DOWNLOADS; ++i) {
+        global_first = 1 + static_cast<int>(rng() % (BENCH_ENTRIES - BENCH_RANGE));
+        global = user_stats.DownloadLeaderboardEntries(board.m_hSteamLeaderboard, k_ELeaderboardDataRequestGlobal, global_first, global_first + BENCH_RANGE - 1);
+    }
+
+    double global_time = emu_test::seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    SteamAPICall_t around{};
+    for (int i = 0; i < BENCH_DOWNLOADS; ++i) {
+        around = user_stats.DownloadLeaderboardEntries(board.m_hSteamLeaderboard, k_ELeaderboardDataRequestGlobalAroundUser, -BENCH_AROUND_USER, BENCH_AROUND_USER);
+    }
+
+    double around_time = emu_test::seconds_since(start);
+
+    std::cout << "loaded " << BENCH_ENTRIES << " entries in " << load_time * 1000.0 << " ms" << std::endl;
+    std::cout << BENCH_RANGE << " rows of the global range: " << global_time * 1000000.0 / BENCH_DOWNLOADS << " us per download" << std::endl;
+    std::cout << (2 * BENCH_AROUND_USER + 1) << " rows around the user: " << around_time * 1000000.0 / BENCH_DOWNLOADS << " us per download" << std::endl;
+
+    // the last downloads are still there
+    LeaderboardScoresDownloaded_t result{};
+    if (!emu_test::wait_call_result(peer, global, result)) emu_test::fail("the global download never finished");
+    check_rows(user_stats, result, global_first, BENCH_RANGE);
+
+    if (!emu_test::wait_call_result(peer, around, result)) emu_test::fail("the download around the user never finished");
+    check_rows(user_stats, result, my_rank - BENCH_AROUND_USER, 2 * BENCH_AROUND_USER + 1);
+    LeaderboardEntry_t mine{};
+    user_stats.GetDownloadedLeaderboardEntry(result.m_hSteamLeaderboardEntries, BENCH_AROUND_USER, &mine, nullptr, 0);
+    if (mine.m_steamIDUser != peer.settings.get_local_steam_id() || mine.m_nScore != BENCH_MY_SCORE) emu_test::fail("the local user isn't in the middle of the rows around them");
+
+    emu_test::remove_dir(save_dir);
+    std::cout << "Success!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,140 @@
+// times a RequestLobbyList() search over 10k lobbies
+// the lobbies come from fake owners through the local message queue, the same path as lobbies sent by other peers
+// the first frame of the search evaluates every lobby, later frames only the lobbies that changed
+
+#include "emu_test.hpp"
+#include "dll/steam_matchmaking.h"
+
+#define BENCH_LOBBIES 10000
+#define BENCH_CHANGED_LOBBIES 100
+#define BENCH_IDLE_FRAMES 1000
+#define BENCH_MAX_RESULTS 50
+#define BENCH_NEAR_SKILL 500
+
+static const char *modes[] = { "ctf", "deathmatch", "coop", "race" };
+
+struct Bench_Lobby {
+    CSteamID id{};
+    CSteamID owner{};
+    uint32 member_limit{};
+    uint64 version{};
+    std::string mode{};
+    int level{};
+    int region{};
+    int skill{};
+};
+
+static void send_lobby(emu_test::Peer &peer, const Bench_Lobby &l)
+{
+    Common_Message msg{};
+    msg.set_source_id(l.owner.ConvertToUint64());
+    msg.set_dest_id(peer.settings.get_local_steam_id().ConvertToUint64());
+
+    Lobby *lobby = msg.mutable_lobby();
+    lobby->set_room_id(l.id.ConvertToUint64());
+    lobby->set_owner(l.owner.ConvertToUint64());
+    lobby->set_member_limit(l.member_limit);
+    lobby->set_type(k_ELobbyTypePublic);
+    lobby->set_joinable(true);
+    lobby->set_appid(EMU_TEST_APPID);
+    lobby->set_version(l.version);
+    lobby->add_members()->set_id(l.owner.ConvertToUint64());
+    (*lobby->mutable_values())["Mode"] = l.mode;
+    (*lobby->mutable_values())["level"] = std::to_string(l.level);
+    (*lobby->mutable_values())["region"] = std::to_string(l.region);
+    (*lobby->mutable_values())["skill"] = std::to_string(l.skill);
+
+    peer.network.sendTo(std::move(msg), true);
+}
+
+// the filters of the search below, written out by hand
+static bool reference_match(const Bench_Lobby &l)
+{
+    return l.mode == "ctf" && l.level >= 20 && l.region != 3 && static_cast<int>(l.member_limit) - 1 >= 2;
+}
+
+static double time_frame(emu_test::Peer &peer)
+{
+    auto start = std::chrono::steady_clock::now();
+    peer.run();
+    return emu_test::seconds_since(start);
+}
+
+int main()
+{
+    std::set<IP_PORT> broadcasts{};
+    emu_test::Peer peer(emu_test::random_user_id(), &broadcasts, false);
+    Steam_Matchmaking matchmaking(&peer.settings, nullptr, &peer.network, &peer.callback_results, &peer.callbacks, &peer.run_every_runcb);
+
+    std::mt19937 rng(1234);
+    std::vector<Bench_Lobby> lobbies(BENCH_LOBBIES);
+    for (auto &l : lobbies) {
+        l.id = generate_steam_id_lobby();
+        l.owner = generate_steam_id_user();
+        l.member_limit = 1 + rng() % 8;
+        l.version = 1;
+        l.mode = modes[rng() % 4];
+        l.level = static_cast<int>(rng() % 100);
+        l.region = static_cast<int>(rng() % 8);
+        l.skill = static_cast<int>(rng() % 1000);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto const &l : lobbies) send_lobby(peer, l);
+    peer.run();
+    std::cout << "received " << BENCH_LOBBIES << " lobbies in " << emu_test::seconds_since(start) << " s" << std::endl;
+
+    matchmaking.AddRequestLobbyListStringFilter("mode", "ctf", k_ELobbyComparisonEqual);
+    matchmaking.AddRequestLobbyListNumericalFilter("LEVEL", 20, k_ELobbyComparisonEqualToOrGreaterThan);
+    matchmaking.AddRequestLobbyListNumericalFilter("region", 3, k_ELobbyComparisonNotEqual);
+    matchmaking.AddRequestLobbyListFilterSlotsAvailable(2);
+    matchmaking.AddRequestLobbyListNearValueFilter("skill", BENCH_NEAR_SKILL);
+    matchmaking.AddRequestLobbyListResultCountFilter(BENCH_MAX_RESULTS);
+    SteamAPICall_t search = matchmaking.RequestLobbyList();
+
+    double full_frame = time_frame(peer);
+
+    double idle_frames = 0;
+    for (int i = 0; i < BENCH_IDLE_FRAMES; ++i) idle_frames += time_frame(peer);
+
+    // some owners change their lobby while the search runs
+    for (int i = 0; i < BENCH_CHANGED_LOBBIES; ++i) {
+        auto &l = lobbies[rng() % lobbies.size()];
+        l.mode = modes[rng() % 4];
+        l.level = static_cast<int>(rng() % 100);
+        l.skill = static_cast<int>(rng() % 1000);
+        ++l.version;
+        send_lobby(peer, l);
+    }
+
+    double changed_frame = time_frame(peer);
+
+    std::cout << "first frame, all lobbies evaluated: " << full_frame * 1000.0 << " ms" << std::endl;
+    std::cout << "frame without changes: " << idle_frames * 1000.0 / BENCH_IDLE_FRAMES << " ms" << std::endl;
+    std::cout << "frame with " << BENCH_CHANGED_LOBBIES << " changed lobbies: " << changed_frame * 1000.0 << " ms" << std::endl;
+
+    // the near filter keeps the search open until it times out
+    LobbyMatchList_t result{};
+    if (!emu_test::wait_call_result(peer, search, result)) emu_test::fail("the search never finished");
+
+    std::vector<int> expected_distances{};
+    for (auto const &l : lobbies) {
+        if (reference_match(l)) expected_distances.push_back(std::abs(l.skill - BENCH_NEAR_SKILL));
+    }
+
+    std::sort(expected_distances.begin(), expected_distances.end());
+    if (expected_distances.size() > BENCH_MAX_RESULTS) expected_distances.resize(BENCH_MAX_RESULTS);
+    if (result.m_nLobbiesMatching != expected_distances.size()) {
+        emu_test::fail("the search returned " + std::to_string(result.m_nLobbiesMatching) + " lobbies instead of " + std::to_string(expected_distances.size()));
+    }
+
+    for (uint32 i = 0; i < result.m_nLobbiesMatching; ++i) {
+        CSteamID id = matchmaking.GetLobbyByIndex(static_cast<int>(i));
+        auto l = std::find_if(lobbies.begin(), lobbies.end(), [&](const Bench_Lobby &l) { return l.id == id; });
+        if (l == lobbies.end() || !reference_match(*l)) emu_test::fail("the search returned a lobby that doesn't match");
+        if (std::abs(l->skill - BENCH_NEAR_SKILL) != expected_distances[i]) emu_test::fail("the results aren't sorted by the near value");
+    }
+
+    std::cout << "Success!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,152 @@
+// fires 50k A2S_INFO queries per second at a local game server and counts the replies
+// the queries come from a few thousand loopback addresses so the per source rate limit doesn't drop them,
+// like a server list refresh from many players
+
+#include "emu_test.hpp"
+#include "dll/dll.h"
+
+#include <atomic>
+#include <netinet/in.h>
+
+#define BENCH_GAME_PORT 47700
+#define BENCH_QUERY_PORT 47701
+#define BENCH_QUERIES_PER_SECOND 50000
+#define BENCH_DURATION 5.0
+// each source stays under the rate limit of the server, 50k/s over 4000 sources is 12.5 queries/s each
+#define BENCH_SOURCES 4000
+// queries are sent in bursts this often
+#define BENCH_BURST_INTERVAL 0.005
+#define BENCH_MIN_ANSWERED 0.9
+
+static const char a2s_info[] = "\xFF\xFF\xFF\xFFTSource Engine Query";
+
+// 127.10.0.1 and up, every 127/8 address is local so they can all be used as source
+static in_addr source_address(unsigned index)
+{
+    in_addr addr{};
+    addr.s_addr = htonl(0x7F0A0000 | ((index / 250) << 8) | (index % 250 + 1));
+    return addr;
+}
+
+static size_t receive_replies(int sock)
+{
+    static char buffers[64][1500];
+    struct mmsghdr msgs[64]{};
+    struct iovec iovs[64]{};
+    for (int i = 0; i < 64; ++i) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = sizeof(buffers[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t replies = 0;
+    int count = 0;
+    while ((count = recvmmsg(sock, msgs, 64, MSG_DONTWAIT, NULL)) > 0) {
+        for (int i = 0; i < count; ++i) {
+            if (msgs[i].msg_len > 4 && buffers[i][4] == 'I') ++replies;
+        }
+    }
+
+    return replies;
+}
+
+int main()
+{
+    setenv("SteamAppId", std::to_string(EMU_TEST_APPID).c_str(), 1);
+    if (!SteamInternal_GameServer_Init(0, 0, BENCH_GAME_PORT, BENCH_QUERY_PORT, eServerModeNoAuthentication, "1.0.0.0")) {
+        emu_test::fail("the game server didn't start");
+    }
+
+    Steam_GameServer *gameserver = get_steam_client()->steam_gameserver;
+    gameserver->SetServerName("bench server");
+    gameserver->SetMapName("bench_map");
+    gameserver->SetMaxPlayerCount(32);
+    gameserver->SetDedicatedServer(true);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int buffer_size = 8 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (sockaddr *)&local, sizeof(local)) != 0) emu_test::fail("couldn't bind the client socket");
+
+    std::atomic<bool> done{};
+    size_t sent = 0, answered = 0;
+    std::thread client([&]() {
+        constexpr unsigned burst = static_cast<unsigned>(BENCH_QUERIES_PER_SECOND * BENCH_BURST_INTERVAL);
+        sockaddr_in server{};
+        server.sin_family = AF_INET;
+        server.sin_addr.s_addr = htonl(0x7F000001);
+        server.sin_port = htons(BENCH_QUERY_PORT);
+
+        struct mmsghdr msgs[burst]{};
+        struct iovec iov{ (void *)a2s_info, sizeof(a2s_info) };
+        std::vector<char> controls(burst * CMSG_SPACE(sizeof(in_pktinfo)));
+        unsigned next_source = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        auto next_burst = start;
+        while (emu_test::seconds_since(start) < BENCH_DURATION) {
+            // the source address of each query is picked with IP_PKTINFO
+            for (unsigned i = 0; i < burst; ++i) {
+                msghdr &hdr = msgs[i].msg_hdr;
+                hdr = {};
+                hdr.msg_name = &server;
+                hdr.msg_namelen = sizeof(server);
+                hdr.msg_iov = &iov;
+                hdr.msg_iovlen = 1;
+                hdr.msg_control = &controls[i * CMSG_SPACE(sizeof(in_pktinfo))];
+                hdr.msg_controllen = CMSG_SPACE(sizeof(in_pktinfo));
+
+                cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+                cmsg->cmsg_level = IPPROTO_IP;
+                cmsg->cmsg_type = IP_PKTINFO;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+                in_pktinfo info{};
+                info.ipi_spec_dst = source_address(next_source++ % BENCH_SOURCES);
+                memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+            }
+
+            int res = sendmmsg(sock, msgs, burst, 0);
+            if (res > 0) sent += static_cast<size_t>(res);
+            answered += receive_replies(sock);
+
+            next_burst += std::chrono::microseconds(static_cast<long long>(BENCH_BURST_INTERVAL * 1000000));
+            while (std::chrono::steady_clock::now() < next_burst) {
+                answered += receive_replies(sock);
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+
+        // the last replies
+        auto drain = std::chrono::steady_clock::now();
+        while (emu_test::seconds_since(drain) < 0.5) {
+            answered += receive_replies(sock);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        done = true;
+    });
+
+    size_t frames = 0;
+    while (!done) {
+        SteamGameServer_RunCallbacks();
+        ++frames;
+    }
+
+    client.join();
+    close(sock);
+    SteamGameServer_Shutdown();
+
+    double rate = static_cast<double>(sent) / BENCH_DURATION;
+    double ratio = sent ? static_cast<double>(answered) / static_cast<double>(sent) : 0.0;
+    std::cout << "sent " << sent << " queries (" << rate << "/s), answered " << answered << " (" << ratio * 100.0 << "%), server frames " << frames << std::endl;
+    if (rate < BENCH_QUERIES_PER_SECOND * 0.9) emu_test::fail("the client couldn't send fast enough");
+    if (ratio < BENCH_MIN_ANSWERED) emu_test::fail("too many queries weren't answered");
+
+    std::cout << "Success!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,96 @@
+// times reading a shared file back with UGCRead() in 1 MB chunks
+// reading the same chunks with one Local_Storage::get_data() call each, like older versions did, is timed for comparison
+
+#include "emu_test.hpp"
+#include "dll/steam_remote_storage.h"
+#include "dll/ugc_remote_storage_bridge.h"
+
+#define BENCH_FILE "bench_ugc.bin"
+#define BENCH_FILE_SIZE (256 * 1024 * 1024)
+#define BENCH_CHUNK_SIZE (1024 * 1024)
+#define BENCH_ROUNDS 4
+
+static char expected_byte(size_t offset)
+{
+    return static_cast<char>(offset % 251);
+}
+
+static void check_chunk(const std::vector<char> &chunk, size_t size, size_t offset)
+{
+    for (size_t i = 0; i < size; ++i) {
+        if (chunk[i] != expected_byte(offset + i)) emu_test::fail("wrong data at offset " + std::to_string(offset + i));
+    }
+}
+
+static double throughput(double seconds)
+{
+    return static_cast<double>(BENCH_FILE_SIZE) * BENCH_ROUNDS / (1024.0 * 1024.0) / seconds;
+}
+
+int main()
+{
+    std::string save_dir = emu_test::temp_dir("bench_ugc_read");
+    emu_test::Peer peer(emu_test::random_user_id(), nullptr, true);
+    Local_Storage local_storage(save_dir);
+    local_storage.setAppId(EMU_TEST_APPID);
+    Ugc_Remote_Storage_Bridge ugc_bridge(&peer.settings);
+    Steam_Remote_Storage remote_storage(&peer.settings, &ugc_bridge, &local_storage, &peer.callback_results, &peer.callbacks, &peer.run_every_runcb);
+
+    {
+        std::vector<char> data(BENCH_FILE_SIZE);
+        for (size_t i = 0; i < data.size(); ++i) data[i] = expected_byte(i);
+        if (local_storage.store_data(Local_Storage::remote_storage_folder, BENCH_FILE, data.data(), BENCH_FILE_SIZE) != BENCH_FILE_SIZE) {
+            emu_test::fail("couldn't write the file");
+        }
+    }
+
+    std::vector<char> chunk(BENCH_CHUNK_SIZE);
+
+    // one open, seek and close per chunk
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        for (size_t offset = 0; offset < BENCH_FILE_SIZE; offset += BENCH_CHUNK_SIZE) {
+            int read = local_storage.get_data(Local_Storage::remote_storage_folder, BENCH_FILE, chunk.data(), BENCH_CHUNK_SIZE, static_cast<unsigned int>(offset));
+            if (read != BENCH_CHUNK_SIZE) emu_test::fail("get_data read " + std::to_string(read) + " bytes");
+            if (round == 0) check_chunk(chunk, BENCH_CHUNK_SIZE, offset);
+        }
+    }
+
+    double get_data_time = emu_test::seconds_since(start);
+
+    RemoteStorageFileShareResult_t shared{};
+    if (!emu_test::wait_call_result(peer, remote_storage.FileShare(BENCH_FILE), shared) || shared.m_eResult != k_EResultOK) {
+        emu_test::fail("FileShare failed");
+    }
+
+    double ugc_read_time = 0;
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        RemoteStorageDownloadUGCResult_t downloaded{};
+        if (!emu_test::wait_call_result(peer, remote_storage.UGCDownload(shared.m_hFile, 0), downloaded) || downloaded.m_eResult != k_EResultOK) {
+            emu_test::fail("UGCDownload failed");
+        }
+
+        if (downloaded.m_nSizeInBytes != BENCH_FILE_SIZE) emu_test::fail("UGCDownload gave the wrong size");
+
+        start = std::chrono::steady_clock::now();
+        for (size_t offset = 0; offset < BENCH_FILE_SIZE; offset += BENCH_CHUNK_SIZE) {
+            int32 read = remote_storage.UGCRead(shared.m_hFile, chunk.data(), BENCH_CHUNK_SIZE, static_cast<uint32>(offset), k_EUGCRead_ContinueReadingUntilFinished);
+            if (read != BENCH_CHUNK_SIZE) emu_test::fail("UGCRead read " + std::to_string(read) + " bytes");
+            if (round == 0) check_chunk(chunk, BENCH_CHUNK_SIZE, offset);
+        }
+
+        ugc_read_time += emu_test::seconds_since(start);
+
+        // the file is closed once the last byte is read
+        if (remote_storage.UGCRead(shared.m_hFile, chunk.data(), BENCH_CHUNK_SIZE, 0, k_EUGCRead_ContinueReadingUntilFinished) != -1) {
+            emu_test::fail("UGCRead still works after the whole file was read");
+        }
+    }
+
+    std::cout << "get_data per chunk: " << throughput(get_data_time) << " MB/s" << std::endl;
+    std::cout << "UGCRead: " << throughput(ugc_read_time) << " MB/s" << std::endl;
+
+    emu_test::remove_dir(save_dir);
+    std::cout << "Success!" << std::endl;
+    return 0;
+}
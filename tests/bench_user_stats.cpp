@@ -0,0 +1,86 @@
+// times 100k SetStat() calls and the StoreStats() after them, then loads the stats again
+// the per stat file writes of older versions are timed too for comparison, and one of those files is migrated
+
+#include "emu_test.hpp"
+#include "dll/steam_user_stats.h"
+
+#define BENCH_STATS 100
+#define BENCH_SET_CALLS 100000
+// one file write per change like older versions did, fewer calls since each one hits the disk
+#define BENCH_LEGACY_CALLS 10000
+#define BENCH_LEGACY_STAT "legacy_stat"
+#define BENCH_LEGACY_VALUE 1234
+
+static std::string stat_name(int i)
+{
+    return "stat_" + std::to_string(i);
+}
+
+int main()
+{
+    std::string save_dir = emu_test::temp_dir("bench_user_stats");
+    emu_test::Peer peer(emu_test::random_user_id(), nullptr, true);
+    Local_Storage local_storage(save_dir);
+    local_storage.setAppId(EMU_TEST_APPID);
+
+    Stat_config cfg{};
+    cfg.type = GameServerStats_Messages::StatInfo::STAT_TYPE_INT;
+    cfg.default_value_int = 0;
+    for (int i = 0; i < BENCH_STATS; ++i) peer.settings.setStatDefiniton(stat_name(i), cfg);
+    peer.settings.setStatDefiniton(BENCH_LEGACY_STAT, cfg);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_LEGACY_CALLS; ++i) {
+        int32 value = i;
+        local_storage.store_data(Local_Storage::stats_storage_folder, stat_name(i % BENCH_STATS), (char *)&value, sizeof(value));
+    }
+
+    double legacy_time = emu_test::seconds_since(start);
+    for (int i = 0; i < BENCH_STATS; ++i) local_storage.file_delete(Local_Storage::stats_storage_folder, stat_name(i));
+
+    // the only stat still saved the old way
+    int32 legacy_value = BENCH_LEGACY_VALUE;
+    local_storage.store_data(Local_Storage::stats_storage_folder, BENCH_LEGACY_STAT, (char *)&legacy_value, sizeof(legacy_value));
+
+    std::vector<int32> values(BENCH_STATS);
+    {
+        Steam_User_Stats user_stats(&peer.settings, &peer.network, &local_storage, &peer.callback_results, &peer.callbacks, &peer.run_every_runcb, nullptr);
+        int files_before = local_storage.count_files(Local_Storage::stats_storage_folder);
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < BENCH_SET_CALLS; ++i) {
+            int32 &value = values[i % BENCH_STATS];
+            ++value;
+            if (!user_stats.SetStat(stat_name(i % BENCH_STATS).c_str(), value)) emu_test::fail("SetStat failed");
+        }
+
+        double set_time = emu_test::seconds_since(start);
+        if (local_storage.count_files(Local_Storage::stats_storage_folder) != files_before || local_storage.file_exists("", Steam_User_Stats::stats_user_file)) {
+            emu_test::fail("SetStat wrote to the disk");
+        }
+
+        start = std::chrono::steady_clock::now();
+        user_stats.StoreStats();
+        double store_time = emu_test::seconds_since(start);
+
+        std::cout << BENCH_LEGACY_CALLS << " per file writes: " << legacy_time * 1000000.0 / BENCH_LEGACY_CALLS << " us each" << std::endl;
+        std::cout << BENCH_SET_CALLS << " SetStat: " << set_time * 1000.0 << " ms, " << set_time * 1000000.0 / BENCH_SET_CALLS << " us each" << std::endl;
+        std::cout << "StoreStats: " << store_time * 1000.0 << " ms" << std::endl;
+    }
+
+    // the legacy stat can only come from the packed file now
+    local_storage.file_delete(Local_Storage::stats_storage_folder, BENCH_LEGACY_STAT);
+
+    Steam_User_Stats user_stats(&peer.settings, &peer.network, &local_storage, &peer.callback_results, &peer.callbacks, &peer.run_every_runcb, nullptr);
+    for (int i = 0; i < BENCH_STATS; ++i) {
+        int32 value = 0;
+        if (!user_stats.GetStat(stat_name(i).c_str(), &value) || value != values[i]) emu_test::fail("wrong value loaded for " + stat_name(i));
+    }
+
+    int32 value = 0;
+    if (!user_stats.GetStat(BENCH_LEGACY_STAT, &value) || value != BENCH_LEGACY_VALUE) emu_test::fail("the legacy stat wasn't migrated");
+
+    emu_test::remove_dir(save_dir);
+    std::cout << "Success!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,123 @@
+#ifndef __INCLUDED_EMU_TEST_HPP__
+#define __INCLUDED_EMU_TEST_HPP__
+
+#include "dll/common_includes.h"
+#include "dll/settings.h"
+#include "dll/local_storage.h"
+#include "dll/network.h"
+#include "dll/callsystem.h"
+
+#include <iostream>
+#include <random>
+#include <filesystem>
+
+#include <unistd.h> // sysconf
+
+// appid and base listen port of the test peers, far from what games use so a running game doesn't answer
+#define EMU_TEST_APPID 3999001
+#define EMU_TEST_PORT 47650
+
+namespace emu_test {
+
+// what the interfaces need from a steam client, a few of them can run in one process
+struct Peer {
+    Settings settings;
+    Networking network;
+    SteamCallResults callback_results{};
+    SteamCallBacks callbacks;
+    RunEveryRunCB run_every_runcb{};
+
+    Peer(CSteamID id, std::set<IP_PORT> *custom_broadcasts, bool disable_sockets)
+        : settings(id, CGameID(EMU_TEST_APPID), "emu_test", "english", false),
+          network(id, EMU_TEST_APPID, EMU_TEST_PORT, custom_broadcasts, disable_sockets),
+          callbacks(&callback_results)
+    {
+    }
+
+    // same order as Steam_Client::RunCallbacks()
+    void run()
+    {
+        network.Run();
+        run_every_runcb.run();
+        callback_results.runCallResults();
+        callbacks.runCallBacks();
+    }
+};
+
+inline CSteamID random_user_id()
+{
+    std::random_device rd{};
+    return CSteamID(static_cast<uint32>(rd() | 1), k_EUniversePublic, k_EAccountTypeIndividual);
+}
+
+// loopback addresses of the first few ports a test peer can bind, every peer finds the others there
+inline std::set<IP_PORT> loopback_broadcasts(unsigned count)
+{
+    std::set<IP_PORT> broadcasts{};
+    for (unsigned i = 0; i < count; ++i) {
+        broadcasts.insert(IP_PORT{ 0x7F000001, static_cast<uint16>(EMU_TEST_PORT + i) });
+    }
+
+    return broadcasts;
+}
+
+// empty folder in the temp dir, removed first if a previous run left it
+inline std::string temp_dir(const std::string &name)
+{
+    auto path = std::filesystem::temp_directory_path() / ("gse_" + name + "_" + std::to_string(getpid()));
+    std::error_code ec{};
+    std::filesystem::remove_all(path, ec);
+    std::filesystem::create_directories(path, ec);
+    return path.u8string() + PATH_SEPARATOR;
+}
+
+inline void remove_dir(const std::string &path)
+{
+    std::error_code ec{};
+    std::filesystem::remove_all(std::filesystem::u8path(path), ec);
+}
+
+inline double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start).count();
+}
+
+// runs run() until done() or the timeout, returns done()
+inline bool wait_until(const std::function<bool()> &done, double timeout, const std::function<void()> &run)
+{
+    auto start = std::chrono::steady_clock::now();
+    while (!done()) {
+        if (seconds_since(start) > timeout) return false;
+
+        run();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return true;
+}
+
+// result of an api call, for the interfaces that only give one through a call result
+template<typename T>
+bool wait_call_result(Peer &peer, SteamAPICall_t api_call, T &result, double timeout = 5.0)
+{
+    return wait_until([&]() { return peer.callback_results.callback_result(api_call, &result, sizeof(result)); }, timeout, [&]() { peer.run_every_runcb.run(); });
+}
+
+// resident memory of this process in bytes, 0 if it can't be read
+inline size_t resident_memory()
+{
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (!(statm >> pages >> resident)) return 0;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+[[noreturn]] inline void fail(const std::string &what)
+{
+    std::cerr << "Failed! " << what << std::endl;
+    exit(1);
+}
+
+}
+
+#endif // __INCLUDED_EMU_TEST_HPP__
@@ -0,0 +1,176 @@
+// floods one ISteamNetworkingSockets connection between two peers over loopback
+// the flooded connection must get k_EResultLimitExceeded once its send buffer is full,
+// the other connections to the same peer must keep working and memory must stay bounded
+
+#include "emu_test.hpp"
+#include "dll/steam_networking_sockets.h"
+
+#define FLOOD_CONNECTIONS 3
+#define FLOOD_SEND_BUFFER (256 * 1024)
+#define FLOOD_MESSAGE_SIZE (16 * 1024)
+#define FLOOD_SMALL_MESSAGE_SIZE 64
+// the send buffer must be full long before this much is queued
+#define FLOOD_MAX_QUEUED (256 * 1024 * 1024)
+// how long the flood runs while both peers are running
+#define FLOOD_DURATION 3.0
+// growth of the process allowed while a connection is kept full
+#define FLOOD_MAX_MEMORY_GROWTH (32 * 1024 * 1024)
+
+struct Sockets_Peer : emu_test::Peer {
+    shared_between_client_server sbcs{};
+    Steam_Networking_Sockets sockets;
+
+    Sockets_Peer(std::set<IP_PORT> *broadcasts)
+        : emu_test::Peer(emu_test::random_user_id(), broadcasts, false),
+          sockets(&settings, &network, &callback_results, &callbacks, &run_every_runcb, &sbcs)
+    {
+    }
+
+    void accept_connections()
+    {
+        std::vector<HSteamNetConnection> incoming{};
+        for (auto &c : sbcs.connect_sockets) {
+            if (c.second.status == CONNECT_SOCKET_NOT_ACCEPTED) incoming.push_back(c.first);
+        }
+
+        for (auto c : incoming) sockets.AcceptConnection(c);
+    }
+
+    std::vector<HSteamNetConnection> connected()
+    {
+        std::vector<HSteamNetConnection> out{};
+        for (auto &c : sbcs.connect_sockets) {
+            if (c.second.status == CONNECT_SOCKET_CONNECTED) out.push_back(c.first);
+        }
+
+        return out;
+    }
+};
+
+static bool is_connected(Steam_Networking_Sockets &sockets, HSteamNetConnection conn)
+{
+    SteamNetConnectionInfo_t info{};
+    return sockets.GetConnectionInfo(conn, &info) && info.m_eState == k_ESteamNetworkingConnectionState_Connected;
+}
+
+static EResult send_reliable(Steam_Networking_Sockets &sockets, HSteamNetConnection conn, const std::vector<char> &data)
+{
+    return sockets.SendMessageToConnection(conn, data.data(), static_cast<uint32>(data.size()), k_nSteamNetworkingSend_Reliable, nullptr);
+}
+
+static int64 pending_reliable(Steam_Networking_Sockets &sockets, HSteamNetConnection conn)
+{
+    SteamNetConnectionRealTimeStatus_t status{};
+    if (sockets.GetConnectionRealTimeStatus(conn, &status, 0, nullptr) != k_EResultOK) emu_test::fail("no status for the flooded connection");
+    return status.m_cbPendingReliable;
+}
+
+int main()
+{
+    auto broadcasts = emu_test::loopback_broadcasts(4);
+    Sockets_Peer client(&broadcasts);
+    Sockets_Peer server(&broadcasts);
+    auto run_both = [&]() { client.run(); server.run(); server.accept_connections(); };
+
+    SteamNetworkingConfigValue_t option{};
+    option.SetInt32(k_ESteamNetworkingConfig_SendBufferSize, FLOOD_SEND_BUFFER);
+    server.sockets.CreateListenSocketP2P(0, 0, nullptr);
+
+    // the peers have to find each other first, connection requests sent before that are lost
+    SteamNetworkingIdentity server_identity{};
+    server_identity.SetSteamID(server.settings.get_local_steam_id());
+    std::vector<HSteamNetConnection> conns{};
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+        if (emu_test::seconds_since(start) > 30.0) emu_test::fail("the peers never connected");
+
+        for (auto c : conns) client.sockets.CloseConnection(c, 0, nullptr, false);
+        conns.clear();
+        for (int i = 0; i < FLOOD_CONNECTIONS; ++i) {
+            conns.push_back(client.sockets.ConnectP2P(server_identity, 0, 1, &option));
+        }
+
+        bool all_connected = emu_test::wait_until([&]() {
+            return std::all_of(conns.begin(), conns.end(), [&](HSteamNetConnection c) { return is_connected(client.sockets, c); });
+        }, 3.0, run_both);
+        if (all_connected) break;
+    }
+
+    std::cout << "connected in " << emu_test::seconds_since(start) << " s" << std::endl;
+    HSteamNetConnection flooded = conns[0];
+    std::vector<char> message(FLOOD_MESSAGE_SIZE, 'f');
+    std::vector<char> small_message(FLOOD_SMALL_MESSAGE_SIZE, 's');
+
+    // nothing runs, the connection is filled until it refuses more
+    size_t queued = 0;
+    EResult res = k_EResultOK;
+    while ((res = send_reliable(client.sockets, flooded, message)) == k_EResultOK) {
+        queued += message.size();
+        if (queued > FLOOD_MAX_QUEUED) emu_test::fail("the send buffer never filled up");
+    }
+
+    if (res != k_EResultLimitExceeded) emu_test::fail("flooding failed with " + std::to_string(res) + " instead of k_EResultLimitExceeded");
+    if (pending_reliable(client.sockets, flooded) > FLOOD_SEND_BUFFER) emu_test::fail("more than the send buffer is pending");
+    std::cout << "full after " << queued << " bytes, pending " << pending_reliable(client.sockets, flooded) << std::endl;
+
+    unsigned small_sent = 0;
+    for (size_t i = 1; i < conns.size(); ++i) {
+        if (send_reliable(client.sockets, conns[i], small_message) != k_EResultOK) emu_test::fail("another connection was refused while the flooded one is full");
+        ++small_sent;
+    }
+
+    // refused sends must not cost anything
+    size_t memory_before = emu_test::resident_memory();
+    for (int i = 0; i < 100000; ++i) {
+        if (send_reliable(client.sockets, flooded, message) == k_EResultOK) emu_test::fail("a full connection accepted more");
+    }
+
+    if (emu_test::resident_memory() > memory_before + FLOOD_MAX_MEMORY_GROWTH) emu_test::fail("refused sends made the process grow");
+
+    // now both sides run, the flooded connection is kept full while the server reads everything
+    size_t delivered = 0;
+    unsigned small_received = 0;
+    size_t max_memory = memory_before;
+    auto receive_all = [&]() {
+        for (auto c : server.connected()) {
+            SteamNetworkingMessage_t *msgs[64];
+            int count = 0;
+            while ((count = server.sockets.ReceiveMessagesOnConnection(c, msgs, 64)) > 0) {
+                for (int i = 0; i < count; ++i) {
+                    delivered += msgs[i]->m_cbSize;
+                    if (msgs[i]->m_cbSize == FLOOD_SMALL_MESSAGE_SIZE) ++small_received;
+                    msgs[i]->Release();
+                }
+            }
+        }
+    };
+
+    start = std::chrono::steady_clock::now();
+    while (emu_test::seconds_since(start) < FLOOD_DURATION) {
+        run_both();
+        receive_all();
+
+        while (send_reliable(client.sockets, flooded, message) == k_EResultOK) {}
+        if (pending_reliable(client.sockets, flooded) > FLOOD_SEND_BUFFER) emu_test::fail("more than the send buffer is pending");
+
+        for (size_t i = 1; i < conns.size(); ++i) {
+            if (send_reliable(client.sockets, conns[i], small_message) != k_EResultOK) emu_test::fail("another connection was refused while the flooded one is full");
+            ++small_sent;
+        }
+
+        max_memory = std::max(max_memory, emu_test::resident_memory());
+    }
+
+    if (max_memory > memory_before + FLOOD_MAX_MEMORY_GROWTH) {
+        emu_test::fail("the process grew by " + std::to_string(max_memory - memory_before) + " bytes during the flood");
+    }
+
+    // whatever the other connections sent arrives once the flood stops
+    if (!emu_test::wait_until([&]() { receive_all(); return small_received >= small_sent; }, 10.0, run_both)) {
+        emu_test::fail("only " + std::to_string(small_received) + " of the " + std::to_string(small_sent) + " messages of the other connections arrived");
+    }
+
+    std::cout << "delivered " << delivered << " bytes in " << FLOOD_DURATION << " s, memory growth " << (max_memory - memory_before) << " bytes" << std::endl;
+    std::cout << "Success!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,169 @@
+// queries a local Source_Query responder with the A2S client of Networking
+// the responder drops the first packet it gets and answers the others after a delay,
+// so the retries, the challenges, the split rules response and the measured ping are all used
+
+#include "emu_test.hpp"
+#include "dll/steam_gameserver.h"
+#include "dll/source_query.h"
+
+#include <atomic>
+#include <netinet/in.h>
+
+// added by the responder before each reply
+#define RESPONDER_DELAY_MS 20
+// enough rules for a response split in a few packets
+#define RESPONDER_RULES 200
+// queries sent at once, within the burst the responder allows from one address
+#define CONCURRENT_QUERIES 30
+
+struct Responder {
+    int sock = -1;
+    uint16 port{};
+    Source_Query source_query{};
+    Gameserver gs{};
+    std::vector<std::pair<CSteamID, Gameserver_Player_Info_t>> players{};
+    std::atomic<bool> stop{};
+    std::atomic<unsigned> received{};
+
+    Responder()
+    {
+        sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(0x7F000001);
+        if (bind(sock, (sockaddr *)&addr, sizeof(addr)) != 0) emu_test::fail("couldn't bind the responder");
+
+        socklen_t len = sizeof(addr);
+        getsockname(sock, (sockaddr *)&addr, &len);
+        port = ntohs(addr.sin_port);
+
+        timeval timeout{ 0, 100000 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        gs.set_server_name("test server");
+        gs.set_map_name("test_map");
+        gs.set_mod_dir("test");
+        gs.set_product("test");
+        gs.set_appid(EMU_TEST_APPID);
+        gs.set_max_player_count(16);
+        gs.set_port(47660);
+        for (int i = 0; i < RESPONDER_RULES; ++i) {
+            (*gs.mutable_values())["rule_" + std::to_string(i)] = "value of the rule " + std::to_string(i);
+        }
+
+        const char *names[] = { "first", "second", "third" };
+        for (uint32 i = 0; i < 3; ++i) {
+            Gameserver_Player_Info_t info{};
+            info.join_time = std::chrono::steady_clock::now();
+            info.name = names[i];
+            info.score = i * 10;
+            players.emplace_back(emu_test::random_user_id(), info);
+        }
+    }
+
+    ~Responder()
+    {
+        close(sock);
+    }
+
+    void run()
+    {
+        char buffer[1500];
+        while (!stop) {
+            sockaddr_in from{};
+            socklen_t from_len = sizeof(from);
+            ssize_t len = recvfrom(sock, buffer, sizeof(buffer), 0, (sockaddr *)&from, &from_len);
+            if (len < 0) continue;
+
+            // the first query is lost
+            if (received++ == 0) continue;
+
+            auto replies = source_query.handle_source_query(buffer, static_cast<size_t>(len), ntohl(from.sin_addr.s_addr), ntohs(from.sin_port), gs, 1, players);
+            std::this_thread::sleep_for(std::chrono::milliseconds(RESPONDER_DELAY_MS));
+            for (auto &reply : replies) {
+                sendto(sock, reply.data(), reply.size(), 0, (sockaddr *)&from, from_len);
+            }
+        }
+    }
+};
+
+static A2S_Result query(emu_test::Peer &peer, uint16 port, A2S_Query_Type type)
+{
+    uint64 id = peer.network.a2sQuery(0x7F000001, port, type);
+    A2S_Result result{};
+    if (!emu_test::wait_until([&]() { return peer.network.a2sResult(id, result); }, 10.0, [&]() { peer.run(); })) {
+        emu_test::fail("the query never finished");
+    }
+
+    return result;
+}
+
+int main()
+{
+    std::set<IP_PORT> broadcasts{};
+    emu_test::Peer peer(emu_test::random_user_id(), &broadcasts, false);
+
+    Responder responder{};
+    std::thread responder_thread([&]() { responder.run(); });
+
+    A2S_Result info = query(peer, responder.port, A2S_QUERY_INFO);
+    if (!info.responded) emu_test::fail("A2S_INFO wasn't answered after the first query was lost");
+    if (info.info.server_name() != "test server" || info.info.map_name() != "test_map") emu_test::fail("wrong server name or map");
+    if (info.info.max_player_count() != 16 || info.info.num_players() != 3) emu_test::fail("wrong player counts");
+    if (info.ping < RESPONDER_DELAY_MS || info.ping > 500) emu_test::fail("ping of " + std::to_string(info.ping) + " ms isn't the delay of the answered attempt");
+    std::cout << "A2S_INFO answered, ping " << info.ping << " ms" << std::endl;
+
+    A2S_Result players = query(peer, responder.port, A2S_QUERY_PLAYERS);
+    if (!players.responded) emu_test::fail("A2S_PLAYER wasn't answered");
+    if (players.players.size() != 3) emu_test::fail("got " + std::to_string(players.players.size()) + " players instead of 3");
+    for (size_t i = 0; i < players.players.size(); ++i) {
+        if (players.players[i].name != responder.players[i].second.name || players.players[i].score != static_cast<int32>(responder.players[i].second.score)) {
+            emu_test::fail("wrong player " + std::to_string(i));
+        }
+    }
+
+    A2S_Result rules = query(peer, responder.port, A2S_QUERY_RULES);
+    if (!rules.responded) emu_test::fail("A2S_RULES wasn't answered");
+    if (rules.rules.size() != RESPONDER_RULES) emu_test::fail("got " + std::to_string(rules.rules.size()) + " rules instead of " + std::to_string(RESPONDER_RULES));
+    for (auto const &rule : rules.rules) {
+        auto value = responder.gs.values().find(rule.first);
+        if (value == responder.gs.values().end() || value->second != rule.second) emu_test::fail("wrong rule " + rule.first);
+    }
+
+    std::cout << "players and split rules answered" << std::endl;
+
+    // many queries at once on the same socket
+    std::vector<uint64> ids{};
+    for (int i = 0; i < CONCURRENT_QUERIES; ++i) {
+        ids.push_back(peer.network.a2sQuery(0x7F000001, responder.port, A2S_QUERY_INFO));
+    }
+
+    unsigned answered = 0;
+    emu_test::wait_until([&]() {
+        auto id = ids.begin();
+        while (id != ids.end()) {
+            A2S_Result result{};
+            if (peer.network.a2sResult(*id, result)) {
+                if (result.responded) ++answered;
+                id = ids.erase(id);
+            } else {
+                ++id;
+            }
+        }
+
+        return ids.empty();
+    }, 20.0, [&]() { peer.run(); });
+    if (answered != CONCURRENT_QUERIES) emu_test::fail("only " + std::to_string(answered) + " of " + std::to_string(CONCURRENT_QUERIES) + " concurrent queries were answered");
+
+    responder.stop = true;
+    responder_thread.join();
+
+    // nothing listens there anymore
+    auto start = std::chrono::steady_clock::now();
+    A2S_Result lost = query(peer, responder.port, A2S_QUERY_INFO);
+    if (lost.responded) emu_test::fail("a closed port answered");
+    std::cout << "unanswered query finished in " << emu_test::seconds_since(start) << " s" << std::endl;
+
+    std::cout << "Success!" << std::endl;
+    return 0;
+}